@@ -34,14 +34,30 @@
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+/* Flags of QEMUBH.  */
+enum {
+    /* On bh_list or idle_bh_list, waiting for aio_bh_poll() */
+    BH_PENDING   = (1 << 0),
+    /* Invoke the callback */
+    BH_SCHEDULED = (1 << 1),
+    /* Free without invoking the callback */
+    BH_DELETED   = (1 << 2),
+    /* Invoke the callback less frequently */
+    BH_IDLE      = (1 << 3),
+};
+
 struct QEMUBH {
     AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
-    QEMUBH *next;
-    bool scheduled;
-    bool idle;
-    bool deleted;
+    QSLIST_ENTRY(QEMUBH) next;
+    unsigned flags;
+};
+
+/* The bottom halves taken from the context's lists by one aio_bh_poll() */
+struct BHListSlice {
+    QSLIST_HEAD(, QEMUBH) bh_list;
+    QSIMPLEQ_ENTRY(BHListSlice) next;
 };
 
 QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
@@ -53,12 +69,6 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
         .cb = cb,
         .opaque = opaque,
     };
-    qemu_mutex_lock(&ctx->bh_lock);
-    bh->next = ctx->first_bh;
-    /* Make sure that the members are ready before putting bh into list */
-    smp_wmb();
-    ctx->first_bh = bh;
-    qemu_mutex_unlock(&ctx->bh_lock);
     return bh;
 }
 
@@ -67,51 +77,122 @@ void aio_bh_call(QEMUBH *bh)
     bh->cb(bh->opaque);
 }
 
-/* Multiple occurrences of aio_bh_poll cannot be called concurrently */
+/* Can be called from any thread.  Every non-idle enqueue notifies the event
+ * loop: the list can hold bottom halves that were cancelled or deleted while
+ * queued, so a non-empty list does not mean that the loop is awake.
+ * aio_notify() is cheap unless the loop is about to block.
+ */
+static void aio_bh_enqueue(QEMUBH *bh, unsigned new_flags)
+{
+    AioContext *ctx = bh->ctx;
+    unsigned old_flags;
+
+    /* The memory barrier implicit in atomic_fetch_or makes sure that:
+     * 1. any writes needed by the callback are done before the flags are
+     *    read in aio_bh_poll.
+     * 2. ctx is loaded before the callback has a chance to execute and bh
+     *    could be freed.
+     */
+    old_flags = atomic_fetch_or(&bh->flags, BH_PENDING | new_flags);
+    if (old_flags & BH_PENDING) {
+        /* Already queued.  qemu_bh_schedule() turns an idle bottom half
+         * into a regular one, and must wake up a loop that went to sleep
+         * while the bottom half was idle or cancelled.
+         */
+        if (!(new_flags & (BH_IDLE | BH_DELETED)) &&
+            (old_flags & (BH_SCHEDULED | BH_IDLE)) != BH_SCHEDULED) {
+            atomic_and(&bh->flags, ~BH_IDLE);
+            aio_notify(ctx);
+        }
+        return;
+    }
+
+    if (new_flags & (BH_IDLE | BH_DELETED)) {
+        /* These do not wake up the event loop */
+        QSLIST_INSERT_HEAD_ATOMIC(&ctx->idle_bh_list, bh, next);
+        return;
+    }
+
+    QSLIST_INSERT_HEAD_ATOMIC(&ctx->bh_list, bh, next);
+    aio_notify(ctx);
+}
+
+/* Only called from aio_bh_poll() and aio_ctx_finalize() */
+static QEMUBH *aio_bh_dequeue(BHListSlice *s, unsigned *flags)
+{
+    QEMUBH *bh = QSLIST_FIRST(&s->bh_list);
+
+    if (!bh) {
+        return NULL;
+    }
+
+    QSLIST_REMOVE_HEAD(&s->bh_list, next);
+
+    /* The atomic_fetch_and is paired with aio_bh_enqueue().  The implicit
+     * memory barrier ensures that the callback sees all writes done by the
+     * scheduling thread.  It also ensures that the scheduling thread sees
+     * the cleared flags before bh->cb has run, and thus will queue the
+     * bottom half again if necessary.
+     */
+    *flags = atomic_fetch_and(&bh->flags,
+                              ~(BH_PENDING | BH_SCHEDULED | BH_IDLE));
+    return bh;
+}
+
+/* Moves the bottom halves queued on ctx to s.  */
+static void aio_bh_take(AioContext *ctx, BHListSlice *s)
+{
+    QSLIST_HEAD(, QEMUBH) idle;
+    QEMUBH *bh;
+
+    /* Avoid the atomic exchanges when there is nothing to take */
+    QSLIST_INIT(&s->bh_list);
+    if (atomic_read(&ctx->bh_list.slh_first)) {
+        QSLIST_MOVE_ATOMIC(&s->bh_list, &ctx->bh_list);
+    }
+    if (!atomic_read(&ctx->idle_bh_list.slh_first)) {
+        return;
+    }
+    QSLIST_MOVE_ATOMIC(&idle, &ctx->idle_bh_list);
+    while ((bh = QSLIST_FIRST(&idle)) != NULL) {
+        QSLIST_REMOVE_HEAD(&idle, next);
+        QSLIST_INSERT_HEAD(&s->bh_list, bh, next);
+    }
+}
+
+/* Multiple occurrences of aio_bh_poll cannot be called concurrently.
+ * A callback can call aio_poll() and thus aio_bh_poll() recursively;
+ * the nested call runs the bottom halves taken by the outer ones first.
+ */
 int aio_bh_poll(AioContext *ctx)
 {
-    QEMUBH *bh, **bhp, *next;
-    int ret;
+    BHListSlice slice;
+    BHListSlice *s;
+    int ret = 0;
 
-    ctx->walking_bh++;
-
-    ret = 0;
-    for (bh = ctx->first_bh; bh; bh = next) {
-        /* Make sure that fetching bh happens before accessing its members */
-        smp_read_barrier_depends();
-        next = bh->next;
-        /* The atomic_xchg is paired with the one in qemu_bh_schedule.  The
-         * implicit memory barrier ensures that the callback sees all writes
-         * done by the scheduling thread.  It also ensures that the scheduling
-         * thread sees the zero before bh->cb has run, and thus will call
-         * aio_notify again if necessary.
-         */
-        if (!bh->deleted && atomic_xchg(&bh->scheduled, 0)) {
+    aio_bh_take(ctx, &slice);
+    QSIMPLEQ_INSERT_TAIL(&ctx->bh_slice_list, &slice, next);
+
+    while ((s = QSIMPLEQ_FIRST(&ctx->bh_slice_list))) {
+        QEMUBH *bh;
+        unsigned flags;
+
+        bh = aio_bh_dequeue(s, &flags);
+        if (!bh) {
+            QSIMPLEQ_REMOVE_HEAD(&ctx->bh_slice_list, next);
+            continue;
+        }
+
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
             /* Idle BHs and the notify BH don't count as progress */
-            if (!bh->idle && bh != ctx->notify_dummy_bh) {
+            if (!(flags & BH_IDLE) && bh != ctx->notify_dummy_bh) {
                 ret = 1;
             }
-            bh->idle = 0;
             aio_bh_call(bh);
         }
-    }
-
-    ctx->walking_bh--;
-
-    /* remove deleted bhs */
-    if (!ctx->walking_bh) {
-        qemu_mutex_lock(&ctx->bh_lock);
-        bhp = &ctx->first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted) {
-                *bhp = bh->next;
-                g_free(bh);
-            } else {
-                bhp = &bh->next;
-            }
+        if (flags & BH_DELETED) {
+            g_free(bh);
         }
-        qemu_mutex_unlock(&ctx->bh_lock);
     }
 
     return ret;
@@ -119,28 +200,12 @@ int aio_bh_poll(AioContext *ctx)
 
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
-    bh->idle = 1;
-    /* Make sure that idle & any writes needed by the callback are done
-     * before the locations are read in the aio_bh_poll.
-     */
-    atomic_mb_set(&bh->scheduled, 1);
+    aio_bh_enqueue(bh, BH_SCHEDULED | BH_IDLE);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    AioContext *ctx;
-
-    ctx = bh->ctx;
-    bh->idle = 0;
-    /* The memory barrier implicit in atomic_xchg makes sure that:
-     * 1. idle & any writes needed by the callback are done before the
-     *    locations are read in the aio_bh_poll.
-     * 2. ctx is loaded before scheduled is set and the callback has a chance
-     *    to execute.
-     */
-    if (atomic_xchg(&bh->scheduled, 1) == 0) {
-        aio_notify(ctx);
-    }
+    aio_bh_enqueue(bh, BH_SCHEDULED);
 }
 
 
@@ -148,7 +213,7 @@ void qemu_bh_schedule(QEMUBH *bh)
  */
 void qemu_bh_cancel(QEMUBH *bh)
 {
-    bh->scheduled = 0;
+    atomic_and(&bh->flags, ~BH_SCHEDULED);
 }
 
 /* This func is async.The bottom half will do the delete action at the finial
@@ -156,20 +221,22 @@ void qemu_bh_cancel(QEMUBH *bh)
  */
 void qemu_bh_delete(QEMUBH *bh)
 {
-    bh->scheduled = 0;
-    bh->deleted = 1;
+    aio_bh_enqueue(bh, BH_DELETED);
 }
 
-int64_t
-aio_compute_timeout(AioContext *ctx)
+/* Returns 0 if a bottom half on the list should run now, 10 ms if only
+ * idle ones are scheduled, timeout otherwise.  The list can be one of
+ * the context's, which other threads push to concurrently.
+ */
+static int64_t aio_compute_bh_list_timeout(QEMUBH *first, int64_t timeout)
 {
-    int64_t deadline;
-    int timeout = -1;
     QEMUBH *bh;
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            if (bh->idle) {
+    for (bh = first; bh; bh = QSLIST_NEXT(bh, next)) {
+        unsigned flags = atomic_read(&bh->flags);
+
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+            if (flags & BH_IDLE) {
                 /* idle bottom halves will be polled at least
                  * every 10ms */
                 timeout = 10000000;
@@ -180,6 +247,40 @@ aio_compute_timeout(AioContext *ctx)
             }
         }
     }
+    return timeout;
+}
+
+/* Returns -1 if no bottom half is scheduled */
+static int64_t aio_compute_bh_timeout(AioContext *ctx)
+{
+    int64_t timeout;
+    BHListSlice *s;
+
+    timeout = aio_compute_bh_list_timeout(
+        atomic_rcu_read(&ctx->bh_list.slh_first), -1);
+    if (timeout == 0) {
+        return 0;
+    }
+    QSIMPLEQ_FOREACH(s, &ctx->bh_slice_list, next) {
+        timeout = aio_compute_bh_list_timeout(QSLIST_FIRST(&s->bh_list),
+                                              timeout);
+        if (timeout == 0) {
+            return 0;
+        }
+    }
+    return aio_compute_bh_list_timeout(
+        atomic_rcu_read(&ctx->idle_bh_list.slh_first), timeout);
+}
+
+int64_t
+aio_compute_timeout(AioContext *ctx)
+{
+    int64_t deadline;
+    int64_t timeout = aio_compute_bh_timeout(ctx);
+
+    if (timeout == 0) {
+        return 0;
+    }
 
     deadline = timerlistgroup_deadline_ns(&ctx->tlg);
     if (deadline == 0) {
@@ -210,15 +311,13 @@ static gboolean
 aio_ctx_check(GSource *source)
 {
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
 
     atomic_and(&ctx->notify_me, ~1);
     aio_notify_accept(ctx);
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (!bh->deleted && bh->scheduled) {
-            return true;
-        }
+    /* Idle bottom halves are run too, if the loop wakes up for them */
+    if (aio_compute_bh_timeout(ctx) != -1) {
+        return true;
     }
     return aio_pending(ctx) || (timerlistgroup_deadline_ns(&ctx->tlg) == 0);
 }
@@ -239,6 +338,9 @@ static void
 aio_ctx_finalize(GSource     *source)
 {
     AioContext *ctx = (AioContext *) source;
+    BHListSlice slice;
+    QEMUBH *bh;
+    unsigned flags;
 
     qemu_bh_delete(ctx->notify_dummy_bh);
     thread_pool_free(ctx->thread_pool);
@@ -251,22 +353,20 @@ aio_ctx_finalize(GSource     *source)
     }
 #endif
 
-    qemu_mutex_lock(&ctx->bh_lock);
-    while (ctx->first_bh) {
-        QEMUBH *next = ctx->first_bh->next;
+    /* There must be no aio_bh_poll() calls going on */
+    assert(QSIMPLEQ_EMPTY(&ctx->bh_slice_list));
 
+    aio_bh_take(ctx, &slice);
+    while ((bh = aio_bh_dequeue(&slice, &flags))) {
         /* qemu_bh_delete() must have been called on BHs in this AioContext */
-        assert(ctx->first_bh->deleted);
+        assert(flags & BH_DELETED);
 
-        g_free(ctx->first_bh);
-        ctx->first_bh = next;
+        g_free(bh);
     }
-    qemu_mutex_unlock(&ctx->bh_lock);
 
     aio_set_event_notifier(ctx, &ctx->notifier, false, NULL);
     event_notifier_cleanup(&ctx->notifier);
     rfifolock_destroy(&ctx->lock);
-    qemu_mutex_destroy(&ctx->bh_lock);
     timerlistgroup_deinit(&ctx->tlg);
 }
 
@@ -286,7 +386,8 @@ GSource *aio_get_g_source(AioContext *ctx)
 ThreadPool *aio_get_thread_pool(AioContext *ctx)
 {
     if (!ctx->thread_pool) {
-        ctx->thread_pool = thread_pool_new(ctx);
+        /* Publish an initialized pool to qmp_query_thread_pools() */
+        atomic_rcu_set(&ctx->thread_pool, thread_pool_new(ctx));
     }
     return ctx->thread_pool;
 }
@@ -365,7 +466,9 @@ AioContext *aio_context_new(Error **errp)
     ctx->linux_aio = NULL;
 #endif
     ctx->thread_pool = NULL;
-    qemu_mutex_init(&ctx->bh_lock);
+    QSLIST_INIT(&ctx->bh_list);
+    QSLIST_INIT(&ctx->idle_bh_list);
+    QSIMPLEQ_INIT(&ctx->bh_slice_list);
     rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
 
@@ -49,6 +49,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -76,6 +77,110 @@ BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
     }
 }
 
+static void block_latency_histogram_clear(BlockLatencyHistogram *hist)
+{
+    g_free(hist->boundaries);
+    g_free(hist->bins);
+    hist->boundaries = NULL;
+    hist->bins = NULL;
+    hist->nbins = 0;
+}
+
+bool block_latency_histogram_check(uint64List *boundaries)
+{
+    uint64List *entry;
+    uint64_t prev = 0;
+
+    for (entry = boundaries; entry; entry = entry->next) {
+        if (entry->value <= prev) {
+            return false;
+        }
+        prev = entry->value;
+    }
+
+    return true;
+}
+
+int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
+                                uint64List *boundaries)
+{
+    BlockLatencyHistogram *hist;
+    uint64List *entry;
+    int nbins = 1;
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    hist = &stats->latency_histogram[type];
+
+    if (!block_latency_histogram_check(boundaries)) {
+        return -EINVAL;
+    }
+    for (entry = boundaries; entry; entry = entry->next) {
+        nbins++;
+    }
+
+    block_latency_histogram_clear(hist);
+    if (boundaries == NULL) {
+        return 0;
+    }
+
+    hist->nbins = nbins;
+    hist->boundaries = g_new(uint64_t, nbins - 1);
+    for (entry = boundaries, i = 0; entry; entry = entry->next, i++) {
+        hist->boundaries[i] = entry->value;
+    }
+    hist->bins = g_new0(uint64_t, nbins);
+
+    return 0;
+}
+
+void block_latency_histograms_reset(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        BlockLatencyHistogram *hist = &stats->latency_histogram[i];
+
+        if (hist->bins) {
+            memset(hist->bins, 0, hist->nbins * sizeof(hist->bins[0]));
+        }
+    }
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    int i;
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        block_latency_histogram_clear(&stats->latency_histogram[i]);
+    }
+}
+
+static void block_latency_histogram_account(BlockLatencyHistogram *hist,
+                                            int64_t latency_ns)
+{
+    int lo, hi;
+
+    if (hist->bins == NULL) {
+        return;
+    }
+
+    /* Find the first boundary above @latency_ns; its index is the bin */
+    lo = 0;
+    hi = hist->nbins - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (latency_ns < 0 || (uint64_t)latency_ns < hist->boundaries[mid]) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    hist->bins[lo]++;
+}
+
 void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
                       int64_t bytes, enum BlockAcctType type)
 {
@@ -106,6 +211,9 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
     QSLIST_FOREACH(s, &stats->intervals, entries) {
         timed_average_account(&s->latency[cookie->type], latency_ns);
     }
+
+    block_latency_histogram_account(&stats->latency_histogram[cookie->type],
+                                    latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
@@ -129,6 +237,9 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+
+        block_latency_histogram_account(
+            &stats->latency_histogram[cookie->type], latency_ns);
     }
 }
 
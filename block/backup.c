@@ -25,6 +25,8 @@
 #include "qemu/bitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_CHUNK (4 * 1024 * 1024)
+#define BACKUP_MAX_WORKERS 64
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -49,8 +51,25 @@ typedef struct BackupBlockJob {
     int64_t cluster_size;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+    /* try blk_co_copy_range() before copying through a bounce buffer */
+    bool use_copy_range;
+
+    /* Background copy workers */
+    int max_workers;
+    int in_flight;
+    bool waiting_for_io;
+    /* first worker error, the job decides what to do about it */
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t worker_error_cluster;
 } BackupBlockJob;
 
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t start;
+    int64_t nb_clusters;
+} BackupWorker;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -94,6 +113,51 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Copy @bytes at @offset from the source to the target through a bounce
+ * buffer, writing zeroes instead of data if possible */
+static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
+                                                      int64_t offset,
+                                                      int bytes,
+                                                      void *bounce_buffer,
+                                                      bool *error_is_read,
+                                                      bool is_write_notifier)
+{
+    BlockBackend *blk = job->common.blk;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int ret;
+
+    iov.iov_base = bounce_buffer;
+    iov.iov_len = bytes;
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = blk_co_preadv(blk, offset, bytes, &bounce_qiov,
+                        is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, offset / job->cluster_size, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        return ret;
+    }
+
+    if (buffer_is_zero(bounce_buffer, bytes)) {
+        ret = blk_co_pwrite_zeroes(job->target, offset, bytes,
+                                   BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = blk_co_pwritev(job->target, offset, bytes, &bounce_qiov, 0);
+    }
+    if (ret < 0) {
+        trace_backup_do_cow_write_fail(job, offset / job->cluster_size, ret);
+        if (error_is_read) {
+            *error_is_read = false;
+        }
+        return ret;
+    }
+
+    return 0;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -101,13 +165,12 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 {
     BlockBackend *blk = job->common.blk;
     CowRequest cow_request;
-    struct iovec iov;
-    QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    int64_t start, end;
-    int n;
+    int64_t max_clusters = MAX(BACKUP_MAX_CHUNK / job->cluster_size, 1);
+    int64_t start, end, run_end;
+    int bytes;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
@@ -119,58 +182,58 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start = run_end) {
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
+            run_end = start + 1;
             continue; /* already copied */
         }
 
-        trace_backup_do_cow_process(job, start);
+        /* Copy all clusters up to the next one that is already done in a
+         * single request */
+        run_end = find_next_bit(job->done_bitmap, end, start);
+        run_end = MIN(run_end, start + max_clusters);
 
-        n = MIN(sectors_per_cluster,
-                job->common.len / BDRV_SECTOR_SIZE -
-                start * sectors_per_cluster);
+        trace_backup_do_cow_process(job, start);
 
-        if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+        bytes = MIN((run_end - start) * job->cluster_size,
+                    job->common.len - start * job->cluster_size);
 
-        ret = blk_co_preadv(blk, start * job->cluster_size,
-                            bounce_qiov.size, &bounce_qiov,
-                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        ret = -ENOTSUP;
+        if (job->use_copy_range) {
+            ret = blk_co_copy_range(blk, start * job->cluster_size,
+                                    job->target, start * job->cluster_size,
+                                    bytes, is_write_notifier ?
+                                    BDRV_REQ_NO_SERIALISING : 0);
+            if (ret < 0) {
+                /* Retry through a buffer, which also tells read errors apart
+                 * from write errors, and don't bother with offloading again */
+                trace_backup_do_cow_copy_range_fail(job, start, ret);
+                job->use_copy_range = false;
             }
-            goto out;
-        }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = blk_co_pwritev(job->target, start * job->cluster_size,
-                                 bounce_qiov.size, &bounce_qiov, 0);
         }
         if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+            if (!bounce_buffer) {
+                bounce_buffer = blk_blockalign(blk, MIN(end - start,
+                                                        max_clusters) *
+                                                    job->cluster_size);
+            }
+            ret = backup_cow_with_bounce_buffer(job, start * job->cluster_size,
+                                                bytes, bounce_buffer,
+                                                error_is_read,
+                                                is_write_notifier);
+            if (ret < 0) {
+                goto out;
             }
-            goto out;
         }
 
-        set_bit(start, job->done_bitmap);
+        bitmap_set(job->done_bitmap, start, run_end - start);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
          */
-        job->sectors_read += n;
-        job->common.offset += n * BDRV_SECTOR_SIZE;
+        job->sectors_read += bytes >> BDRV_SECTOR_BITS;
+        job->common.offset += bytes;
     }
 
 out:
@@ -314,62 +377,213 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
-static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+/* Return whether the cluster at @cluster has data that the sync mode wants to
+ * have in the backup (sync=full and sync=top only) */
+static bool coroutine_fn backup_cluster_needed(BackupBlockJob *job,
+                                               int64_t cluster)
 {
-    bool error_is_read;
-    int ret = 0;
-    int clusters_per_iter;
-    uint32_t granularity;
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int i, n;
+    int alloced = 0;
+
+    if (job->sync_mode != MIRROR_SYNC_MODE_TOP) {
+        /* FULL sync mode we copy the whole drive. */
+        return true;
+    }
+
+    /* Check to see if these blocks are already in the backing file. */
+    for (i = 0; i < sectors_per_cluster;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced = bdrv_is_allocated(bs, cluster * sectors_per_cluster + i,
+                                    sectors_per_cluster - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    /* If the above loop never found any sectors that are in
+     * the topmost image, skip this backup. */
+    return alloced != 0;
+}
+
+/* Find the first cluster at or after @cluster that must be copied, or the
+ * number of clusters in the job if there is none */
+static int64_t coroutine_fn backup_next_cluster(BackupBlockJob *job,
+                                                HBitmapIter *hbi,
+                                                int64_t cluster)
+{
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
     int64_t sector;
-    int64_t cluster;
-    int64_t end;
-    int64_t last_cluster = -1;
+
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (cluster >= end) {
+            return end;
+        }
+        /* The iterator returns the start of a dirty granule, which can be
+         * before @cluster if the granularity is larger than a cluster */
+        bdrv_set_dirty_iter(hbi, cluster * sectors_per_cluster);
+        sector = hbitmap_iter_next(hbi);
+        if (sector == -1) {
+            return end;
+        }
+        return MIN(MAX(cluster, sector / sectors_per_cluster), end);
+    }
+
+    while (cluster < end && !backup_cluster_needed(job, cluster)) {
+        cluster++;
+    }
+    return cluster;
+}
+
+static void coroutine_fn backup_worker_entry(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
+    bool error_is_read = false;
+    int ret;
+
+    ret = backup_do_cow(job, w->start * sectors_per_cluster,
+                        w->nb_clusters * sectors_per_cluster,
+                        &error_is_read, false);
+    if (ret < 0) {
+        if (job->worker_ret == 0) {
+            job->worker_ret = ret;
+            job->worker_error_is_read = error_is_read;
+        }
+        job->worker_error_cluster = MIN(job->worker_error_cluster, w->start);
+    }
+
+    g_free(w);
+    job->in_flight--;
+    if (job->waiting_for_io) {
+        qemu_coroutine_enter(job->common.co);
+    }
+}
+
+/* Wait until no more than @max_in_flight workers are running */
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job,
+                                                 int max_in_flight)
+{
+    while (job->in_flight > max_in_flight) {
+        job->waiting_for_io = true;
+        qemu_coroutine_yield();
+        job->waiting_for_io = false;
+    }
+}
+
+static void coroutine_fn backup_start_worker(BackupBlockJob *job,
+                                             int64_t start,
+                                             int64_t nb_clusters)
+{
+    BackupWorker *w;
+    Coroutine *co;
+
+    backup_wait_for_workers(job, job->max_workers - 1);
+
+    w = g_new(BackupWorker, 1);
+    *w = (BackupWorker) {
+        .job            = job,
+        .start          = start,
+        .nb_clusters    = nb_clusters,
+    };
+
+    job->in_flight++;
+    trace_backup_worker_start(job, start, nb_clusters, job->in_flight);
+    co = qemu_coroutine_create(backup_worker_entry, w);
+    qemu_coroutine_enter(co);
+}
+
+/* Copy everything that the sync mode requires, using up to max_workers
+ * parallel requests.  Consecutive clusters that need copying are merged into
+ * one request; the request size doubles as long as the data is contiguous,
+ * up to BACKUP_MAX_CHUNK, and falls back to a single cluster after a gap. */
+static int coroutine_fn backup_run_workers(BackupBlockJob *job)
+{
+    BlockErrorAction action;
     HBitmapIter hbi;
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int64_t max_clusters = MAX(BACKUP_MAX_CHUNK / job->cluster_size, 1);
+    int64_t chunk_clusters = 1;
+    int64_t progress_end = 0;
+    int64_t start, next, n;
+    bool incremental = job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL;
+    int ret = 0;
 
-    granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
-    clusters_per_iter = MAX((granularity / job->cluster_size), 1);
-    bdrv_dirty_iter_init(job->sync_bitmap, &hbi);
+    if (incremental) {
+        bdrv_dirty_iter_init(job->sync_bitmap, &hbi);
+    }
+
+    job->worker_ret = 0;
+    job->worker_error_cluster = INT64_MAX;
+
+    next = backup_next_cluster(job, &hbi, 0);
+    for (;;) {
+        if (job->worker_ret < 0 || next >= end) {
+            backup_wait_for_workers(job, 0);
+            if (job->worker_ret == 0) {
+                /* The last copies may take long; don't complete behind the
+                 * back of a pause request that came in meanwhile */
+                block_job_pause_point(&job->common);
+                break;
+            }
+
+            /* Depending on error action, fail now or retry from the first
+             * cluster that failed */
+            action = backup_error_action(job, job->worker_error_is_read,
+                                         -job->worker_ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ret = job->worker_ret;
+                break;
+            }
+            next = backup_next_cluster(job, &hbi, job->worker_error_cluster);
+            job->worker_ret = 0;
+            job->worker_error_cluster = INT64_MAX;
+            continue;
+        }
 
-    /* Find the next dirty sector(s) */
-    while ((sector = hbitmap_iter_next(&hbi)) != -1) {
-        cluster = sector / sectors_per_cluster;
+        if (yield_and_check(job)) {
+            break;
+        }
 
         /* Fake progress updates for any clusters we skipped */
-        if (cluster != last_cluster + 1) {
-            job->common.offset += ((cluster - last_cluster - 1) *
-                                   job->cluster_size);
+        if (incremental && next > progress_end) {
+            job->common.offset += (next - progress_end) * job->cluster_size;
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    return ret;
-                }
-                ret = backup_do_cow(job, cluster * sectors_per_cluster,
-                                    sectors_per_cluster, &error_is_read,
-                                    false);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    return ret;
-                }
-            } while (ret < 0);
+        start = next;
+        n = 1;
+        next = backup_next_cluster(job, &hbi, start + 1);
+        while (next == start + n && n < chunk_clusters) {
+            n++;
+            next = backup_next_cluster(job, &hbi, start + n);
         }
+        progress_end = MAX(progress_end, start + n);
 
-        /* If the bitmap granularity is smaller than the backup granularity,
-         * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < job->cluster_size) {
-            bdrv_set_dirty_iter(&hbi, cluster * sectors_per_cluster);
+        if (n == chunk_clusters && next == start + n) {
+            chunk_clusters = MIN(chunk_clusters * 2, max_clusters);
+        } else {
+            chunk_clusters = 1;
         }
 
-        last_cluster = cluster - 1;
+        backup_start_worker(job, start, n);
     }
 
+    backup_wait_for_workers(job, 0);
+
     /* Play some final catchup with the progress meter */
-    end = DIV_ROUND_UP(job->common.len, job->cluster_size);
-    if (last_cluster + 1 < end) {
-        job->common.offset += ((end - last_cluster - 1) * job->cluster_size);
+    if (incremental && ret == 0 && !block_job_is_cancelled(&job->common) &&
+        progress_end < end) {
+        job->common.offset += (end - progress_end) * job->cluster_size;
     }
 
     return ret;
@@ -381,14 +595,12 @@ static void coroutine_fn backup_run(void *opaque)
     BackupCompleteData *data;
     BlockDriverState *bs = blk_bs(job->common.blk);
     BlockBackend *target = job->target;
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->done_bitmap = bitmap_new(end);
@@ -402,62 +614,9 @@ static void coroutine_fn backup_run(void *opaque)
              * notify callback service CoW requests. */
             block_job_yield(&job->common);
         }
-    } else if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
-        ret = backup_run_incremental(job);
     } else {
-        /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(job, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        /* FULL, TOP and INCREMENTAL SYNC_MODE's require copying */
+        ret = backup_run_workers(job);
     }
 
     notifier_with_return_remove(&job->before_write);
@@ -479,6 +638,7 @@ void backup_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
+                  int64_t max_workers,
                   BlockCompletionFunc *cb, void *opaque,
                   BlockJobTxn *txn, Error **errp)
 {
@@ -495,6 +655,12 @@ void backup_start(const char *job_id, BlockDriverState *bs,
         return;
     }
 
+    if (max_workers < 1 || max_workers > BACKUP_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(BACKUP_MAX_WORKERS));
+        return;
+    }
+
     if (!bdrv_is_inserted(bs)) {
         error_setg(errp, "Device is not inserted: %s",
                    bdrv_get_device_name(bs));
@@ -552,6 +718,8 @@ void backup_start(const char *job_id, BlockDriverState *bs,
 
     job->on_source_error = on_source_error;
     job->on_target_error = on_target_error;
+    job->max_workers = max_workers;
+    job->use_copy_range = true;
     job->sync_mode = sync_mode;
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
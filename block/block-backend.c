@@ -15,6 +15,7 @@
 #include "block/block_int.h"
 #include "block/blockjob.h"
 #include "block/throttle-groups.h"
+#include "block/latency-trace.h"
 #include "sysemu/blockdev.h"
 #include "sysemu/sysemu.h"
 #include "qapi-event.h"
@@ -742,10 +743,23 @@ static int blk_check_request(BlockBackend *blk, int64_t sector_num,
                                   nb_sectors * BDRV_SECTOR_SIZE);
 }
 
+/* Wait for the throttle group of @blk, accounting the time in its own span */
+static void coroutine_fn blk_co_throttle(BlockBackend *blk,
+                                         unsigned int bytes, bool is_write)
+{
+    BlockLatencySpan span;
+
+    block_latency_span_begin(&span);
+    throttle_group_co_io_limits_intercept(blk, bytes, is_write);
+    block_latency_span_end(&span, is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ,
+                           "throttle", throttle_group_get_name(blk));
+}
+
 int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
                                unsigned int bytes, QEMUIOVector *qiov,
                                BdrvRequestFlags flags)
 {
+    BlockLatencySpan span;
     int ret;
 
     trace_blk_co_preadv(blk, blk_bs(blk), offset, bytes, flags);
@@ -755,18 +769,23 @@ int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
         return ret;
     }
 
+    block_latency_span_begin(&span);
+
     /* throttling disk I/O */
     if (blk->public.throttle_state) {
-        throttle_group_co_io_limits_intercept(blk, bytes, false);
+        blk_co_throttle(blk, bytes, false);
     }
 
-    return bdrv_co_preadv(blk->root, offset, bytes, qiov, flags);
+    ret = bdrv_co_preadv(blk->root, offset, bytes, qiov, flags);
+    block_latency_span_end(&span, BLOCK_ACCT_READ, "blk", blk->name);
+    return ret;
 }
 
 int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
                                 unsigned int bytes, QEMUIOVector *qiov,
                                 BdrvRequestFlags flags)
 {
+    BlockLatencySpan span;
     int ret;
 
     trace_blk_co_pwritev(blk, blk_bs(blk), offset, bytes, flags);
@@ -776,16 +795,77 @@ int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
         return ret;
     }
 
+    block_latency_span_begin(&span);
+
     /* throttling disk I/O */
     if (blk->public.throttle_state) {
-        throttle_group_co_io_limits_intercept(blk, bytes, true);
+        blk_co_throttle(blk, bytes, true);
     }
 
     if (!blk->enable_write_cache) {
         flags |= BDRV_REQ_FUA;
     }
 
-    return bdrv_co_pwritev(blk->root, offset, bytes, qiov, flags);
+    ret = bdrv_co_pwritev(blk->root, offset, bytes, qiov, flags);
+    block_latency_span_end(&span, BLOCK_ACCT_WRITE, "blk", blk->name);
+    return ret;
+}
+
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   unsigned int bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The copy can't be made durable on its own, so let the caller fall back
+     * to a FUA write */
+    if (!blk_out->enable_write_cache) {
+        return -ENOTSUP;
+    }
+
+    /* throttling disk I/O */
+    if (blk_in->public.throttle_state) {
+        throttle_group_co_io_limits_intercept(blk_in, bytes, false);
+    }
+    if (blk_out->public.throttle_state) {
+        throttle_group_co_io_limits_intercept(blk_out, bytes, true);
+    }
+
+    return bdrv_co_copy_range(blk_in->root, off_in, blk_out->root, off_out,
+                              bytes, flags);
+}
+
+int coroutine_fn blk_co_host_read(BlockBackend *blk, int64_t offset,
+                                  unsigned int bytes, BdrvHostReadFunc *fn,
+                                  void *opaque)
+{
+    BlockLatencySpan span;
+    int ret;
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The caller decides how much of the range is read, so the throttle
+     * group can't be charged up front */
+    if (blk->public.throttle_state) {
+        return -ENOTSUP;
+    }
+
+    block_latency_span_begin(&span);
+    ret = bdrv_co_host_read(blk->root, offset, bytes, fn, opaque, 0);
+    block_latency_span_end(&span, BLOCK_ACCT_READ, "blk", blk->name);
+    return ret;
 }
 
 typedef struct BlkRwCo {
@@ -847,6 +927,52 @@ static int blk_prw(BlockBackend *blk, int64_t offset, uint8_t *buf,
     return rwco.ret;
 }
 
+typedef struct BlkCopyRangeCo {
+    BlockBackend *blk_in;
+    int64_t off_in;
+    BlockBackend *blk_out;
+    int64_t off_out;
+    unsigned int bytes;
+    BdrvRequestFlags flags;
+    int ret;
+} BlkCopyRangeCo;
+
+static void blk_copy_range_entry(void *opaque)
+{
+    BlkCopyRangeCo *crco = opaque;
+
+    crco->ret = blk_co_copy_range(crco->blk_in, crco->off_in,
+                                  crco->blk_out, crco->off_out,
+                                  crco->bytes, crco->flags);
+}
+
+int blk_copy_range(BlockBackend *blk_in, int64_t off_in,
+                   BlockBackend *blk_out, int64_t off_out,
+                   unsigned int bytes, BdrvRequestFlags flags)
+{
+    AioContext *aio_context;
+    Coroutine *co;
+    BlkCopyRangeCo crco = {
+        .blk_in     = blk_in,
+        .off_in     = off_in,
+        .blk_out    = blk_out,
+        .off_out    = off_out,
+        .bytes      = bytes,
+        .flags      = flags,
+        .ret        = NOT_DONE,
+    };
+
+    co = qemu_coroutine_create(blk_copy_range_entry, &crco);
+    qemu_coroutine_enter(co);
+
+    aio_context = blk_get_aio_context(blk_out);
+    while (crco.ret == NOT_DONE) {
+        aio_poll(aio_context, true);
+    }
+
+    return crco.ret;
+}
+
 int blk_pread_unthrottled(BlockBackend *blk, int64_t offset, uint8_t *buf,
                           int count)
 {
@@ -1118,11 +1244,17 @@ int blk_co_pdiscard(BlockBackend *blk, int64_t offset, int count)
 
 int blk_co_flush(BlockBackend *blk)
 {
+    BlockLatencySpan span;
+    int ret;
+
     if (!blk_is_available(blk)) {
         return -ENOMEDIUM;
     }
 
-    return bdrv_co_flush(blk_bs(blk));
+    block_latency_span_begin(&span);
+    ret = bdrv_co_flush(blk_bs(blk));
+    block_latency_span_end(&span, BLOCK_ACCT_FLUSH, "blk", blk->name);
+    return ret;
 }
 
 int blk_flush(BlockBackend *blk)
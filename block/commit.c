@@ -18,6 +18,7 @@
 #include "block/blockjob.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
+#include "qemu/cutils.h"
 #include "qemu/ratelimit.h"
 #include "sysemu/block-backend.h"
 
@@ -28,10 +29,18 @@ enum {
      * contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /*
+     * Maximum size of a single allocation query, and of a single request for
+     * an area that reads as zeroes.
+     */
+    COMMIT_BATCH_SIZE = 64 * 1024 * 1024, /* in bytes */
 };
 
 #define SLICE_TIME 100000000ULL /* ns */
 
+#define COMMIT_WORKERS 4
+
 typedef struct CommitBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -42,11 +51,27 @@ typedef struct CommitBlockJob {
     int base_flags;
     int orig_overlay_flags;
     char *backing_file_str;
+
+    /* Background copy workers */
+    int in_flight;
+    bool waiting_for_io;
+
+    /* first worker error, the job decides what to do about it */
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t worker_error_sector;
 } CommitBlockJob;
 
+typedef struct CommitWorker {
+    CommitBlockJob *job;
+    int64_t sector_num;
+    int nb_sectors;
+    bool zero;
+} CommitWorker;
+
 static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
                                         int64_t sector_num, int nb_sectors,
-                                        void *buf)
+                                        void *buf, bool *error_is_read)
 {
     int ret = 0;
     QEMUIOVector qiov;
@@ -60,18 +85,101 @@ static int coroutine_fn commit_populate(BlockBackend *bs, BlockBackend *base,
     ret = blk_co_preadv(bs, sector_num * BDRV_SECTOR_SIZE,
                         qiov.size, &qiov, 0);
     if (ret < 0) {
+        *error_is_read = true;
         return ret;
     }
 
-    ret = blk_co_pwritev(base, sector_num * BDRV_SECTOR_SIZE,
-                         qiov.size, &qiov, 0);
+    /* Data that happens to be zero need not be written out */
+    if (buffer_is_zero(buf, qiov.size)) {
+        ret = blk_co_pwrite_zeroes(base, sector_num * BDRV_SECTOR_SIZE,
+                                   qiov.size, BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = blk_co_pwritev(base, sector_num * BDRV_SECTOR_SIZE,
+                             qiov.size, &qiov, 0);
+    }
     if (ret < 0) {
+        *error_is_read = false;
         return ret;
     }
 
     return 0;
 }
 
+static void coroutine_fn commit_worker_entry(void *opaque)
+{
+    CommitWorker *w = opaque;
+    CommitBlockJob *s = w->job;
+    bool error_is_read = false;
+    void *buf;
+    int ret;
+
+    if (w->zero) {
+        ret = blk_co_pwrite_zeroes(s->base, w->sector_num * BDRV_SECTOR_SIZE,
+                                   w->nb_sectors * BDRV_SECTOR_SIZE,
+                                   BDRV_REQ_MAY_UNMAP);
+    } else {
+        buf = blk_try_blockalign(s->top, w->nb_sectors * BDRV_SECTOR_SIZE);
+        if (buf == NULL) {
+            ret = -ENOMEM;
+        } else {
+            ret = commit_populate(s->top, s->base, w->sector_num,
+                                  w->nb_sectors, buf, &error_is_read);
+            qemu_vfree(buf);
+        }
+    }
+
+    if (ret < 0) {
+        if (s->worker_ret == 0) {
+            s->worker_ret = ret;
+            s->worker_error_is_read = error_is_read;
+        }
+        s->worker_error_sector = MIN(s->worker_error_sector, w->sector_num);
+    } else {
+        /* Publish progress */
+        s->common.offset += w->nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    g_free(w);
+    s->in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+}
+
+/* Wait until no more than @max_in_flight workers are running */
+static void coroutine_fn commit_wait_for_workers(CommitBlockJob *s,
+                                                 int max_in_flight)
+{
+    while (s->in_flight > max_in_flight) {
+        s->waiting_for_io = true;
+        qemu_coroutine_yield();
+        s->waiting_for_io = false;
+    }
+}
+
+static void coroutine_fn commit_start_worker(CommitBlockJob *s,
+                                             int64_t sector_num,
+                                             int nb_sectors, bool zero)
+{
+    CommitWorker *w;
+    Coroutine *co;
+
+    commit_wait_for_workers(s, COMMIT_WORKERS - 1);
+
+    w = g_new(CommitWorker, 1);
+    *w = (CommitWorker) {
+        .job        = s,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .zero       = zero,
+    };
+
+    s->in_flight++;
+    trace_commit_worker_start(s, sector_num, nb_sectors, zero, s->in_flight);
+    co = qemu_coroutine_create(commit_worker_entry, w);
+    qemu_coroutine_enter(co);
+}
+
 typedef struct {
     int ret;
 } CommitCompleteData;
@@ -112,12 +220,14 @@ static void coroutine_fn commit_run(void *opaque)
 {
     CommitBlockJob *s = opaque;
     CommitCompleteData *data;
-    int64_t sector_num, end;
+    BlockErrorAction action;
+    BlockDriverState *file;
+    int64_t sector_num = 0, end;
+    int64_t progress_end = 0;
     uint64_t delay_ns = 0;
+    int64_t status;
     int ret = 0;
     int n = 0;
-    void *buf = NULL;
-    int bytes_written = 0;
     int64_t base_len;
 
     ret = s->common.len = blk_getlength(s->top);
@@ -140,51 +250,86 @@ static void coroutine_fn commit_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = blk_blockalign(s->top, COMMIT_BUFFER_SIZE);
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
-        bool copy;
+    /* Query the allocation status of up to COMMIT_BATCH_SIZE at a time and
+     * hand what is allocated above the base to up to COMMIT_WORKERS
+     * coroutines.  Data is copied in COMMIT_BUFFER_SIZE chunks, areas that
+     * read as zeroes are written with a single write zeroes request.  On an
+     * error, all workers are waited for before the error action is applied;
+     * the job then resumes from the first chunk that failed.
+     */
+    s->worker_ret = 0;
+    s->worker_error_sector = INT64_MAX;
+
+    for (;;) {
+        bool copy, zero;
+
+        if (s->worker_ret < 0 || sector_num >= end) {
+            commit_wait_for_workers(s, 0);
+            if (s->worker_ret == 0) {
+                break;
+            }
+
+            action = block_job_error_action(&s->common, s->on_error,
+                                            s->worker_error_is_read,
+                                            -s->worker_ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ret = s->worker_ret;
+                goto out;
+            }
+            sector_num = s->worker_error_sector;
+            s->worker_ret = 0;
+            s->worker_error_sector = INT64_MAX;
+            continue;
+        }
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
             break;
         }
         /* Copy if allocated above the base */
-        ret = bdrv_is_allocated_above(blk_bs(s->top), blk_bs(s->base),
-                                      sector_num,
-                                      COMMIT_BUFFER_SIZE / BDRV_SECTOR_SIZE,
-                                      &n);
-        copy = (ret == 1);
-        trace_commit_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            ret = commit_populate(s->top, s->base, sector_num, n, buf);
-            bytes_written += n * BDRV_SECTOR_SIZE;
+        status = bdrv_get_block_status_above(blk_bs(s->top), blk_bs(s->base),
+                                             sector_num,
+                                             MIN(end - sector_num,
+                                                 COMMIT_BATCH_SIZE >>
+                                                 BDRV_SECTOR_BITS),
+                                             &n, &file);
+        trace_commit_one_iteration(s, sector_num, n, status);
+        if (status < 0) {
+            s->worker_ret = status;
+            s->worker_error_is_read = true;
+            s->worker_error_sector = sector_num;
+            continue;
         }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, false, s->on_error, -ret);
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                goto out;
-            } else {
-                n = 0;
-                continue;
-            }
+
+        copy = status & BDRV_BLOCK_ALLOCATED;
+        zero = status & BDRV_BLOCK_ZERO;
+        if (copy && !zero) {
+            n = MIN(n, COMMIT_BUFFER_SIZE >> BDRV_SECTOR_BITS);
         }
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
 
-        if (copy && s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+        if (copy) {
+            commit_start_worker(s, sector_num, n, zero);
+            if (!zero && s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            }
+        } else if (sector_num + n > progress_end) {
+            /* Publish progress, but only once for areas that are walked
+             * again after an error */
+            s->common.offset += (sector_num + n - progress_end) *
+                                BDRV_SECTOR_SIZE;
         }
+        sector_num += n;
+        progress_end = MAX(progress_end, sector_num);
     }
 
     ret = 0;
 
 out:
-    qemu_vfree(buf);
+    commit_wait_for_workers(s, 0);
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
@@ -21,6 +21,7 @@
 #include "qemu/osdep.h"
 
 #include "block/block_int.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -36,8 +37,16 @@
 
 typedef struct BlockCrypto BlockCrypto;
 
+/* Number of cipher jobs that may run in the thread pool at once */
+#define BLOCK_CRYPTO_MAX_THREADS 4
+
 struct BlockCrypto {
     QCryptoBlock *block;
+
+    /* Cipher jobs currently running in the thread pool, and
+     * requests waiting for one of them to finish */
+    int nb_threads;
+    CoQueue thread_queue;
 };
 
 
@@ -313,6 +322,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
+                                       BLOCK_CRYPTO_MAX_THREADS,
                                        errp);
 
     if (!crypto->block) {
@@ -322,6 +332,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
 
     bs->encrypted = true;
     bs->valid_key = true;
+    qemu_co_queue_init(&crypto->thread_queue);
 
     ret = 0;
  cleanup:
@@ -387,141 +398,239 @@ static void block_crypto_close(BlockDriverState *bs)
 }
 
 
-#define BLOCK_CRYPTO_MAX_SECTORS 32
+/*
+ * Requests are split into chunks that are read, decrypted and copied
+ * out (or copied in, encrypted and written) independently. Several
+ * chunks of a request are in flight at once so that I/O on the
+ * underlying file overlaps with the cipher work, which runs in the
+ * thread pool so that one image can use several cores. Chunks are
+ * kept small so that their bounce buffers come from the heap and
+ * stay in the cache between the copy and the cipher work.
+ */
+#define BLOCK_CRYPTO_CHUNK_SECTORS 128  /* 64 KB */
+#define BLOCK_CRYPTO_MAX_TASKS (2 * BLOCK_CRYPTO_MAX_THREADS)
 
-static coroutine_fn int
-block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
-                      int remaining_sectors, QEMUIOVector *qiov)
+typedef struct BlockCryptoCryptData {
+    QCryptoBlock *block;
+    bool encrypt;
+    uint64_t sector_num;
+    uint8_t *buf;
+    size_t len;
+} BlockCryptoCryptData;
+
+typedef struct BlockCryptoRequest {
+    BlockDriverState *bs;
+    QEMUIOVector *qiov;
+    bool encrypt;
+    Coroutine *co;
+    bool waiting;
+    int in_flight;
+    int ret;
+} BlockCryptoRequest;
+
+typedef struct BlockCryptoTask {
+    BlockCryptoRequest *req;
+    int64_t sector_num;
+    int nb_sectors;
+    uint64_t qiov_offset;
+} BlockCryptoTask;
+
+static int block_crypto_crypt_worker(void *opaque)
+{
+    BlockCryptoCryptData *data = opaque;
+    int ret;
+
+    if (data->encrypt) {
+        ret = qcrypto_block_encrypt(data->block, data->sector_num,
+                                    data->buf, data->len, NULL);
+    } else {
+        ret = qcrypto_block_decrypt(data->block, data->sector_num,
+                                    data->buf, data->len, NULL);
+    }
+
+    return ret < 0 ? -EIO : 0;
+}
+
+static coroutine_fn int block_crypto_co_crypt(BlockDriverState *bs,
+                                              bool encrypt,
+                                              int64_t sector_num,
+                                              uint8_t *buf, size_t len)
 {
     BlockCrypto *crypto = bs->opaque;
-    int cur_nr_sectors; /* number of sectors in current iteration */
-    uint64_t bytes_done = 0;
-    uint8_t *cipher_data = NULL;
-    QEMUIOVector hd_qiov;
-    int ret = 0;
-    size_t payload_offset =
-        qcrypto_block_get_payload_offset(crypto->block) / 512;
+    BlockCryptoCryptData data = {
+        .block      = crypto->block,
+        .encrypt    = encrypt,
+        .sector_num = sector_num,
+        .buf        = buf,
+        .len        = len,
+    };
+    ThreadPool *pool;
+    int ret;
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+    /* The QCryptoBlock has one cipher per thread */
+    while (crypto->nb_threads >= BLOCK_CRYPTO_MAX_THREADS) {
+        qemu_co_queue_wait(&crypto->thread_queue);
+    }
 
-    /* Bounce buffer so we have a linear mem region for
-     * entire sector. XXX optimize so we avoid bounce
-     * buffer in case that qiov->niov == 1
-     */
-    cipher_data =
-        qemu_try_blockalign(bs->file->bs, MIN(BLOCK_CRYPTO_MAX_SECTORS * 512,
-                                              qiov->size));
+    crypto->nb_threads++;
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ret = thread_pool_submit_co(pool, block_crypto_crypt_worker, &data);
+    crypto->nb_threads--;
+
+    qemu_co_queue_next(&crypto->thread_queue);
+
+    return ret;
+}
+
+static coroutine_fn int block_crypto_co_rw_chunk(BlockCryptoRequest *req,
+                                                 int64_t sector_num,
+                                                 int nb_sectors,
+                                                 uint64_t qiov_offset)
+{
+    BlockDriverState *bs = req->bs;
+    BlockCrypto *crypto = bs->opaque;
+    size_t bytes = nb_sectors * BDRV_SECTOR_SIZE;
+    int64_t payload_offset =
+        qcrypto_block_get_payload_offset(crypto->block) / BDRV_SECTOR_SIZE;
+    uint8_t *cipher_data;
+    QEMUIOVector hd_qiov;
+    struct iovec iov;
+    int ret;
+
+    /* Bounce buffer, since we must neither encrypt the guest's data
+     * in place nor hand the cipher a scattered buffer */
+    cipher_data = qemu_try_blockalign(bs->file->bs, bytes);
     if (cipher_data == NULL) {
-        ret = -ENOMEM;
-        goto cleanup;
+        return -ENOMEM;
     }
 
-    while (remaining_sectors) {
-        cur_nr_sectors = remaining_sectors;
-
-        if (cur_nr_sectors > BLOCK_CRYPTO_MAX_SECTORS) {
-            cur_nr_sectors = BLOCK_CRYPTO_MAX_SECTORS;
-        }
+    iov = (struct iovec) {
+        .iov_base = cipher_data,
+        .iov_len  = bytes,
+    };
+    qemu_iovec_init_external(&hd_qiov, &iov, 1);
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_add(&hd_qiov, cipher_data, cur_nr_sectors * 512);
+    if (req->encrypt) {
+        qemu_iovec_to_buf(req->qiov, qiov_offset, cipher_data, bytes);
 
-        ret = bdrv_co_readv(bs->file,
-                            payload_offset + sector_num,
-                            cur_nr_sectors, &hd_qiov);
+        ret = block_crypto_co_crypt(bs, true, sector_num, cipher_data, bytes);
         if (ret < 0) {
-            goto cleanup;
+            goto out;
         }
 
-        if (qcrypto_block_decrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
-            goto cleanup;
+        ret = bdrv_co_writev(bs->file, payload_offset + sector_num,
+                             nb_sectors, &hd_qiov);
+    } else {
+        ret = bdrv_co_readv(bs->file, payload_offset + sector_num,
+                            nb_sectors, &hd_qiov);
+        if (ret < 0) {
+            goto out;
         }
 
-        qemu_iovec_from_buf(qiov, bytes_done,
-                            cipher_data, cur_nr_sectors * 512);
+        ret = block_crypto_co_crypt(bs, false, sector_num, cipher_data, bytes);
+        if (ret < 0) {
+            goto out;
+        }
 
-        remaining_sectors -= cur_nr_sectors;
-        sector_num += cur_nr_sectors;
-        bytes_done += cur_nr_sectors * 512;
+        qemu_iovec_from_buf(req->qiov, qiov_offset, cipher_data, bytes);
     }
 
- cleanup:
-    qemu_iovec_destroy(&hd_qiov);
+ out:
     qemu_vfree(cipher_data);
-
     return ret;
 }
 
-
-static coroutine_fn int
-block_crypto_co_writev(BlockDriverState *bs, int64_t sector_num,
-                       int remaining_sectors, QEMUIOVector *qiov)
+static void coroutine_fn block_crypto_task_entry(void *opaque)
 {
-    BlockCrypto *crypto = bs->opaque;
-    int cur_nr_sectors; /* number of sectors in current iteration */
-    uint64_t bytes_done = 0;
-    uint8_t *cipher_data = NULL;
-    QEMUIOVector hd_qiov;
-    int ret = 0;
-    size_t payload_offset =
-        qcrypto_block_get_payload_offset(crypto->block) / 512;
+    BlockCryptoTask *task = opaque;
+    BlockCryptoRequest *req = task->req;
+    int ret;
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+    if (req->ret == 0) {
+        ret = block_crypto_co_rw_chunk(req, task->sector_num,
+                                       task->nb_sectors, task->qiov_offset);
+        if (ret < 0 && req->ret == 0) {
+            req->ret = ret;
+        }
+    }
 
-    /* Bounce buffer so we have a linear mem region for
-     * entire sector. XXX optimize so we avoid bounce
-     * buffer in case that qiov->niov == 1
-     */
-    cipher_data =
-        qemu_try_blockalign(bs->file->bs, MIN(BLOCK_CRYPTO_MAX_SECTORS * 512,
-                                              qiov->size));
-    if (cipher_data == NULL) {
-        ret = -ENOMEM;
-        goto cleanup;
+    req->in_flight--;
+    if (req->waiting) {
+        qemu_coroutine_enter(req->co);
     }
+    g_free(task);
+}
 
-    while (remaining_sectors) {
-        cur_nr_sectors = remaining_sectors;
+static void coroutine_fn block_crypto_wait_for_tasks(BlockCryptoRequest *req,
+                                                     int max_in_flight)
+{
+    while (req->in_flight > max_in_flight) {
+        req->waiting = true;
+        qemu_coroutine_yield();
+        req->waiting = false;
+    }
+}
 
-        if (cur_nr_sectors > BLOCK_CRYPTO_MAX_SECTORS) {
-            cur_nr_sectors = BLOCK_CRYPTO_MAX_SECTORS;
-        }
+static coroutine_fn int block_crypto_co_rw(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           int nb_sectors,
+                                           QEMUIOVector *qiov,
+                                           bool encrypt)
+{
+    BlockCryptoRequest req = {
+        .bs      = bs,
+        .qiov    = qiov,
+        .encrypt = encrypt,
+        .co      = qemu_coroutine_self(),
+    };
+    uint64_t qiov_offset = 0;
 
-        qemu_iovec_to_buf(qiov, bytes_done,
-                          cipher_data, cur_nr_sectors * 512);
+    if (nb_sectors <= BLOCK_CRYPTO_CHUNK_SECTORS) {
+        return block_crypto_co_rw_chunk(&req, sector_num, nb_sectors, 0);
+    }
 
-        if (qcrypto_block_encrypt(crypto->block,
-                                  sector_num,
-                                  cipher_data, cur_nr_sectors * 512,
-                                  NULL) < 0) {
-            ret = -EIO;
-            goto cleanup;
-        }
+    while (nb_sectors > 0 && req.ret == 0) {
+        BlockCryptoTask *task;
+        Coroutine *co;
+        int n = MIN(nb_sectors, BLOCK_CRYPTO_CHUNK_SECTORS);
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_add(&hd_qiov, cipher_data, cur_nr_sectors * 512);
+        block_crypto_wait_for_tasks(&req, BLOCK_CRYPTO_MAX_TASKS - 1);
 
-        ret = bdrv_co_writev(bs->file,
-                             payload_offset + sector_num,
-                             cur_nr_sectors, &hd_qiov);
-        if (ret < 0) {
-            goto cleanup;
-        }
+        task = g_new(BlockCryptoTask, 1);
+        *task = (BlockCryptoTask) {
+            .req         = &req,
+            .sector_num  = sector_num,
+            .nb_sectors  = n,
+            .qiov_offset = qiov_offset,
+        };
+
+        req.in_flight++;
+        co = qemu_coroutine_create(block_crypto_task_entry, task);
+        qemu_coroutine_enter(co);
 
-        remaining_sectors -= cur_nr_sectors;
-        sector_num += cur_nr_sectors;
-        bytes_done += cur_nr_sectors * 512;
+        sector_num += n;
+        nb_sectors -= n;
+        qiov_offset += n * BDRV_SECTOR_SIZE;
     }
 
- cleanup:
-    qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cipher_data);
+    block_crypto_wait_for_tasks(&req, 0);
 
-    return ret;
+    return req.ret;
+}
+
+static coroutine_fn int
+block_crypto_co_readv(BlockDriverState *bs, int64_t sector_num,
+                      int remaining_sectors, QEMUIOVector *qiov)
+{
+    return block_crypto_co_rw(bs, sector_num, remaining_sectors, qiov, false);
+}
+
+
+static coroutine_fn int
+block_crypto_co_writev(BlockDriverState *bs, int64_t sector_num,
+                       int remaining_sectors, QEMUIOVector *qiov)
+{
+    return block_crypto_co_rw(bs, sector_num, remaining_sectors, qiov, true);
 }
 
 
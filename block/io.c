@@ -27,6 +27,7 @@
 #include "sysemu/block-backend.h"
 #include "block/blockjob.h"
 #include "block/block_int.h"
+#include "block/latency-trace.h"
 #include "qemu/cutils.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
@@ -960,14 +961,112 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
         goto err;
     }
 
-    skip_bytes = offset - cluster_offset;
-    qemu_iovec_from_buf(qiov, 0, bounce_buffer + skip_bytes, bytes);
+    if (qiov) {
+        skip_bytes = offset - cluster_offset;
+        qemu_iovec_from_buf(qiov, 0, bounce_buffer + skip_bytes, bytes);
+    }
 
 err:
     qemu_vfree(bounce_buffer);
     return ret;
 }
 
+typedef struct BdrvCoRPrefetch {
+    BlockDriverState *bs;
+    int64_t offset;
+    unsigned int bytes;
+} BdrvCoRPrefetch;
+
+static void coroutine_fn bdrv_co_copy_on_read_prefetch_entry(void *opaque)
+{
+    BdrvCoRPrefetch *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BdrvTrackedRequest req;
+    int64_t offset = p->offset;
+    int64_t end = p->offset + p->bytes;
+    int pnum;
+    int ret;
+
+    /* Serialise against guest writes like any copy-on-read request.  The
+     * tracked request also makes bdrv_drain() wait for us.  */
+    tracked_request_begin(&req, bs, p->offset, p->bytes, BDRV_TRACKED_READ);
+    mark_request_serialising(&req, bdrv_get_cluster_size(bs));
+    wait_serialising_requests(&req);
+
+    while (offset < end) {
+        ret = bdrv_is_allocated(bs, offset >> BDRV_SECTOR_BITS,
+                                (end - offset) >> BDRV_SECTOR_BITS, &pnum);
+        if (ret < 0 || pnum == 0) {
+            break;
+        }
+        if (!ret) {
+            ret = bdrv_co_do_copy_on_readv(bs, offset,
+                                           pnum << BDRV_SECTOR_BITS, NULL);
+            if (ret < 0) {
+                break;
+            }
+        }
+        offset += (int64_t) pnum << BDRV_SECTOR_BITS;
+    }
+
+    tracked_request_end(&req);
+    bs->cor_prefetch_in_flight = false;
+    g_free(p);
+}
+
+/* Size of the area that guest copy-on-read copies ahead of a request */
+#define COPY_ON_READ_PREFETCH_BYTES (1 * 1024 * 1024)
+
+/*
+ * Called for guest reads with copy-on-read enabled.  On a miss, starts to
+ * copy the clusters following the request in the background, so that a
+ * sequential reader finds them in the image.  A reader that hits the second
+ * half of the previous prefetch window moves the window ahead.  At most one
+ * prefetch is in flight per node.
+ */
+static void bdrv_copy_on_read_prefetch(BlockDriverState *bs, int64_t offset,
+                                       unsigned int bytes, bool miss)
+{
+    int64_t cluster_size = bdrv_get_cluster_size(bs);
+    int64_t end = offset + bytes;
+    int64_t start, total_bytes;
+    BdrvCoRPrefetch *p;
+    Coroutine *co;
+
+    if (bs->cor_prefetch_in_flight) {
+        return;
+    }
+    if (miss) {
+        start = end;
+    } else if (end > bs->cor_prefetch_end - COPY_ON_READ_PREFETCH_BYTES / 2 &&
+               end <= bs->cor_prefetch_end) {
+        start = bs->cor_prefetch_end;
+    } else {
+        return;
+    }
+
+    total_bytes = bdrv_getlength(bs);
+    start = ROUND_UP(start, cluster_size);
+    if (total_bytes < 0 || start >= total_bytes) {
+        return;
+    }
+    bytes = MIN(ROUND_UP(COPY_ON_READ_PREFETCH_BYTES, cluster_size),
+                total_bytes - start);
+
+    trace_bdrv_copy_on_read_prefetch(bs, start, bytes, miss);
+    bs->cor_prefetch_end = start + bytes;
+    bs->cor_prefetch_in_flight = true;
+
+    p = g_new(BdrvCoRPrefetch, 1);
+    *p = (BdrvCoRPrefetch) {
+        .bs     = bs,
+        .offset = start,
+        .bytes  = bytes,
+    };
+    co = qemu_coroutine_create(bdrv_co_copy_on_read_prefetch_entry, p);
+    qemu_coroutine_enter(co);
+}
+
 /*
  * Forwards an already correctly aligned request to the BlockDriver. This
  * handles copy on read, zeroing after EOF, and fragmentation of large
@@ -994,7 +1093,8 @@ static int coroutine_fn bdrv_aligned_preadv(BlockDriverState *bs,
      * potential fallback support, if we ever implement any read flags
      * to pass through to drivers.  For now, there aren't any
      * passthrough flags.  */
-    assert(!(flags & ~(BDRV_REQ_NO_SERIALISING | BDRV_REQ_COPY_ON_READ)));
+    assert(!(flags & ~(BDRV_REQ_NO_SERIALISING | BDRV_REQ_COPY_ON_READ |
+                       BDRV_REQ_PREFETCH)));
 
     /* Handle Copy on Read and associated serialisation */
     if (flags & BDRV_REQ_COPY_ON_READ) {
@@ -1021,6 +1121,11 @@ static int coroutine_fn bdrv_aligned_preadv(BlockDriverState *bs,
             goto out;
         }
 
+        if (flags & BDRV_REQ_PREFETCH) {
+            bdrv_copy_on_read_prefetch(bs, offset, bytes,
+                                       !ret || pnum != nb_sectors);
+        }
+
         if (!ret || pnum != nb_sectors) {
             ret = bdrv_co_do_copy_on_readv(bs, offset, bytes, qiov);
             goto out;
@@ -1080,6 +1185,7 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
     BlockDriverState *bs = child->bs;
     BlockDriver *drv = bs->drv;
     BdrvTrackedRequest req;
+    BlockLatencySpan span;
 
     uint64_t align = bs->bl.request_alignment;
     uint8_t *head_buf = NULL;
@@ -1097,8 +1203,14 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
         return ret;
     }
 
+    block_latency_span_begin(&span);
+
     /* Don't do copy-on-read if we read data before write operation */
     if (bs->copy_on_read && !(flags & BDRV_REQ_NO_SERIALISING)) {
+        /* Block jobs that ask for copy-on-read do their own read-ahead */
+        if (!(flags & BDRV_REQ_COPY_ON_READ)) {
+            flags |= BDRV_REQ_PREFETCH;
+        }
         flags |= BDRV_REQ_COPY_ON_READ;
     }
 
@@ -1139,6 +1251,8 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
         qemu_vfree(tail_buf);
     }
 
+    block_latency_span_end(&span, BLOCK_ACCT_READ, drv->format_name,
+                           bs->node_name);
     return ret;
 }
 
@@ -1458,6 +1572,7 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
 {
     BlockDriverState *bs = child->bs;
     BdrvTrackedRequest req;
+    BlockLatencySpan span;
     uint64_t align = bs->bl.request_alignment;
     uint8_t *head_buf = NULL;
     uint8_t *tail_buf = NULL;
@@ -1478,6 +1593,8 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
         return ret;
     }
 
+    block_latency_span_begin(&span);
+
     /*
      * Align write if necessary by performing a read-modify-write cycle.
      * Pad qiov with the read parts and be sure to have a tracked request not
@@ -1579,6 +1696,8 @@ fail:
     qemu_vfree(tail_buf);
 out:
     tracked_request_end(&req);
+    block_latency_span_end(&span, BLOCK_ACCT_WRITE, bs->drv->format_name,
+                           bs->node_name);
     return ret;
 }
 
@@ -1615,6 +1734,154 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    uint64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    uint64_t dst_offset,
+                                                    uint64_t bytes,
+                                                    BdrvRequestFlags flags,
+                                                    bool recurse_src)
+{
+    BlockDriverState *src_bs = src->bs;
+    BlockDriverState *dst_bs = dst->bs;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!src_bs->drv || !dst_bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst_bs->read_only) {
+        return -EPERM;
+    }
+    assert(!(dst_bs->open_flags & BDRV_O_INACTIVE));
+
+    ret = bdrv_check_byte_request(src_bs, src_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_check_byte_request(dst_bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!src_bs->drv->bdrv_co_copy_range_from ||
+        !dst_bs->drv->bdrv_co_copy_range_to ||
+        src_bs->copy_on_read ||
+        dst_bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF ||
+        !QEMU_IS_ALIGNED(src_offset | bytes, src_bs->bl.request_alignment) ||
+        !QEMU_IS_ALIGNED(dst_offset | bytes, dst_bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        tracked_request_begin(&req, src_bs, src_offset, bytes,
+                              BDRV_TRACKED_READ);
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+        ret = src_bs->drv->bdrv_co_copy_range_from(src_bs, src, src_offset,
+                                                   dst, dst_offset,
+                                                   bytes, flags);
+        tracked_request_end(&req);
+        return ret;
+    }
+
+    /* The destination side is a write and needs the same bookkeeping as
+     * bdrv_aligned_pwritev() */
+    tracked_request_begin(&req, dst_bs, dst_offset, bytes, BDRV_TRACKED_WRITE);
+    wait_serialising_requests(&req);
+
+    ret = notifier_with_return_list_notify(&dst_bs->before_write_notifiers,
+                                           &req);
+    if (ret == 0) {
+        ret = dst_bs->drv->bdrv_co_copy_range_to(dst_bs, src, src_offset,
+                                                 dst, dst_offset,
+                                                 bytes, flags);
+    }
+
+    if (ret != -ENOTSUP) {
+        int64_t start_sector = dst_offset >> BDRV_SECTOR_BITS;
+        int64_t end_sector = DIV_ROUND_UP(dst_offset + bytes,
+                                          BDRV_SECTOR_SIZE);
+
+        ++dst_bs->write_gen;
+        bdrv_set_dirty(dst_bs, start_sector, end_sector - start_sector);
+
+        if (dst_bs->wr_highest_offset < dst_offset + bytes) {
+            dst_bs->wr_highest_offset = dst_offset + bytes;
+        }
+        if (ret >= 0) {
+            dst_bs->total_sectors = MAX(dst_bs->total_sectors, end_sector);
+            ret = 0;
+        }
+    }
+
+    tracked_request_end(&req);
+    return ret;
+}
+
+/* Pass a copy request down the source chain */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                  bytes, flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, true);
+}
+
+/* Pass a copy request down the destination chain */
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes, BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_offset, dst, dst_offset,
+                                bytes, flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, false);
+}
+
+int coroutine_fn bdrv_co_host_read(BdrvChild *child, int64_t offset,
+                                   unsigned int bytes, BdrvHostReadFunc *fn,
+                                   void *opaque, BdrvRequestFlags flags)
+{
+    BlockDriverState *bs = child->bs;
+    BdrvTrackedRequest req;
+    int fd;
+    int ret;
+
+    trace_bdrv_co_host_read(child, offset, bytes, flags);
+
+    ret = bdrv_check_byte_request(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Copy-on-read has to see the data go by */
+    fd = bdrv_get_host_fd(bs);
+    if (fd < 0 || bs->copy_on_read) {
+        return -ENOTSUP;
+    }
+
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+        wait_serialising_requests(&req);
+    }
+    ret = fn(opaque, fd, offset, bytes);
+    tracked_request_end(&req);
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes, BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                   bytes, flags);
+}
+
 typedef struct BdrvCoGetBlockStatusData {
     BlockDriverState *bs;
     BlockDriverState *base;
@@ -2272,12 +2539,14 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 {
     int ret;
     BdrvTrackedRequest req;
+    BlockLatencySpan span;
 
     if (!bs || !bdrv_is_inserted(bs) || bdrv_is_read_only(bs) ||
         bdrv_is_sg(bs)) {
         return 0;
     }
 
+    block_latency_span_begin(&span);
     tracked_request_begin(&req, bs, 0, 0, BDRV_TRACKED_FLUSH);
 
     int current_gen = bs->write_gen;
@@ -2362,6 +2631,8 @@ out:
     qemu_co_queue_next(&bs->flush_queue);
 
     tracked_request_end(&req);
+    block_latency_span_end(&span, BLOCK_ACCT_FLUSH, bs->drv->format_name,
+                           bs->node_name);
     return ret;
 }
 
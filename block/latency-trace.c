@@ -0,0 +1,315 @@
+/*
+ * QEMU block layer request latency tracing
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/latency-trace.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/notify.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "qmp-commands.h"
+
+typedef struct BlockLatencyRecord {
+    void *req;                  /* coroutine that ran the request */
+    int64_t start_ns;
+    int64_t end_ns;
+    const char *kind;
+    enum BlockAcctType op;
+    char name[32];
+} BlockLatencyRecord;
+
+typedef struct BlockLatencyRing BlockLatencyRing;
+struct BlockLatencyRing {
+    /* Taken by the owning thread for each span and by the collector */
+    QemuMutex lock;
+    BlockLatencyRecord *records;
+    size_t size;
+    uint64_t head;              /* number of spans ever recorded */
+
+    /* Protected by rings_lock */
+    bool orphan;                /* the owning thread has exited */
+    QLIST_ENTRY(BlockLatencyRing) next;
+};
+
+bool block_latency_trace_enabled;
+
+static QemuMutex rings_lock;
+static QLIST_HEAD(, BlockLatencyRing) rings = QLIST_HEAD_INITIALIZER(rings);
+static size_t rings_size = BLOCK_LATENCY_TRACE_DEFAULT_SIZE;
+
+static __thread BlockLatencyRing *thread_ring;
+static __thread Notifier thread_ring_notifier;
+
+static const char *const op_names[BLOCK_MAX_IOTYPE] = {
+    [BLOCK_ACCT_READ]  = "read",
+    [BLOCK_ACCT_WRITE] = "write",
+    [BLOCK_ACCT_FLUSH] = "flush",
+};
+
+static void __attribute__((__constructor__)) block_latency_trace_init(void)
+{
+    qemu_mutex_init(&rings_lock);
+}
+
+static void thread_ring_orphan(Notifier *n, void *unused)
+{
+    /* The ring is freed by the next block_latency_trace_start() */
+    qemu_mutex_lock(&rings_lock);
+    thread_ring->orphan = true;
+    qemu_mutex_unlock(&rings_lock);
+    thread_ring = NULL;
+}
+
+static BlockLatencyRing *get_thread_ring(void)
+{
+    BlockLatencyRing *ring = thread_ring;
+
+    if (ring) {
+        return ring;
+    }
+
+    ring = g_new0(BlockLatencyRing, 1);
+    qemu_mutex_init(&ring->lock);
+
+    qemu_mutex_lock(&rings_lock);
+    ring->size = rings_size;
+    ring->records = g_new(BlockLatencyRecord, ring->size);
+    QLIST_INSERT_HEAD(&rings, ring, next);
+    qemu_mutex_unlock(&rings_lock);
+
+    thread_ring = ring;
+    thread_ring_notifier.notify = thread_ring_orphan;
+    qemu_thread_atexit_add(&thread_ring_notifier);
+    return ring;
+}
+
+void block_latency_span_record(BlockLatencySpan *span, enum BlockAcctType op,
+                               const char *kind, const char *name)
+{
+    BlockLatencyRing *ring = get_thread_ring();
+    BlockLatencyRecord *rec;
+    int64_t now = get_clock();
+
+    qemu_mutex_lock(&ring->lock);
+    rec = &ring->records[ring->head++ % ring->size];
+    rec->req = qemu_coroutine_self();
+    rec->start_ns = span->start_ns;
+    rec->end_ns = now;
+    rec->kind = kind;
+    rec->op = op;
+    pstrcpy(rec->name, sizeof(rec->name), name ?: "");
+    qemu_mutex_unlock(&ring->lock);
+}
+
+void block_latency_trace_start(size_t size)
+{
+    BlockLatencyRing *ring, *next_ring;
+
+    assert(size > 0);
+
+    qemu_mutex_lock(&rings_lock);
+    rings_size = size;
+    QLIST_FOREACH_SAFE(ring, &rings, next, next_ring) {
+        if (ring->orphan) {
+            QLIST_REMOVE(ring, next);
+            qemu_mutex_destroy(&ring->lock);
+            g_free(ring->records);
+            g_free(ring);
+            continue;
+        }
+
+        qemu_mutex_lock(&ring->lock);
+        if (ring->size != size) {
+            g_free(ring->records);
+            ring->records = g_new(BlockLatencyRecord, size);
+            ring->size = size;
+        }
+        ring->head = 0;
+        qemu_mutex_unlock(&ring->lock);
+    }
+    qemu_mutex_unlock(&rings_lock);
+
+    atomic_set(&block_latency_trace_enabled, true);
+}
+
+void block_latency_trace_stop(void)
+{
+    atomic_set(&block_latency_trace_enabled, false);
+}
+
+/* Order the spans of each request by start time, callers first */
+static int compare_records(const void *a, const void *b)
+{
+    const BlockLatencyRecord *ra = a;
+    const BlockLatencyRecord *rb = b;
+
+    if (ra->req != rb->req) {
+        return (uintptr_t)ra->req < (uintptr_t)rb->req ? -1 : 1;
+    }
+    if (ra->start_ns != rb->start_ns) {
+        return ra->start_ns < rb->start_ns ? -1 : 1;
+    }
+    if (ra->end_ns != rb->end_ns) {
+        return ra->end_ns > rb->end_ns ? -1 : 1;
+    }
+    return 0;
+}
+
+static int compare_stacks(gconstpointer a, gconstpointer b)
+{
+    const BlockLatencyTraceStack *sa = a;
+    const BlockLatencyTraceStack *sb = b;
+
+    return strcmp(sa->stack, sb->stack);
+}
+
+typedef struct StackFrame {
+    const BlockLatencyRecord *rec;
+    char *stack;
+    int64_t callees_ns;
+} StackFrame;
+
+static void pop_frame(StackFrame *frame, GHashTable *stacks)
+{
+    BlockLatencyTraceStack *s;
+    int64_t self_ns;
+
+    self_ns = frame->rec->end_ns - frame->rec->start_ns - frame->callees_ns;
+
+    s = g_hash_table_lookup(stacks, frame->stack);
+    if (!s) {
+        s = g_new0(BlockLatencyTraceStack, 1);
+        s->stack = frame->stack;
+        g_hash_table_insert(stacks, s->stack, s);
+    } else {
+        g_free(frame->stack);
+    }
+    s->ns += MAX(self_ns, 0);
+    s->count++;
+}
+
+BlockLatencyTraceStackList *block_latency_trace_collect(void)
+{
+    BlockLatencyRing *ring;
+    BlockLatencyRecord *recs = NULL;
+    size_t nrecs = 0;
+    StackFrame *frames = NULL;
+    int depth = 0, max_depth = 0;
+    GHashTable *stacks;
+    GList *list, *l;
+    BlockLatencyTraceStackList *head = NULL, **p_next = &head;
+    size_t i;
+
+    /* Copy the spans out of the rings, oldest first within each ring */
+    qemu_mutex_lock(&rings_lock);
+    QLIST_FOREACH(ring, &rings, next) {
+        size_t n, first;
+
+        qemu_mutex_lock(&ring->lock);
+        n = MIN(ring->head, ring->size);
+        first = (ring->head - n) % ring->size;
+        recs = g_renew(BlockLatencyRecord, recs, nrecs + n);
+        for (i = 0; i < n; i++) {
+            recs[nrecs++] = ring->records[(first + i) % ring->size];
+        }
+        qemu_mutex_unlock(&ring->lock);
+    }
+    qemu_mutex_unlock(&rings_lock);
+
+    qsort(recs, nrecs, sizeof(*recs), compare_records);
+
+    /*
+     * Rebuild the call stacks: a span is called by the innermost span of
+     * the same coroutine that contains it. Spans whose caller was already
+     * overwritten in the ring start a stack of their own.
+     */
+    stacks = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < nrecs; i++) {
+        const BlockLatencyRecord *rec = &recs[i];
+        StackFrame *caller;
+        GString *stack;
+
+        while (depth > 0) {
+            caller = &frames[depth - 1];
+            if (caller->rec->req == rec->req &&
+                rec->start_ns < caller->rec->end_ns &&
+                rec->end_ns <= caller->rec->end_ns) {
+                break;
+            }
+            pop_frame(caller, stacks);
+            depth--;
+        }
+
+        caller = depth > 0 ? &frames[depth - 1] : NULL;
+        stack = g_string_new(caller ? caller->stack : op_names[rec->op]);
+        g_string_append_printf(stack, ";%s", rec->kind);
+        if (rec->name[0]) {
+            g_string_append_printf(stack, ":%s", rec->name);
+        }
+        if (caller && caller->rec->op != rec->op) {
+            g_string_append_printf(stack, " (%s)", op_names[rec->op]);
+        }
+        if (caller) {
+            caller->callees_ns += rec->end_ns - rec->start_ns;
+        }
+
+        if (depth == max_depth) {
+            max_depth = MAX(max_depth * 2, 8);
+            frames = g_renew(StackFrame, frames, max_depth);
+        }
+        frames[depth++] = (StackFrame) {
+            .rec    = rec,
+            .stack  = g_string_free(stack, false),
+        };
+    }
+    while (depth > 0) {
+        pop_frame(&frames[--depth], stacks);
+    }
+
+    list = g_list_sort(g_hash_table_get_values(stacks), compare_stacks);
+    for (l = list; l; l = l->next) {
+        BlockLatencyTraceStackList *entry;
+
+        entry = g_new0(BlockLatencyTraceStackList, 1);
+        entry->value = l->data;
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    g_list_free(list);
+    g_hash_table_destroy(stacks);
+    g_free(frames);
+    g_free(recs);
+    return head;
+}
+
+void qmp_block_latency_trace_start(bool has_size, uint32_t size,
+                                   Error **errp)
+{
+    if (!has_size) {
+        size = BLOCK_LATENCY_TRACE_DEFAULT_SIZE;
+    } else if (size == 0) {
+        error_setg(errp, "The trace size must be positive");
+        return;
+    }
+
+    block_latency_trace_start(size);
+}
+
+void qmp_block_latency_trace_stop(Error **errp)
+{
+    block_latency_trace_stop();
+}
+
+BlockLatencyTraceStackList *qmp_query_block_latency_trace(Error **errp)
+{
+    return block_latency_trace_collect();
+}
@@ -22,10 +22,12 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define MIN_IN_FLIGHT 1
+#define DEFAULT_IN_FLIGHT 16
+#define MAX_IN_FLIGHT 64
 #define MAX_IO_SECTORS ((1 << 20) >> BDRV_SECTOR_BITS) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE \
-    (MAX_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
+    (DEFAULT_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -34,6 +36,15 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+/* Copy offloading is only tried for one request at first, so that a target
+ * that doesn't support it doesn't fail every request in flight */
+typedef enum MirrorCopyRange {
+    MIRROR_COPY_RANGE_PROBE,    /* the next request tries it */
+    MIRROR_COPY_RANGE_PROBING,  /* a request is trying it */
+    MIRROR_COPY_RANGE_ON,       /* it worked, all requests try it */
+    MIRROR_COPY_RANGE_OFF,
+} MirrorCopyRange;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -66,9 +77,18 @@ typedef struct MirrorBlockJob {
     int64_t sectors_in_flight;
     int ret;
     bool unmap;
+    /* whether to try blk_co_copy_range() before reading into the buffer */
+    MirrorCopyRange copy_range;
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+
+    /* Number of requests that may be in flight, adjusted to the latency of
+     * the writes to the target (see mirror_update_in_flight_limit) */
+    int max_in_flight;
+    int64_t lat_base;   /* lowest recent write latency, in ns per sector */
+    int64_t lat_avg;    /* moving average of the write latency */
+    int lat_samples;    /* writes completed since the last adjustment */
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -76,6 +96,7 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t write_start_ns; /* 0 unless the data write is timed */
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -128,6 +149,48 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     }
 }
 
+/* Adjust the number of requests in flight to the latency of the target.
+ *
+ * As long as the latency per sector stays close to the lowest recently
+ * seen, the target is not saturated and one more request is allowed in
+ * flight; if it grows well beyond that, requests are queueing up in the
+ * target and the depth is reduced.  The decision is taken once per
+ * max_in_flight completed writes, and the size of each request follows
+ * from the depth because the buffer is shared by all requests. */
+static void mirror_update_in_flight_limit(MirrorBlockJob *s, MirrorOp *op)
+{
+    int64_t lat;
+
+    if (!op->write_start_ns || !op->nb_sectors) {
+        return;
+    }
+
+    lat = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->write_start_ns) /
+          op->nb_sectors;
+    lat = MAX(lat, 1);
+    if (!s->lat_base || lat < s->lat_base) {
+        s->lat_base = lat;
+    }
+    s->lat_avg = s->lat_avg ? (s->lat_avg * 7 + lat) / 8 : lat;
+
+    if (++s->lat_samples < s->max_in_flight) {
+        return;
+    }
+    s->lat_samples = 0;
+
+    if (s->lat_avg < 2 * s->lat_base) {
+        s->max_in_flight = MIN(s->max_in_flight + 1, MAX_IN_FLIGHT);
+    } else if (s->lat_avg > 4 * s->lat_base) {
+        s->max_in_flight = MAX(s->max_in_flight * 3 / 4, MIN_IN_FLIGHT);
+    }
+
+    /* Let the baseline drift up so that it follows a slower target */
+    s->lat_base += s->lat_base / 64 + 1;
+
+    trace_mirror_update_in_flight_limit(s, s->max_in_flight, s->lat_avg,
+                                        s->lat_base);
+}
+
 static void mirror_write_complete(void *opaque, int ret)
 {
     MirrorOp *op = opaque;
@@ -140,6 +203,8 @@ static void mirror_write_complete(void *opaque, int ret)
         if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
         }
+    } else {
+        mirror_update_in_flight_limit(s, op);
     }
     mirror_iteration_done(op, ret);
 }
@@ -160,10 +225,49 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+
+    /* Don't send zeroes over the wire, they may even be unmapped */
+    if (qemu_iovec_is_zero(&op->qiov)) {
+        trace_mirror_zero_detected(s, op->sector_num, op->nb_sectors);
+        blk_aio_pwrite_zeroes(s->target, op->sector_num * BDRV_SECTOR_SIZE,
+                              op->qiov.size,
+                              s->unmap ? BDRV_REQ_MAY_UNMAP : 0,
+                              mirror_write_complete, op);
+        return;
+    }
+
+    op->write_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     blk_aio_pwritev(s->target, op->sector_num * BDRV_SECTOR_SIZE, &op->qiov,
                     0, mirror_write_complete, op);
 }
 
+static void coroutine_fn mirror_co_copy_range(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    op->write_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    ret = blk_co_copy_range(s->common.blk, op->sector_num * BDRV_SECTOR_SIZE,
+                            s->target, op->sector_num * BDRV_SECTOR_SIZE,
+                            op->qiov.size, 0);
+    if (ret < 0) {
+        /* Retry through the buffer, which also tells read errors apart from
+         * write errors, and don't bother with offloading again */
+        trace_mirror_copy_range_fail(s, op->sector_num, ret);
+        s->copy_range = MIRROR_COPY_RANGE_OFF;
+        op->write_start_ns = 0;
+        blk_aio_preadv(s->common.blk, op->sector_num * BDRV_SECTOR_SIZE,
+                       &op->qiov, 0, mirror_read_complete, op);
+        return;
+    }
+
+    if (s->copy_range == MIRROR_COPY_RANGE_PROBING) {
+        s->copy_range = MIRROR_COPY_RANGE_ON;
+    }
+    mirror_write_complete(op, ret);
+}
+
 static inline void mirror_clip_sectors(MirrorBlockJob *s,
                                        int64_t sector_num,
                                        int *nb_sectors)
@@ -261,7 +365,7 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     }
 
     /* Allocate a MirrorOp that is used as an AIO callback.  */
-    op = g_new(MirrorOp, 1);
+    op = g_new0(MirrorOp, 1);
     op->s = s;
     op->sector_num = sector_num;
     op->nb_sectors = nb_sectors;
@@ -284,6 +388,17 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     s->sectors_in_flight += nb_sectors;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
 
+    if (s->copy_range == MIRROR_COPY_RANGE_PROBE ||
+        s->copy_range == MIRROR_COPY_RANGE_ON) {
+        Coroutine *co = qemu_coroutine_create(mirror_co_copy_range, op);
+
+        if (s->copy_range == MIRROR_COPY_RANGE_PROBE) {
+            s->copy_range = MIRROR_COPY_RANGE_PROBING;
+        }
+        qemu_coroutine_enter(co);
+        return ret;
+    }
+
     blk_aio_preadv(source, sector_num * BDRV_SECTOR_SIZE, &op->qiov, 0,
                    mirror_read_complete, op);
     return ret;
@@ -327,8 +442,10 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
     int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / MAX_IN_FLIGHT,
-                             MAX_IO_SECTORS);
+    /* The buffer is shared by all requests in flight, so the deeper the
+     * queue, the smaller each request, down to a single chunk */
+    int max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) /
+                             s->max_in_flight, sectors_per_chunk);
 
     sector_num = hbitmap_iter_next(&s->hbi);
     if (sector_num < 0) {
@@ -414,7 +531,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
             mirror_wait_for_io(s);
         }
@@ -572,7 +689,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, -1);
                 mirror_wait_for_io(s);
                 continue;
@@ -708,7 +825,7 @@ static void coroutine_fn mirror_run(void *opaque)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 mirror_wait_for_io(s);
@@ -952,6 +1069,14 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    /* Don't even probe if the drivers can't do it */
+    if (bs->drv->bdrv_co_copy_range_from &&
+        target->drv->bdrv_co_copy_range_to) {
+        s->copy_range = MIRROR_COPY_RANGE_PROBE;
+    } else {
+        s->copy_range = MIRROR_COPY_RANGE_OFF;
+    }
+    s->max_in_flight = DEFAULT_IN_FLIGHT;
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
@@ -27,65 +27,73 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "nbd-client.h"
 
-#define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
-#define INDEX_TO_HANDLE(bs, index)  ((index)  ^ ((uint64_t)(intptr_t)bs))
+#define HANDLE_TO_INDEX(c, handle) ((handle) ^ ((uint64_t)(intptr_t)c))
+#define INDEX_TO_HANDLE(c, index)  ((index)  ^ ((uint64_t)(intptr_t)c))
 
-static void nbd_recv_coroutines_enter_all(NbdClientSession *s)
+/* Requests at least this large are split across all connections */
+#define NBD_STRIPE_MIN_SIZE (128 * 1024)
+#define NBD_STRIPE_ALIGN    4096
+
+static void nbd_recv_coroutines_enter_all(NbdClientConnection *c)
 {
     int i;
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i]) {
-            qemu_coroutine_enter(s->recv_coroutine[i]);
+        if (c->recv_coroutine[i]) {
+            qemu_coroutine_enter(c->recv_coroutine[i]);
         }
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_connection_detach_aio_context(NbdClientConnection *c,
+                                              AioContext *ctx)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
+    aio_set_fd_handler(ctx, c->sioc->fd, false, NULL, NULL, NULL);
+}
 
-    if (!client->ioc) { /* Already closed */
+static void nbd_teardown_connection(NbdClientConnection *c)
+{
+    if (!c->ioc) { /* Already closed */
         return;
     }
 
     /* finish any pending coroutines */
-    qio_channel_shutdown(client->ioc,
+    qio_channel_shutdown(c->ioc,
                          QIO_CHANNEL_SHUTDOWN_BOTH,
                          NULL);
-    nbd_recv_coroutines_enter_all(client);
+    nbd_recv_coroutines_enter_all(c);
 
-    nbd_client_detach_aio_context(bs);
-    object_unref(OBJECT(client->sioc));
-    client->sioc = NULL;
-    object_unref(OBJECT(client->ioc));
-    client->ioc = NULL;
+    nbd_connection_detach_aio_context(c, bdrv_get_aio_context(c->session->bs));
+    object_unref(OBJECT(c->sioc));
+    c->sioc = NULL;
+    object_unref(OBJECT(c->ioc));
+    c->ioc = NULL;
 }
 
 static void nbd_reply_ready(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    NbdClientSession *s = nbd_get_client_session(bs);
+    NbdClientConnection *c = opaque;
     uint64_t i;
     int ret;
 
-    if (!s->ioc) { /* Already closed */
+    if (!c->ioc) { /* Already closed */
         return;
     }
 
-    if (s->reply.handle == 0) {
+    if (c->reply.handle == 0) {
         /* No reply already in flight.  Fetch a header.  It is possible
          * that another thread has done the same thing in parallel, so
          * the socket is not readable anymore.
          */
-        ret = nbd_receive_reply(s->ioc, &s->reply);
+        ret = nbd_receive_reply(c->ioc, &c->reply);
         if (ret == -EAGAIN) {
             return;
         }
         if (ret < 0) {
-            s->reply.handle = 0;
+            c->reply.handle = 0;
             goto fail;
         }
     }
@@ -93,155 +101,433 @@ static void nbd_reply_ready(void *opaque)
     /* There's no need for a mutex on the receive side, because the
      * handler acts as a synchronization point and ensures that only
      * one coroutine is called until the reply finishes.  */
-    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    i = HANDLE_TO_INDEX(c, c->reply.handle);
     if (i >= MAX_NBD_REQUESTS) {
         goto fail;
     }
 
-    if (s->recv_coroutine[i]) {
-        qemu_coroutine_enter(s->recv_coroutine[i]);
+    if (c->recv_coroutine[i]) {
+        qemu_coroutine_enter(c->recv_coroutine[i]);
         return;
     }
 
 fail:
-    nbd_teardown_connection(bs);
+    nbd_teardown_connection(c);
 }
 
 static void nbd_restart_write(void *opaque)
 {
-    BlockDriverState *bs = opaque;
+    NbdClientConnection *c = opaque;
 
-    qemu_coroutine_enter(nbd_get_client_session(bs)->send_coroutine);
+    qemu_coroutine_enter(c->send_coroutine);
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+static int nbd_co_send_request(NbdClientConnection *c,
                                struct nbd_request *request,
                                QEMUIOVector *qiov)
 {
-    NbdClientSession *s = nbd_get_client_session(bs);
     AioContext *aio_context;
     int rc, ret, i;
 
-    qemu_co_mutex_lock(&s->send_mutex);
+    qemu_co_mutex_lock(&c->send_mutex);
 
     for (i = 0; i < MAX_NBD_REQUESTS; i++) {
-        if (s->recv_coroutine[i] == NULL) {
-            s->recv_coroutine[i] = qemu_coroutine_self();
+        if (c->recv_coroutine[i] == NULL) {
+            c->recv_coroutine[i] = qemu_coroutine_self();
             break;
         }
     }
 
     g_assert(qemu_in_coroutine());
     assert(i < MAX_NBD_REQUESTS);
-    request->handle = INDEX_TO_HANDLE(s, i);
+    request->handle = INDEX_TO_HANDLE(c, i);
 
-    if (!s->ioc) {
-        qemu_co_mutex_unlock(&s->send_mutex);
+    if (!c->ioc) {
+        qemu_co_mutex_unlock(&c->send_mutex);
         return -EPIPE;
     }
 
-    s->send_coroutine = qemu_coroutine_self();
-    aio_context = bdrv_get_aio_context(bs);
+    c->send_coroutine = qemu_coroutine_self();
+    aio_context = bdrv_get_aio_context(c->session->bs);
 
-    aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+    aio_set_fd_handler(aio_context, c->sioc->fd, false,
+                       nbd_reply_ready, nbd_restart_write, c);
     if (qiov) {
-        qio_channel_set_cork(s->ioc, true);
-        rc = nbd_send_request(s->ioc, request);
+        qio_channel_set_cork(c->ioc, true);
+        rc = nbd_send_request(c->ioc, request);
         if (rc >= 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
+            ret = nbd_wr_syncv(c->ioc, qiov->iov, qiov->niov, request->len,
                                false);
             if (ret != request->len) {
                 rc = -EIO;
             }
         }
-        qio_channel_set_cork(s->ioc, false);
+        qio_channel_set_cork(c->ioc, false);
     } else {
-        rc = nbd_send_request(s->ioc, request);
+        rc = nbd_send_request(c->ioc, request);
     }
-    aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
-    s->send_coroutine = NULL;
-    qemu_co_mutex_unlock(&s->send_mutex);
+    aio_set_fd_handler(aio_context, c->sioc->fd, false,
+                       nbd_reply_ready, NULL, c);
+    c->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&c->send_mutex);
     return rc;
 }
 
-static void nbd_co_receive_reply(NbdClientSession *s,
+static int nbd_co_read_exact(NbdClientConnection *c, void *buf, size_t size)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+
+    return nbd_wr_syncv(c->ioc, &iov, 1, size, true) == size ? 0 : -EIO;
+}
+
+static int nbd_co_drop(NbdClientConnection *c, size_t size)
+{
+    size_t bufsize = MIN(size, 65536);
+    char *buf = g_malloc(bufsize);
+    int ret = 0;
+
+    while (size > 0 && ret == 0) {
+        size_t count = MIN(bufsize, size);
+
+        ret = nbd_co_read_exact(c, buf, count);
+        size -= count;
+    }
+    g_free(buf);
+    return ret;
+}
+
+/* Process the payload of a structured reply chunk.  Protocol errors and
+ * errors reported by the server are stored in reply->error; a negative
+ * return value means that the payload could not be read.  */
+static int nbd_co_receive_chunk(NbdClientConnection *c,
+                                struct nbd_request *request,
+                                struct nbd_reply *reply,
+                                QEMUIOVector *qiov, NBDExtent *extent)
+{
+    uint8_t buf[8 + 4];
+    uint32_t length = reply->length;
+    uint64_t offset;
+    uint32_t count;
+    int ret;
+
+    switch (reply->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (!(reply->flags & NBD_REPLY_FLAG_DONE)) {
+            goto invalid;
+        }
+        break;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+        /* Payload: 64 bit offset, data */
+        if (!qiov || length < 8) {
+            goto invalid;
+        }
+        ret = nbd_co_read_exact(c, buf, 8);
+        if (ret < 0) {
+            return ret;
+        }
+        offset = ldq_be_p(buf);
+        count = length - 8;
+        length = count;
+        if (offset < request->from ||
+            offset - request->from + count > request->len) {
+            goto invalid;
+        }
+        if (count) {
+            QEMUIOVector sub;
+
+            qemu_iovec_init(&sub, qiov->niov);
+            qemu_iovec_concat(&sub, qiov, offset - request->from, count);
+            ret = nbd_wr_syncv(c->ioc, sub.iov, sub.niov, count, true);
+            qemu_iovec_destroy(&sub);
+            if (ret != count) {
+                return -EIO;
+            }
+        }
+        break;
+
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        /* Payload: 64 bit offset, 32 bit hole size */
+        if (!qiov || length != 8 + 4) {
+            goto invalid;
+        }
+        ret = nbd_co_read_exact(c, buf, 8 + 4);
+        if (ret < 0) {
+            return ret;
+        }
+        offset = ldq_be_p(buf);
+        count = ldl_be_p(buf + 8);
+        if (offset < request->from ||
+            offset - request->from + count > request->len) {
+            reply->error = EINVAL;
+            break;
+        }
+        qemu_iovec_memset(qiov, offset - request->from, 0, count);
+        break;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* Payload: 32 bit context ID, then 32 bit length and flags for each
+         * extent.  We only asked for one extent, ignore the others.  */
+        if (!extent || length < 4 + 8) {
+            goto invalid;
+        }
+        ret = nbd_co_read_exact(c, buf, 4 + 8);
+        if (ret < 0) {
+            return ret;
+        }
+        length -= 4 + 8;
+        if (ldl_be_p(buf) != c->session->ext.meta_context_id) {
+            goto invalid;
+        }
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+        return nbd_co_drop(c, length);
+
+    default:
+        if (!NBD_REPLY_TYPE_IS_ERR(reply->type) || length < 4 + 2) {
+            goto invalid;
+        }
+        /* Payload: 32 bit error, 16 bit message length, message and, for
+         * NBD_REPLY_TYPE_ERROR_OFFSET, a 64 bit offset.  */
+        ret = nbd_co_read_exact(c, buf, 4 + 2);
+        if (ret < 0) {
+            return ret;
+        }
+        length -= 4 + 2;
+        reply->error = nbd_errno_to_system_errno(ldl_be_p(buf));
+        if (!reply->error) {
+            reply->error = EINVAL;
+        }
+        return nbd_co_drop(c, length);
+    }
+    return 0;
+
+invalid:
+    reply->error = EINVAL;
+    return nbd_co_drop(c, length);
+}
+
+static void nbd_co_receive_reply(NbdClientConnection *c,
                                  struct nbd_request *request,
                                  struct nbd_reply *reply,
-                                 QEMUIOVector *qiov)
+                                 QEMUIOVector *qiov,
+                                 NBDExtent *extent)
 {
+    uint32_t error = 0;
+    bool done = false;
     int ret;
 
-    /* Wait until we're woken up by the read handler.  TODO: perhaps
-     * peek at the next reply and avoid yielding if it's ours?  */
-    qemu_coroutine_yield();
-    *reply = s->reply;
-    if (reply->handle != request->handle ||
-        !s->ioc) {
-        reply->error = EIO;
-    } else {
-        if (qiov && reply->error == 0) {
-            ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
-                               true);
-            if (ret != request->len) {
+    /* A simple reply is always final, structured replies can be split
+     * in chunks.  Keep the first error we see, but go on consuming chunks
+     * until the server says it is done.  */
+    while (!done) {
+        /* Wait until we're woken up by the read handler.  TODO: perhaps
+         * peek at the next reply and avoid yielding if it's ours?  */
+        qemu_coroutine_yield();
+        *reply = c->reply;
+        if (reply->handle != request->handle ||
+            !c->ioc) {
+            reply->error = EIO;
+            return;
+        }
+
+        if (reply->structured) {
+            ret = nbd_co_receive_chunk(c, request, reply, qiov, extent);
+            if (ret < 0) {
                 reply->error = EIO;
             }
+            done = ret < 0 || (reply->flags & NBD_REPLY_FLAG_DONE);
+        } else {
+            if (qiov && reply->error == 0) {
+                ret = nbd_wr_syncv(c->ioc, qiov->iov, qiov->niov,
+                                   request->len, true);
+                if (ret != request->len) {
+                    reply->error = EIO;
+                }
+            }
+            done = true;
+        }
+        if (!error) {
+            error = reply->error;
         }
 
         /* Tell the read handler to read another header.  */
-        s->reply.handle = 0;
+        c->reply.handle = 0;
     }
+    reply->error = error;
 }
 
-static void nbd_coroutine_start(NbdClientSession *s,
+static void nbd_coroutine_start(NbdClientConnection *c,
    struct nbd_request *request)
 {
     /* Poor man semaphore.  The free_sema is locked when no other request
      * can be accepted, and unlocked after receiving one reply.  */
-    if (s->in_flight >= MAX_NBD_REQUESTS - 1) {
-        qemu_co_mutex_lock(&s->free_sema);
-        assert(s->in_flight < MAX_NBD_REQUESTS);
+    if (c->in_flight >= MAX_NBD_REQUESTS - 1) {
+        qemu_co_mutex_lock(&c->free_sema);
+        assert(c->in_flight < MAX_NBD_REQUESTS);
     }
-    s->in_flight++;
+    c->in_flight++;
 
-    /* s->recv_coroutine[i] is set as soon as we get the send_lock.  */
+    /* c->recv_coroutine[i] is set as soon as we get the send_lock.  */
 }
 
-static void nbd_coroutine_end(NbdClientSession *s,
+static void nbd_coroutine_end(NbdClientConnection *c,
     struct nbd_request *request)
 {
-    int i = HANDLE_TO_INDEX(s, request->handle);
-    s->recv_coroutine[i] = NULL;
-    if (s->in_flight-- == MAX_NBD_REQUESTS) {
-        qemu_co_mutex_unlock(&s->free_sema);
+    int i = HANDLE_TO_INDEX(c, request->handle);
+    c->recv_coroutine[i] = NULL;
+    if (c->in_flight-- == MAX_NBD_REQUESTS) {
+        qemu_co_mutex_unlock(&c->free_sema);
     }
 }
 
+/* Send @request on connection @c and wait for the reply.  @write_qiov is
+ * the payload of the request, @read_qiov and @extent receive the payload
+ * of the reply.  */
+static int nbd_co_request(NbdClientConnection *c, struct nbd_request *request,
+                          QEMUIOVector *write_qiov, QEMUIOVector *read_qiov,
+                          NBDExtent *extent)
+{
+    struct nbd_reply reply;
+    ssize_t ret;
+
+    nbd_coroutine_start(c, request);
+    ret = nbd_co_send_request(c, request, write_qiov);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(c, request, &reply, read_qiov, extent);
+    }
+    nbd_coroutine_end(c, request);
+    return -reply.error;
+}
+
+/* Pick the connection with the fewest requests in flight, going round
+ * robin among equally loaded ones.  Closed connections are skipped unless
+ * there is nothing else left.  */
+static NbdClientConnection *nbd_pick_connection(NbdClientSession *s)
+{
+    NbdClientConnection *best = NULL;
+    int i;
+
+    for (i = 0; i < s->num_conns; i++) {
+        NbdClientConnection *c = &s->conns[(s->next_conn + i) % s->num_conns];
+
+        if (!best || (!best->ioc && c->ioc) ||
+            (c->ioc && c->in_flight < best->in_flight)) {
+            best = c;
+        }
+    }
+    s->next_conn = (best - s->conns + 1) % s->num_conns;
+    return best;
+}
+
+typedef struct NbdStripe {
+    NbdClientConnection *conn;
+    struct nbd_request request;
+    QEMUIOVector qiov;
+    bool is_write;
+    int ret;
+
+    struct NbdStripeSet *set;
+} NbdStripe;
+
+typedef struct NbdStripeSet {
+    Coroutine *co;
+    int in_flight;
+    bool waiting;
+} NbdStripeSet;
+
+static void coroutine_fn nbd_co_stripe_entry(void *opaque)
+{
+    NbdStripe *stripe = opaque;
+    NbdStripeSet *set = stripe->set;
+
+    stripe->ret = nbd_co_request(stripe->conn, &stripe->request,
+                                 stripe->is_write ? &stripe->qiov : NULL,
+                                 stripe->is_write ? NULL : &stripe->qiov,
+                                 NULL);
+    set->in_flight--;
+    if (set->in_flight == 0 && set->waiting) {
+        qemu_coroutine_enter(set->co);
+    }
+}
+
+/* Read or write @bytes at @offset.  Large requests are cut in one stripe
+ * per connection, which are sent in parallel; anything else goes to the
+ * least busy connection.  */
+static int nbd_co_rw(BlockDriverState *bs, struct nbd_request *request,
+                     QEMUIOVector *qiov)
+{
+    NbdClientSession *s = nbd_get_client_session(bs);
+    bool is_write = (request->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE;
+    NbdStripeSet set = { .co = qemu_coroutine_self() };
+    NbdStripe *stripes;
+    uint64_t stripe_size, pos;
+    int i, n, ret = 0;
+
+    if (s->num_conns == 1 || request->len < NBD_STRIPE_MIN_SIZE) {
+        return nbd_co_request(nbd_pick_connection(s), request,
+                              is_write ? qiov : NULL,
+                              is_write ? NULL : qiov, NULL);
+    }
+
+    stripe_size = ROUND_UP(DIV_ROUND_UP(request->len, s->num_conns),
+                           NBD_STRIPE_ALIGN);
+    n = DIV_ROUND_UP(request->len, stripe_size);
+    stripes = g_new0(NbdStripe, n);
+
+    for (i = 0, pos = 0; i < n; i++, pos += stripe_size) {
+        NbdStripe *stripe = &stripes[i];
+        uint64_t len = MIN(stripe_size, request->len - pos);
+
+        stripe->conn = nbd_pick_connection(s);
+        stripe->request = (struct nbd_request) {
+            .type = request->type,
+            .from = request->from + pos,
+            .len = len,
+        };
+        stripe->is_write = is_write;
+        stripe->set = &set;
+        qemu_iovec_init(&stripe->qiov, qiov->niov);
+        qemu_iovec_concat(&stripe->qiov, qiov, pos, len);
+    }
+
+    set.in_flight = n;
+    for (i = 0; i < n; i++) {
+        Coroutine *co = qemu_coroutine_create(nbd_co_stripe_entry,
+                                              &stripes[i]);
+        qemu_coroutine_enter(co);
+    }
+    while (set.in_flight > 0) {
+        set.waiting = true;
+        qemu_coroutine_yield();
+        set.waiting = false;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (stripes[i].ret < 0 && ret == 0) {
+            ret = stripes[i].ret;
+        }
+        qemu_iovec_destroy(&stripes[i].qiov);
+    }
+    g_free(stripes);
+    return ret;
+}
+
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = {
         .type = NBD_CMD_READ,
         .from = offset,
         .len = bytes,
     };
-    struct nbd_reply reply;
-    ssize_t ret;
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
     assert(!flags);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_rw(bs, &request, qiov);
 }
 
 int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
@@ -253,8 +539,6 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
         .from = offset,
         .len = bytes,
     };
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (flags & BDRV_REQ_FUA) {
         assert(client->nbdflags & NBD_FLAG_SEND_FUA);
@@ -263,23 +547,13 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, qiov);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    return nbd_co_rw(bs, &request, qiov);
 }
 
 int nbd_client_co_flush(BlockDriverState *bs)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
     struct nbd_request request = { .type = NBD_CMD_FLUSH };
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
@@ -288,15 +562,11 @@ int nbd_client_co_flush(BlockDriverState *bs)
     request.from = 0;
     request.len = 0;
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
-    if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
-    }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
+    /* Multiple connections are only used if the server advertised
+     * NBD_FLAG_CAN_MULTI_CONN, which guarantees that a flush on any
+     * connection covers the writes completed on all of them.  */
+    return nbd_co_request(nbd_pick_connection(client), &request,
+                          NULL, NULL, NULL);
 }
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
@@ -307,37 +577,88 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
         .from = offset,
         .len = count,
     };
-    struct nbd_reply reply;
-    ssize_t ret;
 
     if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
 
-    nbd_coroutine_start(client, &request);
-    ret = nbd_co_send_request(bs, &request, NULL);
+    return nbd_co_request(nbd_pick_connection(client), &request,
+                          NULL, NULL, NULL);
+}
+
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+        .from = sector_num << BDRV_SECTOR_BITS,
+        .len = MIN((uint64_t)nb_sectors << BDRV_SECTOR_BITS,
+                   UINT32_MAX & BDRV_SECTOR_MASK),
+    };
+    NBDExtent extent = { 0 };
+    int64_t ret;
+
+    *file = bs;
+    if (!client->ext.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num << BDRV_SECTOR_BITS);
+    }
+
+    ret = nbd_co_request(nbd_pick_connection(client), &request,
+                         NULL, NULL, &extent);
     if (ret < 0) {
-        reply.error = -ret;
-    } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        return ret;
+    }
+    if (extent.length == 0) {
+        return -EIO;
+    }
+
+    *pnum = MIN(extent.length, request.len) >> BDRV_SECTOR_BITS;
+    if (*pnum == 0) {
+        /* Less than a sector, we can't tell anything about it */
+        *pnum = 1;
+        extent.flags = 0;
     }
-    nbd_coroutine_end(client, &request);
-    return -reply.error;
 
+    ret = extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0;
+    if (!(extent.flags & NBD_STATE_HOLE)) {
+        ret |= BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID |
+               (sector_num << BDRV_SECTOR_BITS);
+    }
+    return ret;
 }
 
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    aio_set_fd_handler(bdrv_get_aio_context(bs),
-                       nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        if (client->conns[i].sioc) {
+            nbd_connection_detach_aio_context(&client->conns[i],
+                                              bdrv_get_aio_context(bs));
+        }
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+    NbdClientSession *client = nbd_get_client_session(bs);
+    int i;
+
+    for (i = 0; i < client->num_conns; i++) {
+        NbdClientConnection *c = &client->conns[i];
+
+        if (c->sioc) {
+            aio_set_fd_handler(new_context, c->sioc->fd,
+                               false, nbd_reply_ready, NULL, c);
+        }
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -348,59 +669,143 @@ void nbd_client_close(BlockDriverState *bs)
         .from = 0,
         .len = 0
     };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
-    }
+    for (i = 0; i < client->num_conns; i++) {
+        NbdClientConnection *c = &client->conns[i];
+
+        if (c->ioc == NULL) {
+            continue;
+        }
 
-    nbd_send_request(client->ioc, &request);
+        nbd_send_request(c->ioc, &request);
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(c);
+    }
 }
 
-int nbd_client_init(BlockDriverState *bs,
-                    QIOChannelSocket *sioc,
-                    const char *export,
-                    QCryptoTLSCreds *tlscreds,
-                    const char *hostname,
-                    Error **errp)
+static int nbd_connection_init(NbdClientConnection *c,
+                               QIOChannelSocket *sioc,
+                               const char *export,
+                               QCryptoTLSCreds *tlscreds,
+                               const char *hostname,
+                               uint16_t *nbdflags, off_t *size,
+                               NBDExtensions *ext, Error **errp)
 {
-    NbdClientSession *client = nbd_get_client_session(bs);
     int ret;
 
     /* NBD handshake */
     logout("session init %s\n", export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
+    ext->structured_reply = true;
+    ext->base_allocation = true;
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
-                                &client->nbdflags,
+                                nbdflags,
                                 tlscreds, hostname,
-                                &client->ioc,
-                                &client->size, errp);
+                                &c->ioc,
+                                size, ext, errp);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
-    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
-        bs->supported_write_flags = BDRV_REQ_FUA;
-    }
 
-    qemu_co_mutex_init(&client->send_mutex);
-    qemu_co_mutex_init(&client->free_sema);
-    client->sioc = sioc;
-    object_ref(OBJECT(client->sioc));
+    qemu_co_mutex_init(&c->send_mutex);
+    qemu_co_mutex_init(&c->free_sema);
+    c->sioc = sioc;
+    object_ref(OBJECT(c->sioc));
 
-    if (!client->ioc) {
-        client->ioc = QIO_CHANNEL(sioc);
-        object_ref(OBJECT(client->ioc));
+    if (!c->ioc) {
+        c->ioc = QIO_CHANNEL(sioc);
+        object_ref(OBJECT(c->ioc));
     }
 
     /* Now that we're connected, set the socket to be non-blocking and
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
 
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    return 0;
+}
+
+int nbd_client_init(BlockDriverState *bs,
+                    QIOChannelSocket *sioc,
+                    const char *export,
+                    QCryptoTLSCreds *tlscreds,
+                    const char *hostname,
+                    Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *c = &client->conns[0];
+    int ret;
+
+    client->bs = bs;
+    c->session = client;
+    ret = nbd_connection_init(c, sioc, export, tlscreds, hostname,
+                              &client->nbdflags, &client->size,
+                              &client->ext, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
+        bs->supported_write_flags = BDRV_REQ_FUA;
+    }
+    client->num_conns = 1;
+
+    aio_set_fd_handler(bdrv_get_aio_context(bs), c->sioc->fd,
+                       false, nbd_reply_ready, NULL, c);
 
     logout("Established connection with NBD server\n");
     return 0;
 }
+
+/* Open one more connection to the export that nbd_client_init() connected
+ * to.  The server must have advertised NBD_FLAG_CAN_MULTI_CONN and must
+ * present the export in the same way on the new connection.  */
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    NbdClientConnection *c;
+    NBDExtensions ext;
+    uint16_t nbdflags;
+    off_t size;
+    int ret;
+
+    assert(client->nbdflags & NBD_FLAG_CAN_MULTI_CONN);
+    if (client->num_conns == NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "Too many connections to the NBD server");
+        return -EINVAL;
+    }
+
+    c = &client->conns[client->num_conns];
+    memset(c, 0, sizeof(*c));
+    c->session = client;
+    ret = nbd_connection_init(c, sioc, export, tlscreds, hostname,
+                              &nbdflags, &size, &ext, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (nbdflags != client->nbdflags || size != client->size ||
+        ext.structured_reply != client->ext.structured_reply ||
+        ext.base_allocation != client->ext.base_allocation ||
+        ext.meta_context_id != client->ext.meta_context_id) {
+        error_setg(errp, "NBD server changed the export on a new connection");
+        nbd_send_request(c->ioc, &(struct nbd_request) {
+            .type = NBD_CMD_DISC,
+        });
+        object_unref(OBJECT(c->sioc));
+        object_unref(OBJECT(c->ioc));
+        memset(c, 0, sizeof(*c));
+        return -EINVAL;
+    }
+
+    client->num_conns++;
+    aio_set_fd_handler(bdrv_get_aio_context(bs), c->sioc->fd,
+                       false, nbd_reply_ready, NULL, c);
+    return 0;
+}
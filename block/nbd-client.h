@@ -17,11 +17,15 @@
 
 #define MAX_NBD_REQUESTS    16
 
-typedef struct NbdClientSession {
+/* Maximum number of connections to a multi-conn capable export */
+#define NBD_MAX_CONNECTIONS 16
+
+typedef struct NbdClientSession NbdClientSession;
+
+typedef struct NbdClientConnection {
+    NbdClientSession *session;
     QIOChannelSocket *sioc; /* The master data channel */
     QIOChannel *ioc; /* The current I/O channel which may differ (eg TLS) */
-    uint16_t nbdflags;
-    off_t size;
 
     CoMutex send_mutex;
     CoMutex free_sema;
@@ -30,9 +34,22 @@ typedef struct NbdClientSession {
 
     Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
     struct nbd_reply reply;
+} NbdClientConnection;
+
+struct NbdClientSession {
+    BlockDriverState *bs;
+    uint16_t nbdflags;
+    off_t size;
+    NBDExtensions ext;
+
+    /* Requests are spread over all connections; more than one is only
+     * opened if the server advertises NBD_FLAG_CAN_MULTI_CONN.  */
+    NbdClientConnection conns[NBD_MAX_CONNECTIONS];
+    int num_conns;
+    unsigned next_conn;
 
     bool is_unix;
-} NbdClientSession;
+};
 
 NbdClientSession *nbd_get_client_session(BlockDriverState *bs);
 
@@ -42,6 +59,12 @@ int nbd_client_init(BlockDriverState *bs,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
                     Error **errp);
+int nbd_client_add_connection(BlockDriverState *bs,
+                              QIOChannelSocket *sioc,
+                              const char *export_name,
+                              QCryptoTLSCreds *tlscreds,
+                              const char *hostname,
+                              Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
 int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count);
@@ -50,6 +73,10 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                           uint64_t bytes, QEMUIOVector *qiov, int flags);
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags);
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
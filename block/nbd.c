@@ -40,6 +40,9 @@
 
 #define EN_OPTSTR ":exportname="
 
+/* How long to wait for the server to greet additional connections */
+#define NBD_EXTRA_CONN_TIMEOUT 2
+
 typedef struct BDRVNBDState {
     NbdClientSession client;
 
@@ -262,6 +265,17 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
     return sioc;
 }
 
+/* A server that has no room for another client may leave the connection
+ * in its listen queue, so don't block forever in the handshake.  */
+static void nbd_set_recv_timeout(QIOChannelSocket *sioc, int seconds)
+{
+#ifndef _WIN32
+    struct timeval tv = { .tv_sec = seconds };
+
+    qemu_setsockopt(sioc->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+}
+
 
 static QCryptoTLSCreds *nbd_get_tls_creds(const char *id, Error **errp)
 {
@@ -322,6 +336,11 @@ static QemuOptsList nbd_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of the TLS credentials to use",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server allows it",
+        },
     },
 };
 
@@ -335,6 +354,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     SocketAddress *saddr = NULL;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
+    uint64_t connections;
     int ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
@@ -364,6 +384,13 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         hostname = saddr->u.inet.data->host;
     }
 
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    if (connections < 1 || connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        goto error;
+    }
+
     /* establish TCP connection, return error if it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
@@ -376,6 +403,34 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, s->export,
                           tlscreds, hostname, errp);
+    if (ret < 0) {
+        goto error;
+    }
+
+    /* Additional connections are only safe if the server says so; if it
+     * does not accept as many clients as we'd like, make do with what we
+     * have.  */
+    if (connections > 1 && !(s->client.nbdflags & NBD_FLAG_CAN_MULTI_CONN)) {
+        connections = 1;
+    }
+    while (s->client.num_conns < connections) {
+        Error *conn_err = NULL;
+        QIOChannelSocket *extra;
+
+        extra = nbd_establish_connection(saddr, &conn_err);
+        if (extra) {
+            nbd_set_recv_timeout(extra, NBD_EXTRA_CONN_TIMEOUT);
+            nbd_client_add_connection(bs, extra, s->export, tlscreds,
+                                      hostname, &conn_err);
+            nbd_set_recv_timeout(extra, 0);
+            object_unref(OBJECT(extra));
+        }
+        if (conn_err) {
+            error_free(conn_err);
+            break;
+        }
+    }
+
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -494,6 +549,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -512,6 +568,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -530,6 +587,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
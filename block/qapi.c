@@ -361,6 +361,32 @@ static BlockStats *bdrv_query_stats(BlockBackend *blk,
                                     const BlockDriverState *bs,
                                     bool query_backing);
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **next;
+    int i;
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+
+    next = &info->boundaries;
+    for (i = 0; i < hist->nbins - 1; i++) {
+        *next = g_new0(uint64List, 1);
+        (*next)->value = hist->boundaries[i];
+        next = &(*next)->next;
+    }
+
+    next = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        *next = g_new0(uint64List, 1);
+        (*next)->value = hist->bins[i];
+        next = &(*next)->next;
+    }
+
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -395,6 +421,22 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    if (stats->latency_histogram[BLOCK_ACCT_READ].bins) {
+        ds->has_rd_latency_histogram = true;
+        ds->rd_latency_histogram = bdrv_latency_histogram_info(
+            &stats->latency_histogram[BLOCK_ACCT_READ]);
+    }
+    if (stats->latency_histogram[BLOCK_ACCT_WRITE].bins) {
+        ds->has_wr_latency_histogram = true;
+        ds->wr_latency_histogram = bdrv_latency_histogram_info(
+            &stats->latency_histogram[BLOCK_ACCT_WRITE]);
+    }
+    if (stats->latency_histogram[BLOCK_ACCT_FLUSH].bins) {
+        ds->has_flush_latency_histogram = true;
+        ds->flush_latency_histogram = bdrv_latency_histogram_info(
+            &stats->latency_histogram[BLOCK_ACCT_FLUSH]);
+    }
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
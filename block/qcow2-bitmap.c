@@ -0,0 +1,1242 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+/* Constraints on the bitmap directory entries that QEMU supports */
+#define BME_MAX_TABLE_SIZE          0x8000000
+#define BME_MAX_PHYS_SIZE           0x20000000 /* bitmap size in RAM */
+#define BME_MIN_GRANULARITY_BITS    9
+#define BME_MAX_GRANULARITY_BITS    31
+#define BME_MAX_NAME_SIZE           1023
+
+/* Bitmap directory entry flags */
+#define BME_FLAG_IN_USE             (1U << 0)
+#define BME_FLAG_AUTO               (1U << 1)
+#define BME_FLAG_EXTRA_DATA_COMPAT  (1U << 2)
+#define BME_RESERVED_FLAGS          0xfffffff8U
+
+/* Bitmap table entries */
+#define BME_TABLE_ENTRY_RESERVED_MASK   0xff000000000001feULL
+#define BME_TABLE_ENTRY_OFFSET_MASK     0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES   (1ULL << 0)
+
+/* The only bitmap type that is defined */
+#define BT_DIRTY_TRACKING_BITMAP    1
+
+typedef struct Qcow2BitmapDirEntry {
+    uint64_t bitmap_table_offset;
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data and name follow */
+} QEMU_PACKED Qcow2BitmapDirEntry;
+
+typedef struct Qcow2BitmapTable {
+    uint64_t offset;
+    uint32_t size; /* number of entries */
+    QSIMPLEQ_ENTRY(Qcow2BitmapTable) entry;
+} Qcow2BitmapTable;
+typedef QSIMPLEQ_HEAD(Qcow2BitmapTableList, Qcow2BitmapTable)
+    Qcow2BitmapTableList;
+
+typedef struct Qcow2Bitmap {
+    Qcow2BitmapTable table;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    char *name;
+
+    /* Extra data that QEMU doesn't know, kept as is */
+    uint8_t *extra_data;
+    uint32_t extra_data_size;
+
+    /* The bitmap in RAM that this entry was loaded into or stored from */
+    BdrvDirtyBitmap *dirty_bitmap;
+
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
+} Qcow2Bitmap;
+typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
+static bool can_write(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return !bs->read_only && !(s->flags & BDRV_O_INACTIVE);
+}
+
+/* Number of sectors of the virtual disk covered by one cluster of the bitmap
+ * data */
+static uint64_t sectors_covered_by_bitmap_cluster(const BDRVQcow2State *s,
+                                                  BdrvDirtyBitmap *bitmap)
+{
+    uint64_t sector_granularity =
+        bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS;
+
+    return sector_granularity * (s->cluster_size << 3);
+}
+
+/* Number of bitmap table entries that a bitmap of this granularity needs for
+ * the current disk size */
+static uint64_t bitmap_table_size_for(BlockDriverState *bs,
+                                      uint8_t granularity_bits)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t disk_size = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t nb_bits = DIV_ROUND_UP(disk_size, 1ULL << granularity_bits);
+
+    return DIV_ROUND_UP(nb_bits, (uint64_t)s->cluster_size << 3);
+}
+
+static int check_table_entry(uint64_t entry, int cluster_size)
+{
+    uint64_t offset;
+
+    if (entry & BME_TABLE_ENTRY_RESERVED_MASK) {
+        return -EINVAL;
+    }
+
+    offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+    if (offset != 0) {
+        /* if offset specified, bit 0 is reserved */
+        if ((entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) ||
+            (offset % cluster_size) != 0)
+        {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int bitmap_table_load(BlockDriverState *bs, Qcow2BitmapTable *tb,
+                             uint64_t **bitmap_table)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    table = g_try_new(uint64_t, tb->size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, tb->offset, table, tb->size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < tb->size; ++i) {
+        be64_to_cpus(&table[i]);
+        ret = check_table_entry(table[i], s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    *bitmap_table = table;
+    return 0;
+
+fail:
+    g_free(table);
+    return ret;
+}
+
+/* Free the data clusters listed in a bitmap table (in host byte order) */
+static void clear_bitmap_table(BlockDriverState *bs, uint64_t *bitmap_table,
+                               uint32_t bitmap_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < bitmap_table_size; ++i) {
+        uint64_t offset = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset != 0) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+        bitmap_table[i] = 0;
+    }
+}
+
+/* Free all clusters of a stored bitmap: its data and its bitmap table */
+static int free_bitmap_clusters(BlockDriverState *bs, Qcow2BitmapTable *tb)
+{
+    uint64_t *bitmap_table;
+    int ret;
+
+    ret = bitmap_table_load(bs, tb, &bitmap_table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    clear_bitmap_table(bs, bitmap_table, tb->size);
+    qcow2_free_clusters(bs, tb->offset, tb->size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+    g_free(bitmap_table);
+
+    tb->offset = 0;
+    tb->size = 0;
+
+    return 0;
+}
+
+/* Fill @bitmap from its data clusters. The data is read one cluster at a
+ * time, and clusters that are not allocated are not read at all. */
+static int load_bitmap_data(BlockDriverState *bs,
+                            const uint64_t *bitmap_table,
+                            uint32_t bitmap_table_size,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sbc = sectors_covered_by_bitmap_cluster(s, bitmap);
+    uint64_t sector, i;
+    uint8_t *buf;
+    int ret = 0;
+
+    assert(DIV_ROUND_UP(bm_size, sbc) == bitmap_table_size);
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0, sector = 0; i < bitmap_table_size; ++i, sector += sbc) {
+        uint64_t count = MIN(bm_size - sector, sbc);
+        uint64_t offset = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset == 0) {
+            /* All-ones clusters are set below, once the bitmap is usable */
+            bdrv_dirty_bitmap_deserialize_zeroes(bitmap, sector, count, false);
+        } else {
+            ret = bdrv_pread(bs->file, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto finish;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count,
+                                               false);
+        }
+    }
+    ret = 0;
+
+finish:
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+
+    if (ret == 0) {
+        for (i = 0, sector = 0; i < bitmap_table_size; ++i, sector += sbc) {
+            if (bitmap_table[i] & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+                bdrv_set_dirty_bitmap(bitmap, sector,
+                                      MIN(bm_size - sector, sbc));
+            }
+        }
+    }
+
+    g_free(buf);
+    return ret;
+}
+
+static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                    Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    uint64_t *bitmap_table = NULL;
+    int ret;
+
+    bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                      bm->name, errp);
+    if (bitmap == NULL) {
+        return NULL;
+    }
+
+    ret = bitmap_table_load(bs, &bm->table, &bitmap_table);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret,
+                         "Could not read bitmap table of bitmap '%s'",
+                         bm->name);
+        goto fail;
+    }
+
+    ret = load_bitmap_data(bs, bitmap_table, bm->table.size, bitmap);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap '%s' from image",
+                         bm->name);
+        goto fail;
+    }
+
+    if (!(bm->flags & BME_FLAG_AUTO)) {
+        bdrv_disable_dirty_bitmap(bitmap);
+    }
+
+    g_free(bitmap_table);
+    return bitmap;
+
+fail:
+    g_free(bitmap_table);
+    bdrv_release_dirty_bitmap(bs, bitmap);
+    return NULL;
+}
+
+/*
+ * Bitmap directory
+ */
+
+static inline uint32_t calc_dir_entry_size(size_t name_size,
+                                           size_t extra_data_size)
+{
+    return ROUND_UP(sizeof(Qcow2BitmapDirEntry) + name_size + extra_data_size,
+                    8);
+}
+
+static inline uint32_t dir_entry_size(Qcow2BitmapDirEntry *entry)
+{
+    return calc_dir_entry_size(entry->name_size, entry->extra_data_size);
+}
+
+static inline uint8_t *dir_entry_extra_data_field(Qcow2BitmapDirEntry *entry)
+{
+    return (uint8_t *)(entry + 1);
+}
+
+static inline char *dir_entry_name_field(Qcow2BitmapDirEntry *entry)
+{
+    return (char *)(entry + 1) + entry->extra_data_size;
+}
+
+static inline Qcow2BitmapDirEntry *next_dir_entry(Qcow2BitmapDirEntry *entry)
+{
+    return (Qcow2BitmapDirEntry *)((uint8_t *)entry + dir_entry_size(entry));
+}
+
+static inline void bitmap_dir_entry_to_cpu(Qcow2BitmapDirEntry *entry)
+{
+    be64_to_cpus(&entry->bitmap_table_offset);
+    be32_to_cpus(&entry->bitmap_table_size);
+    be32_to_cpus(&entry->flags);
+    be16_to_cpus(&entry->name_size);
+    be32_to_cpus(&entry->extra_data_size);
+}
+
+static inline void bitmap_dir_entry_to_be(Qcow2BitmapDirEntry *entry)
+{
+    cpu_to_be64s(&entry->bitmap_table_offset);
+    cpu_to_be32s(&entry->bitmap_table_size);
+    cpu_to_be32s(&entry->flags);
+    cpu_to_be16s(&entry->name_size);
+    cpu_to_be32s(&entry->extra_data_size);
+}
+
+static int check_dir_entry(BlockDriverState *bs, Qcow2BitmapDirEntry *entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t phys_bitmap_bytes;
+
+    if (entry->type != BT_DIRTY_TRACKING_BITMAP ||
+        entry->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        entry->granularity_bits > BME_MAX_GRANULARITY_BITS ||
+        entry->name_size == 0 || entry->name_size > BME_MAX_NAME_SIZE ||
+        (entry->flags & BME_RESERVED_FLAGS) ||
+        entry->bitmap_table_size == 0 ||
+        entry->bitmap_table_size > BME_MAX_TABLE_SIZE ||
+        entry->bitmap_table_offset == 0 ||
+        offset_into_cluster(s, entry->bitmap_table_offset))
+    {
+        return -EINVAL;
+    }
+
+    phys_bitmap_bytes = (uint64_t)entry->bitmap_table_size * s->cluster_size;
+    if (phys_bitmap_bytes > BME_MAX_PHYS_SIZE) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static Qcow2BitmapList *bitmap_list_new(void)
+{
+    Qcow2BitmapList *bm_list = g_new(Qcow2BitmapList, 1);
+    QSIMPLEQ_INIT(bm_list);
+
+    return bm_list;
+}
+
+static void bitmap_free(Qcow2Bitmap *bm)
+{
+    g_free(bm->name);
+    g_free(bm->extra_data);
+    g_free(bm);
+}
+
+static void bitmap_list_free(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+
+    if (bm_list == NULL) {
+        return;
+    }
+
+    while ((bm = QSIMPLEQ_FIRST(bm_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(bm_list, entry);
+        bitmap_free(bm);
+    }
+
+    g_free(bm_list);
+}
+
+static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
+                                        const char *name)
+{
+    Qcow2Bitmap *bm;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (strcmp(name, bm->name) == 0) {
+            return bm;
+        }
+    }
+
+    return NULL;
+}
+
+/* Read and check the bitmap directory described by the header extension */
+static Qcow2BitmapList *bitmap_list_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size = s->bitmap_directory_size;
+    uint8_t *dir, *dir_end;
+    Qcow2BitmapDirEntry *e;
+    uint32_t nb_dir_entries = 0;
+    Qcow2BitmapList *bm_list = NULL;
+    int ret;
+
+    if (size == 0 || size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Invalid bitmap directory size");
+        return NULL;
+    }
+
+    dir = g_try_malloc(size);
+    if (dir == NULL) {
+        error_setg(errp, "Failed to allocate space for bitmap directory");
+        return NULL;
+    }
+    dir_end = dir + size;
+
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir, size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read bitmap directory");
+        goto fail;
+    }
+
+    bm_list = bitmap_list_new();
+    for (e = (Qcow2BitmapDirEntry *)dir;
+         e < (Qcow2BitmapDirEntry *)dir_end;
+         e = next_dir_entry(e))
+    {
+        Qcow2Bitmap *bm;
+
+        if ((uint8_t *)(e + 1) > dir_end) {
+            goto broken_dir;
+        }
+
+        if (++nb_dir_entries > s->nb_bitmaps) {
+            error_setg(errp, "More bitmaps found than specified in header"
+                       " extension");
+            goto fail;
+        }
+        bitmap_dir_entry_to_cpu(e);
+
+        if ((uint8_t *)next_dir_entry(e) > dir_end) {
+            goto broken_dir;
+        }
+
+        ret = check_dir_entry(bs, e);
+        if (ret < 0) {
+            error_setg(errp, "Bitmap '%.*s' doesn't satisfy the constraints",
+                       e->name_size, dir_entry_name_field(e));
+            goto fail;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->table.offset = e->bitmap_table_offset;
+        bm->table.size = e->bitmap_table_size;
+        bm->flags = e->flags;
+        bm->granularity_bits = e->granularity_bits;
+        bm->name = g_strndup(dir_entry_name_field(e), e->name_size);
+        bm->extra_data_size = e->extra_data_size;
+        bm->extra_data = g_memdup(dir_entry_extra_data_field(e),
+                                  e->extra_data_size);
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+    }
+
+    if (nb_dir_entries != s->nb_bitmaps) {
+        error_setg(errp, "Less bitmaps found than specified in header"
+                         " extension");
+        goto fail;
+    }
+
+    if ((uint8_t *)e != dir_end) {
+        goto broken_dir;
+    }
+
+    g_free(dir);
+    return bm_list;
+
+broken_dir:
+    error_setg(errp, "Broken bitmap directory");
+
+fail:
+    g_free(dir);
+    bitmap_list_free(bm_list);
+
+    return NULL;
+}
+
+/* Write the bitmap directory into newly allocated clusters */
+static int bitmap_list_store(BlockDriverState *bs, Qcow2BitmapList *bm_list,
+                             uint64_t *offset, uint64_t *size)
+{
+    uint8_t *dir;
+    int64_t dir_offset = 0;
+    uint64_t dir_size = 0;
+    Qcow2Bitmap *bm;
+    Qcow2BitmapDirEntry *e;
+    int ret;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        dir_size += calc_dir_entry_size(strlen(bm->name), bm->extra_data_size);
+    }
+
+    if (dir_size == 0 || dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        return -EINVAL;
+    }
+
+    dir = g_try_malloc0(dir_size);
+    if (dir == NULL) {
+        return -ENOMEM;
+    }
+
+    e = (Qcow2BitmapDirEntry *)dir;
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        Qcow2BitmapDirEntry *next;
+
+        e->bitmap_table_offset = bm->table.offset;
+        e->bitmap_table_size = bm->table.size;
+        e->flags = bm->flags;
+        e->type = BT_DIRTY_TRACKING_BITMAP;
+        e->granularity_bits = bm->granularity_bits;
+        e->name_size = strlen(bm->name);
+        e->extra_data_size = bm->extra_data_size;
+        memcpy(dir_entry_extra_data_field(e), bm->extra_data,
+               bm->extra_data_size);
+        memcpy(dir_entry_name_field(e), bm->name, e->name_size);
+
+        next = next_dir_entry(e);
+        bitmap_dir_entry_to_be(e);
+        e = next;
+    }
+
+    dir_offset = qcow2_alloc_clusters(bs, dir_size);
+    if (dir_offset < 0) {
+        ret = dir_offset;
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    g_free(dir);
+
+    *offset = dir_offset;
+    *size = dir_size;
+
+    return 0;
+
+fail:
+    g_free(dir);
+
+    if (dir_offset > 0) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+
+    return ret;
+}
+
+/*
+ * Replace the bitmap directory with one made from @bm_list (which may be
+ * empty) and point the header extension to it. The old directory is freed.
+ */
+static int update_ext_header_and_dir(BlockDriverState *bs,
+                                     Qcow2BitmapList *bm_list)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+    uint64_t new_offset = 0;
+    uint64_t new_size = 0;
+    uint32_t new_nb_bitmaps = 0;
+    uint64_t old_offset = s->bitmap_directory_offset;
+    uint64_t old_size = s->bitmap_directory_size;
+    uint32_t old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_autocl = s->autoclear_features;
+    Qcow2Bitmap *bm;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        new_nb_bitmaps++;
+    }
+
+    if (new_nb_bitmaps > QCOW2_MAX_BITMAPS) {
+        return -EINVAL;
+    }
+
+    if (new_nb_bitmaps > 0) {
+        ret = bitmap_list_store(bs, bm_list, &new_offset, &new_size);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* The new refcounts and everything that the directory points to must
+         * be on disk before the header references them */
+        ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    s->bitmap_directory_offset = new_offset;
+    s->bitmap_directory_size = new_size;
+    s->nb_bitmaps = new_nb_bitmaps;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    if (old_size > 0) {
+        qcow2_free_clusters(bs, old_offset, old_size, QCOW2_DISCARD_OTHER);
+    }
+
+    return 0;
+
+fail:
+    if (new_offset > 0) {
+        qcow2_free_clusters(bs, new_offset, new_size, QCOW2_DISCARD_OTHER);
+    }
+
+    s->bitmap_directory_offset = old_offset;
+    s->bitmap_directory_size = old_size;
+    s->nb_bitmaps = old_nb_bitmaps;
+    s->autoclear_features = old_autocl;
+
+    return ret;
+}
+
+/* Free the list of dropped bitmaps; if @free_clusters is true, the directory
+ * doesn't reference them anymore and their clusters are freed as well. Errors
+ * only leak clusters, so they are not reported. */
+static void free_dropped_bitmaps(BlockDriverState *bs,
+                                 Qcow2BitmapTableList *drop_tables,
+                                 bool free_clusters)
+{
+    Qcow2BitmapTable *tb, *next;
+
+    QSIMPLEQ_FOREACH_SAFE(tb, drop_tables, entry, next) {
+        if (free_clusters) {
+            free_bitmap_clusters(bs, tb);
+        }
+        g_free(tb);
+    }
+    QSIMPLEQ_INIT(drop_tables);
+}
+
+/* Take @bm out of @bm_list; its clusters go to @drop_tables */
+static void drop_bitmap(Qcow2BitmapList *bm_list, Qcow2Bitmap *bm,
+                        Qcow2BitmapTableList *drop_tables)
+{
+    Qcow2BitmapTable *tb = g_memdup(&bm->table, sizeof(bm->table));
+
+    QSIMPLEQ_INSERT_TAIL(drop_tables, tb, entry);
+    QSIMPLEQ_REMOVE(bm_list, bm, Qcow2Bitmap, entry);
+    bitmap_free(bm);
+}
+
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    Error *local_err = NULL;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bm_list = bitmap_list_load(bs, &local_err);
+    if (bm_list == NULL) {
+        fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        uint64_t *bitmap_table = NULL;
+        uint32_t i;
+
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size, bm->table.offset,
+                                       bm->table.size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, &bm->table, &bitmap_table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR bitmap table of bitmap '%s' is invalid\n",
+                    bm->name);
+            res->corruptions++;
+            continue;
+        }
+
+        for (i = 0; i < bm->table.size; ++i) {
+            uint64_t offset = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (offset == 0) {
+                continue;
+            }
+
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, offset,
+                                           s->cluster_size);
+            if (ret < 0) {
+                g_free(bitmap_table);
+                goto out;
+            }
+        }
+
+        g_free(bitmap_table);
+    }
+    ret = 0;
+
+out:
+    bitmap_list_free(bm_list);
+
+    return ret;
+}
+
+/*
+ * Load the bitmaps of the image into BdrvDirtyBitmaps that are stored again
+ * when the image is closed. From now until then, the bitmaps in the image are
+ * marked in use: if QEMU doesn't get to store them, they are known to be
+ * inconsistent and are dropped the next time the image is opened.
+ */
+void qcow2_load_autoloading_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2BitmapTableList drop_tables;
+    Qcow2Bitmap *bm, *next;
+    bool changed = false;
+    int ret;
+
+    if (s->nb_bitmaps == 0 || !can_write(bs)) {
+        return;
+    }
+
+    bm_list = bitmap_list_load(bs, errp);
+    if (bm_list == NULL) {
+        return;
+    }
+
+    QSIMPLEQ_INIT(&drop_tables);
+    QSIMPLEQ_FOREACH_SAFE(bm, bm_list, entry, next) {
+        if (bm->extra_data_size != 0 &&
+            !(bm->flags & BME_FLAG_EXTRA_DATA_COMPAT))
+        {
+            /* Must not be used, but must be kept as it is */
+            continue;
+        }
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("Warning: bitmap '%s' was not stored properly, "
+                         "dropping it", bm->name);
+            drop_bitmap(bm_list, bm, &drop_tables);
+            changed = true;
+            continue;
+        }
+
+        if (bm->table.size != bitmap_table_size_for(bs, bm->granularity_bits)) {
+            error_report("Warning: bitmap '%s' doesn't match the size of the "
+                         "image, dropping it", bm->name);
+            drop_bitmap(bm_list, bm, &drop_tables);
+            changed = true;
+            continue;
+        }
+
+        bm->dirty_bitmap = load_bitmap(bs, bm, errp);
+        if (bm->dirty_bitmap == NULL) {
+            goto fail;
+        }
+        bdrv_dirty_bitmap_set_persistance(bm->dirty_bitmap, true);
+
+        bm->flags |= BME_FLAG_IN_USE;
+        changed = true;
+    }
+
+    if (changed) {
+        ret = update_ext_header_and_dir(bs, bm_list);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Can't update bitmap directory");
+            goto fail;
+        }
+        free_dropped_bitmaps(bs, &drop_tables, true);
+    }
+
+    bitmap_list_free(bm_list);
+    return;
+
+fail:
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bm->dirty_bitmap) {
+            bdrv_release_dirty_bitmap(bs, bm->dirty_bitmap);
+        }
+    }
+    free_dropped_bitmaps(bs, &drop_tables, false);
+    bitmap_list_free(bm_list);
+}
+
+/*
+ * Write the data of @bitmap into newly allocated clusters, one cluster at a
+ * time. Parts of the bitmap without dirty bits are not allocated at all, so
+ * storing a large but sparse bitmap is cheap. Returns the bitmap table in
+ * host byte order.
+ */
+static uint64_t *store_bitmap_data(BlockDriverState *bs,
+                                   BdrvDirtyBitmap *bitmap,
+                                   uint32_t *bitmap_table_size, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sbc = sectors_covered_by_bitmap_cluster(s, bitmap);
+    uint64_t tb_size = DIV_ROUND_UP(bm_size, sbc);
+    uint64_t *tb;
+    uint8_t *buf = NULL;
+    HBitmapIter hbi;
+    int64_t sector;
+    int ret;
+
+    if (tb_size > BME_MAX_TABLE_SIZE ||
+        tb_size * s->cluster_size > BME_MAX_PHYS_SIZE)
+    {
+        error_setg(errp, "Bitmap '%s' is too big", bm_name);
+        return NULL;
+    }
+
+    tb = g_try_new0(uint64_t, tb_size);
+    if (tb == NULL) {
+        error_setg(errp, "No memory");
+        return NULL;
+    }
+
+    buf = g_malloc(s->cluster_size);
+
+    bdrv_dirty_iter_init(bitmap, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        uint64_t cluster = sector / sbc;
+        uint64_t end, write_size;
+        int64_t off;
+
+        sector = cluster * sbc;
+        end = MIN(bm_size, sector + sbc);
+        write_size =
+            bdrv_dirty_bitmap_serialization_size(bitmap, sector, end - sector);
+        assert(write_size <= s->cluster_size);
+
+        off = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (off < 0) {
+            error_setg_errno(errp, -off,
+                             "Failed to allocate clusters for bitmap '%s'",
+                             bm_name);
+            goto fail;
+        }
+        tb[cluster] = off;
+
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, end - sector);
+        if (write_size < s->cluster_size) {
+            memset(buf + write_size, 0, s->cluster_size - write_size);
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file, off, buf, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto fail;
+        }
+
+        if (end >= bm_size) {
+            break;
+        }
+
+        bdrv_set_dirty_iter(&hbi, end);
+    }
+
+    *bitmap_table_size = tb_size;
+    g_free(buf);
+
+    return tb;
+
+fail:
+    clear_bitmap_table(bs, tb, tb_size);
+    g_free(buf);
+    g_free(tb);
+
+    return NULL;
+}
+
+/* Store @bm->dirty_bitmap in the image and fill in the bitmap table of @bm */
+static int store_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
+{
+    int ret;
+    uint32_t i;
+    uint64_t *tb;
+    int64_t tb_offset;
+    uint32_t tb_size;
+    const char *bm_name = bm->name;
+
+    tb = store_bitmap_data(bs, bm->dirty_bitmap, &tb_size, errp);
+    if (tb == NULL) {
+        return -EINVAL;
+    }
+
+    assert(tb_size <= BME_MAX_TABLE_SIZE);
+    tb_offset = qcow2_alloc_clusters(bs, tb_size * sizeof(tb[0]));
+    if (tb_offset < 0) {
+        error_setg_errno(errp, -tb_offset,
+                         "Failed to allocate clusters for bitmap '%s'",
+                         bm_name);
+        ret = tb_offset;
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, tb_offset,
+                                        tb_size * sizeof(tb[0]));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+        goto fail;
+    }
+
+    for (i = 0; i < tb_size; ++i) {
+        cpu_to_be64s(&tb[i]);
+    }
+    ret = bdrv_pwrite(bs->file, tb_offset, tb, tb_size * sizeof(tb[0]));
+    for (i = 0; i < tb_size; ++i) {
+        be64_to_cpus(&tb[i]);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                         bm_name);
+        goto fail;
+    }
+
+    g_free(tb);
+
+    bm->table.offset = tb_offset;
+    bm->table.size = tb_size;
+
+    return 0;
+
+fail:
+    clear_bitmap_table(bs, tb, tb_size);
+
+    if (tb_offset > 0) {
+        qcow2_free_clusters(bs, tb_offset, tb_size * sizeof(tb[0]),
+                            QCOW2_DISCARD_OTHER);
+    }
+
+    g_free(tb);
+
+    return ret;
+}
+
+/*
+ * Store all persistent dirty bitmaps in the image. The entries of bitmaps that
+ * were loaded on open (and are marked in use) are replaced, the entries of
+ * bitmaps that were removed in the meantime are dropped, and the others are
+ * left alone.
+ *
+ * This runs on close and inactivation, which must not return before the
+ * bitmaps are on disk, so the data is written synchronously.  Only dirty
+ * parts are written and only one cluster is buffered at a time, but the
+ * monitor is not serviced until all of it is written.
+ */
+void qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BdrvDirtyBitmap *bitmap;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2BitmapTableList drop_tables;
+    Qcow2Bitmap *bm, *next;
+    bool changed = false;
+    int ret;
+
+    if (!can_write(bs) ||
+        (s->nb_bitmaps == 0 && !bdrv_has_persistent_dirty_bitmaps(bs)))
+    {
+        return;
+    }
+
+    if (s->nb_bitmaps == 0) {
+        bm_list = bitmap_list_new();
+    } else {
+        bm_list = bitmap_list_load(bs, errp);
+        if (bm_list == NULL) {
+            return;
+        }
+    }
+
+    QSIMPLEQ_INIT(&drop_tables);
+    QSIMPLEQ_FOREACH_SAFE(bm, bm_list, entry, next) {
+        bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+        if ((bm->flags & BME_FLAG_IN_USE) ||
+            (bitmap && bdrv_dirty_bitmap_get_persistance(bitmap)))
+        {
+            drop_bitmap(bm_list, bm, &drop_tables);
+            changed = true;
+        }
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        uint32_t granularity;
+
+        if (!bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            continue;
+        }
+
+        granularity = bdrv_dirty_bitmap_granularity(bitmap);
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->name = g_strdup(bdrv_dirty_bitmap_name(bitmap));
+        bm->granularity_bits = ctz32(granularity);
+        bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
+        bm->dirty_bitmap = bitmap;
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+
+        ret = store_bitmap(bs, bm, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        changed = true;
+    }
+
+    if (changed) {
+        ret = update_ext_header_and_dir(bs, bm_list);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to update bitmap extension");
+            goto fail;
+        }
+        free_dropped_bitmaps(bs, &drop_tables, true);
+    }
+
+    bitmap_list_free(bm_list);
+    return;
+
+fail:
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bm->dirty_bitmap != NULL && bm->table.offset != 0) {
+            free_bitmap_clusters(bs, &bm->table);
+        }
+    }
+    free_dropped_bitmaps(bs, &drop_tables, false);
+    bitmap_list_free(bm_list);
+}
+
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs,
+                                      const char *name,
+                                      uint32_t granularity,
+                                      Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    BdrvDirtyBitmap *bitmap;
+    uint32_t nb_bitmaps = 0;
+    int granularity_bits = ctz32(granularity);
+    bool found = false;
+
+    if (s->qcow_version < 3) {
+        /* Without autoclear_features, we would always have to assume
+         * that a program without persistent dirty bitmap support has
+         * accessed this qcow2 file when opening it, and would thus
+         * have to drop all dirty bitmaps (defeating their purpose).
+         */
+        error_setg(errp, "Cannot store dirty bitmaps in qcow2 v2 files");
+        return false;
+    }
+
+    if (!can_write(bs)) {
+        error_setg(errp, "Cannot store dirty bitmaps in read-only images");
+        return false;
+    }
+
+    if (granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        granularity_bits > BME_MAX_GRANULARITY_BITS)
+    {
+        error_setg(errp, "Granularity exceeds maximum (%llu bytes)",
+                   1ULL << BME_MAX_GRANULARITY_BITS);
+        return false;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        error_setg(errp, "Name length exceeds maximum (%u characters)",
+                   BME_MAX_NAME_SIZE);
+        return false;
+    }
+
+    /* Entries that are in use are replaced or dropped on close, so only the
+     * others count in addition to the persistent bitmaps in RAM */
+    if (s->nb_bitmaps > 0) {
+        bm_list = bitmap_list_load(bs, errp);
+        if (bm_list == NULL) {
+            return false;
+        }
+
+        QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+            if (!(bm->flags & BME_FLAG_IN_USE)) {
+                nb_bitmaps++;
+            }
+        }
+
+        bm = find_bitmap_by_name(bm_list, name);
+        found = bm != NULL && !(bm->flags & BME_FLAG_IN_USE);
+        bitmap_list_free(bm_list);
+    }
+
+    if (found) {
+        error_setg(errp, "Bitmap with the same name is already stored");
+        return false;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistance(bitmap)) {
+            nb_bitmaps++;
+        }
+    }
+    if (nb_bitmaps >= QCOW2_MAX_BITMAPS) {
+        error_setg(errp, "Maximum number of persistent bitmaps is already "
+                   "reached");
+        return false;
+    }
+
+    return true;
+}
+
+Qcow2BitmapInfoList *qcow2_get_bitmap_info_list(BlockDriverState *bs,
+                                                Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    Qcow2BitmapInfoList *list = NULL;
+    Qcow2BitmapInfoList **plist = &list;
+
+    if (s->nb_bitmaps == 0) {
+        return NULL;
+    }
+
+    bm_list = bitmap_list_load(bs, errp);
+    if (bm_list == NULL) {
+        return NULL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        Qcow2BitmapInfo *info = g_new0(Qcow2BitmapInfo, 1);
+        Qcow2BitmapInfoList *obj = g_new0(Qcow2BitmapInfoList, 1);
+        Qcow2BitmapInfoFlagsList **pflags = &info->flags;
+        uint32_t flags[] = { BME_FLAG_IN_USE, BME_FLAG_AUTO };
+        Qcow2BitmapInfoFlags values[] = {
+            QCOW2_BITMAP_INFO_FLAGS_IN_USE, QCOW2_BITMAP_INFO_FLAGS_AUTO,
+        };
+        int i;
+
+        info->name = g_strdup(bm->name);
+        info->granularity = 1U << bm->granularity_bits;
+        for (i = 0; i < ARRAY_SIZE(flags); i++) {
+            if (bm->flags & flags[i]) {
+                Qcow2BitmapInfoFlagsList *entry =
+                    g_new0(Qcow2BitmapInfoFlagsList, 1);
+                entry->value = values[i];
+                *pflags = entry;
+                pflags = &entry->next;
+            }
+        }
+
+        obj->value = info;
+        *plist = obj;
+        plist = &obj->next;
+    }
+
+    bitmap_list_free(bm_list);
+
+    return list;
+}
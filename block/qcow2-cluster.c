@@ -30,6 +30,9 @@
 #include "block/block_int.h"
 #include "block/qcow2.h"
 #include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/bitmap.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
@@ -144,20 +147,26 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * @bs: The BlockDriverState
+ * @offset: A guest offset, used to calculate what slice of the L2
+ *          table to load.
+ * @l2_offset: Offset to the L2 table in the image file.
+ * @l2_slice: Location to store the pointer to the L2 slice.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Loads a L2 slice into memory (L2 slices are the parts of L2 tables
+ * that are loaded by the qcow2 cache). If the slice is in the cache,
+ * the cache is used; otherwise the L2 slice is loaded from the image
+ * file.
  */
-
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+                   uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
+    int start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
-    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                           (void **)l2_table);
+    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
+                           (void **)l2_slice);
 }
 
 /*
@@ -204,13 +213,16 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The new table is written slice by slice through the L2 cache; the caller
+ * has to load the slice it is interested in afterwards.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t old_l2_offset;
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
+    unsigned slice, slice_size2, n_slices;
     int64_t l2_offset;
     int ret;
 
@@ -220,7 +232,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -233,39 +245,47 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new entry in the l2 cache */
 
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
+
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        goto fail;
-    }
+    for (slice = 0; slice < n_slices; slice++) {
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void **) &l2_slice);
+        if (ret < 0) {
+            goto fail;
+        }
 
-    l2_table = *table;
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new slice */
+            memset(l2_slice, 0, slice_size2);
+        } else {
+            uint64_t *old_slice;
+            uint64_t old_l2_slice_offset =
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_size2;
+
+            /* if there was an old l2 table, read a slice from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache, old_l2_slice_offset,
+                                  (void **) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
 
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
+            memcpy(l2_slice, old_slice, slice_size2);
 
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
-        if (ret < 0) {
-            goto fail;
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_slice);
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        /* write the l2 slice to the file */
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
-        qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_table);
+        trace_qcow2_l2_allocate_write_l2(bs, l1_index);
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
 
-    /* write the l2 table to the file */
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
-
-    trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -279,18 +299,17 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    if (l2_table != NULL) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_slice != NULL) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -303,12 +322,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(int nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcow2State *s, int nb_clusters,
+        uint64_t *l2_slice, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -317,8 +336,8 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) == QCOW2_CLUSTER_NORMAL);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
@@ -326,21 +345,132 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_clusters_by_type(int nb_clusters,
-                                             uint64_t *l2_table,
-                                             int wanted_type)
+/*
+ * Returns the number of subclusters, starting at @sc_from, that have the same
+ * type as subcluster @sc_from of the cluster described by @l2_entry and
+ * @l2_bitmap. The type is stored in *type. Returns -EINVAL if the L2 entry is
+ * invalid.
+ *
+ * Without extended L2 entries, and for compressed clusters, the whole cluster
+ * is considered to have the same type.
+ */
+static int get_subcluster_range_type(BDRVQcow2State *s, uint64_t l2_entry,
+                                     uint64_t l2_bitmap, unsigned sc_from,
+                                     QCow2SubclusterType *type)
 {
-    int i;
+    uint32_t val;
+
+    *type = qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc_from);
+
+    if (*type == QCOW2_SUBCLUSTER_INVALID) {
+        return -EINVAL;
+    } else if (!has_subclusters(s) || *type == QCOW2_SUBCLUSTER_COMPRESSED) {
+        return s->subclusters_per_cluster - sc_from;
+    }
+
+    switch (*type) {
+    case QCOW2_SUBCLUSTER_NORMAL:
+        val = l2_bitmap | QCOW_OFLAG_SUB_ALLOC_RANGE(0, sc_from);
+        return cto32(val) - sc_from;
+
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+        val = (l2_bitmap | QCOW_OFLAG_SUB_ZERO_RANGE(0, sc_from)) >> 32;
+        return cto32(val) - sc_from;
+
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        val = ((l2_bitmap >> 32) | l2_bitmap)
+            & ~QCOW_OFLAG_SUB_ALLOC_RANGE(0, sc_from);
+        return ctz32(val) - sc_from;
+
+    default:
+        abort();
+    }
+}
+
+/*
+ * Maps a subcluster type to the cluster type that qcow2_get_cluster_offset()
+ * reports. Callers reading data don't care whether a zero or unallocated
+ * subcluster has a host cluster, so both variants map to the same type.
+ */
+static int subcluster_to_cluster_type(QCow2SubclusterType type)
+{
+    switch (type) {
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        return QCOW2_CLUSTER_UNALLOCATED;
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+        return QCOW2_CLUSTER_ZERO;
+    case QCOW2_SUBCLUSTER_NORMAL:
+        return QCOW2_CLUSTER_NORMAL;
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        return QCOW2_CLUSTER_COMPRESSED;
+    default:
+        abort();
+    }
+}
+
+/*
+ * Returns the number of contiguous subclusters, starting at subcluster
+ * @sc_index of the cluster at @l2_index, that read the same way as the first
+ * one (see subcluster_to_cluster_type()). Data subclusters must also be
+ * contiguous in the image file. At most @nb_clusters clusters are checked.
+ *
+ * Compressed clusters are always returned one by one.
+ *
+ * Returns -EIO if an invalid L2 entry is found; *l2_index is then updated to
+ * point to it.
+ */
+static int count_contiguous_subclusters(BDRVQcow2State *s, int nb_clusters,
+                                        unsigned sc_index, uint64_t *l2_slice,
+                                        unsigned int *l2_index)
+{
+    int i, count = 0;
+    int expected_type = QCOW2_CLUSTER_UNALLOCATED;
+    uint64_t expected_offset = 0;
+
+    assert(*l2_index + nb_clusters <= s->l2_slice_size);
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        unsigned first_sc = (i == 0) ? sc_index : 0;
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, *l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, *l2_index + i);
+        QCow2SubclusterType sc_type;
+        int type, ret;
+
+        ret = get_subcluster_range_type(s, l2_entry, l2_bitmap, first_sc,
+                                        &sc_type);
+        if (ret < 0) {
+            *l2_index += i;
+            return -EIO;
+        }
+        type = subcluster_to_cluster_type(sc_type);
 
-        if (type != wanted_type) {
+        if (i == 0) {
+            if (type == QCOW2_CLUSTER_COMPRESSED) {
+                return ret;
+            }
+            expected_type = type;
+            expected_offset = l2_entry & L2E_OFFSET_MASK;
+        } else if (type != expected_type) {
+            break;
+        } else if (type == QCOW2_CLUSTER_NORMAL) {
+            expected_offset += s->cluster_size;
+            if ((l2_entry & L2E_OFFSET_MASK) != expected_offset) {
+                break;
+            }
+        }
+
+        count += ret;
+        /* Stop if the type changes before the end of the cluster */
+        if (first_sc + ret < s->subclusters_per_cluster) {
             break;
         }
     }
 
-    return i;
+    return count;
 }
 
 /* The crypt function is compatible with the linux cryptoloop
@@ -389,30 +519,21 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
     return 0;
 }
 
-static int coroutine_fn do_perform_cow(BlockDriverState *bs,
-                                       uint64_t src_cluster_offset,
-                                       uint64_t cluster_offset,
-                                       int offset_in_cluster,
-                                       int bytes)
+static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
+                                            uint64_t src_cluster_offset,
+                                            unsigned offset_in_cluster,
+                                            QEMUIOVector *qiov)
 {
-    BDRVQcow2State *s = bs->opaque;
-    QEMUIOVector qiov;
-    struct iovec iov;
     int ret;
 
-    iov.iov_len = bytes;
-    iov.iov_base = qemu_try_blockalign(bs, iov.iov_len);
-    if (iov.iov_base == NULL) {
-        return -ENOMEM;
+    if (qiov->size == 0) {
+        return 0;
     }
 
-    qemu_iovec_init_external(&qiov, &iov, 1);
-
     BLKDBG_EVENT(bs->file, BLKDBG_COW_READ);
 
     if (!bs->drv) {
-        ret = -ENOMEDIUM;
-        goto out;
+        return -ENOMEDIUM;
     }
 
     /* Call .bdrv_co_readv() directly instead of using the public block-layer
@@ -420,43 +541,62 @@ static int coroutine_fn do_perform_cow(BlockDriverState *bs,
      * which can lead to deadlock when block layer copy-on-read is enabled.
      */
     ret = bs->drv->bdrv_co_preadv(bs, src_cluster_offset + offset_in_cluster,
-                                  bytes, &qiov, 0);
+                                  qiov->size, qiov, 0);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
-    if (bs->encrypted) {
+    return 0;
+}
+
+static bool coroutine_fn do_perform_cow_encrypt(BlockDriverState *bs,
+                                                uint64_t cluster_offset,
+                                                unsigned offset_in_cluster,
+                                                uint8_t *buffer,
+                                                unsigned bytes)
+{
+    if (bytes && bs->encrypted) {
+        BDRVQcow2State *s = bs->opaque;
         Error *err = NULL;
         int64_t sector = (cluster_offset + offset_in_cluster)
                          >> BDRV_SECTOR_BITS;
         assert(s->cipher);
         assert((offset_in_cluster & ~BDRV_SECTOR_MASK) == 0);
         assert((bytes & ~BDRV_SECTOR_MASK) == 0);
-        if (qcow2_encrypt_sectors(s, sector, iov.iov_base, iov.iov_base,
+        if (qcow2_encrypt_sectors(s, sector, buffer, buffer,
                                   bytes >> BDRV_SECTOR_BITS, true, &err) < 0) {
-            ret = -EIO;
             error_free(err);
-            goto out;
+            return false;
         }
     }
+    return true;
+}
+
+static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
+                                             uint64_t cluster_offset,
+                                             unsigned offset_in_cluster,
+                                             QEMUIOVector *qiov)
+{
+    int ret;
+
+    if (qiov->size == 0) {
+        return 0;
+    }
 
     ret = qcow2_pre_write_overlap_check(bs, 0,
-            cluster_offset + offset_in_cluster, bytes);
+            cluster_offset + offset_in_cluster, qiov->size);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
     BLKDBG_EVENT(bs->file, BLKDBG_COW_WRITE);
     ret = bdrv_co_pwritev(bs->file, cluster_offset + offset_in_cluster,
-                          bytes, &qiov, 0);
+                          qiov->size, qiov, 0);
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
-    ret = 0;
-out:
-    qemu_vfree(iov.iov_base);
-    return ret;
+    return 0;
 }
 
 
@@ -471,7 +611,9 @@ out:
  *
  * On exit, *bytes is the number of bytes starting at offset that have the same
  * cluster type and (if applicable) are stored contiguously in the image file.
- * Compressed clusters are always returned one by one.
+ * With extended L2 entries the type is tracked per subcluster, so *bytes may
+ * end in the middle of a cluster. Compressed clusters are always returned one
+ * by one.
  *
  * Returns the cluster type (QCOW2_CLUSTER_*) on success, -errno in error
  * cases.
@@ -480,22 +622,24 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
                              unsigned int *bytes, uint64_t *cluster_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    unsigned int l2_index;
-    uint64_t l1_index, l2_offset, *l2_table;
-    int l1_bits, c;
+    unsigned int l2_index, sc_index;
+    uint64_t l1_index, l2_offset, *l2_slice;
+    uint64_t l2_entry, l2_bitmap;
+    int sc;
     unsigned int offset_in_cluster;
     uint64_t bytes_available, bytes_needed, nb_clusters;
+    QCow2SubclusterType type;
     int ret;
 
     offset_in_cluster = offset_into_cluster(s, offset);
     bytes_needed = (uint64_t) *bytes + offset_in_cluster;
 
-    l1_bits = s->l2_bits + s->cluster_bits;
-
     /* compute how many bytes there are between the start of the cluster
-     * containing offset and the end of the l1 entry */
-    bytes_available = (1ULL << l1_bits) - (offset & ((1ULL << l1_bits) - 1))
-                    + offset_in_cluster;
+     * containing offset and the end of the l2 slice that contains
+     * the entry pointing to it */
+    bytes_available =
+        ((uint64_t) (s->l2_slice_size - offset_to_l2_slice_index(s, offset)))
+        << s->cluster_bits;
 
     if (bytes_needed > bytes_available) {
         bytes_needed = bytes_available;
@@ -505,7 +649,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     /* seek to the l2 offset in the l1 table */
 
-    l1_index = offset >> l1_bits;
+    l1_index = offset_to_l1_index(s, offset);
     if (l1_index >= s->l1_size) {
         ret = QCOW2_CLUSTER_UNALLOCATED;
         goto out;
@@ -524,17 +668,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    l2_index = offset_to_l2_slice_index(s, offset);
+    sc_index = offset_to_sc_index(s, offset);
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
 
     nb_clusters = size_to_clusters(s, bytes_needed);
     /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
@@ -542,14 +688,16 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
      * true */
     assert(nb_clusters <= INT_MAX);
 
-    ret = qcow2_get_cluster_type(*cluster_offset);
-    switch (ret) {
-    case QCOW2_CLUSTER_COMPRESSED:
-        /* Compressed clusters can only be processed one by one */
-        c = 1;
-        *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
+    type = qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc_index);
+    switch (type) {
+    case QCOW2_SUBCLUSTER_INVALID:
+        /* Reported by count_contiguous_subclusters() below */
+        break;
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        *cluster_offset = l2_entry & L2E_COMPRESSED_OFFSET_SIZE_MASK;
         break;
-    case QCOW2_CLUSTER_ZERO:
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
         if (s->qcow_version < 3) {
             qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
                                     " in pre-v3 image (L2 offset: %#" PRIx64
@@ -557,21 +705,12 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             ret = -EIO;
             goto fail;
         }
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
-                                              QCOW2_CLUSTER_ZERO);
-        *cluster_offset = 0;
         break;
-    case QCOW2_CLUSTER_UNALLOCATED:
-        /* how many empty clusters ? */
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
-                                              QCOW2_CLUSTER_UNALLOCATED);
-        *cluster_offset = 0;
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
         break;
-    case QCOW2_CLUSTER_NORMAL:
-        /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
-        *cluster_offset &= L2E_OFFSET_MASK;
+    case QCOW2_SUBCLUSTER_NORMAL:
+        *cluster_offset = l2_entry & L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
                                     PRIx64 " unaligned (L2 offset: %#" PRIx64
@@ -585,9 +724,20 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         abort();
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+    sc = count_contiguous_subclusters(s, nb_clusters, sc_index,
+                                      l2_slice, &l2_index);
+    if (sc < 0) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster entry found "
+                                "(L2 offset: %#" PRIx64 ", L2 index: %#x)",
+                                l2_offset, l2_index);
+        ret = -EIO;
+        goto fail;
+    }
+
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
-    bytes_available = (int64_t)c * s->cluster_size;
+    ret = subcluster_to_cluster_type(type);
+    bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
 
 out:
     if (bytes_available > bytes_needed) {
@@ -603,34 +753,407 @@ out:
     return ret;
 
 fail:
-    qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **)&l2_slice);
     return ret;
 }
 
+/*
+ * The allocation map answers block status queries for unallocated areas
+ * without looking at every L2 slice, which matters when a long backing chain
+ * is queried layer by layer. A bit is set for every cluster whose L2 entry
+ * is in use (data, zero or compressed, or any subcluster allocated), and
+ * also for every cluster that a request might have written to since the map
+ * was built. Bits are never cleared; anything that rewrites the L1 table
+ * drops the whole map with qcow2_alloc_map_invalidate().
+ *
+ * Allocating writes drop s->lock between qcow2_alloc_cluster_offset() and
+ * qcow2_alloc_cluster_link_l2(), so an L2 table can be scanned while its new
+ * entries are still zero. Their qcow2_alloc_map_mark() may have happened
+ * before the map existed, so the scan also sets the bits of the allocations
+ * in s->cluster_allocs.
+ */
+
+static uint64_t alloc_map_nb_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
+}
+
+static int alloc_map_init(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_clusters = alloc_map_nb_clusters(bs);
+    uint64_t nb_l2_tables = DIV_ROUND_UP(nb_clusters, s->l2_size);
+
+    s->alloc_map = hbitmap_alloc(nb_clusters, 0);
+    s->alloc_map_scanned = bitmap_try_new(nb_l2_tables);
+    if (s->alloc_map_scanned == NULL) {
+        qcow2_alloc_map_invalidate(bs);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Reads the L2 table for @l1_index and sets the bits of all clusters that
+ * are in use.
+ */
+static int alloc_map_scan_l2(BlockDriverState *bs, uint64_t l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_clusters = alloc_map_nb_clusters(bs);
+    uint64_t l2_offset, cluster_index, *l2_slice;
+    uint64_t l2_start, l2_end, start, end;
+    QCowL2Meta *m;
+    int i, j, ret;
+
+    if (l1_index >= s->l1_size) {
+        goto done;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        goto done;
+    }
+
+    if (offset_into_cluster(s, l2_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#" PRIx64
+                                " unaligned (L1 index: %#" PRIx64 ")",
+                                l2_offset, l1_index);
+        return -EIO;
+    }
+
+    cluster_index = l1_index << s->l2_bits;
+    for (i = 0; i < s->l2_size && cluster_index < nb_clusters;
+         i += s->l2_slice_size)
+    {
+        ret = l2_load(bs, cluster_index << s->cluster_bits, l2_offset,
+                      &l2_slice);
+        if (ret < 0) {
+            return ret;
+        }
+
+        for (j = 0; j < s->l2_slice_size && cluster_index < nb_clusters;
+             j++, cluster_index++)
+        {
+            if (get_l2_entry(s, l2_slice, j) ||
+                (has_subclusters(s) && get_l2_bitmap(s, l2_slice, j)))
+            {
+                hbitmap_set(s->alloc_map, cluster_index, 1);
+            }
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+    }
+
+done:
+    l2_start = l1_index << s->l2_bits;
+    l2_end = MIN(l2_start + s->l2_size, nb_clusters);
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        start = MAX(m->offset >> s->cluster_bits, l2_start);
+        end = MIN((m->offset >> s->cluster_bits) + m->nb_clusters, l2_end);
+        if (start < end) {
+            hbitmap_set(s->alloc_map, start, end - start);
+        }
+    }
+
+    set_bit(l1_index, s->alloc_map_scanned);
+    return 0;
+}
+
+/*
+ * Checks whether the area starting at @offset is known to be unallocated in
+ * this image, scanning the L2 tables involved if they haven't been scanned
+ * yet.
+ *
+ * Returns 1 if it is, and reduces *bytes to the length of the unallocated
+ * area. Returns 0 if the first cluster may be allocated, in which case the
+ * caller has to look at its L2 entry, or -errno on failure.
+ */
+int qcow2_alloc_map_get_unallocated(BlockDriverState *bs, uint64_t offset,
+                                    unsigned int *bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start, end, cluster, next, l1_index;
+    HBitmapIter hbi;
+    int64_t hit;
+    int ret;
+
+    if (s->alloc_map == NULL) {
+        ret = alloc_map_init(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    start = offset >> s->cluster_bits;
+    end = MIN(size_to_clusters(s, offset + *bytes),
+              alloc_map_nb_clusters(bs));
+
+    for (cluster = start; cluster < end; cluster = next) {
+        l1_index = cluster >> s->l2_bits;
+        next = MIN((l1_index + 1) << s->l2_bits, end);
+
+        if (!test_bit(l1_index, s->alloc_map_scanned)) {
+            ret = alloc_map_scan_l2(bs, l1_index);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        hbitmap_iter_init(&hbi, s->alloc_map, cluster);
+        hit = hbitmap_iter_next(&hbi);
+        if (hit >= 0 && hit < next) {
+            end = hit;
+            break;
+        }
+    }
+
+    if (end <= start) {
+        return 0;
+    }
+
+    *bytes = MIN(*bytes, (end << s->cluster_bits) - offset);
+    return 1;
+}
+
+/*
+ * Must be called before the L2 entries for the given guest range may be
+ * changed to anything but unallocated.
+ */
+void qcow2_alloc_map_mark(BlockDriverState *bs, uint64_t offset,
+                          uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t start, end;
+
+    if (s->alloc_map == NULL) {
+        return;
+    }
+
+    start = offset >> s->cluster_bits;
+    end = MIN(size_to_clusters(s, offset + bytes),
+              alloc_map_nb_clusters(bs));
+    if (start < end) {
+        hbitmap_set(s->alloc_map, start, end - start);
+    }
+}
+
+void qcow2_alloc_map_invalidate(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->alloc_map) {
+        hbitmap_free(s->alloc_map);
+        s->alloc_map = NULL;
+    }
+    g_free(s->alloc_map_scanned);
+    s->alloc_map_scanned = NULL;
+}
+
+/*
+ * When the guest accesses the image sequentially, the L2 slice that covers
+ * the area after the current request is read before any request needs it,
+ * and for writes also the refcount blocks that the next cluster allocations
+ * are going to use. The tables are read without holding s->lock and are
+ * then added to the metadata caches.
+ */
+
+/* Number of sequential requests before prefetching starts */
+#define QCOW2_PREFETCH_MIN_STREAK 4
+
+typedef struct Qcow2PrefetchCo {
+    BlockDriverState *bs;
+    uint64_t offset;
+    bool is_write;
+} Qcow2PrefetchCo;
+
+typedef uint64_t Qcow2PrefetchOffsetFunc(BlockDriverState *bs, uint64_t key);
+
+/* Returns the host offset of the L2 slice for guest offset @offset, or 0 */
+static uint64_t prefetch_l2_slice_offset(BlockDriverState *bs,
+                                         uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index = offset_to_l1_index(s, offset);
+    uint64_t l2_offset;
+
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    /* Corrupted entries are reported when a request uses them */
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return 0;
+    }
+
+    return l2_offset + l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+}
+
+/* Returns the host offset of the refcount block with index @index, or 0 */
+static uint64_t prefetch_refblock_offset(BlockDriverState *bs, uint64_t index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refblock_offset;
+
+    if (index >= s->refcount_table_size) {
+        return 0;
+    }
+
+    refblock_offset = s->refcount_table[index] & REFT_OFFSET_MASK;
+    if (offset_into_cluster(s, refblock_offset)) {
+        return 0;
+    }
+
+    return refblock_offset;
+}
+
+/*
+ * Reads the table given by @get_offset and @key into *@cache unless it is
+ * cached already. Must be called with s->lock held, which is dropped during
+ * the read. Errors are ignored; a request that needs the table reads it
+ * again and reports them.
+ */
+static void coroutine_fn prefetch_table(BlockDriverState *bs,
+                                        Qcow2Cache **cache, size_t size,
+                                        Qcow2PrefetchOffsetFunc *get_offset,
+                                        uint64_t key)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset, generation;
+    void *buf;
+    int ret;
+
+    offset = get_offset(bs, key);
+    if (!offset || qcow2_cache_is_cached(*cache, offset)) {
+        return;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, size);
+    if (buf == NULL) {
+        return;
+    }
+
+    generation = qcow2_cache_generation(*cache);
+    trace_qcow2_prefetch_table(qemu_coroutine_self(),
+                               *cache == s->l2_table_cache, offset);
+
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_pread(bs->file, offset, buf, size);
+    qemu_co_mutex_lock(&s->lock);
+
+    /* The table must not have been moved or changed while s->lock was not
+     * held; the cache generation covers everything but the L1 and refcount
+     * tables themselves */
+    if (ret >= 0 && get_offset(bs, key) == offset) {
+        qcow2_cache_add_prefetched(bs, *cache, offset, buf, generation);
+    }
+
+    qemu_vfree(buf);
+}
+
+static void coroutine_fn qcow2_prefetch_entry(void *opaque)
+{
+    Qcow2PrefetchCo *p = opaque;
+    BlockDriverState *bs = p->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refblock_index;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    prefetch_table(bs, &s->l2_table_cache, s->l2_slice_size * l2_entry_size(s),
+                   prefetch_l2_slice_offset, p->offset);
+
+    if (p->is_write) {
+        /* New clusters are allocated from free_cluster_index onwards */
+        refblock_index = s->free_cluster_index >> s->refcount_block_bits;
+        prefetch_table(bs, &s->refcount_block_cache, s->cluster_size,
+                       prefetch_refblock_offset, refblock_index);
+        prefetch_table(bs, &s->refcount_block_cache, s->cluster_size,
+                       prefetch_refblock_offset, refblock_index + 1);
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+
+    s->prefetch_in_flight--;
+    g_free(p);
+}
+
+/*
+ * Called at the start of each guest request. Once a sequential stream of
+ * requests has been detected, starts a prefetch of the L2 slice following
+ * the one the request ends in.
+ */
+void qcow2_prefetch_metadata(BlockDriverState *bs, uint64_t offset,
+                             uint64_t bytes, bool is_write)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t) s->l2_slice_size << s->cluster_bits;
+    uint64_t next_slice;
+    Qcow2PrefetchCo *p;
+    Coroutine *co;
+
+    if (!s->metadata_prefetch) {
+        return;
+    }
+
+    if (offset == s->prefetch_next_offset) {
+        s->prefetch_streak++;
+    } else {
+        s->prefetch_streak = 0;
+    }
+    s->prefetch_next_offset = offset + bytes;
+
+    if (s->prefetch_streak < QCOW2_PREFETCH_MIN_STREAK) {
+        return;
+    }
+
+    next_slice = QEMU_ALIGN_UP(offset + bytes, slice_bytes);
+    if (next_slice == s->prefetch_l2_offset ||
+        next_slice >= bs->total_sectors * BDRV_SECTOR_SIZE)
+    {
+        return;
+    }
+    s->prefetch_l2_offset = next_slice;
+
+    p = g_new(Qcow2PrefetchCo, 1);
+    *p = (Qcow2PrefetchCo) {
+        .bs         = bs,
+        .offset     = next_slice,
+        .is_write   = is_write,
+    };
+
+    s->prefetch_in_flight++;
+    co = qemu_coroutine_create(qcow2_prefetch_entry, p);
+    qemu_coroutine_enter(co);
+}
+
 /*
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the appropriate slice of its l2 table.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the cluster index in the l2 slice is given to the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
 static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
-                             uint64_t **new_l2_table,
+                             uint64_t **new_l2_slice,
                              int *new_l2_index)
 {
     BDRVQcow2State *s = bs->opaque;
     unsigned int l2_index;
     uint64_t l1_index, l2_offset;
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
     int ret;
 
     /* seek to the l2 offset in the l1 table */
 
-    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    l1_index = offset_to_l1_index(s, offset);
     if (l1_index >= s->l1_size) {
         ret = qcow2_grow_l1_table(bs, l1_index + 1, false);
         if (ret < 0) {
@@ -647,33 +1170,35 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* seek the l2 table of the given l2 offset */
-
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
+
+        /* Get the offset of the newly-allocated l2 table */
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+        assert(offset_into_cluster(s, l2_offset) == 0);
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
-    *new_l2_table = l2_table;
+    *new_l2_slice = l2_slice;
     *new_l2_index = l2_index;
 
     return 0;
@@ -698,26 +1223,26 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     int l2_index, ret;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int64_t cluster_offset;
     int nb_csectors;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return 0;
     }
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
         return 0;
     }
 
     cluster_offset = qcow2_alloc_bytes(bs, compressed_size);
     if (cluster_offset < 0) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
         return 0;
     }
 
@@ -732,45 +1257,148 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     /* compressed clusters never have the copied flag */
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_slice, l2_index, 0);
+    }
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
     return cluster_offset;
 }
 
-static int perform_cow(BlockDriverState *bs, QCowL2Meta *m, Qcow2COWRegion *r)
+static int perform_cow(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2COWRegion *start = &m->cow_start;
+    Qcow2COWRegion *end = &m->cow_end;
+    unsigned buffer_size;
+    unsigned data_bytes = end->offset - (start->offset + start->nb_bytes);
+    bool merge_reads;
+    uint8_t *start_buffer, *end_buffer;
+    QEMUIOVector qiov;
     int ret;
 
-    if (r->nb_bytes == 0) {
+    assert(start->nb_bytes <= UINT_MAX - end->nb_bytes);
+    assert(start->nb_bytes + end->nb_bytes <= UINT_MAX - data_bytes);
+    assert(start->offset + start->nb_bytes <= end->offset);
+    assert(!m->data_qiov || m->data_qiov->size == data_bytes);
+
+    if (start->nb_bytes == 0 && end->nb_bytes == 0) {
         return 0;
     }
 
+    /* If we have to read both the start and end COW regions and the
+     * middle region is not too large then perform just one read
+     * operation */
+    merge_reads = start->nb_bytes && end->nb_bytes && data_bytes <= 16384;
+    if (merge_reads) {
+        buffer_size = start->nb_bytes + data_bytes + end->nb_bytes;
+    } else {
+        /* If we have to do two reads, add some padding in the middle
+         * if necessary to make sure that the end region is optimally
+         * aligned. */
+        size_t align = bdrv_opt_mem_align(bs);
+        assert(align > 0 && align <= UINT_MAX);
+        assert(QEMU_ALIGN_UP(start->nb_bytes, align) <=
+               UINT_MAX - end->nb_bytes);
+        buffer_size = QEMU_ALIGN_UP(start->nb_bytes, align) + end->nb_bytes;
+    }
+
+    /* Reserve a buffer large enough to store all the data that we're
+     * going to read */
+    start_buffer = qemu_try_blockalign(bs, buffer_size);
+    if (start_buffer == NULL) {
+        return -ENOMEM;
+    }
+    /* The part of the buffer where the end region is located */
+    end_buffer = start_buffer + buffer_size - end->nb_bytes;
+
+    qemu_iovec_init(&qiov, 2 + (m->data_qiov ? m->data_qiov->niov : 0));
+
     qemu_co_mutex_unlock(&s->lock);
-    ret = do_perform_cow(bs, m->offset, m->alloc_offset, r->offset, r->nb_bytes);
-    qemu_co_mutex_lock(&s->lock);
+    /* First we read the existing data from both COW regions. We
+     * either read the whole region in one go, or the start and end
+     * regions separately. */
+    if (merge_reads) {
+        qemu_iovec_add(&qiov, start_buffer, buffer_size);
+        ret = do_perform_cow_read(bs, m->offset, start->offset, &qiov);
+    } else {
+        qemu_iovec_add(&qiov, start_buffer, start->nb_bytes);
+        ret = do_perform_cow_read(bs, m->offset, start->offset, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
 
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, end_buffer, end->nb_bytes);
+        ret = do_perform_cow_read(bs, m->offset, end->offset, &qiov);
+    }
     if (ret < 0) {
-        return ret;
+        goto fail;
+    }
+
+    /* Encrypt the data if necessary before writing it */
+    if (!do_perform_cow_encrypt(bs, m->alloc_offset, start->offset,
+                                start_buffer, start->nb_bytes) ||
+        !do_perform_cow_encrypt(bs, m->alloc_offset, end->offset,
+                                end_buffer, end->nb_bytes)) {
+        ret = -EIO;
+        goto fail;
     }
 
+    /* And now we can write everything. If we have the guest data we
+     * can write everything in one single operation */
+    if (m->data_qiov) {
+        qemu_iovec_reset(&qiov);
+        if (start->nb_bytes) {
+            qemu_iovec_add(&qiov, start_buffer, start->nb_bytes);
+        }
+        qemu_iovec_concat(&qiov, m->data_qiov, 0, data_bytes);
+        if (end->nb_bytes) {
+            qemu_iovec_add(&qiov, end_buffer, end->nb_bytes);
+        }
+        /* NOTE: we have a write_aio blkdebug event here followed by
+         * a cow_write one in do_perform_cow_write(), but there's only
+         * one single I/O operation */
+        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start->offset, &qiov);
+    } else {
+        /* If there's no guest data then write both COW regions separately */
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, start_buffer, start->nb_bytes);
+        ret = do_perform_cow_write(bs, m->alloc_offset, start->offset, &qiov);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        qemu_iovec_reset(&qiov);
+        qemu_iovec_add(&qiov, end_buffer, end->nb_bytes);
+        ret = do_perform_cow_write(bs, m->alloc_offset, end->offset, &qiov);
+    }
+
+fail:
+    qemu_co_mutex_lock(&s->lock);
+
     /*
      * Before we update the L2 table to actually point to the new cluster, we
      * need to be sure that the refcounts have been increased and COW was
      * handled.
      */
-    qcow2_cache_depends_on_flush(s->l2_table_cache);
+    if (ret == 0) {
+        qcow2_cache_depends_on_flush(s->l2_table_cache);
+    }
 
-    return 0;
+    qemu_vfree(start_buffer);
+    qemu_iovec_destroy(&qiov);
+    return ret;
 }
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcow2State *s = bs->opaque;
     int i, j = 0, l2_index, ret;
-    uint64_t *old_cluster, *l2_table;
+    uint64_t *old_cluster, *l2_slice;
     uint64_t cluster_offset = m->alloc_offset;
 
     trace_qcow2_cluster_link_l2(qemu_coroutine_self(), m->nb_clusters);
@@ -783,12 +1411,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
 
     /* copy content of unmodified sectors */
-    ret = perform_cow(bs, m, &m->cow_start);
-    if (ret < 0) {
-        goto err;
-    }
-
-    ret = perform_cow(bs, m, &m->cow_end);
+    ret = perform_cow(bs, m);
     if (ret < 0) {
         goto err;
     }
@@ -802,13 +1425,13 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
                                    s->refcount_block_cache);
     }
 
-    ret = get_cluster_table(bs, m->offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, m->offset, &l2_slice, &l2_index);
     if (ret < 0) {
         goto err;
     }
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
 
-    assert(l2_index + m->nb_clusters <= s->l2_size);
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
         /* if two concurrent writes happen to the same unallocated cluster
          * each write allocates separate cluster and writes data concurrently.
@@ -816,16 +1439,35 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
          * cluster the second one has to do RMW (which is done above by
          * perform_cow()), update l2 table with its cluster pointer and free
          * old cluster. This is what this loop does */
-        if (l2_table[l2_index + i] != 0) {
-            old_cluster[j++] = l2_table[l2_index + i];
+        uint64_t old_entry = get_l2_entry(s, l2_slice, l2_index + i);
+
+        if (!m->keep_old && old_entry != 0) {
+            old_cluster[j++] = old_entry;
         }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_slice, l2_index + i, (cluster_offset +
+                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+
+        /* Mark the subclusters that were written or copied as allocated */
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+            uint64_t written_from = m->cow_start.offset;
+            uint64_t written_to = m->cow_end.offset + m->cow_end.nb_bytes;
+            int first_sc, last_sc;
+
+            written_from = MAX(written_from, (uint64_t) i << s->cluster_bits);
+            written_to = MIN(written_to, (uint64_t) (i + 1) << s->cluster_bits);
+            assert(written_from < written_to);
+            first_sc = offset_to_sc_index(s, written_from);
+            last_sc = offset_to_sc_index(s, written_to - 1);
+            l2_bitmap |= QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc + 1);
+            l2_bitmap &= ~QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc + 1);
+            set_l2_bitmap(s, l2_slice, l2_index + i, l2_bitmap);
+        }
      }
 
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
     /*
      * If this was a COW, we need to decrease the refcount of the old cluster.
@@ -835,7 +1477,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -846,18 +1488,34 @@ err:
     return ret;
  }
 
+/*
+ * Free the clusters allocated for @m if their data could not be written,
+ * instead of leaking them. Must not be called after
+ * qcow2_alloc_cluster_link_l2() has started to link them.
+ */
+void qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!m->keep_old && m->nb_clusters != 0) {
+        qcow2_free_clusters(bs, m->alloc_offset,
+                            (uint64_t)m->nb_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+    }
+}
+
 /*
  * Returns the number of contiguous clusters that can be used for an allocating
  * write, but require COW to be performed (this includes yet unallocated space,
  * which must copy from the backing file)
  */
 static int count_cow_clusters(BDRVQcow2State *s, int nb_clusters,
-    uint64_t *l2_table, int l2_index)
+    uint64_t *l2_slice, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -880,6 +1538,176 @@ out:
     return i;
 }
 
+/*
+ * Creates a QCowL2Meta for an allocating write of @bytes at @guest_offset to
+ * the clusters at @host_cluster_offset and adds it to the list of in-flight
+ * allocations. @l2_slice contains the L2 entries of the affected clusters.
+ *
+ * cow_start and cow_end cover the parts of the affected clusters that are not
+ * written by the request but must be copied to the new clusters. With
+ * extended L2 entries, leading and trailing subclusters that are unallocated
+ * or read as zeroes keep their state and are not copied.
+ *
+ * If @keep_old is true, the clusters are already allocated and are written in
+ * place. If all affected subclusters already contain data, no QCowL2Meta is
+ * necessary and none is created.
+ *
+ * Returns 0 on success and -errno in error cases.
+ */
+static int calculate_l2_meta(BlockDriverState *bs, uint64_t host_cluster_offset,
+                             uint64_t guest_offset, unsigned bytes,
+                             uint64_t *l2_slice, QCowL2Meta **m, bool keep_old)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int l2_index = offset_to_l2_slice_index(s, guest_offset);
+    uint64_t l2_entry, l2_bitmap;
+    unsigned cow_start_from, cow_end_to;
+    unsigned cow_start_to = offset_into_cluster(s, guest_offset);
+    unsigned cow_end_from = cow_start_to + bytes;
+    unsigned nb_clusters = size_to_clusters(s, cow_end_from);
+    unsigned sc_index;
+    QCowL2Meta *old_m = *m;
+    QCow2SubclusterType type;
+    bool skip_cow = keep_old;
+    int i;
+
+    assert(nb_clusters <= s->l2_slice_size - l2_index);
+
+    /* Check the type of all affected subclusters */
+    for (i = 0; i < nb_clusters; i++) {
+        l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        if (skip_cow) {
+            uint64_t write_from = MAX(cow_start_to,
+                                      (uint64_t) i << s->cluster_bits);
+            uint64_t write_to = MIN(cow_end_from,
+                                    (uint64_t) (i + 1) << s->cluster_bits);
+            int first_sc = offset_to_sc_index(s, write_from);
+            int last_sc = offset_to_sc_index(s, write_to - 1);
+            int cnt = get_subcluster_range_type(s, l2_entry, l2_bitmap,
+                                                first_sc, &type);
+            /* Are all written subclusters already allocated? */
+            if (type != QCOW2_SUBCLUSTER_NORMAL || first_sc + cnt <= last_sc) {
+                skip_cow = false;
+            }
+        } else {
+            type = qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, 0);
+        }
+        if (type == QCOW2_SUBCLUSTER_INVALID) {
+            int l1_index = offset_to_l1_index(s, guest_offset);
+            uint64_t l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster entry "
+                                    "found (L2 offset: %#" PRIx64 ", L2 "
+                                    "index: %#x)", l2_offset, l2_index + i);
+            return -EIO;
+        }
+    }
+
+    if (skip_cow) {
+        return 0;
+    }
+
+    /* Where the COW region before the request starts */
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    sc_index = offset_to_sc_index(s, guest_offset);
+    type = qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc_index);
+
+    switch (type) {
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        cow_start_from = 0;
+        break;
+    case QCOW2_SUBCLUSTER_NORMAL:
+        if (keep_old) {
+            cow_start_from = cow_start_to;
+            break;
+        }
+        /* fall through */
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        if (keep_old) {
+            cow_start_from = sc_index << s->subcluster_bits;
+        } else if (has_subclusters(s)) {
+            /* Leading subclusters without data are not copied */
+            uint32_t alloc_bitmap = l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+            cow_start_from =
+                MIN(sc_index, ctz32(alloc_bitmap)) << s->subcluster_bits;
+        } else {
+            cow_start_from = 0;
+        }
+        break;
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        cow_start_from = sc_index << s->subcluster_bits;
+        break;
+    default:
+        abort();
+    }
+
+    /* Where the COW region after the request ends */
+    l2_index += nb_clusters - 1;
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    sc_index = offset_to_sc_index(s, guest_offset + bytes - 1);
+    type = qcow2_get_subcluster_type(s, l2_entry, l2_bitmap, sc_index);
+
+    switch (type) {
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        cow_end_to = ROUND_UP(cow_end_from, s->cluster_size);
+        break;
+    case QCOW2_SUBCLUSTER_NORMAL:
+        if (keep_old) {
+            cow_end_to = cow_end_from;
+            break;
+        }
+        /* fall through */
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        if (keep_old) {
+            cow_end_to = ROUND_UP(cow_end_from, s->subcluster_size);
+        } else {
+            cow_end_to = ROUND_UP(cow_end_from, s->cluster_size);
+            if (has_subclusters(s)) {
+                /* Trailing subclusters without data are not copied */
+                uint32_t alloc_bitmap = l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+                cow_end_to -= MIN(s->subclusters_per_cluster - sc_index - 1,
+                                  clz32(alloc_bitmap)) << s->subcluster_bits;
+            }
+        }
+        break;
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        cow_end_to = ROUND_UP(cow_end_from, s->subcluster_size);
+        break;
+    default:
+        abort();
+    }
+
+    *m = g_malloc0(sizeof(**m));
+    **m = (QCowL2Meta) {
+        .next           = old_m,
+
+        .alloc_offset   = host_cluster_offset,
+        .offset         = start_of_cluster(s, guest_offset),
+        .nb_clusters    = nb_clusters,
+        .keep_old       = keep_old,
+
+        .cow_start = {
+            .offset     = cow_start_from,
+            .nb_bytes   = cow_start_to - cow_start_from,
+        },
+        .cow_end = {
+            .offset     = cow_end_from,
+            .nb_bytes   = cow_end_to - cow_end_from,
+        },
+    };
+
+    qemu_co_queue_init(&(*m)->dependent_requests);
+    QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+
+    return 0;
+}
+
 /*
  * Check if there already is an AIO write request in flight which allocates
  * the same cluster. In this case we need to wait until the previous
@@ -905,8 +1733,10 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
 
         uint64_t start = guest_offset;
         uint64_t end = start + bytes;
-        uint64_t old_start = l2meta_cow_start(old_alloc);
-        uint64_t old_end = l2meta_cow_end(old_alloc);
+        /* The L2 entries of all clusters touched by old_alloc change, even if
+         * it only writes some of their subclusters */
+        uint64_t old_start = start_of_cluster(s, l2meta_cow_start(old_alloc));
+        uint64_t old_end = ROUND_UP(l2meta_cow_end(old_alloc), s->cluster_size);
 
         if (end <= old_start || start >= old_end) {
             /* No intersection */
@@ -951,6 +1781,10 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
  * *host_offset is not zero, only physically contiguous clusters beginning at
  * this host offset are counted.
  *
+ * With extended L2 entries, writing to subclusters of these clusters that do
+ * not contain data yet still needs a QCowL2Meta to update their bitmaps and
+ * to copy the rest of the subcluster; it is added to *m.
+ *
  * Note that guest_offset may not be cluster aligned. In this case, the
  * returned *host_offset points to exact byte referenced by guest_offset and
  * therefore isn't cluster aligned as well.
@@ -973,7 +1807,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
     BDRVQcow2State *s = bs->opaque;
     int l2_index;
     uint64_t cluster_offset;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     uint64_t nb_clusters;
     unsigned int keep_clusters;
     int ret;
@@ -985,23 +1819,23 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
-    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1028,8 +1862,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
+            count_contiguous_clusters(s, nb_clusters, l2_slice, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
@@ -1037,6 +1870,14 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
 
+        if (has_subclusters(s)) {
+            ret = calculate_l2_meta(bs, cluster_offset & L2E_OFFSET_MASK,
+                                    guest_offset, *bytes, l2_slice, m, true);
+            if (ret < 0) {
+                goto out;
+            }
+        }
+
         ret = 1;
     } else {
         ret = 0;
@@ -1044,7 +1885,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Cleanup */
 out:
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
     /* Only return a host offset if we actually made progress. Otherwise we
      * would make requirements for handle_alloc() that it can't fulfill */
@@ -1128,7 +1969,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 {
     BDRVQcow2State *s = bs->opaque;
     int l2_index;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     uint64_t entry;
     uint64_t nb_clusters;
     int ret;
@@ -1140,29 +1981,29 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     assert(*bytes > 0);
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
-    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, guest_offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_slice, l2_index);
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
         nb_clusters = 1;
     } else {
-        nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
+        nb_clusters = count_cow_clusters(s, nb_clusters, l2_slice, l2_index);
     }
 
     /* This function is only called when there were no non-COW clusters, so if
@@ -1170,8 +2011,6 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
-
     /* Allocate, if necessary at a given offset in the image file */
     alloc_cluster_offset = start_of_cluster(s, *host_offset);
     ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
@@ -1183,7 +2022,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     /* Can't extend contiguous allocation */
     if (nb_clusters == 0) {
         *bytes = 0;
-        return 0;
+        ret = 0;
+        goto out;
     }
 
     /* !*host_offset would overwrite the image header and is reserved for "no
@@ -1200,53 +2040,42 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     /*
      * Save info needed for meta data update.
      *
-     * requested_bytes: Number of bytes from the start of the first
-     * newly allocated cluster to the end of the (possibly shortened
-     * before) write request.
-     *
-     * avail_bytes: Number of bytes from the start of the first
-     * newly allocated to the end of the last newly allocated cluster.
-     *
-     * nb_bytes: The number of bytes from the start of the first
-     * newly allocated cluster to the end of the area that the write
-     * request actually writes to (excluding COW at the end)
-     */
-    uint64_t requested_bytes = *bytes + offset_into_cluster(s, guest_offset);
-    int avail_bytes = MIN(INT_MAX, nb_clusters << s->cluster_bits);
-    int nb_bytes = MIN(requested_bytes, avail_bytes);
-    QCowL2Meta *old_m = *m;
-
-    *m = g_malloc0(sizeof(**m));
-
-    **m = (QCowL2Meta) {
-        .next           = old_m,
-
-        .alloc_offset   = alloc_cluster_offset,
-        .offset         = start_of_cluster(s, guest_offset),
-        .nb_clusters    = nb_clusters,
-
-        .cow_start = {
-            .offset     = 0,
-            .nb_bytes   = offset_into_cluster(s, guest_offset),
-        },
-        .cow_end = {
-            .offset     = nb_bytes,
-            .nb_bytes   = avail_bytes - nb_bytes,
-        },
-    };
-    qemu_co_queue_init(&(*m)->dependent_requests);
-    QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+     * requested_bytes: Number of bytes from the start of the first
+     * newly allocated cluster to the end of the (possibly shortened
+     * before) write request.
+     *
+     * avail_bytes: Number of bytes from the start of the first
+     * newly allocated to the end of the last newly allocated cluster.
+     *
+     * nb_bytes: The number of bytes from the start of the first
+     * newly allocated cluster to the end of the area that the write
+     * request actually writes to (excluding COW at the end)
+     */
+    uint64_t requested_bytes = *bytes + offset_into_cluster(s, guest_offset);
+    int avail_bytes = MIN(INT_MAX, nb_clusters << s->cluster_bits);
+    int nb_bytes = MIN(requested_bytes, avail_bytes);
 
     *host_offset = alloc_cluster_offset + offset_into_cluster(s, guest_offset);
     *bytes = MIN(*bytes, nb_bytes - offset_into_cluster(s, guest_offset));
     assert(*bytes != 0);
 
-    return 1;
+    ret = calculate_l2_meta(bs, alloc_cluster_offset, guest_offset, *bytes,
+                            l2_slice, m, false);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = 1;
+
+out:
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+    return ret;
 
 fail:
     if (*m && (*m)->nb_clusters > 0) {
         QLIST_REMOVE(*m, next_in_flight);
     }
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     return ret;
 }
 
@@ -1403,35 +2232,337 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
 
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+/*
+ * Compressed clusters are decompressed in the thread pool into a small cache
+ * of whole clusters. When the guest reads compressed clusters sequentially,
+ * the clusters that follow are read and decompressed in the background, so
+ * that several of them are decompressed in parallel and the request that
+ * needs one later finds it in the cache.
+ */
+
+/* Memory used for decompressed clusters */
+#define QCOW2_COMPRESSED_CACHE_BYTES (4 * 1024 * 1024)
+#define QCOW2_COMPRESSED_CACHE_MIN 4
+#define QCOW2_COMPRESSED_CACHE_MAX 64
+/* Maximum number of clusters decompressed ahead of the guest */
+#define QCOW2_COMPRESSED_READAHEAD 8
+
+typedef struct Qcow2DecompressData {
+    uint8_t *dest;
+    int dest_size;
+    const uint8_t *src;
+    int src_size;
+} Qcow2DecompressData;
+
+typedef struct Qcow2ReadaheadCo {
+    BlockDriverState *bs;
+    Qcow2CompressedCluster *c;
+} Qcow2ReadaheadCo;
+
+void qcow2_compressed_cache_init(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    s->compressed_cache_size = QCOW2_COMPRESSED_CACHE_BYTES / s->cluster_size;
+    s->compressed_cache_size = MIN(MAX(s->compressed_cache_size,
+                                       QCOW2_COMPRESSED_CACHE_MIN),
+                                   QCOW2_COMPRESSED_CACHE_MAX);
+    s->compressed_readahead = MIN(QCOW2_COMPRESSED_READAHEAD,
+                                  s->compressed_cache_size / 2);
+    s->compressed_cache = g_new0(Qcow2CompressedCluster,
+                                 s->compressed_cache_size);
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        qemu_co_queue_init(&s->compressed_cache[i].waiters);
+    }
+    s->compressed_next_offset = -1;
+
+    /* Handing the work to another thread only pays off if it can run on
+     * another CPU; the readahead still overlaps the reads otherwise */
+    s->compressed_threads = true;
+#ifdef _SC_NPROCESSORS_ONLN
+    s->compressed_threads = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+#endif
+}
+
+void qcow2_compressed_cache_destroy(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    assert(s->compressed_in_flight == 0);
+    for (i = 0; s->compressed_cache && i < s->compressed_cache_size; i++) {
+        g_free(s->compressed_cache[i].data);
+    }
+    g_free(s->compressed_cache);
+    s->compressed_cache = NULL;
+}
+
+/*
+ * Must be called before a host cluster that may have held compressed data
+ * can be written to. Clusters that are being loaded are still handed to the
+ * requests that wait for them, but are not found by later lookups.
+ */
+void qcow2_compressed_cache_invalidate(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        s->compressed_cache[i].l2_entry = 0;
+    }
+}
+
+static Qcow2CompressedCluster *compressed_cache_find(BDRVQcow2State *s,
+                                                     uint64_t l2_entry)
+{
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        if (s->compressed_cache[i].l2_entry == l2_entry) {
+            return &s->compressed_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the least recently used entry that nobody uses, set up for loading
+ * the cluster with L2 entry @l2_entry, or NULL if there is no such entry.
+ */
+static Qcow2CompressedCluster *compressed_cache_claim(BDRVQcow2State *s,
+                                                      uint64_t l2_entry)
+{
+    Qcow2CompressedCluster *c = NULL;
+    int i;
+
+    for (i = 0; i < s->compressed_cache_size; i++) {
+        Qcow2CompressedCluster *e = &s->compressed_cache[i];
+
+        if (!e->loading && !e->refcnt &&
+            (!c || e->lru_counter < c->lru_counter)) {
+            c = e;
+        }
+    }
+    if (!c) {
+        return NULL;
+    }
+
+    if (!c->data) {
+        c->data = g_try_malloc(s->cluster_size);
+        if (!c->data) {
+            return NULL;
+        }
+    }
+
+    c->l2_entry = l2_entry;
+    c->loading = true;
+    c->ret = 0;
+    c->refcnt = 1;
+    return c;
+}
+
+static int decompress_worker(void *opaque)
+{
+    Qcow2DecompressData *data = opaque;
+
+    return decompress_buffer(data->dest, data->dest_size,
+                             data->src, data->src_size);
+}
+
+/*
+ * Reads the compressed cluster described by @l2_entry and decompresses it
+ * into @c->data, in the thread pool if there is more than one CPU. Must be
+ * called without s->lock.
+ */
+static void coroutine_fn compressed_cache_load(BlockDriverState *bs,
+                                               Qcow2CompressedCluster *c,
+                                               uint64_t l2_entry)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
+    Qcow2DecompressData data;
+    ThreadPool *pool;
     uint64_t coffset;
+    int nb_csectors, csize;
+    uint8_t *buf;
+    int ret;
 
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data,
-                        nb_csectors);
-        if (ret < 0) {
-            return ret;
+    coffset = l2_entry & s->cluster_offset_mask;
+    nb_csectors = ((l2_entry >> s->csize_shift) & s->csize_mask) + 1;
+    csize = nb_csectors * BDRV_SECTOR_SIZE - (coffset & 511);
+
+    buf = g_try_malloc(csize);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_pread(bs->file, coffset, buf, csize);
+    if (ret < 0) {
+        goto out;
+    }
+
+    data = (Qcow2DecompressData) {
+        .dest       = c->data,
+        .dest_size  = s->cluster_size,
+        .src        = buf,
+        .src_size   = csize,
+    };
+    if (s->compressed_threads) {
+        pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        ret = thread_pool_submit_co(pool, decompress_worker, &data);
+    } else {
+        ret = decompress_worker(&data);
+    }
+    ret = ret < 0 ? -EIO : 0;
+
+out:
+    g_free(buf);
+    trace_qcow2_load_compressed(qemu_coroutine_self(), coffset, ret);
+    c->ret = ret;
+    c->loading = false;
+    c->lru_counter = ++s->compressed_lru_counter;
+    qemu_co_queue_restart_all(&c->waiters);
+}
+
+static void coroutine_fn compressed_readahead_entry(void *opaque)
+{
+    Qcow2ReadaheadCo *r = opaque;
+    BDRVQcow2State *s = r->bs->opaque;
+
+    compressed_cache_load(r->bs, r->c, r->c->l2_entry);
+    r->c->refcnt--;
+
+    s->compressed_in_flight--;
+    g_free(r);
+}
+
+/*
+ * Starts loading the compressed clusters that follow guest offset @offset,
+ * up to the first one that is not compressed. Must be called with s->lock
+ * held.
+ */
+static void coroutine_fn compressed_readahead(BlockDriverState *bs,
+                                              uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t end = bs->total_sectors * BDRV_SECTOR_SIZE;
+    uint64_t l2_entry;
+    unsigned int bytes;
+    Qcow2CompressedCluster *c;
+    Qcow2ReadaheadCo *r;
+    Coroutine *co;
+    int i, ret;
+
+    offset = start_of_cluster(s, offset);
+    for (i = 1; i <= s->compressed_readahead; i++) {
+        if (s->compressed_in_flight >= s->compressed_readahead ||
+            offset + i * s->cluster_size >= end) {
+            break;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -EIO;
+
+        bytes = s->cluster_size;
+        ret = qcow2_get_cluster_offset(bs, offset + i * s->cluster_size,
+                                       &bytes, &l2_entry);
+        if (ret != QCOW2_CLUSTER_COMPRESSED) {
+            break;
+        }
+        if (compressed_cache_find(s, l2_entry)) {
+            continue;
         }
-        s->cluster_cache_offset = coffset;
+
+        c = compressed_cache_claim(s, l2_entry);
+        if (!c) {
+            break;
+        }
+
+        r = g_new(Qcow2ReadaheadCo, 1);
+        *r = (Qcow2ReadaheadCo) {
+            .bs = bs,
+            .c  = c,
+        };
+        s->compressed_in_flight++;
+        co = qemu_coroutine_create(compressed_readahead_entry, r);
+        qemu_coroutine_enter(co);
     }
-    return 0;
+}
+
+/*
+ * Reads qiov->size bytes at guest offset @offset from the compressed cluster
+ * described by @l2_entry. Must be called with s->lock held, which is dropped
+ * while the cluster is loaded.
+ */
+int coroutine_fn qcow2_co_read_compressed(BlockDriverState *bs,
+                                          uint64_t offset,
+                                          uint64_t l2_entry,
+                                          QEMUIOVector *qiov)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCluster *c, tmp = { 0 };
+    bool sequential;
+    int ret;
+
+    sequential = start_of_cluster(s, offset) == s->compressed_next_offset ||
+                 start_of_cluster(s, offset) + s->cluster_size ==
+                 s->compressed_next_offset;
+    s->compressed_next_offset = start_of_cluster(s, offset) + s->cluster_size;
+
+    c = compressed_cache_find(s, l2_entry);
+    if (c && !c->loading && c->ret < 0) {
+        /* Try again instead of returning an old error */
+        c->l2_entry = 0;
+        c = NULL;
+    }
+    if (c) {
+        /* Keep the readahead from reusing the entry */
+        c->refcnt++;
+    }
+
+    if (sequential) {
+        compressed_readahead(bs, offset);
+    }
+
+    if (c) {
+        if (c->loading) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&c->waiters);
+            qemu_co_mutex_lock(&s->lock);
+        }
+    } else {
+        c = compressed_cache_claim(s, l2_entry);
+        if (!c) {
+            /* All entries are busy, use one outside of the cache */
+            c = &tmp;
+            qemu_co_queue_init(&c->waiters);
+            c->data = g_try_malloc(s->cluster_size);
+            if (!c->data) {
+                return -ENOMEM;
+            }
+            c->refcnt = 1;
+        }
+        qemu_co_mutex_unlock(&s->lock);
+        compressed_cache_load(bs, c, l2_entry);
+        qemu_co_mutex_lock(&s->lock);
+    }
+
+    ret = c->ret;
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, 0, c->data + offset_into_cluster(s, offset),
+                            qiov->size);
+        c->lru_counter = ++s->compressed_lru_counter;
+    }
+    c->refcnt--;
+
+    if (c == &tmp) {
+        g_free(tmp.data);
+    }
+    return ret;
 }
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1439,24 +2570,38 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
                              bool full_discard)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int l2_index;
     int ret;
     int i;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t old_l2_entry;
+        uint64_t old_l2_entry, old_l2_bitmap;
+        uint64_t new_l2_entry, new_l2_bitmap;
+
+        old_l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
 
-        old_l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        if (!full_discard && s->qcow_version >= 3) {
+            if (has_subclusters(s)) {
+                new_l2_entry = 0;
+                new_l2_bitmap = QCOW_L2_BITMAP_ALL_ZEROES;
+            } else {
+                new_l2_entry = QCOW_OFLAG_ZERO;
+                new_l2_bitmap = 0;
+            }
+        } else {
+            new_l2_entry = new_l2_bitmap = 0;
+        }
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1470,10 +2615,18 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
          *
          * If full_discard is true, the sector should not read back as zeroes,
          * but rather fall through to the backing file.
+         *
+         * With extended L2 entries, unallocated clusters may still have
+         * subclusters that read as zeroes; their bitmap must be updated.
          */
         switch (qcow2_get_cluster_type(old_l2_entry)) {
             case QCOW2_CLUSTER_UNALLOCATED:
-                if (full_discard || !bs->backing) {
+                if (has_subclusters(s)) {
+                    if (old_l2_bitmap == new_l2_bitmap ||
+                        (!full_discard && !bs->backing)) {
+                        continue;
+                    }
+                } else if (full_discard || !bs->backing) {
                     continue;
                 }
                 break;
@@ -1493,18 +2646,17 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         }
 
         /* First remove L2 entries */
-        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-        if (!full_discard && s->qcow_version >= 3) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
-        } else {
-            l2_table[l2_index + i] = cpu_to_be64(0);
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+        set_l2_entry(s, l2_slice, l2_index + i, new_l2_entry);
+        if (has_subclusters(s)) {
+            set_l2_bitmap(s, l2_slice, l2_index + i, new_l2_bitmap);
         }
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_l2_entry, 1, type);
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
     return nb_clusters;
 }
@@ -1559,43 +2711,106 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
                           uint64_t nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table;
+    uint64_t *l2_slice;
     int l2_index;
     int ret;
     int i;
 
-    ret = get_cluster_table(bs, offset, &l2_table, &l2_index);
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
     if (ret < 0) {
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_slice, l2_index + i);
 
-        /* Update L2 entries */
-        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+        /* Update L2 entries. With extended L2 entries, preallocated clusters
+         * keep their offset and only the bitmap marks them as zero. */
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
         if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_slice, l2_index + i,
+                         has_subclusters(s) ? 0 : QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
-        } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+        } else if (!has_subclusters(s)) {
+            set_l2_entry(s, l2_slice, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
+        }
+        if (has_subclusters(s)) {
+            set_l2_bitmap(s, l2_slice, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
         }
     }
 
-    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
 
     return nb_clusters;
 }
 
+/*
+ * Marks @nb_subclusters subclusters starting at @offset, which must all be in
+ * the same cluster, as reading as zeroes. Only for images with extended L2
+ * entries; whole clusters are handled by zero_single_l2().
+ *
+ * Returns -ENOTSUP for compressed clusters, which cannot be zeroed partially.
+ */
+static int zero_l2_subclusters(BlockDriverState *bs, uint64_t offset,
+                               unsigned nb_subclusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice;
+    uint64_t l2_entry, old_l2_bitmap, l2_bitmap;
+    int l2_index, ret, sc = offset_to_sc_index(s, offset);
+
+    assert(has_subclusters(s));
+    assert(offset_into_subcluster(s, offset) == 0);
+    assert(nb_subclusters > 0);
+    assert(sc + nb_subclusters <= s->subclusters_per_cluster);
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    switch (qcow2_get_cluster_type(l2_entry)) {
+    case QCOW2_CLUSTER_COMPRESSED:
+        ret = -ENOTSUP;
+        goto out;
+    case QCOW2_CLUSTER_NORMAL:
+    case QCOW2_CLUSTER_UNALLOCATED:
+        break;
+    default:
+        qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster entry found "
+                                "(guest offset: %#" PRIx64 ")", offset);
+        ret = -EIO;
+        goto out;
+    }
+
+    old_l2_bitmap = l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    l2_bitmap |= QCOW_OFLAG_SUB_ZERO_RANGE(sc, sc + nb_subclusters);
+    l2_bitmap &= ~QCOW_OFLAG_SUB_ALLOC_RANGE(sc, sc + nb_subclusters);
+    if (l2_bitmap != old_l2_bitmap) {
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+        set_l2_bitmap(s, l2_slice, l2_index, l2_bitmap);
+    }
+
+    ret = 0;
+out:
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+    return ret;
+}
+
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
+    uint64_t end_offset = offset + ((uint64_t) nb_sectors << BDRV_SECTOR_BITS);
+    uint64_t head = 0, tail = 0;
     uint64_t nb_clusters;
     int ret;
 
@@ -1604,11 +2819,29 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         return -ENOTSUP;
     }
 
-    /* Each L2 table is handled by its own loop iteration */
-    nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
+    /* With extended L2 entries, the parts of the request that don't cover a
+     * whole cluster are zeroed subcluster by subcluster */
+    if (has_subclusters(s)) {
+        head = MIN(end_offset, ROUND_UP(offset, s->cluster_size)) - offset;
+        if (offset + head < end_offset) {
+            tail = offset_into_cluster(s, end_offset);
+        }
+        end_offset -= tail;
+    }
 
     s->cache_discards = true;
 
+    if (head) {
+        ret = zero_l2_subclusters(bs, offset, size_to_subclusters(s, head));
+        if (ret < 0) {
+            goto fail;
+        }
+        offset += head;
+    }
+
+    /* Each L2 table is handled by its own loop iteration */
+    nb_clusters = size_to_clusters(s, end_offset - offset);
+
     while (nb_clusters > 0) {
         ret = zero_single_l2(bs, offset, nb_clusters);
         if (ret < 0) {
@@ -1619,6 +2852,13 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
         offset += (ret * s->cluster_size);
     }
 
+    if (tail) {
+        ret = zero_l2_subclusters(bs, end_offset, size_to_subclusters(s, tail));
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     ret = 0;
 fail:
     s->cache_discards = false;
@@ -1643,22 +2883,25 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
 {
     BDRVQcow2State *s = bs->opaque;
     bool is_active_l1 = (l1_table == s->l1_table);
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
+    unsigned slice, slice_size2, n_slices;
     int ret;
     int i, j;
 
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
+
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
-        l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
-        if (l2_table == NULL) {
+        l2_slice = qemu_try_blockalign(bs->file->bs, slice_size2);
+        if (l2_slice == NULL) {
             return -ENOMEM;
         }
     }
 
     for (i = 0; i < l1_size; i++) {
         uint64_t l2_offset = l1_table[i] & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
         uint64_t l2_refcount;
 
         if (!l2_offset) {
@@ -1678,123 +2921,132 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             goto fail;
         }
 
-        if (is_active_l1) {
-            /* get active L2 tables from cache */
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                    (void **)&l2_table);
-        } else {
-            /* load inactive L2 tables from disk */
-            ret = bdrv_read(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                            (void *)l2_table, s->cluster_sectors);
-        }
-        if (ret < 0) {
-            goto fail;
-        }
-
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &l2_refcount);
         if (ret < 0) {
             goto fail;
         }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            int64_t offset = l2_entry & L2E_OFFSET_MASK;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
-            bool preallocated = offset != 0;
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t slice_offset = l2_offset + slice * slice_size2;
+            bool l2_dirty = false;
 
-            if (cluster_type != QCOW2_CLUSTER_ZERO) {
-                continue;
+            if (is_active_l1) {
+                /* get active L2 tables from cache */
+                ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                                      (void **)&l2_slice);
+            } else {
+                /* load inactive L2 tables from disk */
+                ret = bdrv_pread(bs->file, slice_offset, l2_slice,
+                                 slice_size2);
             }
+            if (ret < 0) {
+                goto fail;
+            }
+
+            for (j = 0; j < s->l2_slice_size; j++) {
+                uint64_t l2_entry = get_l2_entry(s, l2_slice, j);
+                int64_t offset = l2_entry & L2E_OFFSET_MASK;
+                int cluster_type = qcow2_get_cluster_type(l2_entry);
+                bool preallocated = offset != 0;
 
-            if (!preallocated) {
-                if (!bs->backing) {
-                    /* not backed; therefore we can simply deallocate the
-                     * cluster */
-                    l2_table[j] = 0;
-                    l2_dirty = true;
+                if (cluster_type != QCOW2_CLUSTER_ZERO) {
                     continue;
                 }
 
-                offset = qcow2_alloc_clusters(bs, s->cluster_size);
-                if (offset < 0) {
-                    ret = offset;
-                    goto fail;
-                }
+                if (!preallocated) {
+                    if (!bs->backing) {
+                        /* not backed; therefore we can simply deallocate the
+                         * cluster */
+                        set_l2_entry(s, l2_slice, j, 0);
+                        l2_dirty = true;
+                        continue;
+                    }
 
-                if (l2_refcount > 1) {
-                    /* For shared L2 tables, set the refcount accordingly (it is
-                     * already 1 and needs to be l2_refcount) */
-                    ret = qcow2_update_cluster_refcount(bs,
-                            offset >> s->cluster_bits,
-                            refcount_diff(1, l2_refcount), false,
-                            QCOW2_DISCARD_OTHER);
-                    if (ret < 0) {
-                        qcow2_free_clusters(bs, offset, s->cluster_size,
-                                            QCOW2_DISCARD_OTHER);
+                    offset = qcow2_alloc_clusters(bs, s->cluster_size);
+                    if (offset < 0) {
+                        ret = offset;
                         goto fail;
                     }
+
+                    if (l2_refcount > 1) {
+                        /* For shared L2 tables, set the refcount accordingly
+                         * (it is already 1 and needs to be l2_refcount) */
+                        ret = qcow2_update_cluster_refcount(bs,
+                                offset >> s->cluster_bits,
+                                refcount_diff(1, l2_refcount), false,
+                                QCOW2_DISCARD_OTHER);
+                        if (ret < 0) {
+                            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                                QCOW2_DISCARD_OTHER);
+                            goto fail;
+                        }
+                    }
                 }
-            }
 
-            if (offset_into_cluster(s, offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset "
-                                        "%#" PRIx64 " unaligned (L2 offset: %#"
-                                        PRIx64 ", L2 index: %#x)", offset,
-                                        l2_offset, j);
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                if (offset_into_cluster(s, offset)) {
+                    int l2_index = slice * s->l2_slice_size + j;
+                    qcow2_signal_corruption(bs, true, -1, -1,
+                                            "Data cluster offset %#" PRIx64
+                                            " unaligned (L2 offset: %#"
+                                            PRIx64 ", L2 index: %#x)", offset,
+                                            l2_offset, l2_index);
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    ret = -EIO;
+                    goto fail;
                 }
-                ret = -EIO;
-                goto fail;
-            }
 
-            ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                                    s->cluster_size);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            ret = bdrv_pwrite_zeroes(bs->file, offset, s->cluster_size, 0);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = bdrv_pwrite_zeroes(bs->file, offset, s->cluster_size, 0);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
-            } else {
-                l2_table[j] = cpu_to_be64(offset);
+                if (l2_refcount == 1) {
+                    set_l2_entry(s, l2_slice, j, offset | QCOW_OFLAG_COPIED);
+                } else {
+                    set_l2_entry(s, l2_slice, j, offset);
+                }
+                l2_dirty = true;
             }
-            l2_dirty = true;
-        }
 
-        if (is_active_l1) {
-            if (l2_dirty) {
-                qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-                qcow2_cache_depends_on_flush(s->l2_table_cache);
-            }
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
-        } else {
-            if (l2_dirty) {
-                ret = qcow2_pre_write_overlap_check(bs,
-                        QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
-                        s->cluster_size);
-                if (ret < 0) {
-                    goto fail;
+            if (is_active_l1) {
+                if (l2_dirty) {
+                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                 l2_slice);
+                    qcow2_cache_depends_on_flush(s->l2_table_cache);
                 }
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
+            } else {
+                if (l2_dirty) {
+                    ret = qcow2_pre_write_overlap_check(bs,
+                            QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2,
+                            slice_offset, slice_size2);
+                    if (ret < 0) {
+                        goto fail;
+                    }
 
-                ret = bdrv_write(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                                 (void *)l2_table, s->cluster_sectors);
-                if (ret < 0) {
-                    goto fail;
+                    ret = bdrv_pwrite(bs->file, slice_offset,
+                                      l2_slice, slice_size2);
+                    if (ret < 0) {
+                        goto fail;
+                    }
                 }
             }
         }
@@ -1808,11 +3060,11 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     ret = 0;
 
 fail:
-    if (l2_table) {
+    if (l2_slice) {
         if (!is_active_l1) {
-            qemu_vfree(l2_table);
+            qemu_vfree(l2_slice);
         } else {
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
         }
     }
     return ret;
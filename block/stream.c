@@ -31,14 +31,51 @@ enum {
 
 #define SLICE_TIME 100000000ULL /* ns */
 
+#define STREAM_MAX_WORKERS 64
+
 typedef struct StreamBlockJob {
     BlockJob common;
     RateLimit limit;
     BlockDriverState *base;
     BlockdevOnError on_error;
     char *backing_file_str;
+
+    /* Background copy workers, in the order they were started */
+    QTAILQ_HEAD(, StreamWorker) workers;
+    int max_workers;
+    int in_flight;
+    bool waiting_for_io;
+
+    /* Everything below this sector has been handed to a worker or skipped */
+    int64_t next_sector;
+
+    /* first worker error, the job decides what to do about it */
+    int worker_ret;
+    int64_t worker_error_sector;
 } StreamBlockJob;
 
+typedef struct StreamWorker {
+    StreamBlockJob *job;
+    int64_t sector_num;
+    int nb_sectors;
+    QTAILQ_ENTRY(StreamWorker) next;
+} StreamWorker;
+
+/* Workers complete out of order, so the progress that is published is the
+ * point below which all of the image has been streamed.  This is also where
+ * the job resumes after an error with the 'stop' action.
+ */
+static void stream_update_progress(StreamBlockJob *s)
+{
+    StreamWorker *w = QTAILQ_FIRST(&s->workers);
+    int64_t done = MIN(s->next_sector, s->worker_error_sector);
+
+    if (w) {
+        done = MIN(done, w->sector_num);
+    }
+    s->common.offset = MAX(s->common.offset, done * BDRV_SECTOR_SIZE);
+}
+
 static int coroutine_fn stream_populate(BlockBackend *blk,
                                         int64_t sector_num, int nb_sectors,
                                         void *buf)
@@ -56,6 +93,72 @@ static int coroutine_fn stream_populate(BlockBackend *blk,
                          BDRV_REQ_COPY_ON_READ);
 }
 
+static void coroutine_fn stream_worker_entry(void *opaque)
+{
+    StreamWorker *w = opaque;
+    StreamBlockJob *s = w->job;
+    BlockBackend *blk = s->common.blk;
+    void *buf;
+    int ret;
+
+    buf = qemu_try_blockalign(blk_bs(blk), w->nb_sectors * BDRV_SECTOR_SIZE);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+    } else {
+        ret = stream_populate(blk, w->sector_num, w->nb_sectors, buf);
+        qemu_vfree(buf);
+    }
+
+    if (ret < 0) {
+        if (s->worker_ret == 0) {
+            s->worker_ret = ret;
+        }
+        s->worker_error_sector = MIN(s->worker_error_sector, w->sector_num);
+    }
+
+    QTAILQ_REMOVE(&s->workers, w, next);
+    stream_update_progress(s);
+    g_free(w);
+    s->in_flight--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+}
+
+/* Wait until no more than @max_in_flight workers are running */
+static void coroutine_fn stream_wait_for_workers(StreamBlockJob *s,
+                                                 int max_in_flight)
+{
+    while (s->in_flight > max_in_flight) {
+        s->waiting_for_io = true;
+        qemu_coroutine_yield();
+        s->waiting_for_io = false;
+    }
+}
+
+static void coroutine_fn stream_start_worker(StreamBlockJob *s,
+                                             int64_t sector_num,
+                                             int nb_sectors)
+{
+    StreamWorker *w;
+    Coroutine *co;
+
+    stream_wait_for_workers(s, s->max_workers - 1);
+
+    w = g_new(StreamWorker, 1);
+    *w = (StreamWorker) {
+        .job        = s,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+    };
+
+    QTAILQ_INSERT_TAIL(&s->workers, w, next);
+    s->in_flight++;
+    trace_stream_worker_start(s, sector_num, nb_sectors, s->in_flight);
+    co = qemu_coroutine_create(stream_worker_entry, w);
+    qemu_coroutine_enter(co);
+}
+
 typedef struct {
     int ret;
     bool reached_end;
@@ -93,13 +196,13 @@ static void coroutine_fn stream_run(void *opaque)
     BlockBackend *blk = s->common.blk;
     BlockDriverState *bs = blk_bs(blk);
     BlockDriverState *base = s->base;
+    BlockErrorAction action;
     int64_t sector_num = 0;
     int64_t end = -1;
     uint64_t delay_ns = 0;
     int error = 0;
     int ret = 0;
     int n = 0;
-    void *buf;
 
     if (!bs->backing) {
         goto out;
@@ -112,7 +215,6 @@ static void coroutine_fn stream_run(void *opaque)
     }
 
     end = s->common.len >> BDRV_SECTOR_BITS;
-    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
 
     /* Turn on copy-on-read for the whole block device so that guest read
      * requests help us make progress.  Only do this when copying the entire
@@ -123,11 +225,43 @@ static void coroutine_fn stream_run(void *opaque)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for (sector_num = 0; sector_num < end; sector_num += n) {
+    /* Chunks that need copying are handed to up to max_workers coroutines.
+     * On an error, wait for all of them before applying the error action;
+     * 'stop' resumes from the first chunk that failed.
+     */
+    QTAILQ_INIT(&s->workers);
+    s->next_sector = 0;
+    s->worker_ret = 0;
+    s->worker_error_sector = INT64_MAX;
+
+    for (;;) {
         bool copy;
 
+        if (s->worker_ret < 0 || sector_num >= end) {
+            stream_wait_for_workers(s, 0);
+            if (s->worker_ret == 0) {
+                break;
+            }
+
+            action = block_job_error_action(&s->common, s->on_error, true,
+                                            -s->worker_ret);
+            if (action == BLOCK_ERROR_ACTION_STOP) {
+                sector_num = s->worker_error_sector;
+                s->next_sector = sector_num;
+            } else if (error == 0) {
+                error = s->worker_ret;
+            }
+            s->worker_ret = 0;
+            s->worker_error_sector = INT64_MAX;
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                break;
+            }
+            stream_update_progress(s);
+            continue;
+        }
+
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that bdrv_drain_all() returns.
          */
         block_job_sleep_ns(&s->common, QEMU_CLOCK_REALTIME, delay_ns);
         if (block_job_is_cancelled(&s->common)) {
@@ -154,32 +288,27 @@ static void coroutine_fn stream_run(void *opaque)
             copy = (ret == 1);
         }
         trace_stream_one_iteration(s, sector_num, n, ret);
-        if (copy) {
-            ret = stream_populate(blk, sector_num, n, buf);
-        }
         if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error, true, -ret);
-            if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
-                continue;
-            }
-            if (error == 0) {
-                error = ret;
-            }
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                break;
-            }
+            /* Treat a failed allocation lookup like a failed copy */
+            s->worker_ret = ret;
+            s->worker_error_sector = sector_num;
+            continue;
         }
         ret = 0;
 
-        /* Publish progress */
-        s->common.offset += n * BDRV_SECTOR_SIZE;
-        if (copy && s->common.speed) {
-            delay_ns = ratelimit_calculate_delay(&s->limit, n);
+        if (copy) {
+            stream_start_worker(s, sector_num, n);
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit, n);
+            }
         }
+        sector_num += n;
+        s->next_sector = sector_num;
+        stream_update_progress(s);
     }
 
+    stream_wait_for_workers(s, 0);
+
     if (!base) {
         bdrv_disable_copy_on_read(bs);
     }
@@ -187,8 +316,6 @@ static void coroutine_fn stream_run(void *opaque)
     /* Do not remove the backing file if an error was there but ignored.  */
     ret = error;
 
-    qemu_vfree(buf);
-
 out:
     /* Modify backing chain and close BDSes in main loop */
     data = g_malloc(sizeof(*data));
@@ -217,10 +344,17 @@ static const BlockJobDriver stream_job_driver = {
 void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
                   int64_t speed, BlockdevOnError on_error,
+                  int64_t max_workers,
                   BlockCompletionFunc *cb, void *opaque, Error **errp)
 {
     StreamBlockJob *s;
 
+    if (max_workers < 1 || max_workers > STREAM_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(STREAM_MAX_WORKERS));
+        return;
+    }
+
     s = block_job_create(job_id, &stream_job_driver, bs, speed,
                          cb, opaque, errp);
     if (!s) {
@@ -231,6 +365,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     s->backing_file_str = g_strdup(backing_file_str);
 
     s->on_error = on_error;
+    s->max_workers = max_workers;
     s->common.co = qemu_coroutine_create(stream_run, s);
     trace_stream_start(bs, base, s, s->common.co, opaque);
     qemu_coroutine_enter(s->common.co);
@@ -52,15 +52,31 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BlockBackend's timers only after verifying that
  * that BlockBackend has throttled requests in the queue.
+ *
+ * The members of a group can be in different AioContexts. A thread
+ * never resumes the throttled requests of another BlockBackend
+ * directly: it arms that BlockBackend's timer instead, and the
+ * requests are restarted from the timer callback, which runs in the
+ * BlockBackend's own AioContext. The only lock that is shared by the
+ * members is tg->lock, which is never held while a request runs.
+ *
+ * The next BlockBackend to be scheduled is chosen with weighted fair
+ * queuing: each member has a virtual time that advances by the size
+ * of its requests divided by its weight, and among the members with
+ * queued requests the one with the lowest virtual time goes first.
+ * A member that has been idle starts again at the group's current
+ * virtual time so it can't use the time it spent idle to starve the
+ * others.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockBackendPublic) head;
     BlockBackend *tokens[2];
     bool any_timer_armed[2];
+    uint64_t vclock[2]; /* virtual time of the last scheduled request */
 
     /* These two are protected by the global throttle_groups_lock */
     unsigned refcount;
@@ -168,8 +184,22 @@ static BlockBackend *throttle_group_next_blk(BlockBackend *blk)
     return blk_by_public(next);
 }
 
-/* Return the next BlockBackend in the round-robin sequence with pending I/O
- * requests.
+/* Return the virtual time at which the next request of a BlockBackend
+ * would start.
+ *
+ * This assumes that tg->lock is held.
+ */
+static uint64_t throttle_group_start_vtime(ThrottleGroup *tg,
+                                           BlockBackendPublic *blkp,
+                                           bool is_write)
+{
+    return MAX(blkp->throttle_vtime[is_write], tg->vclock[is_write]);
+}
+
+/* Return the next BlockBackend that should be allowed to do I/O: the one
+ * with the lowest virtual time among those with pending I/O requests. The
+ * members are visited in round-robin order starting after the current
+ * token, so members with the same virtual time take turns.
  *
  * This assumes that tg->lock is held.
  *
@@ -182,25 +212,32 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
 {
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
-    BlockBackend *token, *start;
+    BlockBackend *token, *start, *best = NULL;
+    uint64_t vtime, best_vtime = 0;
 
     start = token = tg->tokens[is_write];
 
-    /* get next bs round in round robin style */
-    token = throttle_group_next_blk(token);
-    while (token != start && !blkp->pending_reqs[is_write]) {
+    do {
         token = throttle_group_next_blk(token);
-    }
+        if (blk_get_public(token)->pending_reqs[is_write]) {
+            vtime = throttle_group_start_vtime(tg, blk_get_public(token),
+                                               is_write);
+            if (!best || vtime < best_vtime) {
+                best = token;
+                best_vtime = vtime;
+            }
+        }
+    } while (token != start);
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current bs because chances are
-     * the current bs get the current request queued.
+    /* If no IO are queued for scheduling then decide the token is the
+     * current bs because chances are the current bs get the current
+     * request queued.
      */
-    if (token == start && !blkp->pending_reqs[is_write]) {
-        token = blk;
+    if (!best) {
+        best = blk;
     }
 
-    return token;
+    return best;
 }
 
 /* Check if the next I/O request for a BlockBackend needs to be throttled or
@@ -257,7 +294,7 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 
     /* Check if there's any pending request to schedule next */
     token = next_throttle_token(blk, is_write);
-    if (!blkp->pending_reqs[is_write]) {
+    if (!blk_get_public(token)->pending_reqs[is_write]) {
         return;
     }
 
@@ -267,13 +304,14 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
         /* Give preference to requests from the current blk */
-        if (qemu_in_coroutine() &&
+        if (qemu_in_coroutine() && token == blk &&
             qemu_co_queue_next(&blkp->throttled_reqs[is_write])) {
             token = blk;
         } else {
-            ThrottleTimers *tt = &blkp->throttle_timers;
+            /* Let the token's own AioContext resume its request */
+            ThrottleTimers *tt = &blk_get_public(token)->throttle_timers;
             int64_t now = qemu_clock_get_ns(tt->clock_type);
-            timer_mod(tt->timers[is_write], now + 1);
+            timer_mod(tt->timers[is_write], now);
             tg->any_timer_armed[is_write] = true;
         }
         tg->tokens[is_write] = token;
@@ -294,6 +332,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
 {
     bool must_wait;
     BlockBackend *token;
+    uint64_t vtime;
 
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
@@ -305,16 +344,29 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || blkp->pending_reqs[is_write]) {
+        QEMUClockType clock_type = blkp->throttle_timers.clock_type;
+        int64_t start = qemu_clock_get_ns(clock_type);
+
         blkp->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_queue_wait(&blkp->throttled_reqs[is_write]);
         qemu_mutex_lock(&tg->lock);
         blkp->pending_reqs[is_write]--;
+
+        blkp->throttled_reqs_count[is_write]++;
+        blkp->throttle_wait_ns[is_write] +=
+            qemu_clock_get_ns(clock_type) - start;
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(blkp->throttle_state, is_write, bytes);
 
+    /* Advance the virtual time of this BlockBackend */
+    vtime = throttle_group_start_vtime(tg, blkp, is_write);
+    tg->vclock[is_write] = vtime;
+    blkp->throttle_vtime[is_write] = vtime + (uint64_t) MAX(bytes, 1) *
+        THROTTLE_GROUP_WEIGHT_DEFAULT / blkp->throttle_weight;
+
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
 
@@ -378,6 +430,143 @@ void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the weight of a BlockBackend in its throttling group
+ *
+ * @blk:    a BlockBackend that is a member of a group
+ * @weight: the new weight, between 1 and THROTTLE_GROUP_WEIGHT_MAX
+ */
+void throttle_group_set_weight(BlockBackend *blk, unsigned int weight)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+
+    assert(weight >= 1 && weight <= THROTTLE_GROUP_WEIGHT_MAX);
+
+    qemu_mutex_lock(&tg->lock);
+    blkp->throttle_weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+/* Get the weight of a BlockBackend in its throttling group
+ *
+ * @blk: a BlockBackend that is a member of a group
+ * @ret: the weight
+ */
+unsigned int throttle_group_get_weight(BlockBackend *blk)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    unsigned int weight;
+
+    qemu_mutex_lock(&tg->lock);
+    weight = blkp->throttle_weight;
+    qemu_mutex_unlock(&tg->lock);
+
+    return weight;
+}
+
+/* Return how much I/O can still be done at the burst rate of a bucket
+ *
+ * @bkt:      the leaky bucket
+ * @delta_ns: the time elapsed since the bucket last leaked
+ * @ret:      the remaining burst credit, in the units of the bucket
+ */
+static int64_t throttle_bucket_credit(LeakyBucket *bkt, int64_t delta_ns)
+{
+    LeakyBucket leaked = *bkt;
+
+    if (delta_ns > 0) {
+        throttle_leak_bucket(&leaked, delta_ns);
+    }
+    return MAX(leaked.max * leaked.burst_length - leaked.level, 0);
+}
+
+/* Fill in the information about a throttling group
+ *
+ * This assumes that tg->lock is held.
+ */
+static ThrottleGroupInfo *throttle_group_info(ThrottleGroup *tg)
+{
+    ThrottleGroupInfo *info = g_new0(ThrottleGroupInfo, 1);
+    ThrottleGroupMemberInfoList **p_next = &info->members;
+    BlockBackendPublic *blkp;
+    LeakyBucket *buckets = tg->ts.cfg.buckets;
+    QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
+    int64_t delta_ns;
+
+    info->name = g_strdup(tg->name);
+
+    QLIST_FOREACH(blkp, &tg->head, round_robin) {
+        ThrottleGroupMemberInfoList *entry;
+        ThrottleGroupMemberInfo *m = g_new0(ThrottleGroupMemberInfo, 1);
+
+        *m = (ThrottleGroupMemberInfo) {
+            .device         = g_strdup(blk_name(blk_by_public(blkp))),
+            .weight         = blkp->throttle_weight,
+            .rd_queued      = blkp->pending_reqs[0],
+            .wr_queued      = blkp->pending_reqs[1],
+            .rd_throttled   = blkp->throttled_reqs_count[0],
+            .wr_throttled   = blkp->throttled_reqs_count[1],
+            .rd_wait_ns     = blkp->throttle_wait_ns[0],
+            .wr_wait_ns     = blkp->throttle_wait_ns[1],
+        };
+        clock_type = blkp->throttle_timers.clock_type;
+
+        entry = g_new0(ThrottleGroupMemberInfoList, 1);
+        entry->value = m;
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+
+    delta_ns = qemu_clock_get_ns(clock_type) - tg->ts.previous_leak;
+
+    info->has_bps_credit = buckets[THROTTLE_BPS_TOTAL].avg > 0;
+    info->bps_credit =
+        throttle_bucket_credit(&buckets[THROTTLE_BPS_TOTAL], delta_ns);
+    info->has_bps_rd_credit = buckets[THROTTLE_BPS_READ].avg > 0;
+    info->bps_rd_credit =
+        throttle_bucket_credit(&buckets[THROTTLE_BPS_READ], delta_ns);
+    info->has_bps_wr_credit = buckets[THROTTLE_BPS_WRITE].avg > 0;
+    info->bps_wr_credit =
+        throttle_bucket_credit(&buckets[THROTTLE_BPS_WRITE], delta_ns);
+    info->has_iops_credit = buckets[THROTTLE_OPS_TOTAL].avg > 0;
+    info->iops_credit =
+        throttle_bucket_credit(&buckets[THROTTLE_OPS_TOTAL], delta_ns);
+    info->has_iops_rd_credit = buckets[THROTTLE_OPS_READ].avg > 0;
+    info->iops_rd_credit =
+        throttle_bucket_credit(&buckets[THROTTLE_OPS_READ], delta_ns);
+    info->has_iops_wr_credit = buckets[THROTTLE_OPS_WRITE].avg > 0;
+    info->iops_wr_credit =
+        throttle_bucket_credit(&buckets[THROTTLE_OPS_WRITE], delta_ns);
+
+    return info;
+}
+
+/* Return information about all throttling groups and their members
+ *
+ * @ret: the list of groups, in the order in which they were created
+ */
+ThrottleGroupInfoList *throttle_group_query_all(void)
+{
+    ThrottleGroupInfoList *head = NULL, **p_next = &head;
+    ThrottleGroup *tg;
+
+    qemu_mutex_lock(&throttle_groups_lock);
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        ThrottleGroupInfoList *entry = g_new0(ThrottleGroupInfoList, 1);
+
+        qemu_mutex_lock(&tg->lock);
+        entry->value = throttle_group_info(tg);
+        qemu_mutex_unlock(&tg->lock);
+
+        *p_next = entry;
+        p_next = &entry->next;
+    }
+    qemu_mutex_unlock(&throttle_groups_lock);
+
+    return head;
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -450,6 +639,15 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
 
     QLIST_INSERT_HEAD(&tg->head, blkp, round_robin);
 
+    if (!blkp->throttle_weight) {
+        blkp->throttle_weight = THROTTLE_GROUP_WEIGHT_DEFAULT;
+    }
+    for (i = 0; i < 2; i++) {
+        blkp->throttle_vtime[i] = tg->vclock[i];
+        blkp->throttled_reqs_count[i] = 0;
+        blkp->throttle_wait_ns[i] = 0;
+    }
+
     throttle_timers_init(&blkp->throttle_timers,
                          blk_get_aio_context(blk),
                          clock_type,
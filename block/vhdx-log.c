@@ -466,8 +466,8 @@ static int vhdx_log_flush_desc(BlockDriverState *bs, VHDXLogDescriptor *desc,
 
     /* count is only > 1 if we are writing zeroes */
     for (i = 0; i < count; i++) {
-        ret = bdrv_pwrite_sync(bs->file, file_offset, buffer,
-                               VHDX_LOG_SECTOR_SIZE);
+        ret = bdrv_pwrite(bs->file, file_offset, buffer,
+                          VHDX_LOG_SECTOR_SIZE);
         if (ret < 0) {
             goto exit;
         }
@@ -834,23 +834,16 @@ static void vhdx_log_raw_to_le_sector(VHDXLogDescriptor *desc,
 }
 
 
+/* Writes a log entry that updates 'count' 4KB sectors of the image file */
 static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
-                          void *data, uint32_t length, uint64_t offset)
+                          void *sectors, uint64_t *file_offsets,
+                          uint32_t count)
 {
     int ret = 0;
     void *buffer = NULL;
-    void *merged_sector = NULL;
-    void *data_tmp, *sector_write;
     unsigned int i;
-    int sector_offset;
-    uint32_t desc_sectors, sectors, total_length;
+    uint32_t desc_sectors, total_length;
     uint32_t sectors_written = 0;
-    uint32_t aligned_length;
-    uint32_t leading_length = 0;
-    uint32_t trailing_length = 0;
-    uint32_t partial_sectors = 0;
-    uint32_t bytes_written = 0;
-    uint64_t file_offset;
     VHDXHeader *header;
     VHDXLogEntryHeader new_hdr;
     VHDXLogDescriptor *new_desc = NULL;
@@ -859,9 +852,11 @@ static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
 
     header = s->headers[s->curr_header];
 
-    /* need to have offset read data, and be on 4096 byte boundary */
+    desc_sectors = vhdx_compute_desc_sectors(count);
+    total_length = (desc_sectors + count) * VHDX_LOG_SECTOR_SIZE;
 
-    if (length > header->log_length) {
+    /* the log is a circular buffer with one sector always left open */
+    if (total_length >= header->log_length) {
         /* no log present.  we could create a log here instead of failing */
         ret = -EINVAL;
         goto exit;
@@ -883,103 +878,46 @@ static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
         s->log.sequence = 1;
     }
 
-    sector_offset = offset % VHDX_LOG_SECTOR_SIZE;
-    file_offset = (offset / VHDX_LOG_SECTOR_SIZE) * VHDX_LOG_SECTOR_SIZE;
-
-    aligned_length = length;
-
-    /* add in the unaligned head and tail bytes */
-    if (sector_offset) {
-        leading_length = (VHDX_LOG_SECTOR_SIZE - sector_offset);
-        leading_length = leading_length > length ? length : leading_length;
-        aligned_length -= leading_length;
-        partial_sectors++;
-    }
-
-    sectors = aligned_length / VHDX_LOG_SECTOR_SIZE;
-    trailing_length = aligned_length - (sectors * VHDX_LOG_SECTOR_SIZE);
-    if (trailing_length) {
-        partial_sectors++;
-    }
-
-    sectors += partial_sectors;
-
-    /* sectors is now how many sectors the data itself takes, not
-     * including the header and descriptor metadata */
-
     new_hdr = (VHDXLogEntryHeader) {
                 .signature           = VHDX_LOG_SIGNATURE,
                 .tail                = s->log.tail,
                 .sequence_number     = s->log.sequence,
-                .descriptor_count    = sectors,
+                .descriptor_count    = count,
                 .reserved            = 0,
                 .flushed_file_offset = bdrv_getlength(bs->file->bs),
                 .last_file_offset    = bdrv_getlength(bs->file->bs),
               };
 
     new_hdr.log_guid = header->log_guid;
-
-    desc_sectors = vhdx_compute_desc_sectors(new_hdr.descriptor_count);
-
-    total_length = (desc_sectors + sectors) * VHDX_LOG_SECTOR_SIZE;
     new_hdr.entry_length = total_length;
 
     vhdx_log_entry_hdr_le_export(&new_hdr);
 
-    buffer = qemu_blockalign(bs, total_length);
+    buffer = qemu_try_blockalign(bs, total_length);
+    if (buffer == NULL) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+    memset(buffer, 0, desc_sectors * VHDX_LOG_SECTOR_SIZE);
     memcpy(buffer, &new_hdr, sizeof(new_hdr));
 
     new_desc = buffer + sizeof(new_hdr);
     data_sector = buffer + (desc_sectors * VHDX_LOG_SECTOR_SIZE);
-    data_tmp = data;
-
-    /* All log sectors are 4KB, so for any partial sectors we must
-     * merge the data with preexisting data from the final file
-     * destination */
-    merged_sector = qemu_blockalign(bs, VHDX_LOG_SECTOR_SIZE);
 
-    for (i = 0; i < sectors; i++) {
+    for (i = 0; i < count; i++) {
         new_desc->signature       = VHDX_LOG_DESC_SIGNATURE;
         new_desc->sequence_number = s->log.sequence;
-        new_desc->file_offset     = file_offset;
-
-        if (i == 0 && leading_length) {
-            /* partial sector at the front of the buffer */
-            ret = bdrv_pread(bs->file, file_offset, merged_sector,
-                             VHDX_LOG_SECTOR_SIZE);
-            if (ret < 0) {
-                goto exit;
-            }
-            memcpy(merged_sector + sector_offset, data_tmp, leading_length);
-            bytes_written = leading_length;
-            sector_write = merged_sector;
-        } else if (i == sectors - 1 && trailing_length) {
-            /* partial sector at the end of the buffer */
-            ret = bdrv_pread(bs->file,
-                            file_offset,
-                            merged_sector + trailing_length,
-                            VHDX_LOG_SECTOR_SIZE - trailing_length);
-            if (ret < 0) {
-                goto exit;
-            }
-            memcpy(merged_sector, data_tmp, trailing_length);
-            bytes_written = trailing_length;
-            sector_write = merged_sector;
-        } else {
-            bytes_written = VHDX_LOG_SECTOR_SIZE;
-            sector_write = data_tmp;
-        }
+        new_desc->file_offset     = file_offsets[i];
 
         /* populate the raw sector data into the proper structures,
          * as well as update the descriptor, and convert to proper
          * endianness */
-        vhdx_log_raw_to_le_sector(new_desc, data_sector, sector_write,
+        vhdx_log_raw_to_le_sector(new_desc, data_sector,
+                                  sectors + i * VHDX_LOG_SECTOR_SIZE,
                                   s->log.sequence);
 
-        data_tmp += bytes_written;
         data_sector++;
         new_desc++;
-        file_offset += VHDX_LOG_SECTOR_SIZE;
     }
 
     /* checksum covers entire entry, from the log header through the
@@ -989,12 +927,12 @@ static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
 
     /* now write to the log */
     ret = vhdx_log_write_sectors(bs, &s->log, &sectors_written, buffer,
-                                 desc_sectors + sectors);
+                                 desc_sectors + count);
     if (ret < 0) {
         goto exit;
     }
 
-    if (sectors_written != desc_sectors + sectors) {
+    if (sectors_written != desc_sectors + count) {
         /* instead of failing, we could flush the log here */
         ret = -EINVAL;
         goto exit;
@@ -1006,13 +944,16 @@ static int vhdx_log_write(BlockDriverState *bs, BDRVVHDXState *s,
 
 exit:
     qemu_vfree(buffer);
-    qemu_vfree(merged_sector);
     return ret;
 }
 
-/* Perform a log write, and then immediately flush the entire log */
+/* Perform a log write of 'count' 4KB sectors, which need not be contiguous
+ * in the file, and then immediately flush the entire log.  The new contents
+ * of the sectors are in 'sectors', one after the other, and file_offsets[i]
+ * is the file offset of sector i. */
 int vhdx_log_write_and_flush(BlockDriverState *bs, BDRVVHDXState *s,
-                             void *data, uint32_t length, uint64_t offset)
+                             void *sectors, uint64_t *file_offsets,
+                             uint32_t count)
 {
     int ret = 0;
     VHDXLogSequence logs = { .valid = true,
@@ -1023,7 +964,7 @@ int vhdx_log_write_and_flush(BlockDriverState *bs, BDRVVHDXState *s,
     /* Make sure data written (new and/or changed blocks) is stable
      * on disk, before creating log entry */
     bdrv_flush(bs);
-    ret = vhdx_log_write(bs, s, data, length, offset);
+    ret = vhdx_log_write(bs, s, sectors, file_offsets, count);
     if (ret < 0) {
         goto exit;
     }
@@ -1041,4 +982,3 @@ int vhdx_log_write_and_flush(BlockDriverState *bs, BDRVVHDXState *s,
 exit:
     return ret;
 }
-
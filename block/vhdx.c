@@ -903,6 +903,7 @@ static int vhdx_open(BlockDriverState *bs, QDict *options, int flags,
     s->first_visible_write = true;
 
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->bat_commit_queue);
     QLIST_INIT(&s->regions);
 
     /* validate the file signature */
@@ -1013,6 +1014,11 @@ fail:
     return ret;
 }
 
+static void vhdx_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    bs->bl.request_alignment = BDRV_SECTOR_SIZE; /* No sub-sector I/O */
+}
+
 static int vhdx_reopen_prepare(BDRVReopenState *state,
                                BlockReopenQueue *queue, Error **errp)
 {
@@ -1080,15 +1086,20 @@ static int vhdx_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 }
 
 
-static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
-                                      int nb_sectors, QEMUIOVector *qiov)
+static coroutine_fn int vhdx_co_preadv(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t bytes, QEMUIOVector *qiov,
+                                       int flags)
 {
     BDRVVHDXState *s = bs->opaque;
     int ret = 0;
     VHDXSectorInfo sinfo;
     uint64_t bytes_done = 0;
+    int64_t sector_num = offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = bytes >> BDRV_SECTOR_BITS;
     QEMUIOVector hd_qiov;
 
+    assert(QEMU_IS_ALIGNED(offset | bytes, BDRV_SECTOR_SIZE));
+
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     qemu_co_mutex_lock(&s->lock);
@@ -1118,9 +1129,8 @@ static coroutine_fn int vhdx_co_readv(BlockDriverState *bs, int64_t sector_num,
                 break;
             case PAYLOAD_BLOCK_FULLY_PRESENT:
                 qemu_co_mutex_unlock(&s->lock);
-                ret = bdrv_co_readv(bs->file,
-                                    sinfo.file_offset >> BDRV_SECTOR_BITS,
-                                    sinfo.sectors_avail, &hd_qiov);
+                ret = bdrv_co_preadv(bs->file, sinfo.file_offset,
+                                     hd_qiov.size, &hd_qiov, 0);
                 qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     goto exit;
@@ -1206,8 +1216,142 @@ int vhdx_user_visible_write(BlockDriverState *bs, BDRVVHDXState *s)
     return ret;
 }
 
-static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
-                                      int nb_sectors, QEMUIOVector *qiov)
+/* Maximum number of BAT sectors in one log entry.  The smallest log is 1MB,
+ * which leaves room for the descriptors. */
+#define VHDX_BAT_LOG_MAX_SECTORS 64
+
+#define VHDX_BAT_ENTRIES_PER_SECTOR \
+    (VHDX_LOG_SECTOR_SIZE / sizeof(VHDXBatEntry))
+
+/*
+ * BAT updates of newly allocated blocks are written through the log in
+ * batches: a writer adds the BAT indices of the blocks it wrote to the
+ * current batch, and the first writer that finds no log write in progress
+ * writes the whole batch in one log entry, while the others wait for it.
+ * Writers that finish while a batch is logged form the next batch, so
+ * concurrent allocating writes share the flushes of the log.
+ */
+struct VHDXBatBatch {
+    GArray *bat_idx;
+    int refcnt;
+    bool done;
+    int ret;
+};
+
+static int vhdx_bat_idx_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Writes the current s->bat entries at the given indices through the log.
+ * Called without s->lock held, with s->bat_committing set. */
+static int coroutine_fn vhdx_bat_log(BlockDriverState *bs, uint32_t *bat_idx,
+                                     unsigned int n)
+{
+    BDRVVHDXState *s = bs->opaque;
+    uint64_t file_offsets[VHDX_BAT_LOG_MAX_SECTORS];
+    uint64_t *sector;
+    uint8_t *buf;
+    unsigned int i, count;
+    uint32_t sector_idx;
+    int ret = 0;
+
+    qsort(bat_idx, n, sizeof(*bat_idx), vhdx_bat_idx_cmp);
+
+    buf = qemu_try_blockalign(bs->file->bs,
+                              VHDX_BAT_LOG_MAX_SECTORS * VHDX_LOG_SECTOR_SIZE);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    i = 0;
+    while (i < n) {
+        /* Collect the BAT sectors for one log entry, starting from their
+         * contents on disk, which reflects all previous log entries */
+        count = 0;
+        while (i < n && count < VHDX_BAT_LOG_MAX_SECTORS) {
+            sector_idx = bat_idx[i] / VHDX_BAT_ENTRIES_PER_SECTOR;
+            file_offsets[count] = s->bat_offset +
+                                  (uint64_t)sector_idx * VHDX_LOG_SECTOR_SIZE;
+            sector = (uint64_t *)(buf + count * VHDX_LOG_SECTOR_SIZE);
+            ret = bdrv_pread(bs->file, file_offsets[count], sector,
+                             VHDX_LOG_SECTOR_SIZE);
+            if (ret < 0) {
+                goto exit;
+            }
+            for (; i < n && bat_idx[i] / VHDX_BAT_ENTRIES_PER_SECTOR ==
+                            sector_idx; i++) {
+                sector[bat_idx[i] % VHDX_BAT_ENTRIES_PER_SECTOR] =
+                    cpu_to_le64(s->bat[bat_idx[i]]);
+            }
+            count++;
+        }
+
+        ret = vhdx_log_write_and_flush(bs, s, buf, file_offsets, count);
+        if (ret < 0) {
+            goto exit;
+        }
+    }
+
+exit:
+    qemu_vfree(buf);
+    return ret;
+}
+
+/* Adds the n BAT entries at bat_idx to the current batch and waits until
+ * they are in the log.  Must be called with s->lock held. */
+static int coroutine_fn vhdx_bat_commit(BlockDriverState *bs,
+                                        uint32_t *bat_idx, unsigned int n)
+{
+    BDRVVHDXState *s = bs->opaque;
+    VHDXBatBatch *b = s->bat_batch;
+    int ret;
+
+    if (b == NULL) {
+        b = g_new0(VHDXBatBatch, 1);
+        b->bat_idx = g_array_new(false, false, sizeof(uint32_t));
+        s->bat_batch = b;
+    }
+    g_array_append_vals(b->bat_idx, bat_idx, n);
+    b->refcnt++;
+
+    while (!b->done) {
+        if (s->bat_committing) {
+            qemu_co_mutex_unlock(&s->lock);
+            qemu_co_queue_wait(&s->bat_commit_queue);
+            qemu_co_mutex_lock(&s->lock);
+            continue;
+        }
+
+        /* Nobody else is logging, so b is still the current batch */
+        assert(b == s->bat_batch);
+        s->bat_batch = NULL;
+        s->bat_committing = true;
+        qemu_co_mutex_unlock(&s->lock);
+
+        b->ret = vhdx_bat_log(bs, (uint32_t *)b->bat_idx->data,
+                              b->bat_idx->len);
+
+        qemu_co_mutex_lock(&s->lock);
+        b->done = true;
+        s->bat_committing = false;
+        qemu_co_queue_restart_all(&s->bat_commit_queue);
+    }
+
+    ret = b->ret;
+    if (--b->refcnt == 0) {
+        g_array_free(b->bat_idx, true);
+        g_free(b);
+    }
+    return ret;
+}
+
+static coroutine_fn int vhdx_co_pwritev(BlockDriverState *bs, uint64_t offset,
+                                        uint64_t bytes, QEMUIOVector *qiov,
+                                        int flags)
 {
     int ret = -ENOTSUP;
     BDRVVHDXState *s = bs->opaque;
@@ -1215,6 +1359,8 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
     uint64_t bytes_done = 0;
     uint64_t bat_entry = 0;
     uint64_t bat_entry_offset = 0;
+    int64_t sector_num = offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = bytes >> BDRV_SECTOR_BITS;
     QEMUIOVector hd_qiov;
     struct iovec iov1 = { 0 };
     struct iovec iov2 = { 0 };
@@ -1222,8 +1368,14 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
     int bat_state;
     uint64_t bat_prior_offset = 0;
     bool bat_update = false;
+    uint32_t *bat_updates;
+    unsigned int nb_bat_updates = 0;
+    int commit_ret;
+
+    assert(QEMU_IS_ALIGNED(offset | bytes, BDRV_SECTOR_SIZE));
 
     qemu_iovec_init(&hd_qiov, qiov->niov);
+    bat_updates = g_new(uint32_t, DIV_ROUND_UP(bytes, s->block_size) + 1);
 
     qemu_co_mutex_lock(&s->lock);
 
@@ -1327,9 +1479,8 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
                 }
                 /* block exists, so we can just overwrite it */
                 qemu_co_mutex_unlock(&s->lock);
-                ret = bdrv_co_writev(bs->file,
-                                    sinfo.file_offset >> BDRV_SECTOR_BITS,
-                                    sectors_to_write, &hd_qiov);
+                ret = bdrv_co_pwritev(bs->file, sinfo.file_offset,
+                                      hd_qiov.size, &hd_qiov, 0);
                 qemu_co_mutex_lock(&s->lock);
                 if (ret < 0) {
                     goto error_bat_restore;
@@ -1345,14 +1496,9 @@ static coroutine_fn int vhdx_co_writev(BlockDriverState *bs, int64_t sector_num,
             }
 
             if (bat_update) {
-                /* this will update the BAT entry into the log journal, and
-                 * then flush the log journal out to disk */
-                ret =  vhdx_log_write_and_flush(bs, s, &bat_entry,
-                                                sizeof(VHDXBatEntry),
-                                                bat_entry_offset);
-                if (ret < 0) {
-                    goto exit;
-                }
+                /* the BAT entry goes into the log journal once the whole
+                 * request is written, see vhdx_bat_commit() */
+                bat_updates[nb_bat_updates++] = sinfo.bat_idx;
             }
 
             nb_sectors -= sinfo.sectors_avail;
@@ -1373,10 +1519,19 @@ error_bat_restore:
                                     &bat_entry_offset, bat_state);
     }
 exit:
+    /* blocks that were written before an error still need their BAT
+     * entries on disk to match s->bat */
+    if (nb_bat_updates) {
+        commit_ret = vhdx_bat_commit(bs, bat_updates, nb_bat_updates);
+        if (ret >= 0) {
+            ret = commit_ret;
+        }
+    }
     qemu_vfree(iov1.iov_base);
     qemu_vfree(iov2.iov_base);
     qemu_co_mutex_unlock(&s->lock);
     qemu_iovec_destroy(&hd_qiov);
+    g_free(bat_updates);
     return ret;
 }
 
@@ -1973,8 +2128,9 @@ static BlockDriver bdrv_vhdx = {
     .bdrv_open              = vhdx_open,
     .bdrv_close             = vhdx_close,
     .bdrv_reopen_prepare    = vhdx_reopen_prepare,
-    .bdrv_co_readv          = vhdx_co_readv,
-    .bdrv_co_writev         = vhdx_co_writev,
+    .bdrv_refresh_limits    = vhdx_refresh_limits,
+    .bdrv_co_preadv         = vhdx_co_preadv,
+    .bdrv_co_pwritev        = vhdx_co_pwritev,
     .bdrv_create            = vhdx_create,
     .bdrv_get_info          = vhdx_get_info,
     .bdrv_check             = vhdx_check,
@@ -355,6 +355,8 @@ typedef struct VHDXRegionEntry {
     QLIST_ENTRY(VHDXRegionEntry) entries;
 } VHDXRegionEntry;
 
+typedef struct VHDXBatBatch VHDXBatBatch;
+
 typedef struct BDRVVHDXState {
     CoMutex lock;
 
@@ -386,6 +388,12 @@ typedef struct BDRVVHDXState {
     VHDXBatEntry *bat;
     uint64_t bat_offset;
 
+    /* BAT entries of newly written blocks that still need to go through
+     * the log, and the coroutines that wait for them */
+    VHDXBatBatch *bat_batch;
+    bool bat_committing;
+    CoQueue bat_commit_queue;
+
     bool first_visible_write;
     MSGUID session_guid;
 
@@ -416,7 +424,8 @@ int vhdx_parse_log(BlockDriverState *bs, BDRVVHDXState *s, bool *flushed,
                    Error **errp);
 
 int vhdx_log_write_and_flush(BlockDriverState *bs, BDRVVHDXState *s,
-                             void *data, uint32_t length, uint64_t offset);
+                             void *sectors, uint64_t *file_offsets,
+                             uint32_t count);
 
 static inline void leguid_to_cpus(MSGUID *guid)
 {
@@ -33,6 +33,7 @@
 #include "qemu/bswap.h"
 #include "migration/migration.h"
 #include "qemu/cutils.h"
+#include "block/thread-pool.h"
 #include <zlib.h>
 
 #define VMDK3_MAGIC (('C' << 24) | ('O' << 16) | ('W' << 8) | 'D')
@@ -87,7 +88,19 @@ typedef struct {
     uint16_t compressAlgorithm;
 } QEMU_PACKED VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* Minimum number of grain tables cached per extent */
+#define VMDK_L2_CACHE_MIN 16
+/* Memory used for cached grain tables per extent, if above the minimum */
+#define VMDK_L2_CACHE_BYTES (1024 * 1024)
+/* Maximum number of adjacent grain tables read in one request on a miss */
+#define VMDK_L2_PREFETCH 16
+
+typedef struct VmdkL2CacheEntry {
+    uint32_t *table;
+    unsigned int l1_index;
+    bool used;
+    QTAILQ_ENTRY(VmdkL2CacheEntry) next;
+} VmdkL2CacheEntry;
 
 typedef struct VmdkExtent {
     BdrvChild *file;
@@ -107,15 +120,42 @@ typedef struct VmdkExtent {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    /* l2_cache_size grain tables of l2_size entries each */
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    unsigned int l2_cache_size;
+    VmdkL2CacheEntry *l2_cache_entries;
+    /* Maps L1 indexes to the VmdkL2CacheEntry holding their table */
+    GHashTable *l2_cache_map;
+    /* Most recently used first */
+    QTAILQ_HEAD(VmdkL2CacheList, VmdkL2CacheEntry) l2_cache_lru;
 
     int64_t cluster_sectors;
     int64_t next_cluster_sector;
     char *type;
 } VmdkExtent;
 
+/* Number of uncompressed grains kept in memory */
+#define VMDK_GRAIN_CACHE_SIZE 16
+/* Maximum number of grains uncompressed ahead of the guest */
+#define VMDK_GRAIN_READAHEAD 8
+
+typedef struct VmdkGrain {
+    VmdkExtent *extent;
+    /* Offset of the grain in the extent file, 0 if the entry is unused */
+    uint64_t cluster_offset;
+    uint8_t *data;
+    size_t data_size;
+    /* Number of valid bytes in data */
+    size_t data_len;
+    /* Set while the grain is read and uncompressed */
+    bool loading;
+    int ret;
+    /* Number of coroutines that use data or wait for it */
+    int refcnt;
+    uint64_t lru_counter;
+    CoQueue waiters;
+} VmdkGrain;
+
 typedef struct BDRVVmdkState {
     CoMutex lock;
     uint64_t desc_offset;
@@ -128,6 +168,13 @@ typedef struct BDRVVmdkState {
     VmdkExtent *extents;
     Error *migration_blocker;
     char *create_type;
+
+    /* Uncompressed grains of compressed extents, see vmdk_read_grain() */
+    VmdkGrain grain_cache[VMDK_GRAIN_CACHE_SIZE];
+    uint64_t grain_lru_counter;
+    uint64_t grain_next_offset;
+    unsigned grain_in_flight;
+    bool grain_threads;
 } BDRVVmdkState;
 
 typedef struct VmdkMetaData {
@@ -222,6 +269,10 @@ static void vmdk_free_extents(BlockDriverState *bs)
         e = &s->extents[i];
         g_free(e->l1_table);
         g_free(e->l2_cache);
+        g_free(e->l2_cache_entries);
+        if (e->l2_cache_map) {
+            g_hash_table_destroy(e->l2_cache_map);
+        }
         g_free(e->l1_backup_table);
         g_free(e->type);
         if (e->file != bs->file) {
@@ -489,8 +540,24 @@ static int vmdk_init_tables(BlockDriverState *bs, VmdkExtent *extent,
         }
     }
 
+    extent->l2_cache_size = MAX(VMDK_L2_CACHE_MIN,
+                                VMDK_L2_CACHE_BYTES /
+                                (extent->l2_size * sizeof(uint32_t)));
+    /* No point in caching more tables than the extent has */
+    extent->l2_cache_size = MAX(1, MIN(extent->l2_cache_size,
+                                       extent->l1_size));
     extent->l2_cache =
-        g_new(uint32_t, extent->l2_size * L2_CACHE_SIZE);
+        g_new(uint32_t, extent->l2_size * extent->l2_cache_size);
+    extent->l2_cache_entries =
+        g_new0(VmdkL2CacheEntry, extent->l2_cache_size);
+    extent->l2_cache_map = g_hash_table_new(NULL, NULL);
+    QTAILQ_INIT(&extent->l2_cache_lru);
+    for (i = 0; i < extent->l2_cache_size; i++) {
+        VmdkL2CacheEntry *entry = &extent->l2_cache_entries[i];
+
+        entry->table = extent->l2_cache + i * extent->l2_size;
+        QTAILQ_INSERT_TAIL(&extent->l2_cache_lru, entry, next);
+    }
     return 0;
  fail_l1b:
     g_free(extent->l1_backup_table);
@@ -934,6 +1001,23 @@ exit:
     return ret;
 }
 
+static void vmdk_grain_cache_init(BlockDriverState *bs)
+{
+    BDRVVmdkState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < VMDK_GRAIN_CACHE_SIZE; i++) {
+        qemu_co_queue_init(&s->grain_cache[i].waiters);
+    }
+    s->grain_next_offset = -1;
+
+    /* Same as qcow2: with a single CPU, uncompress in the coroutine */
+    s->grain_threads = true;
+#ifdef _SC_NPROCESSORS_ONLN
+    s->grain_threads = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+#endif
+}
+
 static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
@@ -971,6 +1055,7 @@ static int vmdk_open(BlockDriverState *bs, QDict *options, int flags,
     s->cid = vmdk_read_cid(bs, 0);
     s->parent_cid = vmdk_read_cid(bs, 1);
     qemu_co_mutex_init(&s->lock);
+    vmdk_grain_cache_init(bs);
 
     /* Disable migration when VMDK images are used */
     error_setg(&s->migration_blocker, "The vmdk format used by node '%s' "
@@ -1113,6 +1198,78 @@ static int vmdk_L2update(VmdkExtent *extent, VmdkMetaData *m_data,
     return VMDK_OK;
 }
 
+static void vmdk_l2_cache_use(VmdkExtent *extent, VmdkL2CacheEntry *entry)
+{
+    QTAILQ_REMOVE(&extent->l2_cache_lru, entry, next);
+    QTAILQ_INSERT_HEAD(&extent->l2_cache_lru, entry, next);
+}
+
+/*
+ * Return the cached grain table of L1 entry @l1_index, reading it from the
+ * image if necessary. On a miss, the following grain tables are read in the
+ * same request as long as they are stored right after it, which is the case
+ * for the images we create and for most images written by VMware, so that
+ * sequential access to a sparse extent only costs one metadata read every
+ * VMDK_L2_PREFETCH tables.
+ *
+ * Returns NULL on error.
+ */
+static uint32_t *vmdk_get_l2_table(VmdkExtent *extent, unsigned int l1_index)
+{
+    size_t table_bytes = extent->l2_size * sizeof(uint32_t);
+    int64_t l2_pos = (int64_t)extent->l1_table[l1_index] * 512;
+    VmdkL2CacheEntry *entry;
+    unsigned int i, n, max;
+    uint8_t *buf;
+    int ret;
+
+    entry = g_hash_table_lookup(extent->l2_cache_map,
+                                GUINT_TO_POINTER(l1_index));
+    if (entry) {
+        vmdk_l2_cache_use(extent, entry);
+        return entry->table;
+    }
+
+    /* Never let a prefetch evict more than half of the cache */
+    max = MAX(1, MIN(VMDK_L2_PREFETCH, extent->l2_cache_size / 2));
+    for (n = 1; n < max && l1_index + n < extent->l1_size; n++) {
+        if (g_hash_table_contains(extent->l2_cache_map,
+                                  GUINT_TO_POINTER(l1_index + n)) ||
+            (int64_t)extent->l1_table[l1_index + n] * 512 !=
+            l2_pos + n * table_bytes) {
+            break;
+        }
+    }
+
+    buf = g_try_malloc(n * table_bytes);
+    if (buf == NULL) {
+        return NULL;
+    }
+    ret = bdrv_pread(extent->file, l2_pos, buf, n * table_bytes);
+    if (ret < 0) {
+        g_free(buf);
+        return NULL;
+    }
+
+    /* Fill the least recently used entries; the requested table goes last
+     * so that it ends up at the head of the list */
+    for (i = n; i-- > 0;) {
+        entry = QTAILQ_LAST(&extent->l2_cache_lru, VmdkL2CacheList);
+        if (entry->used) {
+            g_hash_table_remove(extent->l2_cache_map,
+                                GUINT_TO_POINTER(entry->l1_index));
+        }
+        memcpy(entry->table, buf + i * table_bytes, table_bytes);
+        entry->l1_index = l1_index + i;
+        entry->used = true;
+        g_hash_table_insert(extent->l2_cache_map,
+                            GUINT_TO_POINTER(entry->l1_index), entry);
+        vmdk_l2_cache_use(extent, entry);
+    }
+    g_free(buf);
+    return entry->table;
+}
+
 /**
  * get_cluster_offset
  *
@@ -1143,8 +1300,7 @@ static int get_cluster_offset(BlockDriverState *bs,
                               uint64_t skip_end_bytes)
 {
     unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table;
+    uint32_t *l2_table;
     bool zeroed = false;
     int64_t ret;
     int64_t cluster_sector;
@@ -1166,39 +1322,11 @@ static int get_cluster_offset(BlockDriverState *bs,
     if (!l2_offset) {
         return VMDK_UNALLOC;
     }
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == extent->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++extent->l2_cache_counts[i] == 0xffffffff) {
-                for (j = 0; j < L2_CACHE_SIZE; j++) {
-                    extent->l2_cache_counts[j] >>= 1;
-                }
-            }
-            l2_table = extent->l2_cache + (i * extent->l2_size);
-            goto found;
-        }
-    }
-    /* not found: load a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for (i = 0; i < L2_CACHE_SIZE; i++) {
-        if (extent->l2_cache_counts[i] < min_count) {
-            min_count = extent->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    l2_table = extent->l2_cache + (min_index * extent->l2_size);
-    if (bdrv_pread(extent->file,
-                (int64_t)l2_offset * 512,
-                l2_table,
-                extent->l2_size * sizeof(uint32_t)
-            ) != extent->l2_size * sizeof(uint32_t)) {
+    l2_table = vmdk_get_l2_table(extent, l1_index);
+    if (!l2_table) {
         return VMDK_ERROR;
     }
 
-    extent->l2_cache_offsets[min_index] = l2_offset;
-    extent->l2_cache_counts[min_index] = 1;
- found:
     l2_index = ((offset >> 9) / extent->cluster_sectors) % extent->l2_size;
     cluster_sector = le32_to_cpu(l2_table[l2_index]);
 
@@ -1277,21 +1405,44 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum, BlockDriverState **file)
 {
     BDRVVmdkState *s = bs->opaque;
-    int64_t index_in_cluster, n, ret;
-    uint64_t offset;
+    int64_t index_in_cluster, n, ret, next_ret;
+    uint64_t offset, next_offset;
     VmdkExtent *extent;
 
     extent = find_extent(s, sector_num, NULL);
     if (!extent) {
         return 0;
     }
+    index_in_cluster = vmdk_find_index_in_cluster(extent, sector_num);
+    n = extent->cluster_sectors - index_in_cluster;
+
     qemu_co_mutex_lock(&s->lock);
     ret = get_cluster_offset(bs, extent, NULL,
                              sector_num * 512, false, &offset,
                              0, 0);
+
+    /* Extend the answer over the following grains of the extent that have
+     * the same status, so that callers such as qemu-img convert and map do
+     * not have to come back once per grain */
+    while (ret != VMDK_ERROR && n < nb_sectors &&
+           sector_num + n < extent->end_sector) {
+        next_ret = get_cluster_offset(bs, extent, NULL,
+                                      (sector_num + n) * 512, false,
+                                      &next_offset, 0, 0);
+        if (next_ret != ret) {
+            break;
+        }
+        if (ret == VMDK_OK && !extent->compressed &&
+            next_offset != offset + (index_in_cluster + n) * 512) {
+            break;
+        }
+        n += extent->cluster_sectors;
+    }
     qemu_co_mutex_unlock(&s->lock);
 
-    index_in_cluster = vmdk_find_index_in_cluster(extent, sector_num);
+    if (n > extent->end_sector - sector_num) {
+        n = extent->end_sector - sector_num;
+    }
     switch (ret) {
     case VMDK_ERROR:
         ret = -EIO;
@@ -1313,7 +1464,6 @@ static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
         break;
     }
 
-    n = extent->cluster_sectors - index_in_cluster;
     if (n > nb_sectors) {
         n = nb_sectors;
     }
@@ -1393,41 +1543,131 @@ static int vmdk_write_extent(VmdkExtent *extent, int64_t cluster_offset,
     return ret;
 }
 
-static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
-                            int64_t offset_in_cluster, QEMUIOVector *qiov,
-                            int bytes)
+/*
+ * Grains of compressed extents are uncompressed in the thread pool into a
+ * small cache. When the guest reads such an extent sequentially, the grains
+ * that follow are read and uncompressed in the background, so that several
+ * of them are uncompressed in parallel and the request that needs one later
+ * finds it in the cache.
+ *
+ * Entries are looked up by their offset in the extent file. Allocated grains
+ * of compressed extents are never written again (see vmdk_pwritev()), so the
+ * cache never needs to be invalidated.
+ */
+
+typedef struct VmdkUncompressData {
+    uint8_t *dest;
+    uLongf dest_len;
+    const uint8_t *src;
+    uLong src_len;
+} VmdkUncompressData;
+
+typedef struct VmdkReadaheadCo {
+    BlockDriverState *bs;
+    VmdkGrain *g;
+} VmdkReadaheadCo;
+
+static VmdkGrain *vmdk_grain_cache_find(BDRVVmdkState *s, VmdkExtent *extent,
+                                        uint64_t cluster_offset)
 {
-    int ret;
+    int i;
+
+    for (i = 0; i < VMDK_GRAIN_CACHE_SIZE; i++) {
+        if (s->grain_cache[i].extent == extent &&
+            s->grain_cache[i].cluster_offset == cluster_offset) {
+            return &s->grain_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the least recently used entry that nobody uses, set up for loading
+ * the grain at @cluster_offset of @extent, or NULL if there is no such entry.
+ */
+static VmdkGrain *vmdk_grain_cache_claim(BDRVVmdkState *s, VmdkExtent *extent,
+                                         uint64_t cluster_offset)
+{
+    size_t cluster_bytes = extent->cluster_sectors * BDRV_SECTOR_SIZE;
+    VmdkGrain *g = NULL;
+    int i;
+
+    for (i = 0; i < VMDK_GRAIN_CACHE_SIZE; i++) {
+        VmdkGrain *e = &s->grain_cache[i];
+
+        if (!e->loading && !e->refcnt &&
+            (!g || e->lru_counter < g->lru_counter)) {
+            g = e;
+        }
+    }
+    if (!g) {
+        return NULL;
+    }
+
+    if (g->data_size < cluster_bytes) {
+        g_free(g->data);
+        g->data_size = 0;
+        g->data = g_try_malloc(cluster_bytes);
+        if (!g->data) {
+            g->cluster_offset = 0;
+            return NULL;
+        }
+        g->data_size = cluster_bytes;
+    }
+
+    g->extent = extent;
+    g->cluster_offset = cluster_offset;
+    g->loading = true;
+    g->ret = 0;
+    g->refcnt = 1;
+    return g;
+}
+
+static int vmdk_uncompress_worker(void *opaque)
+{
+    VmdkUncompressData *data = opaque;
+
+    if (uncompress(data->dest, &data->dest_len,
+                   data->src, data->src_len) != Z_OK) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * Reads the grain at @cluster_offset of @extent and uncompresses it into
+ * @g->data, in the thread pool if there is more than one CPU. Does not need
+ * s->lock.
+ */
+static void coroutine_fn vmdk_grain_load(BlockDriverState *bs, VmdkGrain *g,
+                                         VmdkExtent *extent,
+                                         uint64_t cluster_offset)
+{
+    BDRVVmdkState *s = bs->opaque;
+    VmdkUncompressData data;
     int cluster_bytes, buf_bytes;
     uint8_t *cluster_buf, *compressed_data;
-    uint8_t *uncomp_buf;
     uint32_t data_len;
     VmdkGrainMarker *marker;
-    uLongf buf_len;
-
+    ThreadPool *pool;
+    int ret;
 
-    if (!extent->compressed) {
-        ret = bdrv_co_preadv(extent->file,
-                             cluster_offset + offset_in_cluster, bytes,
-                             qiov, 0);
-        if (ret < 0) {
-            return ret;
-        }
-        return 0;
-    }
     cluster_bytes = extent->cluster_sectors * 512;
-    /* Read two clusters in case GrainMarker + compressed data > one cluster */
+    /* Up to two clusters in case GrainMarker + compressed data > one
+     * cluster, but most grains fit in one so read that first */
     buf_bytes = cluster_bytes * 2;
-    cluster_buf = g_malloc(buf_bytes);
-    uncomp_buf = g_malloc(cluster_bytes);
+    cluster_buf = g_try_malloc(buf_bytes);
+    if (cluster_buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
     ret = bdrv_pread(extent->file,
                 cluster_offset,
-                cluster_buf, buf_bytes);
+                cluster_buf, cluster_bytes);
     if (ret < 0) {
         goto out;
     }
     compressed_data = cluster_buf;
-    buf_len = cluster_bytes;
     data_len = cluster_bytes;
     if (extent->has_marker) {
         marker = (VmdkGrainMarker *)cluster_buf;
@@ -1438,23 +1678,167 @@ static int vmdk_read_extent(VmdkExtent *extent, int64_t cluster_offset,
         ret = -EINVAL;
         goto out;
     }
-    ret = uncompress(uncomp_buf, &buf_len, compressed_data, data_len);
-    if (ret != Z_OK) {
-        ret = -EINVAL;
-        goto out;
-
+    if (compressed_data + data_len > cluster_buf + cluster_bytes) {
+        ret = bdrv_pread(extent->file,
+                    cluster_offset + cluster_bytes,
+                    cluster_buf + cluster_bytes, cluster_bytes);
+        if (ret < 0) {
+            goto out;
+        }
     }
-    if (offset_in_cluster < 0 ||
-            offset_in_cluster + bytes > buf_len) {
-        ret = -EINVAL;
-        goto out;
+
+    data = (VmdkUncompressData) {
+        .dest       = g->data,
+        .dest_len   = cluster_bytes,
+        .src        = compressed_data,
+        .src_len    = data_len,
+    };
+    if (s->grain_threads) {
+        pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+        ret = thread_pool_submit_co(pool, vmdk_uncompress_worker, &data);
+    } else {
+        ret = vmdk_uncompress_worker(&data);
     }
-    qemu_iovec_from_buf(qiov, 0, uncomp_buf + offset_in_cluster, bytes);
-    ret = 0;
+    g->data_len = data.dest_len;
 
  out:
-    g_free(uncomp_buf);
     g_free(cluster_buf);
+    g->ret = ret;
+    g->loading = false;
+    g->lru_counter = ++s->grain_lru_counter;
+    qemu_co_queue_restart_all(&g->waiters);
+}
+
+static void coroutine_fn vmdk_grain_readahead_entry(void *opaque)
+{
+    VmdkReadaheadCo *r = opaque;
+    BDRVVmdkState *s = r->bs->opaque;
+
+    vmdk_grain_load(r->bs, r->g, r->g->extent, r->g->cluster_offset);
+    r->g->refcnt--;
+
+    s->grain_in_flight--;
+    g_free(r);
+}
+
+/*
+ * Starts loading the grains of @extent that follow the one at @offset, up
+ * to the first one that is not allocated. Must be called with s->lock held.
+ */
+static void coroutine_fn vmdk_grain_readahead(BlockDriverState *bs,
+                                              VmdkExtent *extent,
+                                              uint64_t offset)
+{
+    BDRVVmdkState *s = bs->opaque;
+    uint64_t cluster_bytes = extent->cluster_sectors * BDRV_SECTOR_SIZE;
+    uint64_t next, cluster_offset;
+    VmdkReadaheadCo *r;
+    VmdkGrain *g;
+    Coroutine *co;
+    int i;
+
+    next = offset - vmdk_find_offset_in_cluster(extent, offset);
+    for (i = 0; i < VMDK_GRAIN_READAHEAD; i++) {
+        next += cluster_bytes;
+        if (s->grain_in_flight >= VMDK_GRAIN_READAHEAD ||
+            next >= extent->end_sector * BDRV_SECTOR_SIZE) {
+            break;
+        }
+
+        if (get_cluster_offset(bs, extent, NULL, next, false,
+                               &cluster_offset, 0, 0) != VMDK_OK) {
+            break;
+        }
+        if (vmdk_grain_cache_find(s, extent, cluster_offset)) {
+            continue;
+        }
+
+        g = vmdk_grain_cache_claim(s, extent, cluster_offset);
+        if (!g) {
+            break;
+        }
+
+        r = g_new(VmdkReadaheadCo, 1);
+        *r = (VmdkReadaheadCo) {
+            .bs = bs,
+            .g  = g,
+        };
+        s->grain_in_flight++;
+        co = qemu_coroutine_create(vmdk_grain_readahead_entry, r);
+        qemu_coroutine_enter(co);
+    }
+}
+
+/*
+ * Reads @bytes at guest @offset from the grain of compressed @extent that is
+ * stored at @cluster_offset. Must be called with s->lock held.
+ */
+static int coroutine_fn vmdk_read_grain(BlockDriverState *bs,
+                                        VmdkExtent *extent,
+                                        uint64_t cluster_offset,
+                                        uint64_t offset, QEMUIOVector *qiov,
+                                        int bytes)
+{
+    BDRVVmdkState *s = bs->opaque;
+    uint64_t cluster_bytes = extent->cluster_sectors * BDRV_SECTOR_SIZE;
+    uint64_t offset_in_cluster = vmdk_find_offset_in_cluster(extent, offset);
+    uint64_t cluster_start = offset - offset_in_cluster;
+    VmdkGrain *g, tmp = { 0 };
+    bool sequential;
+    int ret;
+
+    sequential = cluster_start == s->grain_next_offset ||
+                 cluster_start + cluster_bytes == s->grain_next_offset;
+    s->grain_next_offset = cluster_start + cluster_bytes;
+
+    g = vmdk_grain_cache_find(s, extent, cluster_offset);
+    if (g && !g->loading && g->ret < 0) {
+        /* Try again instead of returning an old error */
+        g->cluster_offset = 0;
+        g = NULL;
+    }
+    if (g) {
+        /* Keep the readahead from reusing the entry */
+        g->refcnt++;
+    }
+
+    if (sequential) {
+        vmdk_grain_readahead(bs, extent, offset);
+    }
+
+    if (g) {
+        if (g->loading) {
+            qemu_co_queue_wait(&g->waiters);
+        }
+    } else {
+        g = vmdk_grain_cache_claim(s, extent, cluster_offset);
+        if (!g) {
+            /* All entries are busy, use one outside of the cache */
+            g = &tmp;
+            qemu_co_queue_init(&g->waiters);
+            g->data = g_try_malloc(cluster_bytes);
+            if (!g->data) {
+                return -ENOMEM;
+            }
+            g->refcnt = 1;
+        }
+        vmdk_grain_load(bs, g, extent, cluster_offset);
+    }
+
+    ret = g->ret;
+    if (ret == 0) {
+        if (offset_in_cluster + bytes > g->data_len) {
+            ret = -EINVAL;
+        } else {
+            qemu_iovec_from_buf(qiov, 0, g->data + offset_in_cluster, bytes);
+            g->lru_counter = ++s->grain_lru_counter;
+        }
+    }
+    g->refcnt--;
+
+    if (g == &tmp) {
+        g_free(tmp.data);
+    }
     return ret;
 }
 
@@ -1509,9 +1893,15 @@ vmdk_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
             qemu_iovec_reset(&local_qiov);
             qemu_iovec_concat(&local_qiov, qiov, bytes_done, n_bytes);
 
-            ret = vmdk_read_extent(extent, cluster_offset, offset_in_cluster,
-                                   &local_qiov, n_bytes);
-            if (ret) {
+            if (extent->compressed) {
+                ret = vmdk_read_grain(bs, extent, cluster_offset, offset,
+                                      &local_qiov, n_bytes);
+            } else {
+                ret = bdrv_co_preadv(extent->file,
+                                     cluster_offset + offset_in_cluster,
+                                     n_bytes, &local_qiov, 0);
+            }
+            if (ret < 0) {
                 goto fail;
             }
         }
@@ -2145,10 +2535,30 @@ exit:
     return ret;
 }
 
+/* Waits for the grain readahead */
+static void vmdk_wait_background_reads(BlockDriverState *bs)
+{
+    BDRVVmdkState *s = bs->opaque;
+
+    while (s->grain_in_flight) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+}
+
+static void vmdk_detach_aio_context(BlockDriverState *bs)
+{
+    vmdk_wait_background_reads(bs);
+}
+
 static void vmdk_close(BlockDriverState *bs)
 {
     BDRVVmdkState *s = bs->opaque;
+    int i;
 
+    vmdk_wait_background_reads(bs);
+    for (i = 0; i < VMDK_GRAIN_CACHE_SIZE; i++) {
+        g_free(s->grain_cache[i].data);
+    }
     vmdk_free_extents(bs);
     g_free(s->create_type);
 
@@ -2396,6 +2806,7 @@ static BlockDriver bdrv_vmdk = {
     .bdrv_write_compressed        = vmdk_write_compressed,
     .bdrv_co_pwrite_zeroes        = vmdk_co_pwrite_zeroes,
     .bdrv_close                   = vmdk_close,
+    .bdrv_detach_aio_context      = vmdk_detach_aio_context,
     .bdrv_create                  = vmdk_create,
     .bdrv_co_flush_to_disk        = vmdk_co_flush,
     .bdrv_co_get_block_status     = vmdk_co_get_block_status,
@@ -147,6 +147,7 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
 {
     BlockBackend *blk;
     NBDExport *exp;
+    uint16_t nbdflags;
 
     if (!nbd_server) {
         error_setg(errp, "NBD server not running");
@@ -176,8 +177,10 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         writable = false;
     }
 
-    exp = nbd_export_new(blk, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY, NULL,
-                         errp);
+    /* Read-only exports can safely be accessed over several connections */
+    nbdflags = writable ? 0 : NBD_FLAG_READ_ONLY | NBD_FLAG_CAN_MULTI_CONN;
+
+    exp = nbd_export_new(blk, 0, -1, nbdflags, NULL, errp);
     if (!exp) {
         return;
     }
@@ -484,6 +484,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
     BlockdevDetectZeroesOptions detect_zeroes =
         BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF;
     const char *throttling_group = NULL;
+    uint64_t throttling_weight;
 
     /* Check common options by copying from bs_opts to opts, all other options
      * stay in bs_opts for processing by bdrv_open(). */
@@ -530,6 +531,15 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
         goto early_err;
     }
 
+    throttling_weight = qemu_opt_get_number(opts, "throttling.weight",
+                                            THROTTLE_GROUP_WEIGHT_DEFAULT);
+    if (throttling_weight < 1 ||
+        throttling_weight > THROTTLE_GROUP_WEIGHT_MAX) {
+        error_setg(errp, "throttling.weight must be between 1 and %d",
+                   THROTTLE_GROUP_WEIGHT_MAX);
+        goto early_err;
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
         if (is_help_option(buf)) {
             error_printf("Supported formats:");
@@ -621,6 +631,7 @@ static BlockBackend *blockdev_init(const char *file, QDict *bs_opts,
             throttling_group = id;
         }
         blk_io_limits_enable(blk, throttling_group);
+        throttle_group_set_weight(blk, throttling_weight);
         blk_set_io_limits(blk, &cfg);
     }
 
@@ -1848,6 +1859,7 @@ static void do_drive_backup(const char *job_id, const char *device,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
                             BlockJobTxn *txn, Error **errp);
 
 static void drive_backup_prepare(BlkActionState *common, Error **errp)
@@ -1887,6 +1899,7 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
                     backup->has_bitmap, backup->bitmap,
                     backup->has_on_source_error, backup->on_source_error,
                     backup->has_on_target_error, backup->on_target_error,
+                    backup->has_max_workers, backup->max_workers,
                     common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -1931,6 +1944,7 @@ static void do_blockdev_backup(const char *job_id, const char *device,
                                BlockdevOnError on_source_error,
                                bool has_on_target_error,
                                BlockdevOnError on_target_error,
+                               bool has_max_workers, int64_t max_workers,
                                BlockJobTxn *txn, Error **errp);
 
 static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
@@ -1976,6 +1990,7 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
                        backup->has_speed, backup->speed,
                        backup->has_on_source_error, backup->on_source_error,
                        backup->has_on_target_error, backup->on_target_error,
+                       backup->has_max_workers, backup->max_workers,
                        common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2031,6 +2046,7 @@ static void block_dirty_bitmap_add_prepare(BlkActionState *common,
     /* AIO context taken and released within qmp_block_dirty_bitmap_add */
     qmp_block_dirty_bitmap_add(action->node, action->name,
                                action->has_granularity, action->granularity,
+                               action->has_persistent, action->persistent,
                                &local_err);
 
     if (!local_err) {
@@ -2712,6 +2728,13 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         goto out;
     }
 
+    if (arg->has_weight &&
+        (arg->weight < 1 || arg->weight > THROTTLE_GROUP_WEIGHT_MAX)) {
+        error_setg(errp, "weight must be between 1 and %d",
+                   THROTTLE_GROUP_WEIGHT_MAX);
+        goto out;
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2721,6 +2744,9 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         } else if (arg->has_group) {
             blk_io_limits_update_group(blk, arg->group);
         }
+        if (arg->has_weight) {
+            throttle_group_set_weight(blk, arg->weight);
+        }
         /* Set the new throttling configuration */
         blk_set_io_limits(blk, &cfg);
     } else if (blk_get_public(blk)->throttle_state) {
@@ -2732,12 +2758,94 @@ out:
     aio_context_release(aio_context);
 }
 
+ThrottleGroupInfoList *qmp_query_throttle_groups(Error **errp)
+{
+    return throttle_group_query_all();
+}
+
+void qmp_block_latency_histogram_set(const char *device,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    static const char *type_name[BLOCK_MAX_IOTYPE] = {
+        [BLOCK_ACCT_READ]  = "read",
+        [BLOCK_ACCT_WRITE] = "write",
+        [BLOCK_ACCT_FLUSH] = "flush",
+    };
+    uint64List *type_boundaries[BLOCK_MAX_IOTYPE];
+    BlockBackend *blk;
+    AioContext *aio_context;
+    int i, ret;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+
+    type_boundaries[BLOCK_ACCT_READ] =
+        has_boundaries_read ? boundaries_read : boundaries;
+    type_boundaries[BLOCK_ACCT_WRITE] =
+        has_boundaries_write ? boundaries_write : boundaries;
+    type_boundaries[BLOCK_ACCT_FLUSH] =
+        has_boundaries_flush ? boundaries_flush : boundaries;
+
+    /* Check all lists first, so that an error leaves every histogram as it
+     * was */
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        if (!block_latency_histogram_check(type_boundaries[i])) {
+            error_setg(errp, "Boundaries of the %s histogram must be "
+                       "strictly ascending and non-zero", type_name[i]);
+            return;
+        }
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        ret = block_latency_histogram_set(blk_get_stats(blk), i,
+                                          type_boundaries[i]);
+        assert(ret == 0);
+    }
+
+    aio_context_release(aio_context);
+}
+
+void qmp_block_latency_histogram_reset(const char *device, Error **errp)
+{
+    BlockBackend *blk;
+    AioContext *aio_context;
+
+    blk = blk_by_name(device);
+    if (!blk) {
+        error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                  "Device '%s' not found", device);
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+    block_latency_histograms_reset(blk_get_stats(blk));
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
+                                bool has_persistent, bool persistent,
                                 Error **errp)
 {
     AioContext *aio_context;
     BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
 
     if (!name || name[0] == '\0') {
         error_setg(errp, "Bitmap name cannot be empty");
@@ -2763,7 +2871,20 @@ void qmp_block_dirty_bitmap_add(const char *node, const char *name,
         granularity = bdrv_get_default_bitmap_granularity(bs);
     }
 
-    bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (!has_persistent) {
+        persistent = false;
+    }
+
+    if (persistent &&
+        !bdrv_can_store_new_dirty_bitmap(bs, name, granularity, errp))
+    {
+        goto out;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, errp);
+    if (bitmap != NULL) {
+        bdrv_dirty_bitmap_set_persistance(bitmap, persistent);
+    }
 
  out:
     aio_context_release(aio_context);
@@ -2981,6 +3102,7 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
                       bool has_backing_file, const char *backing_file,
                       bool has_speed, int64_t speed,
                       bool has_on_error, BlockdevOnError on_error,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     BlockBackend *blk;
@@ -3036,7 +3158,9 @@ void qmp_block_stream(bool has_job_id, const char *job_id, const char *device,
     base_name = has_backing_file ? backing_file : base_name;
 
     stream_start(has_job_id ? job_id : NULL, bs, base_bs, base_name,
-                 has_speed ? speed : 0, on_error, block_job_cb, bs, &local_err);
+                 has_speed ? speed : 0, on_error,
+                 has_max_workers ? max_workers : STREAM_DEFAULT_WORKERS,
+                 block_job_cb, bs, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         goto out;
@@ -3165,6 +3289,7 @@ static void do_drive_backup(const char *job_id, const char *device,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
                             BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk;
@@ -3190,6 +3315,9 @@ static void do_drive_backup(const char *job_id, const char *device,
     if (!has_mode) {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
+    if (!has_max_workers) {
+        max_workers = BACKUP_DEFAULT_WORKERS;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3277,7 +3405,7 @@ static void do_drive_backup(const char *job_id, const char *device,
     }
 
     backup_start(job_id, bs, target_bs, speed, sync, bmap,
-                 on_source_error, on_target_error,
+                 on_source_error, on_target_error, max_workers,
                  block_job_cb, bs, txn, &local_err);
     bdrv_unref(target_bs);
     if (local_err != NULL) {
@@ -3298,6 +3426,7 @@ void qmp_drive_backup(bool has_job_id, const char *job_id,
                       bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     return do_drive_backup(has_job_id ? job_id : NULL, device, target,
@@ -3306,6 +3435,7 @@ void qmp_drive_backup(bool has_job_id, const char *job_id,
                            has_bitmap, bitmap,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
+                           has_max_workers, max_workers,
                            NULL, errp);
 }
 
@@ -3321,6 +3451,7 @@ void do_blockdev_backup(const char *job_id, const char *device,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
                          BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk;
@@ -3338,6 +3469,9 @@ void do_blockdev_backup(const char *job_id, const char *device,
     if (!has_on_target_error) {
         on_target_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_workers) {
+        max_workers = BACKUP_DEFAULT_WORKERS;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3371,7 +3505,8 @@ void do_blockdev_backup(const char *job_id, const char *device,
         }
     }
     backup_start(job_id, bs, target_bs, speed, sync, NULL, on_source_error,
-                 on_target_error, block_job_cb, bs, txn, &local_err);
+                 on_target_error, max_workers, block_job_cb, bs, txn,
+                 &local_err);
     if (local_err != NULL) {
         error_propagate(errp, local_err);
     }
@@ -3387,12 +3522,14 @@ void qmp_blockdev_backup(bool has_job_id, const char *job_id,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
                          Error **errp)
 {
     do_blockdev_backup(has_job_id ? job_id : NULL, device, target,
                        sync, has_speed, speed,
                        has_on_source_error, on_source_error,
                        has_on_target_error, on_target_error,
+                       has_max_workers, max_workers,
                        NULL, errp);
 }
 
@@ -4247,6 +4384,10 @@ QemuOptsList qemu_common_drive_opts = {
             .name = "throttling.group",
             .type = QEMU_OPT_STRING,
             .help = "name of the block throttling group",
+        },{
+            .name = "throttling.weight",
+            .type = QEMU_OPT_NUMBER,
+            .help = "share of the throttling group's limits for this drive",
         },{
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
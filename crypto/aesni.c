@@ -0,0 +1,428 @@
+/*
+ * QEMU Crypto AES using the AES-NI instructions
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "crypto/aesni.h"
+
+#ifdef CONFIG_AESNI_OPT
+#pragma GCC push_options
+#pragma GCC target("aes")
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+/*
+ * The bulk functions keep this many blocks in flight, which
+ * is enough to hide the latency of the AES round instructions.
+ */
+#define AESNI_PARALLEL_BLOCKS 8
+
+bool qcrypto_aesni_available(void)
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return false;
+    }
+
+    return c & bit_AES;
+}
+
+
+int qcrypto_aesni_set_key(const uint8_t *key, size_t nkey,
+                          QCryptoAESNIKey *enc, QCryptoAESNIKey *dec)
+{
+    AES_KEY sched;
+    __m128i rk;
+    int i;
+
+    /*
+     * The table driven implementation computes the same schedule;
+     * its round key words are just stored in host byte order.
+     */
+    if (AES_set_encrypt_key(key, nkey * 8, &sched) != 0) {
+        return -1;
+    }
+
+    enc->rounds = dec->rounds = sched.rounds;
+    for (i = 0; i < 4 * (sched.rounds + 1); i++) {
+        stl_be_p(enc->rd_key + i * 4, sched.rd_key[i]);
+    }
+    memset(&sched, 0, sizeof(sched));
+
+    /* Equivalent inverse cipher: reversed, with InvMixColumns applied
+     * to all but the first and last round key */
+    memcpy(dec->rd_key, enc->rd_key + enc->rounds * AES_BLOCK_SIZE,
+           AES_BLOCK_SIZE);
+    for (i = 1; i < enc->rounds; i++) {
+        rk = _mm_loadu_si128((const __m128i *)
+                             (enc->rd_key +
+                              (enc->rounds - i) * AES_BLOCK_SIZE));
+        _mm_storeu_si128((__m128i *)(dec->rd_key + i * AES_BLOCK_SIZE),
+                         _mm_aesimc_si128(rk));
+    }
+    memcpy(dec->rd_key + enc->rounds * AES_BLOCK_SIZE, enc->rd_key,
+           AES_BLOCK_SIZE);
+
+    return 0;
+}
+
+
+static inline __m128i aesni_round_key(const QCryptoAESNIKey *key, int i)
+{
+    return _mm_loadu_si128((const __m128i *)
+                           (key->rd_key + i * AES_BLOCK_SIZE));
+}
+
+static inline __m128i aesni_encrypt1(const QCryptoAESNIKey *key, __m128i b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, aesni_round_key(key, 0));
+    for (r = 1; r < key->rounds; r++) {
+        b = _mm_aesenc_si128(b, aesni_round_key(key, r));
+    }
+    return _mm_aesenclast_si128(b, aesni_round_key(key, key->rounds));
+}
+
+static inline __m128i aesni_decrypt1(const QCryptoAESNIKey *key, __m128i b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, aesni_round_key(key, 0));
+    for (r = 1; r < key->rounds; r++) {
+        b = _mm_aesdec_si128(b, aesni_round_key(key, r));
+    }
+    return _mm_aesdeclast_si128(b, aesni_round_key(key, key->rounds));
+}
+
+static inline void aesni_encrypt8(const QCryptoAESNIKey *key, __m128i *b)
+{
+    __m128i rk;
+    int i, r;
+
+    rk = aesni_round_key(key, 0);
+    for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+        b[i] = _mm_xor_si128(b[i], rk);
+    }
+    for (r = 1; r < key->rounds; r++) {
+        rk = aesni_round_key(key, r);
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            b[i] = _mm_aesenc_si128(b[i], rk);
+        }
+    }
+    rk = aesni_round_key(key, key->rounds);
+    for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+        b[i] = _mm_aesenclast_si128(b[i], rk);
+    }
+}
+
+static inline void aesni_decrypt8(const QCryptoAESNIKey *key, __m128i *b)
+{
+    __m128i rk;
+    int i, r;
+
+    rk = aesni_round_key(key, 0);
+    for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+        b[i] = _mm_xor_si128(b[i], rk);
+    }
+    for (r = 1; r < key->rounds; r++) {
+        rk = aesni_round_key(key, r);
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            b[i] = _mm_aesdec_si128(b[i], rk);
+        }
+    }
+    rk = aesni_round_key(key, key->rounds);
+    for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+        b[i] = _mm_aesdeclast_si128(b[i], rk);
+    }
+}
+
+static inline __m128i aesni_load(const uint8_t *p)
+{
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline void aesni_store(uint8_t *p, __m128i b)
+{
+    _mm_storeu_si128((__m128i *)p, b);
+}
+
+
+void qcrypto_aesni_ecb_encrypt(const QCryptoAESNIKey *key,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    __m128i b[AESNI_PARALLEL_BLOCKS];
+    int i;
+
+    for (; len >= sizeof(b); len -= sizeof(b)) {
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            b[i] = aesni_load(in + i * AES_BLOCK_SIZE);
+        }
+        aesni_encrypt8(key, b);
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            aesni_store(out + i * AES_BLOCK_SIZE, b[i]);
+        }
+        in += sizeof(b);
+        out += sizeof(b);
+    }
+
+    for (; len; len -= AES_BLOCK_SIZE) {
+        aesni_store(out, aesni_encrypt1(key, aesni_load(in)));
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+}
+
+
+void qcrypto_aesni_ecb_decrypt(const QCryptoAESNIKey *key,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    __m128i b[AESNI_PARALLEL_BLOCKS];
+    int i;
+
+    for (; len >= sizeof(b); len -= sizeof(b)) {
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            b[i] = aesni_load(in + i * AES_BLOCK_SIZE);
+        }
+        aesni_decrypt8(key, b);
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            aesni_store(out + i * AES_BLOCK_SIZE, b[i]);
+        }
+        in += sizeof(b);
+        out += sizeof(b);
+    }
+
+    for (; len; len -= AES_BLOCK_SIZE) {
+        aesni_store(out, aesni_decrypt1(key, aesni_load(in)));
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+}
+
+
+void qcrypto_aesni_cbc_encrypt(const QCryptoAESNIKey *key, uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    __m128i c = aesni_load(iv);
+
+    /* Each block depends on the previous one, so no parallelism here */
+    for (; len; len -= AES_BLOCK_SIZE) {
+        c = aesni_encrypt1(key, _mm_xor_si128(aesni_load(in), c));
+        aesni_store(out, c);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+
+    aesni_store(iv, c);
+}
+
+
+void qcrypto_aesni_cbc_decrypt(const QCryptoAESNIKey *key, uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    __m128i b[AESNI_PARALLEL_BLOCKS], c[AESNI_PARALLEL_BLOCKS];
+    __m128i prev = aesni_load(iv);
+    int i;
+
+    for (; len >= sizeof(b); len -= sizeof(b)) {
+        /* Load all cipher text first, in case @in == @out */
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            c[i] = b[i] = aesni_load(in + i * AES_BLOCK_SIZE);
+        }
+        aesni_decrypt8(key, b);
+        aesni_store(out, _mm_xor_si128(b[0], prev));
+        for (i = 1; i < AESNI_PARALLEL_BLOCKS; i++) {
+            aesni_store(out + i * AES_BLOCK_SIZE,
+                        _mm_xor_si128(b[i], c[i - 1]));
+        }
+        prev = c[AESNI_PARALLEL_BLOCKS - 1];
+        in += sizeof(b);
+        out += sizeof(b);
+    }
+
+    for (; len; len -= AES_BLOCK_SIZE) {
+        __m128i cur = aesni_load(in);
+        aesni_store(out, _mm_xor_si128(aesni_decrypt1(key, cur), prev));
+        prev = cur;
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+
+    aesni_store(iv, prev);
+}
+
+
+/*
+ * Multiply the tweak by x in GF(2^128), as xts_mult_x() does:
+ * shift the little endian 128-bit value left by one, folding
+ * the bit shifted out of the top back in as 0x87. The 64-bit
+ * adds lose bits 63 and 127, which the shuffled sign masks
+ * put back into bit 64 and the low byte respectively.
+ */
+static inline __m128i aesni_xts_mult_x(__m128i t)
+{
+    __m128i carry = _mm_srai_epi32(_mm_shuffle_epi32(t, 0x13), 31);
+
+    carry = _mm_and_si128(carry, _mm_set_epi32(0, 1, 0, 0x87));
+    return _mm_xor_si128(_mm_add_epi64(t, t), carry);
+}
+
+
+void qcrypto_aesni_xts_encrypt(const QCryptoAESNIKey *key,
+                               const QCryptoAESNIKey *tweak_enc,
+                               const QCryptoAESNIKey *tweak_dec,
+                               uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    __m128i b[AESNI_PARALLEL_BLOCKS], t[AESNI_PARALLEL_BLOCKS];
+    __m128i tweak = aesni_encrypt1(tweak_enc, aesni_load(iv));
+    int i;
+
+    for (; len >= sizeof(b); len -= sizeof(b)) {
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            t[i] = tweak;
+            tweak = aesni_xts_mult_x(tweak);
+            b[i] = _mm_xor_si128(aesni_load(in + i * AES_BLOCK_SIZE), t[i]);
+        }
+        aesni_encrypt8(key, b);
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            aesni_store(out + i * AES_BLOCK_SIZE, _mm_xor_si128(b[i], t[i]));
+        }
+        in += sizeof(b);
+        out += sizeof(b);
+    }
+
+    for (; len; len -= AES_BLOCK_SIZE) {
+        __m128i x = _mm_xor_si128(aesni_load(in), tweak);
+        aesni_store(out, _mm_xor_si128(aesni_encrypt1(key, x), tweak));
+        tweak = aesni_xts_mult_x(tweak);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+
+    aesni_store(iv, aesni_decrypt1(tweak_dec, tweak));
+}
+
+
+void qcrypto_aesni_xts_decrypt(const QCryptoAESNIKey *key,
+                               const QCryptoAESNIKey *tweak_enc,
+                               const QCryptoAESNIKey *tweak_dec,
+                               uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    __m128i b[AESNI_PARALLEL_BLOCKS], t[AESNI_PARALLEL_BLOCKS];
+    __m128i tweak = aesni_encrypt1(tweak_enc, aesni_load(iv));
+    int i;
+
+    for (; len >= sizeof(b); len -= sizeof(b)) {
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            t[i] = tweak;
+            tweak = aesni_xts_mult_x(tweak);
+            b[i] = _mm_xor_si128(aesni_load(in + i * AES_BLOCK_SIZE), t[i]);
+        }
+        aesni_decrypt8(key, b);
+        for (i = 0; i < AESNI_PARALLEL_BLOCKS; i++) {
+            aesni_store(out + i * AES_BLOCK_SIZE, _mm_xor_si128(b[i], t[i]));
+        }
+        in += sizeof(b);
+        out += sizeof(b);
+    }
+
+    for (; len; len -= AES_BLOCK_SIZE) {
+        __m128i x = _mm_xor_si128(aesni_load(in), tweak);
+        aesni_store(out, _mm_xor_si128(aesni_decrypt1(key, x), tweak));
+        tweak = aesni_xts_mult_x(tweak);
+        in += AES_BLOCK_SIZE;
+        out += AES_BLOCK_SIZE;
+    }
+
+    aesni_store(iv, aesni_decrypt1(tweak_dec, tweak));
+}
+
+#pragma GCC pop_options
+#else /* ! CONFIG_AESNI_OPT */
+
+bool qcrypto_aesni_available(void)
+{
+    return false;
+}
+
+int qcrypto_aesni_set_key(const uint8_t *key, size_t nkey,
+                          QCryptoAESNIKey *enc, QCryptoAESNIKey *dec)
+{
+    g_assert_not_reached();
+}
+
+void qcrypto_aesni_ecb_encrypt(const QCryptoAESNIKey *key,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    g_assert_not_reached();
+}
+
+void qcrypto_aesni_ecb_decrypt(const QCryptoAESNIKey *key,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    g_assert_not_reached();
+}
+
+void qcrypto_aesni_cbc_encrypt(const QCryptoAESNIKey *key, uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    g_assert_not_reached();
+}
+
+void qcrypto_aesni_cbc_decrypt(const QCryptoAESNIKey *key, uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    g_assert_not_reached();
+}
+
+void qcrypto_aesni_xts_encrypt(const QCryptoAESNIKey *key,
+                               const QCryptoAESNIKey *tweak_enc,
+                               const QCryptoAESNIKey *tweak_dec,
+                               uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    g_assert_not_reached();
+}
+
+void qcrypto_aesni_xts_decrypt(const QCryptoAESNIKey *key,
+                               const QCryptoAESNIKey *tweak_enc,
+                               const QCryptoAESNIKey *tweak_dec,
+                               uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len)
+{
+    g_assert_not_reached();
+}
+
+#endif /* ! CONFIG_AESNI_OPT */
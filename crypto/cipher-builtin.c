@@ -20,6 +20,7 @@
 
 #include "qemu/osdep.h"
 #include "crypto/aes.h"
+#include "crypto/aesni.h"
 #include "crypto/desrfb.h"
 #include "crypto/xts.h"
 
@@ -28,10 +29,20 @@ struct QCryptoCipherBuiltinAESContext {
     AES_KEY enc;
     AES_KEY dec;
 };
+typedef struct QCryptoCipherBuiltinAESNIContext
+QCryptoCipherBuiltinAESNIContext;
+struct QCryptoCipherBuiltinAESNIContext {
+    QCryptoAESNIKey enc;
+    QCryptoAESNIKey dec;
+};
 typedef struct QCryptoCipherBuiltinAES QCryptoCipherBuiltinAES;
 struct QCryptoCipherBuiltinAES {
     QCryptoCipherBuiltinAESContext key;
     QCryptoCipherBuiltinAESContext key_tweak;
+    /* Only set up and used if the host has AES-NI */
+    bool aesni;
+    QCryptoCipherBuiltinAESNIContext ni_key;
+    QCryptoCipherBuiltinAESNIContext ni_key_tweak;
     uint8_t iv[AES_BLOCK_SIZE];
 };
 typedef struct QCryptoCipherBuiltinDESRFB QCryptoCipherBuiltinDESRFB;
@@ -156,6 +167,28 @@ static int qcrypto_cipher_encrypt_aes(QCryptoCipher *cipher,
                                       Error **errp)
 {
     QCryptoCipherBuiltin *ctxt = cipher->opaque;
+    QCryptoCipherBuiltinAES *aes = &ctxt->state.aes;
+
+    if (aes->aesni) {
+        switch (cipher->mode) {
+        case QCRYPTO_CIPHER_MODE_ECB:
+            qcrypto_aesni_ecb_encrypt(&aes->ni_key.enc, in, out, len);
+            break;
+        case QCRYPTO_CIPHER_MODE_CBC:
+            qcrypto_aesni_cbc_encrypt(&aes->ni_key.enc, aes->iv,
+                                      in, out, len);
+            break;
+        case QCRYPTO_CIPHER_MODE_XTS:
+            qcrypto_aesni_xts_encrypt(&aes->ni_key.enc,
+                                      &aes->ni_key_tweak.enc,
+                                      &aes->ni_key_tweak.dec,
+                                      aes->iv, in, out, len);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        return 0;
+    }
 
     switch (cipher->mode) {
     case QCRYPTO_CIPHER_MODE_ECB:
@@ -190,6 +223,28 @@ static int qcrypto_cipher_decrypt_aes(QCryptoCipher *cipher,
                                       Error **errp)
 {
     QCryptoCipherBuiltin *ctxt = cipher->opaque;
+    QCryptoCipherBuiltinAES *aes = &ctxt->state.aes;
+
+    if (aes->aesni) {
+        switch (cipher->mode) {
+        case QCRYPTO_CIPHER_MODE_ECB:
+            qcrypto_aesni_ecb_decrypt(&aes->ni_key.dec, in, out, len);
+            break;
+        case QCRYPTO_CIPHER_MODE_CBC:
+            qcrypto_aesni_cbc_decrypt(&aes->ni_key.dec, aes->iv,
+                                      in, out, len);
+            break;
+        case QCRYPTO_CIPHER_MODE_XTS:
+            qcrypto_aesni_xts_decrypt(&aes->ni_key.dec,
+                                      &aes->ni_key_tweak.enc,
+                                      &aes->ni_key_tweak.dec,
+                                      aes->iv, in, out, len);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        return 0;
+    }
 
     switch (cipher->mode) {
     case QCRYPTO_CIPHER_MODE_ECB:
@@ -284,6 +339,23 @@ static int qcrypto_cipher_init_aes(QCryptoCipher *cipher,
         }
     }
 
+    /* The table driven keys were validated above, so this can't fail */
+    if (qcrypto_aesni_available()) {
+        ctxt->state.aes.aesni = true;
+        if (cipher->mode == QCRYPTO_CIPHER_MODE_XTS) {
+            qcrypto_aesni_set_key(key, nkey / 2,
+                                  &ctxt->state.aes.ni_key.enc,
+                                  &ctxt->state.aes.ni_key.dec);
+            qcrypto_aesni_set_key(key + (nkey / 2), nkey / 2,
+                                  &ctxt->state.aes.ni_key_tweak.enc,
+                                  &ctxt->state.aes.ni_key_tweak.dec);
+        } else {
+            qcrypto_aesni_set_key(key, nkey,
+                                  &ctxt->state.aes.ni_key.enc,
+                                  &ctxt->state.aes.ni_key.dec);
+        }
+    }
+
     ctxt->blocksize = AES_BLOCK_SIZE;
     ctxt->free = qcrypto_cipher_free_aes;
     ctxt->setiv = qcrypto_cipher_setiv_aes;
@@ -44,6 +44,7 @@ void qemu_aio_unref(void *p);
 void qemu_aio_ref(void *p);
 
 typedef struct AioHandler AioHandler;
+typedef struct BHListSlice BHListSlice;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
 
@@ -90,16 +91,20 @@ struct AioContext {
      */
     uint32_t notify_me;
 
-    /* lock to protect between bh's adders and deleter */
-    QemuMutex bh_lock;
-
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
+    /* Bottom halves that were scheduled since the last aio_bh_poll.  Any
+     * thread can push to these lists with QSLIST_INSERT_HEAD_ATOMIC, and
+     * aio_bh_poll takes them whole with QSLIST_MOVE_ATOMIC.  Pushing to
+     * bh_list wakes up the event loop; idle_bh_list has the idle and the
+     * deleted bottom halves, which do not.  A qemu_bh_schedule() of an
+     * idle bottom half leaves it on idle_bh_list and wakes up the loop.
+     */
+    QSLIST_HEAD(, QEMUBH) bh_list;
+    QSLIST_HEAD(, QEMUBH) idle_bh_list;
 
-    /* A simple lock used to protect the first_bh list, and ensure that
-     * no callbacks are removed while we're walking and dispatching callbacks.
+    /* Bottom halves taken by aio_bh_poll calls that have not run yet,
+     * one slice per call; more than one if callbacks call aio_poll.
      */
-    int walking_bh;
+    QSIMPLEQ_HEAD(, BHListSlice) bh_slice_list;
 
     /* Used by aio_notify.
      *
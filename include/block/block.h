@@ -65,9 +65,13 @@ typedef enum {
     BDRV_REQ_MAY_UNMAP          = 0x4,
     BDRV_REQ_NO_SERIALISING     = 0x8,
     BDRV_REQ_FUA                = 0x10,
+    /* Set by the block layer on reads that are copied into the image because
+     * copy-on-read is enabled on it (as opposed to explicit copy-on-read by
+     * a block job).  A miss also prefetches the following clusters.  */
+    BDRV_REQ_PREFETCH           = 0x20,
 
     /* Mask of valid flags */
-    BDRV_REQ_MASK               = 0x1f,
+    BDRV_REQ_MASK               = 0x3f,
 } BdrvRequestFlags;
 
 typedef struct BlockSizes {
@@ -251,6 +255,30 @@ int coroutine_fn bdrv_co_writev(BdrvChild *child, int64_t sector_num,
  */
 int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                                        int count, BdrvRequestFlags flags);
+/*
+ * Copy a range of data from @src to @dst, letting the drivers offload the
+ * copy (e.g. to the host kernel) if they can. Returns -ENOTSUP if the copy
+ * can't be offloaded; in that case nothing has been written and the caller
+ * has to copy the data itself. Both offsets and @bytes must be aligned to
+ * the request alignment of the nodes. The only flag that is honoured is
+ * BDRV_REQ_NO_SERIALISING, which applies to the source.
+ */
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes, BdrvRequestFlags flags);
+/*
+ * Read @bytes at @offset of @child straight from the host file descriptor
+ * returned by bdrv_get_host_fd(), by calling @fn with the descriptor while
+ * the read is tracked like any other request.  @fn may yield; it should not
+ * wait for anything but the file itself, because drain waits for it.
+ * Returns -ENOTSUP if the node has no such descriptor, otherwise the return
+ * value of @fn.
+ */
+typedef int coroutine_fn BdrvHostReadFunc(void *opaque, int fd,
+                                          int64_t offset, unsigned int bytes);
+int coroutine_fn bdrv_co_host_read(BdrvChild *child, int64_t offset,
+                                   unsigned int bytes, BdrvHostReadFunc *fn,
+                                   void *opaque, BdrvRequestFlags flags);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
@@ -403,6 +431,7 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs);
+int bdrv_get_host_fd(BlockDriverState *bs);
 void bdrv_round_sectors_to_clusters(BlockDriverState *bs,
                                     int64_t sector_num, int nb_sectors,
                                     int64_t *cluster_sector_num,
@@ -38,6 +38,7 @@
 
 #define BLOCK_FLAG_ENCRYPT          1
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
+#define BLOCK_FLAG_EXTL2            16
 
 #define BLOCK_OPT_SIZE              "size"
 #define BLOCK_OPT_ENCRYPT           "encryption"
@@ -56,6 +57,7 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -167,6 +169,24 @@ struct BlockDriver {
         int64_t offset, int count, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_pdiscard)(BlockDriverState *bs,
         int64_t offset, int count);
+
+    /*
+     * Copy @bytes from @src to @dst without passing the data through a
+     * buffer in QEMU. The request is passed down through the source chain
+     * with bdrv_co_copy_range_from() (@bs is src->bs) until a driver that
+     * can do the copy calls bdrv_co_copy_range_to(), which is then passed
+     * down the destination chain (@bs is dst->bs). Drivers return -ENOTSUP
+     * if the copy can't be offloaded, and callers then fall back to reading
+     * and writing the data.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset,
+        BdrvChild *dst, uint64_t dst_offset,
+        uint64_t bytes, BdrvRequestFlags flags);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset,
+        BdrvChild *dst, uint64_t dst_offset,
+        uint64_t bytes, BdrvRequestFlags flags);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
@@ -224,6 +244,14 @@ struct BlockDriver {
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
 
+    /*
+     * Return a host file descriptor that contains the data of @bs at the
+     * same offsets, for users that want to read it without going through
+     * the block layer (e.g. with sendfile()).  Drivers that transform the
+     * data or bypass the host page cache must not implement this.
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs);
+
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
                                           int64_t pos);
@@ -320,6 +348,15 @@ struct BlockDriver {
     void (*bdrv_del_child)(BlockDriverState *parent, BdrvChild *child,
                            Error **errp);
 
+    /**
+     * Check whether a new persistent dirty bitmap with the given name and
+     * granularity can be stored in the image when it is closed.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -441,6 +478,8 @@ struct BlockDriverState {
 
     int copy_on_read; /* if nonzero, copy read backing sectors into image.
                          note this is a reference count */
+    bool cor_prefetch_in_flight;    /* copy-on-read prefetch running */
+    int64_t cor_prefetch_end;       /* end of the last prefetch window */
 
     CoQueue flush_queue;            /* Serializing flush queue */
     BdrvTrackedRequest *active_flush_req; /* Flush request in flight */
@@ -577,6 +616,13 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
 int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes, BdrvRequestFlags flags);
 
 int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
@@ -645,6 +691,8 @@ void bdrv_remove_aio_context_notifier(BlockDriverState *bs,
 int is_windows_drive(const char *filename);
 #endif
 
+#define STREAM_DEFAULT_WORKERS 4
+
 /**
  * stream_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -656,6 +704,7 @@ int is_windows_drive(const char *filename);
  * the new backing file if the job completes. Ignored if @base is %NULL.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @on_error: The action to take upon error.
+ * @max_workers: The maximum number of parallel copy requests.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @errp: Error object.
@@ -670,6 +719,7 @@ int is_windows_drive(const char *filename);
 void stream_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, const char *backing_file_str,
                   int64_t speed, BlockdevOnError on_error,
+                  int64_t max_workers,
                   BlockCompletionFunc *cb, void *opaque, Error **errp);
 
 /**
@@ -744,6 +794,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+#define BACKUP_DEFAULT_WORKERS 4
+
 /*
  * backup_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
@@ -755,6 +807,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
+ * @max_workers: The maximum number of parallel copy requests.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @txn: Transaction that this job is part of (may be NULL).
@@ -767,6 +820,7 @@ void backup_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
+                  int64_t max_workers,
                   BlockCompletionFunc *cb, void *opaque,
                   BlockJobTxn *txn, Error **errp);
 
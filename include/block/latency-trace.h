@@ -0,0 +1,85 @@
+/*
+ * QEMU block layer request latency tracing
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+#ifndef BLOCK_LATENCY_TRACE_H
+#define BLOCK_LATENCY_TRACE_H
+
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "block/accounting.h"
+#include "qapi-types.h"
+
+/*
+ * A span covers the time one request spends in one layer of the block
+ * graph: a BlockBackend, its throttle group or a BlockDriverState.
+ * Finished spans are appended to a ring buffer of the current thread;
+ * spans of the same coroutine that contain each other in time are then
+ * nested into a call stack when the trace is collected.
+ *
+ * When tracing is disabled, beginning and ending a span costs one load
+ * and one branch each.
+ */
+typedef struct BlockLatencySpan {
+    int64_t start_ns;           /* 0 if tracing was disabled at the start */
+} BlockLatencySpan;
+
+extern bool block_latency_trace_enabled;
+
+#define BLOCK_LATENCY_TRACE_DEFAULT_SIZE 65536
+
+static inline void block_latency_span_begin(BlockLatencySpan *span)
+{
+    span->start_ns = atomic_read(&block_latency_trace_enabled) ? get_clock()
+                                                               : 0;
+}
+
+void block_latency_span_record(BlockLatencySpan *span, enum BlockAcctType op,
+                               const char *kind, const char *name);
+
+/*
+ * block_latency_span_end:
+ *
+ * Finish @span. @kind names the layer ("blk", "throttle" or the
+ * format name of a driver), @name is the name of the device, throttle
+ * group or node and may be empty.
+ */
+static inline void block_latency_span_end(BlockLatencySpan *span,
+                                          enum BlockAcctType op,
+                                          const char *kind, const char *name)
+{
+    if (span->start_ns) {
+        block_latency_span_record(span, op, kind, name);
+    }
+}
+
+/*
+ * block_latency_trace_start:
+ *
+ * Discard the spans recorded so far and start tracing, keeping the last
+ * @size spans of each thread.
+ */
+void block_latency_trace_start(size_t size);
+
+/*
+ * block_latency_trace_stop:
+ *
+ * Stop tracing. The spans recorded so far can still be collected.
+ */
+void block_latency_trace_stop(void);
+
+/*
+ * block_latency_trace_collect:
+ *
+ * Nest the recorded spans into call stacks and return the time spent in
+ * each stack, excluding the time spent in its callees, sorted by stack.
+ * Each stack is a list of frames separated by semicolons, which is the
+ * folded format that flame graph tools take as input.
+ */
+BlockLatencyTraceStackList *block_latency_trace_collect(void);
+
+#endif
@@ -24,6 +24,16 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+typedef struct ThreadPoolStats {
+    int max_threads;
+    int threads;            /* worker threads, including starting ones */
+    int idle_threads;       /* ...of which waiting for a request */
+    int queued;             /* requests not picked up by a worker yet */
+    uint64_t completed;     /* requests run to completion so far */
+    uint64_t queue_wait_ns; /* total time spent by them in the queue */
+    uint64_t run_ns;        /* total time spent running them */
+} ThreadPoolStats;
+
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
@@ -34,4 +44,7 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+/* Can be called from any thread.  */
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats);
+
 #endif
@@ -28,6 +28,9 @@
 #include "qemu/throttle.h"
 #include "block/block_int.h"
 
+#define THROTTLE_GROUP_WEIGHT_DEFAULT 100
+#define THROTTLE_GROUP_WEIGHT_MAX     1000
+
 const char *throttle_group_get_name(BlockBackend *blk);
 
 ThrottleState *throttle_group_incref(const char *name);
@@ -35,6 +38,10 @@ void throttle_group_unref(ThrottleState *ts);
 
 void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg);
+void throttle_group_set_weight(BlockBackend *blk, unsigned int weight);
+unsigned int throttle_group_get_weight(BlockBackend *blk);
+
+ThrottleGroupInfoList *throttle_group_query_all(void);
 
 void throttle_group_register_blk(BlockBackend *blk, const char *groupname);
 void throttle_group_unregister_blk(BlockBackend *blk);
@@ -0,0 +1,98 @@
+/*
+ * QEMU Crypto AES using the AES-NI instructions
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef QCRYPTO_AESNI_H
+#define QCRYPTO_AESNI_H
+
+#include "crypto/aes.h"
+
+typedef struct QCryptoAESNIKey QCryptoAESNIKey;
+struct QCryptoAESNIKey {
+    /* Round keys, in the byte order used by the instructions */
+    uint8_t rd_key[AES_BLOCK_SIZE * (AES_MAXNR + 1)];
+    int rounds;
+};
+
+/**
+ * qcrypto_aesni_available:
+ *
+ * Determine whether QEMU was built with AES-NI support
+ * and the host CPU implements the instructions. None
+ * of the other functions in this file may be called
+ * unless this returns true.
+ *
+ * Returns: true if the AES-NI functions can be used
+ */
+bool qcrypto_aesni_available(void);
+
+/**
+ * qcrypto_aesni_set_key:
+ * @key: the raw key material
+ * @nkey: the length of @key in bytes, 16, 24 or 32
+ * @enc: filled with the encryption key schedule
+ * @dec: filled with the decryption key schedule
+ *
+ * Expand @key into the round keys used by the other
+ * functions in this file.
+ *
+ * Returns: 0 on success, -1 if @nkey is not valid
+ */
+int qcrypto_aesni_set_key(const uint8_t *key, size_t nkey,
+                          QCryptoAESNIKey *enc, QCryptoAESNIKey *dec);
+
+/*
+ * The functions below process @len bytes from @in to @out,
+ * which may be the same buffer. @len must be a multiple of
+ * AES_BLOCK_SIZE. The CBC and XTS functions update @iv so
+ * that a following call continues where this one stopped,
+ * like AES_cbc_encrypt() and xts_encrypt() do.
+ */
+void qcrypto_aesni_ecb_encrypt(const QCryptoAESNIKey *key,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len);
+void qcrypto_aesni_ecb_decrypt(const QCryptoAESNIKey *key,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len);
+
+void qcrypto_aesni_cbc_encrypt(const QCryptoAESNIKey *key, uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len);
+void qcrypto_aesni_cbc_decrypt(const QCryptoAESNIKey *key, uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len);
+
+/*
+ * @tweak_enc and @tweak_dec are the two schedules of the tweak
+ * key; the latter is needed to hand back the updated @iv.
+ */
+void qcrypto_aesni_xts_encrypt(const QCryptoAESNIKey *key,
+                               const QCryptoAESNIKey *tweak_enc,
+                               const QCryptoAESNIKey *tweak_dec,
+                               uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len);
+void qcrypto_aesni_xts_decrypt(const QCryptoAESNIKey *key,
+                               const QCryptoAESNIKey *tweak_enc,
+                               const QCryptoAESNIKey *tweak_dec,
+                               uint8_t *iv,
+                               const uint8_t *in, uint8_t *out,
+                               size_t len);
+
+#endif /* QCRYPTO_AESNI_H */
@@ -74,12 +74,18 @@ typedef enum {
  * @readfunc: callback for reading data from the volume
  * @opaque: data to pass to @readfunc
  * @flags: bitmask of QCryptoBlockOpenFlags values
+ * @n_threads: maximum number of threads that will perform
+ *             encryption or decryption concurrently
  * @errp: pointer to a NULL-initialized error object
  *
  * Create a new block encryption object for an existing
  * storage volume encrypted with format identified by
  * the parameters in @options.
  *
+ * Up to @n_threads callers may invoke qcrypto_block_encrypt()
+ * and qcrypto_block_decrypt() at the same time, each using
+ * its own cipher instance.
+ *
  * This will use @readfunc to initialize the encryption
  * context based on the volume header(s), extracting the
  * master key(s) as required.
@@ -105,6 +111,7 @@ QCryptoBlock *qcrypto_block_open(QCryptoBlockOpenOptions *options,
                                  QCryptoBlockReadFunc readfunc,
                                  void *opaque,
                                  unsigned int flags,
+                                 size_t n_threads,
                                  Error **errp);
 
 /**
@@ -196,7 +203,9 @@ int qcrypto_block_encrypt(QCryptoBlock *block,
  * qcrypto_block_get_cipher:
  * @block: the block encryption object
  *
- * Get the cipher to use for payload encryption
+ * Get the cipher to use for payload encryption. If the
+ * block was opened for several threads, this is the first
+ * of its cipher instances.
  *
  * Returns: the cipher object
  */
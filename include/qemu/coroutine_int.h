@@ -28,6 +28,11 @@
 #include "qemu/queue.h"
 #include "qemu/coroutine.h"
 
+/* Set with configure --with-coroutine-stack-size.  Stacks are mapped
+ * lazily, so this bounds rather than sets the memory used per coroutine.
+ */
+#define COROUTINE_STACK_SIZE CONFIG_COROUTINE_STACK_SIZE
+
 typedef enum {
     COROUTINE_YIELD = 1,
     COROUTINE_TERMINATE = 2,
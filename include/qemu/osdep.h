@@ -198,6 +198,32 @@ void *qemu_anon_ram_alloc(size_t size, uint64_t *align);
 void qemu_vfree(void *ptr);
 void qemu_anon_ram_free(void *ptr, size_t size);
 
+/**
+ * qemu_alloc_stack:
+ * @sz: pointer to the requested usable size of the stack
+ *
+ * Allocate memory to be used as a stack, for instance by coroutines.
+ * Like g_malloc(), abort if the memory cannot be allocated.  A guard
+ * page is added below the stack so that an overflow crashes instead of
+ * corrupting other memory, and only the pages that are touched take up
+ * physical memory.  The guard page and the rounding to the host page
+ * size increase *@sz.
+ *
+ * The stack must be freed with qemu_free_stack().
+ *
+ * Returns: the lowest address of the allocated memory
+ */
+void *qemu_alloc_stack(size_t *sz);
+
+/**
+ * qemu_free_stack:
+ * @stack: the stack as returned by qemu_alloc_stack()
+ * @sz: the size returned by qemu_alloc_stack() in *@sz
+ *
+ * Free a stack allocated with qemu_alloc_stack().
+ */
+void qemu_free_stack(void *stack, size_t sz);
+
 #define QEMU_MADV_INVALID -1
 
 #if defined(CONFIG_MADVISE)
@@ -76,6 +76,17 @@ typedef struct BlockBackendPublic {
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
     QLIST_ENTRY(BlockBackendPublic) round_robin;
+
+    /* Weighted fair queuing between the members of the group: the share
+     * of the group's limits that this BlockBackend gets, and the virtual
+     * time at which its last request finished */
+    unsigned int   throttle_weight;
+    uint64_t       throttle_vtime[2];
+
+    /* Statistics: number of requests that had to wait, and the total time
+     * they spent waiting */
+    uint64_t       throttled_reqs_count[2];
+    uint64_t       throttle_wait_ns[2];
 } BlockBackendPublic;
 
 BlockBackend *blk_new(void);
@@ -119,6 +130,15 @@ int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
 int coroutine_fn blk_co_pwritev(BlockBackend *blk, int64_t offset,
                                unsigned int bytes, QEMUIOVector *qiov,
                                BdrvRequestFlags flags);
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   unsigned int bytes, BdrvRequestFlags flags);
+int coroutine_fn blk_co_host_read(BlockBackend *blk, int64_t offset,
+                                  unsigned int bytes, BdrvHostReadFunc *fn,
+                                  void *opaque);
+int blk_copy_range(BlockBackend *blk_in, int64_t off_in,
+                   BlockBackend *blk_out, int64_t off_out,
+                   unsigned int bytes, BdrvRequestFlags flags);
 int blk_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                       int count, BdrvRequestFlags flags);
 BlockAIOCB *blk_aio_pwrite_zeroes(BlockBackend *blk, int64_t offset,
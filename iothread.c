@@ -16,10 +16,12 @@
 #include "qom/object_interfaces.h"
 #include "qemu/module.h"
 #include "block/aio.h"
+#include "block/thread-pool.h"
 #include "sysemu/iothread.h"
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -174,3 +176,66 @@ IOThreadInfoList *qmp_query_iothreads(Error **errp)
     object_child_foreach(container, query_one_iothread, &prev);
     return head;
 }
+
+static void add_thread_pool_info(ThreadPoolInfoList ***prev, AioContext *ctx,
+                                 IOThread *iothread)
+{
+    ThreadPoolInfoList *elem;
+    ThreadPoolInfo *info;
+    ThreadPoolStats stats;
+    ThreadPool *pool;
+
+    /* The pool is created lazily by the thread that runs ctx, but never
+     * freed before ctx is.  ThreadPool is opaque here, so atomic_rcu_read()
+     * cannot be used.  */
+    pool = ctx->thread_pool;
+    /* Pairs with atomic_rcu_set() in aio_get_thread_pool() */
+    smp_read_barrier_depends();
+    if (!pool) {
+        return;
+    }
+    thread_pool_get_stats(pool, &stats);
+
+    info = g_new0(ThreadPoolInfo, 1);
+    if (iothread) {
+        info->has_iothread = true;
+        info->iothread = iothread_get_id(iothread);
+    }
+    info->max_threads = stats.max_threads;
+    info->threads = stats.threads;
+    info->idle_threads = stats.idle_threads;
+    info->queued = stats.queued;
+    info->completed = stats.completed;
+    info->queue_wait_ns = stats.queue_wait_ns;
+    info->run_ns = stats.run_ns;
+
+    elem = g_new0(ThreadPoolInfoList, 1);
+    elem->value = info;
+    elem->next = NULL;
+
+    **prev = elem;
+    *prev = &elem->next;
+}
+
+static int query_one_thread_pool(Object *object, void *opaque)
+{
+    ThreadPoolInfoList ***prev = opaque;
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (iothread) {
+        add_thread_pool_info(prev, iothread->ctx, iothread);
+    }
+    return 0;
+}
+
+ThreadPoolInfoList *qmp_query_thread_pools(Error **errp)
+{
+    ThreadPoolInfoList *head = NULL;
+    ThreadPoolInfoList **prev = &head;
+    Object *container = object_get_objects_root();
+
+    add_thread_pool_info(&prev, qemu_get_aio_context(), NULL);
+    object_child_foreach(container, query_one_thread_pool, &prev);
+    return head;
+}
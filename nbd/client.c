@@ -20,7 +20,7 @@
 #include "qapi/error.h"
 #include "nbd-internal.h"
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -309,6 +309,194 @@ static int nbd_receive_query_exports(QIOChannel *ioc,
     return 0;
 }
 
+/* Send option @opt with a payload of @len bytes from @data.  */
+static int nbd_send_option_request(QIOChannel *ioc, uint32_t opt,
+                                   uint32_t len, const char *data,
+                                   Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t be_opt = cpu_to_be32(opt);
+    uint32_t be_len = cpu_to_be32(len);
+
+    if (write_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send option magic");
+        return -1;
+    }
+    if (write_sync(ioc, &be_opt, sizeof(be_opt)) != sizeof(be_opt)) {
+        error_setg(errp, "Failed to send option number");
+        return -1;
+    }
+    if (write_sync(ioc, &be_len, sizeof(be_len)) != sizeof(be_len)) {
+        error_setg(errp, "Failed to send option length");
+        return -1;
+    }
+    if (len && write_sync(ioc, (char *)data, len) != len) {
+        error_setg(errp, "Failed to send option data");
+        return -1;
+    }
+    return 0;
+}
+
+/* Receive the header of a reply to option @opt.  Return 1 with @type and
+ * @len filled in, 0 if the server does not support the option (the error
+ * reply has been consumed), or -1 with errp set.  */
+static int nbd_receive_option_reply(QIOChannel *ioc, uint32_t opt,
+                                    uint32_t *type, uint32_t *len,
+                                    Error **errp)
+{
+    uint64_t magic;
+    uint32_t reply_opt;
+    int ret;
+
+    if (read_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "failed to read option magic");
+        return -1;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+        error_setg(errp, "Unexpected option magic");
+        return -1;
+    }
+    if (read_sync(ioc, &reply_opt, sizeof(reply_opt)) != sizeof(reply_opt)) {
+        error_setg(errp, "failed to read option");
+        return -1;
+    }
+    reply_opt = be32_to_cpu(reply_opt);
+    if (reply_opt != opt) {
+        error_setg(errp, "Unexpected option type %" PRIx32 " expected %x",
+                   reply_opt, opt);
+        return -1;
+    }
+    if (read_sync(ioc, type, sizeof(*type)) != sizeof(*type)) {
+        error_setg(errp, "failed to read option type");
+        return -1;
+    }
+    *type = be32_to_cpu(*type);
+    ret = nbd_handle_reply_err(ioc, opt, *type, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+    if (read_sync(ioc, len, sizeof(*len)) != sizeof(*len)) {
+        error_setg(errp, "failed to read option length");
+        return -1;
+    }
+    *len = be32_to_cpu(*len);
+    return 1;
+}
+
+/* Select the "base:allocation" meta context for export @name, so that
+ * NBD_CMD_BLOCK_STATUS can be used.  */
+static int nbd_receive_meta_context(QIOChannel *ioc, const char *name,
+                                    NBDExtensions *ext, Error **errp)
+{
+    const char *context = NBD_META_CONTEXT_BASE_ALLOCATION;
+    uint32_t namelen = strlen(name);
+    uint32_t ctxlen = strlen(context);
+    uint32_t len = 4 + namelen + 4 + 4 + ctxlen;
+    uint32_t type, id;
+    char *data;
+    int ret;
+
+    /* Payload: export name, one query for the context */
+    data = g_malloc(len);
+    stl_be_p(data, namelen);
+    memcpy(data + 4, name, namelen);
+    stl_be_p(data + 4 + namelen, 1);
+    stl_be_p(data + 8 + namelen, ctxlen);
+    memcpy(data + 12 + namelen, context, ctxlen);
+
+    TRACE("Requesting meta context '%s'", context);
+    ret = nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, len, data,
+                                  errp);
+    g_free(data);
+    if (ret < 0) {
+        return -1;
+    }
+
+    while (1) {
+        char *reply_name;
+
+        ret = nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT,
+                                       &type, &len, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+        if (type == NBD_REP_ACK) {
+            if (len != 0) {
+                error_setg(errp, "length too long for option end");
+                return -1;
+            }
+            break;
+        }
+        if (type != NBD_REP_META_CONTEXT) {
+            error_setg(errp, "Unexpected reply type %" PRIx32 " expected %x",
+                       type, NBD_REP_META_CONTEXT);
+            return -1;
+        }
+        if (len < sizeof(id) || len > sizeof(id) + NBD_MAX_BUFFER_SIZE) {
+            error_setg(errp, "incorrect option length");
+            return -1;
+        }
+        if (read_sync(ioc, &id, sizeof(id)) != sizeof(id)) {
+            error_setg(errp, "failed to read meta context ID");
+            return -1;
+        }
+        len -= sizeof(id);
+        reply_name = g_malloc(len + 1);
+        if (read_sync(ioc, reply_name, len) != len) {
+            error_setg(errp, "failed to read meta context name");
+            g_free(reply_name);
+            return -1;
+        }
+        reply_name[len] = '\0';
+        if (!strcmp(reply_name, context)) {
+            ext->base_allocation = true;
+            ext->meta_context_id = be32_to_cpu(id);
+            TRACE("Using meta context %" PRIu32 " for '%s'",
+                  ext->meta_context_id, reply_name);
+        } else {
+            TRACE("Ignoring meta context '%s'", reply_name);
+        }
+        g_free(reply_name);
+    }
+    return 0;
+}
+
+/* Negotiate the extensions asked for in @want; @ext tells which ones the
+ * server agreed to.  Unsupported extensions are not an error.  */
+static int nbd_receive_extensions(QIOChannel *ioc, const char *name,
+                                  const NBDExtensions *want,
+                                  NBDExtensions *ext, Error **errp)
+{
+    uint32_t type, len;
+    int ret;
+
+    if (!want->structured_reply) {
+        return 0;
+    }
+
+    TRACE("Requesting structured replies");
+    if (nbd_send_option_request(ioc, NBD_OPT_STRUCTURED_REPLY, 0, NULL,
+                                errp) < 0) {
+        return -1;
+    }
+    ret = nbd_receive_option_reply(ioc, NBD_OPT_STRUCTURED_REPLY,
+                                   &type, &len, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+    if (type != NBD_REP_ACK || len != 0) {
+        error_setg(errp, "Unexpected reply %" PRIx32 " to structured reply "
+                   "request", type);
+        return -1;
+    }
+    ext->structured_reply = true;
+
+    if (want->base_allocation) {
+        return nbd_receive_meta_context(ioc, name, ext, errp);
+    }
+    return 0;
+}
+
 static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
                                         QCryptoTLSCreds *tlscreds,
                                         const char *hostname, Error **errp)
@@ -411,10 +599,11 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
                           QIOChannel **outioc,
-                          off_t *size, Error **errp)
+                          off_t *size, NBDExtensions *ext, Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
+    NBDExtensions want = { 0 };
     int rc;
 
     TRACE("Receiving negotiation tlscreds=%p hostname=%s.",
@@ -425,6 +614,10 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
     if (outioc) {
         *outioc = NULL;
     }
+    if (ext) {
+        want = *ext;
+        memset(ext, 0, sizeof(*ext));
+    }
     if (tlscreds && !outioc) {
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
@@ -515,6 +708,10 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+            if (ext &&
+                nbd_receive_extensions(ioc, name, &want, ext, errp) < 0) {
+                goto fail;
+            }
         }
         /* write the export name */
         magic = cpu_to_be64(magic);
@@ -736,16 +933,16 @@ ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
@@ -754,12 +951,46 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
+
+       Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags
+       [ 6 ..  7]    type
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
      */
 
     magic = ldl_be_p(buf);
-    reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* The rest of the header is already on its way, wait for it */
+        do {
+            ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                            NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+            if (ret == -EAGAIN) {
+                qio_channel_wait(ioc, G_IO_IN);
+            }
+        } while (ret == -EAGAIN);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->structured = true;
+        reply->error = 0;
+        reply->flags = lduw_be_p(buf + 4);
+        reply->type = lduw_be_p(buf + 6);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got structured reply: { .flags = %" PRIx16 ", .type = %" PRIu16
+              ", handle = %" PRIu64 ", length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
+    reply->structured = false;
+    reply->error = ldl_be_p(buf + 4);
     reply->error = nbd_errno_to_system_errno(reply->error);
 
     TRACE("Got reply: { magic = 0x%" PRIx32 ", .error = % " PRId32
@@ -772,4 +1003,3 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
     }
     return 0;
 }
-
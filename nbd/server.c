@@ -18,7 +18,11 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "block/thread-pool.h"
 #include "nbd-internal.h"
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
 
 static int system_errno_to_nbd_errno(int err)
 {
@@ -70,6 +74,8 @@ struct NBDExport {
     AioContext *ctx;
 
     Notifier eject_notifier;
+
+    bool no_sendfile;   /* sendfile() failed on the image file */
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -91,6 +97,9 @@ struct NBDClient {
 
     bool can_read;
 
+    bool structured_reply;  /* NBD_OPT_STRUCTURED_REPLY negotiated */
+    bool base_allocation;   /* "base:allocation" meta context selected */
+
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
@@ -98,6 +107,12 @@ struct NBDClient {
 
 /* That's all folks */
 
+/* Meta context ID of "base:allocation", the only context we export */
+#define NBD_META_ID_BASE_ALLOCATION 1
+
+/* Maximum number of extents in a NBD_CMD_BLOCK_STATUS reply */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 1024
+
 static void nbd_set_handlers(NBDClient *client);
 static void nbd_unset_handlers(NBDClient *client);
 static void nbd_update_can_read(NBDClient *client);
@@ -192,12 +207,15 @@ static ssize_t nbd_negotiate_drop_sync(QIOChannel *ioc, size_t size)
 
 */
 
-static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+/* Send an option reply header announcing @len bytes of payload, which the
+ * caller must write next.  */
+static int nbd_negotiate_send_rep_len(QIOChannel *ioc, uint32_t type,
+                                      uint32_t opt, uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
-    TRACE("Reply opt=%" PRIx32 " type=%" PRIx32, type, opt);
+    TRACE("Reply opt=%" PRIx32 " type=%" PRIx32 " len=%" PRIu32,
+          type, opt, len);
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (nbd_negotiate_write(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -214,7 +232,7 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (nbd_negotiate_write(ioc, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -222,6 +240,11 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+{
+    return nbd_negotiate_send_rep_len(ioc, type, opt, 0);
+}
+
 static int nbd_negotiate_send_rep_list(QIOChannel *ioc, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -317,6 +340,146 @@ fail:
     return rc;
 }
 
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                uint32_t length)
+{
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID,
+                                      NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    TRACE("Client requested structured replies");
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+/* Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.  The only
+ * context we know about is "base:allocation", which maps block status
+ * to NBD_CMD_BLOCK_STATUS replies.  */
+static int nbd_negotiate_handle_meta_context(NBDClient *client, uint32_t opt,
+                                             uint32_t length)
+{
+    const char *context = NBD_META_CONTEXT_BASE_ALLOCATION;
+    char name[NBD_MAX_NAME_SIZE + 1];
+    char query[sizeof(NBD_META_CONTEXT_BASE_ALLOCATION)];
+    uint32_t namelen, nr_queries, querylen, id;
+    bool match = false;
+    int ret;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3]    number of queries
+        ...           queries, each a 32 bit length followed by a string
+     */
+    if (!client->structured_reply) {
+        TRACE("Meta contexts require structured replies");
+        goto invalid;
+    }
+
+    if (length < sizeof(namelen) + sizeof(nr_queries)) {
+        goto invalid;
+    }
+    if (nbd_negotiate_read(client->ioc, &namelen, sizeof(namelen)) !=
+        sizeof(namelen)) {
+        return -EIO;
+    }
+    namelen = be32_to_cpu(namelen);
+    length -= sizeof(namelen);
+    if (namelen > NBD_MAX_NAME_SIZE || namelen > length - sizeof(nr_queries)) {
+        goto invalid;
+    }
+    if (nbd_negotiate_read(client->ioc, name, namelen) != namelen) {
+        return -EIO;
+    }
+    name[namelen] = '\0';
+    length -= namelen;
+
+    if (nbd_negotiate_read(client->ioc, &nr_queries, sizeof(nr_queries)) !=
+        sizeof(nr_queries)) {
+        return -EIO;
+    }
+    nr_queries = be32_to_cpu(nr_queries);
+    length -= sizeof(nr_queries);
+
+    if (!nbd_export_find(name)) {
+        TRACE("Meta context requested for unknown export '%s'", name);
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_UNKNOWN, opt);
+    }
+
+    /* Listing with no queries returns all contexts */
+    if (opt == NBD_OPT_LIST_META_CONTEXT && nr_queries == 0) {
+        match = true;
+    }
+
+    while (nr_queries--) {
+        if (length < sizeof(querylen)) {
+            goto invalid;
+        }
+        if (nbd_negotiate_read(client->ioc, &querylen, sizeof(querylen)) !=
+            sizeof(querylen)) {
+            return -EIO;
+        }
+        querylen = be32_to_cpu(querylen);
+        length -= sizeof(querylen);
+        if (querylen > length) {
+            goto invalid;
+        }
+
+        if (querylen == strlen(context) ||
+            (opt == NBD_OPT_LIST_META_CONTEXT && querylen == strlen("base:"))) {
+            if (nbd_negotiate_read(client->ioc, query, querylen) != querylen) {
+                return -EIO;
+            }
+            query[querylen] = '\0';
+            TRACE("Client queried meta context '%s'", query);
+            if (!strcmp(query, context) ||
+                (opt == NBD_OPT_LIST_META_CONTEXT && !strcmp(query, "base:"))) {
+                match = true;
+            }
+        } else if (nbd_negotiate_drop_sync(client->ioc, querylen) !=
+                   querylen) {
+            return -EIO;
+        }
+        length -= querylen;
+    }
+    if (length) {
+        goto invalid;
+    }
+
+    if (match) {
+        ret = nbd_negotiate_send_rep_len(client->ioc, NBD_REP_META_CONTEXT,
+                                         opt, sizeof(id) + strlen(context));
+        if (ret < 0) {
+            return ret;
+        }
+        id = cpu_to_be32(NBD_META_ID_BASE_ALLOCATION);
+        if (nbd_negotiate_write(client->ioc, &id, sizeof(id)) != sizeof(id) ||
+            nbd_negotiate_write(client->ioc, (char *)context,
+                                strlen(context)) != strlen(context)) {
+            LOG("write failed (meta context)");
+            return -EINVAL;
+        }
+    }
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        client->base_allocation = match;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+
+invalid:
+    if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+        return -EIO;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+}
+
 
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
                                                  uint32_t length)
@@ -505,6 +668,23 @@ static int nbd_negotiate_options(NBDClient *client)
                     return ret;
                 }
                 break;
+
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_handle_meta_context(client, clientflags,
+                                                        length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             default:
                 TRACE("Unsupported option 0x%" PRIx32, clientflags);
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
@@ -663,11 +843,8 @@ static ssize_t nbd_receive_request(QIOChannel *ioc, struct nbd_request *request)
     return 0;
 }
 
-static ssize_t nbd_send_reply(QIOChannel *ioc, struct nbd_reply *reply)
+static void nbd_set_reply_header(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     reply->error = system_errno_to_nbd_errno(reply->error);
 
     TRACE("Sending response to client: { .error = %" PRId32
@@ -682,7 +859,14 @@ static ssize_t nbd_send_reply(QIOChannel *ioc, struct nbd_reply *reply)
     stl_be_p(buf, NBD_REPLY_MAGIC);
     stl_be_p(buf + 4, reply->error);
     stq_be_p(buf + 8, reply->handle);
+}
+
+static ssize_t nbd_send_reply(QIOChannel *ioc, struct nbd_reply *reply)
+{
+    uint8_t buf[NBD_REPLY_SIZE];
+    ssize_t ret;
 
+    nbd_set_reply_header(buf, reply);
     ret = write_sync(ioc, buf, sizeof(buf));
     if (ret < 0) {
         return ret;
@@ -970,6 +1154,408 @@ static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
     return rc;
 }
 
+static ssize_t nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                               unsigned niov)
+{
+    size_t size = iov_size(iov, niov);
+    ssize_t rc;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    rc = nbd_wr_syncv(client->ioc, iov, niov, size, false);
+    if (rc != size) {
+        LOG("writing to socket failed");
+        rc = -EIO;
+    } else {
+        rc = 0;
+    }
+
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+}
+
+/* Return whether the payload of a read can be sent with sendfile(),
+ * bypassing the bounce buffer, instead of going through blk_pread().  This
+ * is only the case for plain sockets (no TLS) and for exports whose image
+ * is a file in the host page cache, with nothing in between that changes
+ * the data or limits the I/O.  */
+static bool nbd_export_can_sendfile(NBDClient *client)
+{
+#ifdef CONFIG_SENDFILE
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+
+    return !exp->no_sendfile && bs &&
+           client->ioc == QIO_CHANNEL(client->sioc) &&
+           !blk_get_public(exp->blk)->throttle_state &&
+           bdrv_get_host_fd(bs) >= 0;
+#else
+    return false;
+#endif
+}
+
+#ifdef CONFIG_SENDFILE
+typedef struct NBDSendfileData {
+    NBDClient *client;
+    int sockfd;
+    int fd;
+    off_t offset;
+    size_t len;
+    size_t done;
+    bool eof;
+} NBDSendfileData;
+
+/* Runs in the thread pool, so that page cache misses on the image file
+ * do not stall the AioContext.  The socket is non-blocking; return
+ * -EAGAIN as soon as it is full, so that the worker is not tied to how
+ * fast the client reads.  */
+static int nbd_sendfile_worker(void *opaque)
+{
+    static const uint8_t zero_buf[4096];
+    NBDSendfileData *data = opaque;
+    ssize_t n;
+
+    while (data->done < data->len) {
+        size_t len = data->len - data->done;
+
+        if (!data->eof) {
+            n = sendfile(data->sockfd, data->fd, &data->offset, len);
+        } else {
+            /* Like raw-posix, read the part past the end of file as
+             * zeroes (the last sector of an unaligned image) */
+            n = send(data->sockfd, zero_buf, MIN(len, sizeof(zero_buf)), 0);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (n == 0) {
+            if (data->eof) {
+                return -EIO;
+            }
+            data->eof = true;
+            continue;
+        }
+        data->done += n;
+    }
+    return 0;
+}
+
+/* Called by blk_co_host_read() while the read is tracked */
+static int coroutine_fn nbd_sendfile_co(void *opaque, int fd,
+                                        int64_t offset, unsigned int bytes)
+{
+    NBDSendfileData *data = opaque;
+    ThreadPool *pool = aio_get_thread_pool(data->client->exp->ctx);
+
+    assert(data->done + bytes == data->len);
+    data->fd = fd;
+    data->offset = offset;
+    return thread_pool_submit_co(pool, nbd_sendfile_worker, data);
+}
+#endif
+
+/* Send @iov followed by @len bytes of the export at @dev_pos, which are
+ * sent straight from the image file with sendfile().  If that is not
+ * possible, the data is read through the block layer instead, and after
+ * sendfile() itself failed the export does not try again.  The reply has
+ * been started when the image is read, so unlike the bounce buffer path a
+ * read error can only be reported by dropping the connection.  */
+static int nbd_co_send_iov_from_file(NBDRequest *req, struct iovec *iov,
+                                     unsigned niov, uint64_t dev_pos,
+                                     uint32_t len)
+{
+#ifdef CONFIG_SENDFILE
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    NBDSendfileData data = {
+        .client = client,
+        .sockfd = client->sioc->fd,
+        .len = len,
+    };
+    size_t size = iov_size(iov, niov);
+    ssize_t rc;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    nbd_set_handlers(client);
+
+    qio_channel_set_cork(client->ioc, true);
+    rc = nbd_wr_syncv(client->ioc, iov, niov, size, false);
+    if (rc != size) {
+        LOG("writing to socket failed");
+        rc = -EIO;
+        goto out;
+    }
+
+    /* The write handler must not enter us while we wait for the thread
+     * pool, only while we wait for the socket.  That wait happens outside
+     * of the tracked read, so that draining the export does not depend on
+     * the client.  */
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+
+    do {
+        rc = blk_co_host_read(exp->blk, dev_pos + data.done, len - data.done,
+                              nbd_sendfile_co, &data);
+        if (rc == -EAGAIN) {
+            client->send_coroutine = qemu_coroutine_self();
+            nbd_set_handlers(client);
+            qemu_coroutine_yield();
+            client->send_coroutine = NULL;
+            nbd_set_handlers(client);
+        }
+    } while (rc == -EAGAIN);
+
+    if ((rc == -ENOTSUP || rc == -EINVAL || rc == -ENOSYS) && data.done == 0) {
+        if (rc != -ENOTSUP) {
+            TRACE("sendfile() not supported for the image, disabling it");
+            exp->no_sendfile = true;
+        }
+        rc = blk_pread(exp->blk, dev_pos, req->data, len);
+        if (rc >= 0) {
+            client->send_coroutine = qemu_coroutine_self();
+            nbd_set_handlers(client);
+            rc = write_sync(client->ioc, req->data, len) == len ? 0 : -EIO;
+        }
+    }
+    if (rc < 0) {
+        LOG("sending file data failed: %s", strerror(-rc));
+    }
+
+out:
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    nbd_set_handlers(client);
+    qemu_co_mutex_unlock(&client->send_lock);
+    return rc;
+#else
+    abort();
+#endif
+}
+
+static void nbd_set_structured_header(uint8_t *buf, uint64_t handle,
+                                      uint16_t flags, uint16_t type,
+                                      uint32_t length)
+{
+    TRACE("Sending structured chunk: { .flags = %" PRIx16 ", .type = %" PRIu16
+          ", handle = %" PRIu64 ", length = %" PRIu32 " }",
+          flags, type, handle, length);
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_*)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, length);
+}
+
+/* Send a structured reply chunk.  The payload is in iov[1] ... iov[niov - 1],
+ * iov[0] is filled in with the chunk header.  */
+static ssize_t nbd_co_send_structured_chunk(NBDClient *client, uint64_t handle,
+                                            uint16_t flags, uint16_t type,
+                                            struct iovec *iov, unsigned niov)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+
+    nbd_set_structured_header(buf, handle, flags, type,
+                              iov_size(iov + 1, niov - 1));
+    iov[0].iov_base = buf;
+    iov[0].iov_len = sizeof(buf);
+    return nbd_co_send_iov(client, iov, niov);
+}
+
+static ssize_t nbd_co_send_structured_error(NBDClient *client, uint64_t handle,
+                                            uint32_t error)
+{
+    uint8_t payload[4 + 2];
+    struct iovec iov[2] = {
+        [1] = { .iov_base = payload, .iov_len = sizeof(payload) },
+    };
+
+    /* Payload: 32 bit error, 16 bit message length (no message) */
+    stl_be_p(payload, system_errno_to_nbd_errno(error));
+    stw_be_p(payload + 4, 0);
+    return nbd_co_send_structured_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                                        NBD_REPLY_TYPE_ERROR, iov, 2);
+}
+
+/* Reply to NBD_CMD_READ with structured chunks.  Ranges that read as zero
+ * are sent as NBD_REPLY_TYPE_OFFSET_HOLE instead of going over the wire.
+ * A read error is reported to the client with an error chunk; the return
+ * value is negative only if the reply could not be sent.  */
+static int nbd_co_send_sparse_read(NBDRequest *req, uint64_t handle,
+                                   uint64_t offset, uint32_t size)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint32_t progress = 0;
+    bool sendfile = nbd_export_can_sendfile(client);
+    int ret;
+
+    while (progress < size) {
+        uint64_t pos = offset + progress;
+        uint64_t dev_pos = pos + exp->dev_offset;
+        uint32_t len = size - progress;
+        uint16_t flags = 0;
+        bool hole = false;
+        uint8_t buf[8 + 4];
+        struct iovec iov[3];
+
+        if (bs && QEMU_IS_ALIGNED(dev_pos, BDRV_SECTOR_SIZE) &&
+            len >= BDRV_SECTOR_SIZE) {
+            BlockDriverState *file;
+            int pnum;
+            int64_t status;
+
+            status = bdrv_get_block_status_above(bs, NULL,
+                                                 dev_pos >> BDRV_SECTOR_BITS,
+                                                 len >> BDRV_SECTOR_BITS,
+                                                 &pnum, &file);
+            if (status >= 0 && pnum > 0) {
+                hole = status & BDRV_BLOCK_ZERO;
+                len = pnum << BDRV_SECTOR_BITS;
+            }
+        }
+        if (progress + len == size) {
+            flags |= NBD_REPLY_FLAG_DONE;
+        }
+
+        stq_be_p(buf, pos);
+        if (hole) {
+            /* Payload: 64 bit offset, 32 bit hole size */
+            stl_be_p(buf + 8, len);
+            iov[1].iov_base = buf;
+            iov[1].iov_len = 8 + 4;
+            ret = nbd_co_send_structured_chunk(client, handle, flags,
+                                               NBD_REPLY_TYPE_OFFSET_HOLE,
+                                               iov, 2);
+        } else if (sendfile) {
+            uint8_t hdr[NBD_STRUCTURED_REPLY_SIZE];
+
+            nbd_set_structured_header(hdr, handle, flags,
+                                      NBD_REPLY_TYPE_OFFSET_DATA, 8 + len);
+            iov[0].iov_base = hdr;
+            iov[0].iov_len = sizeof(hdr);
+            iov[1].iov_base = buf;
+            iov[1].iov_len = 8;
+            ret = nbd_co_send_iov_from_file(req, iov, 2, dev_pos, len);
+        } else {
+            ret = blk_pread(exp->blk, dev_pos, req->data + progress, len);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_structured_error(client, handle, -ret);
+            }
+
+            /* Payload: 64 bit offset, data */
+            iov[1].iov_base = buf;
+            iov[1].iov_len = 8;
+            iov[2].iov_base = req->data + progress;
+            iov[2].iov_len = len;
+            ret = nbd_co_send_structured_chunk(client, handle, flags,
+                                               NBD_REPLY_TYPE_OFFSET_DATA,
+                                               iov, 3);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        progress += len;
+    }
+
+    TRACE("Read %" PRIu32 " byte(s)", size);
+    return 0;
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS for the "base:allocation" context.  As
+ * for reads, errors are sent to the client and the return value is only
+ * negative if that failed.  */
+static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
+                                    uint64_t offset, uint32_t length,
+                                    bool only_one)
+{
+    NBDExport *exp = client->exp;
+    BlockDriverState *bs = blk_bs(exp->blk);
+    unsigned max_extents = only_one ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    unsigned nb_extents = 0;
+    uint32_t *payload;
+    uint32_t progress = 0;
+    struct iovec iov[2];
+    int ret;
+
+    if (!bs) {
+        return nbd_co_send_structured_error(client, handle, ENOMEDIUM);
+    }
+
+    /* Payload: 32 bit context ID, then pairs of 32 bit length and flags */
+    payload = g_new(uint32_t, 1 + 2 * max_extents);
+    stl_be_p(&payload[0], NBD_META_ID_BASE_ALLOCATION);
+
+    while (progress < length) {
+        uint64_t dev_pos = offset + progress + exp->dev_offset;
+        uint32_t head = dev_pos & (BDRV_SECTOR_SIZE - 1);
+        uint32_t len = length - progress;
+        BlockDriverState *file;
+        int64_t status;
+        uint32_t flags;
+        int pnum;
+
+        status = bdrv_get_block_status_above(bs, NULL,
+                                             dev_pos >> BDRV_SECTOR_BITS,
+                                             DIV_ROUND_UP((uint64_t)head + len,
+                                                          BDRV_SECTOR_SIZE),
+                                             &pnum, &file);
+        if (status < 0 || pnum == 0) {
+            if (nb_extents) {
+                /* Report what we have, the client will ask again */
+                break;
+            }
+            g_free(payload);
+            return nbd_co_send_structured_error(client, handle,
+                                                status < 0 ? -status : EIO);
+        }
+
+        flags = (status & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (status & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        len = MIN(len, ((uint64_t)pnum << BDRV_SECTOR_BITS) - head);
+
+        if (nb_extents && ldl_be_p(&payload[2 * nb_extents]) == flags) {
+            uint32_t *prev = &payload[2 * nb_extents - 1];
+            stl_be_p(prev, ldl_be_p(prev) + len);
+        } else if (nb_extents == max_extents) {
+            break;
+        } else {
+            stl_be_p(&payload[1 + 2 * nb_extents], len);
+            stl_be_p(&payload[2 + 2 * nb_extents], flags);
+            nb_extents++;
+        }
+        progress += len;
+    }
+
+    TRACE("Sending %u extent(s) covering %" PRIu32 " byte(s)",
+          nb_extents, progress);
+    iov[1].iov_base = payload;
+    iov[1].iov_len = (1 + 2 * nb_extents) * sizeof(uint32_t);
+    ret = nbd_co_send_structured_chunk(client, handle, NBD_REPLY_FLAG_DONE,
+                                       NBD_REPLY_TYPE_BLOCK_STATUS, iov, 2);
+    g_free(payload);
+    return ret;
+}
+
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
  * to keep trying the collection, -EIO to drop connection right away,
  * and any other negative value to report an error to the client
@@ -1052,7 +1638,8 @@ static ssize_t nbd_co_receive_request(NBDRequest *req,
         rc = command == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
         goto out;
     }
-    if (request->type & ~NBD_CMD_MASK_COMMAND & ~NBD_CMD_FLAG_FUA) {
+    if (request->type & ~NBD_CMD_MASK_COMMAND & ~NBD_CMD_FLAG_FUA &
+        ~(command == NBD_CMD_BLOCK_STATUS ? NBD_CMD_FLAG_REQ_ONE : 0)) {
         LOG("unsupported flags (got 0x%x)",
             request->type & ~NBD_CMD_MASK_COMMAND);
         rc = -EINVAL;
@@ -1123,6 +1710,28 @@ static void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, request.handle, request.from,
+                                        request.len) < 0) {
+                goto out;
+            }
+            break;
+        }
+
+        if (nbd_export_can_sendfile(client)) {
+            uint8_t hdr[NBD_REPLY_SIZE];
+            struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(hdr) };
+
+            nbd_set_reply_header(hdr, &reply);
+            if (nbd_co_send_iov_from_file(req, &iov, 1,
+                                          request.from + exp->dev_offset,
+                                          request.len) < 0) {
+                goto out;
+            }
+            TRACE("Sent %" PRIu32 " byte(s) from file", request.len);
+            break;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1191,14 +1800,32 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->base_allocation || !request.len) {
+            reply.error = EINVAL;
+            goto error_reply;
+        }
+        if (nbd_co_send_block_status(client, request.handle, request.from,
+                                     request.len,
+                                     request.type & NBD_CMD_FLAG_REQ_ONE) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%" PRIu32 ") received", request.type);
         reply.error = EINVAL;
     error_reply:
+        if (client->structured_reply) {
+            ret = nbd_co_send_structured_error(client, reply.handle,
+                                               reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
         /* We must disconnect after NBD_CMD_WRITE if we did not
          * read the payload.
          */
-        if (nbd_co_send_reply(req, &reply, 0) < 0 || !req->complete) {
+        if (ret < 0 || !req->complete) {
             goto out;
         }
         break;
@@ -149,6 +149,9 @@ static void QEMU_NORETURN help(void)
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
+           "  '-C' copies data without reading it into QEMU, e.g. by sharing the extents\n"
+           "       of the files on file systems that support it; zeroed data that is\n"
+           "       copied this way is not detected\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -1444,6 +1447,8 @@ typedef struct ImgConvertState {
     bool has_zero_init;
     bool compressed;
     bool target_has_backing;
+    bool copy_range;
+    bool copy_range_done;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
@@ -1508,7 +1513,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
-    if (s->status == BLK_DATA) {
+    if (s->status == BLK_DATA && !s->copy_range) {
         n = MIN(n, s->buf_sectors);
     }
 
@@ -1561,6 +1566,21 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
+/* Copy data without reading it into a buffer, e.g. by sharing the extents of
+ * the files. Returns -ENOTSUP if the images don't support it. */
+static int convert_copy_range(ImgConvertState *s, int64_t sector_num,
+                              int nb_sectors)
+{
+    convert_select_part(s, sector_num);
+    assert(nb_sectors <= s->src_sectors[s->src_cur] -
+                         (sector_num - s->src_cur_offset));
+
+    return blk_copy_range(s->src[s->src_cur],
+                          (sector_num - s->src_cur_offset) << BDRV_SECTOR_BITS,
+                          s->target, sector_num << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, 0);
+}
+
 static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
                          const uint8_t *buf)
 {
@@ -1702,6 +1722,24 @@ static int convert_do_copy(ImgConvertState *s)
                                 0);
         }
 
+        if (s->status == BLK_DATA && s->copy_range) {
+            ret = convert_copy_range(s, sector_num, n);
+            if (ret == 0) {
+                s->copy_range_done = true;
+                sector_num += n;
+                continue;
+            } else if (ret != -ENOTSUP) {
+                error_report("error while copying sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                goto fail;
+            }
+            /* Some parts of an image may not support offloading, e.g.
+             * compressed clusters, so try again with the next chunk unless
+             * it never worked */
+            s->copy_range = s->copy_range_done;
+            n = MIN(n, s->buf_sectors);
+        }
+
         if (s->status == BLK_DATA) {
             ret = convert_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -1764,6 +1802,7 @@ static int img_convert(int argc, char **argv)
     QemuOpts *sn_opts = NULL;
     ImgConvertState state;
     bool image_opts = false;
+    bool copy_range = false;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1779,7 +1818,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnC",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1871,6 +1910,9 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'C':
+            copy_range = true;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -1916,6 +1958,13 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
+    if (copy_range && compress) {
+        error_report("Copy offloading and compression are not supported at "
+                     "the same time");
+        ret = -1;
+        goto out;
+    }
+
     src_flags = 0;
     ret = bdrv_parse_cache_mode(src_cache, &src_flags, &src_writethrough);
     if (ret < 0) {
@@ -2127,6 +2176,7 @@ static int img_convert(int argc, char **argv)
         .target             = out_blk,
         .compressed         = compress,
         .target_has_backing = (bool) out_baseimg,
+        .copy_range         = copy_range,
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
         .buf_sectors        = bufsectors,
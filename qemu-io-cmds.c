@@ -15,6 +15,7 @@
 #include "block/block.h"
 #include "block/block_int.h" /* for info_f() */
 #include "block/qapi.h"
+#include "block/latency-trace.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/timer.h"
@@ -2149,6 +2150,72 @@ static const cmdinfo_t sleep_cmd = {
        .oneline        = "waits for the given value in milliseconds",
 };
 
+static void latency_trace_help(void)
+{
+    printf(
+"\n"
+" records the time that requests spend in each layer of the block graph\n"
+"\n"
+" Example:\n"
+" 'latency_trace start' - discards old spans and starts recording\n"
+" 'latency_trace print' - prints the time spent in each call stack\n"
+"\n"
+" 'start' takes the number of spans to keep as optional argument.\n"
+" 'print' writes one line per call stack in the folded format read by\n"
+" flame graph tools, with the time in nanoseconds spent in the stack\n"
+" excluding its callees; with -c, the number of spans is printed instead.\n"
+"\n");
+}
+
+static int latency_trace_f(BlockBackend *blk, int argc, char **argv);
+
+static const cmdinfo_t latency_trace_cmd = {
+    .name       = "latency_trace",
+    .cfunc      = latency_trace_f,
+    .argmin     = 1,
+    .argmax     = 2,
+    .flags      = CMD_NOFILE_OK,
+    .args       = "start [size] | stop | print [-c]",
+    .oneline    = "traces request latency through the block graph",
+    .help       = latency_trace_help,
+};
+
+static int latency_trace_f(BlockBackend *blk, int argc, char **argv)
+{
+    BlockLatencyTraceStackList *list, *entry;
+    int64_t size = BLOCK_LATENCY_TRACE_DEFAULT_SIZE;
+    bool cflag = false;
+
+    if (!strcmp(argv[1], "start")) {
+        if (argc == 3) {
+            size = cvtnum(argv[2]);
+            if (size <= 0) {
+                print_cvtnum_err(size ?: -EINVAL, argv[2]);
+                return 0;
+            }
+        }
+        block_latency_trace_start(size);
+    } else if (!strcmp(argv[1], "stop") && argc == 2) {
+        block_latency_trace_stop();
+    } else if (!strcmp(argv[1], "print")) {
+        if (argc == 3 && !strcmp(argv[2], "-c")) {
+            cflag = true;
+        } else if (argc != 2) {
+            return qemuio_command_usage(&latency_trace_cmd);
+        }
+        list = block_latency_trace_collect();
+        for (entry = list; entry; entry = entry->next) {
+            printf("%s %" PRIu64 "\n", entry->value->stack,
+                   cflag ? entry->value->count : entry->value->ns);
+        }
+        qapi_free_BlockLatencyTraceStackList(list);
+    } else {
+        return qemuio_command_usage(&latency_trace_cmd);
+    }
+
+    return 0;
+}
+
 static void help_oneline(const char *cmd, const cmdinfo_t *ct)
 {
     if (cmd) {
@@ -2264,4 +2331,5 @@ static void __attribute((constructor)) init_qemuio_commands(void)
     qemuio_add_command(&abort_cmd);
     qemuio_add_command(&sleep_cmd);
     qemuio_add_command(&sigraise_cmd);
+    qemuio_add_command(&latency_trace_cmd);
 }
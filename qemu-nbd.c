@@ -268,7 +268,7 @@ static void *nbd_client_thread(void *arg)
 
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), NULL, &nbdflags,
                                 NULL, NULL, NULL,
-                                &size, &local_error);
+                                &size, NULL, &local_error);
     if (ret < 0) {
         if (local_error) {
             error_report_err(local_error);
@@ -532,6 +532,8 @@ int main(int argc, char **argv)
     memset(&sa_sigterm, 0, sizeof(sa_sigterm));
     sa_sigterm.sa_handler = termsig_handler;
     sigaction(SIGTERM, &sa_sigterm, NULL);
+    /* A client going away must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
 
     qcrypto_init(&error_fatal);
 
@@ -910,6 +912,11 @@ int main(int argc, char **argv)
         }
     }
 
+    if (shared > 1) {
+        /* All clients go through the same BlockBackend, so a flush from
+         * one of them covers writes from all the others.  */
+        nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     exp = nbd_export_new(blk, dev_offset, fd_size, nbdflags, nbd_export_closed,
                          &local_err);
     if (!exp) {
@@ -1106,7 +1106,8 @@ EQMP
 
     {
         .name       = "block-stream",
-        .args_type  = "job-id:s?,device:B,base:s?,speed:o?,backing-file:s?,on-error:s?",
+        .args_type  = "job-id:s?,device:B,base:s?,speed:o?,backing-file:s?,"
+                      "on-error:s?,max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_block_stream,
     },
 
@@ -1140,6 +1141,8 @@ Arguments:
 - "on-error": the action to take on an error (default 'report').  'stop' and
               'enospc' can only be used if the block device supports io-status.
               (json-string, optional) (Since 2.1)
+- "max-workers": the maximum number of copy requests that are issued in
+                 parallel, default 4 (json-int, optional) (Since 2.8)
 
 Example:
 
@@ -1217,7 +1220,8 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "job-id:s?,sync:s,device:B,target:s,speed:i?,mode:s?,"
-                      "format:s?,bitmap:s?,on-source-error:s?,on-target-error:s?",
+                      "format:s?,bitmap:s?,on-source-error:s?,on-target-error:s?,"
+                      "max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_drive_backup,
     },
 
@@ -1261,6 +1265,8 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": the maximum number of copy requests that are issued in
+                 parallel, default 4 (json-int, optional)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
@@ -1273,7 +1279,7 @@ EQMP
     {
         .name       = "blockdev-backup",
         .args_type  = "job-id:s?,sync:s,device:B,target:B,speed:i?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_blockdev_backup,
     },
 
@@ -1304,6 +1310,8 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": the maximum number of copy requests that are issued in
+                 parallel, default 4 (json-int, optional)
 
 Example:
 -> { "execute": "blockdev-backup", "arguments": { "device": "src-id",
@@ -1435,7 +1443,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1452,6 +1460,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image when it is closed, and load it
+                again when the image is opened; only supported by qcow2
+                (json-bool, optional, default false)
 
 Example:
 
@@ -2072,7 +2083,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?,weight:l?",
         .mhandler.cmd_new = qmp_marshal_block_set_io_throttle,
     },
 
@@ -2105,6 +2116,9 @@ Arguments:
 - "iops_wr_max_length": maximum length of the @iops_wr_max burst period, in seconds (json-int, optional)
 - "iops_size":  I/O size in bytes when limiting (json-int, optional)
 - "group": throttle group name (json-string, optional)
+- "weight": share of the group's limits that this device gets while other
+            members of the group have queued requests, between 1 and 1000
+            (json-int, optional, default 100)
 
 Example:
 
@@ -2125,6 +2139,52 @@ Example:
                                                "iops_size": 0 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "query-throttle-groups",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_throttle_groups,
+    },
+
+SQMP
+query-throttle-groups
+---------------------
+
+Show the throttle groups and the throttling statistics of their members.
+
+Each group is represented by a json-object with the following members:
+
+- "name": the name of the group (json-string)
+- "members": the devices in the group (json-array of json-objects)
+    - "device": the device name (json-string)
+    - "weight": the weight of the device in the group (json-int)
+    - "rd-queued", "wr-queued": number of requests currently waiting
+      (json-int)
+    - "rd-throttled", "wr-throttled": number of requests that had to wait
+      (json-int)
+    - "rd-wait-ns", "wr-wait-ns": total time that requests spent waiting,
+      in nanoseconds (json-int)
+- "bps-credit", "bps-rd-credit", "bps-wr-credit", "iops-credit",
+  "iops-rd-credit", "iops-wr-credit": I/O that can still be done at the burst
+  rate, only present if the corresponding limit is set (json-int, optional)
+
+Example:
+
+-> { "execute": "query-throttle-groups" }
+<- { "return": [
+       { "name": "tenant0",
+         "bps-credit": 7500000,
+         "members": [
+           { "device": "virtio0", "weight": 200,
+             "rd-queued": 0, "wr-queued": 2,
+             "rd-throttled": 10, "wr-throttled": 842,
+             "rd-wait-ns": 2381520, "wr-wait-ns": 3019238712 },
+           { "device": "virtio1", "weight": 100,
+             "rd-queued": 0, "wr-queued": 1,
+             "rd-throttled": 0, "wr-throttled": 417,
+             "rd-wait-ns": 0, "wr-wait-ns": 2960118235 } ] } ] }
+
 EQMP
 
     {
@@ -2760,6 +2820,18 @@ Each json-object contain the following:
         - "avg_wr_queue_depth": average number of pending write
                                 operations in the defined interval
                                 (json-number).
+    - "rd_latency_histogram": latency histogram of read operations, if
+                              one was set up with
+                              block-latency-histogram-set (json-object,
+                              optional), with the following members:
+        - "boundaries": interval boundaries in nanoseconds
+                        (json-array of json-int)
+        - "bins": number of operations in each interval, one more
+                  than the number of boundaries (json-array of json-int)
+    - "wr_latency_histogram": latency histogram of write operations
+                              (json-object, optional)
+    - "flush_latency_histogram": latency histogram of flush operations
+                                 (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2966,6 +3038,63 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_iothreads,
     },
 
+SQMP
+query-thread-pools
+------------------
+
+Returns information about the worker thread pools of the main loop and of
+the iothreads.  An event loop has no thread pool until it first needs one.
+
+Return a json-array. Each thread pool is represented by a json-object, which
+contains:
+
+- "iothread": name of the iothread that owns the pool, absent for the main
+  loop (json-str, optional)
+- "max-threads": maximum number of worker threads (json-int)
+- "threads": number of worker threads (json-int)
+- "idle-threads": number of worker threads waiting for a request (json-int)
+- "queued": number of requests waiting for a worker thread (json-int)
+- "completed": number of requests completed (json-int)
+- "queue-wait-ns": total time spent by completed requests waiting for a
+  worker thread, in nanoseconds (json-int)
+- "run-ns": total time spent running completed requests, in nanoseconds
+  (json-int)
+
+Example:
+
+-> { "execute": "query-thread-pools" }
+<- {
+      "return":[
+         {
+            "max-threads":64,
+            "threads":2,
+            "idle-threads":1,
+            "queued":0,
+            "completed":18342,
+            "queue-wait-ns":40211987,
+            "run-ns":2871263901
+         },
+         {
+            "iothread":"iothread0",
+            "max-threads":64,
+            "threads":8,
+            "idle-threads":3,
+            "queued":0,
+            "completed":912775,
+            "queue-wait-ns":1450320110,
+            "run-ns":98120347766
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-thread-pools",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_thread_pools,
+    },
+
 SQMP
 query-pci
 ---------
@@ -4870,6 +4999,144 @@ Example:
                  "write-threshold": 17179869184 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-latency-histogram-set",
+        .args_type  = "device:B,boundaries:q?,boundaries-read:q?,"
+                      "boundaries-write:q?,boundaries-flush:q?",
+        .mhandler.cmd_new = qmp_marshal_block_latency_histogram_set,
+    },
+
+SQMP
+block-latency-histogram-set
+---------------------------
+
+Set up the latency histograms of a block device. They are reported by
+query-blockstats. Any values collected so far are discarded.
+
+Arguments:
+
+- "device": device name (json-string)
+- "boundaries": interval boundaries in nanoseconds for all operation
+                types, strictly ascending (json-array, optional)
+- "boundaries-read": boundaries of the read histogram (json-array, optional)
+- "boundaries-write": boundaries of the write histogram (json-array, optional)
+- "boundaries-flush": boundaries of the flush histogram (json-array, optional)
+
+The histogram of an operation type without boundaries is removed.
+
+Example:
+
+-> { "execute": "block-latency-histogram-set",
+     "arguments": { "device": "drive0",
+                    "boundaries": [ 100000, 1000000, 10000000 ] } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-histogram-reset",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_block_latency_histogram_reset,
+    },
+
+SQMP
+block-latency-histogram-reset
+-----------------------------
+
+Reset the bins of all latency histograms of a block device to zero.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Example:
+
+-> { "execute": "block-latency-histogram-reset",
+     "arguments": { "device": "drive0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-trace-start",
+        .args_type  = "size:i?",
+        .mhandler.cmd_new = qmp_marshal_block_latency_trace_start,
+    },
+
+SQMP
+block-latency-trace-start
+-------------------------
+
+Start recording the time that each request spends in each layer of the
+block graph. The spans recorded so far are discarded.
+
+Arguments:
+
+- "size": number of spans kept per thread, default 65536 (json-int, optional)
+
+Example:
+
+-> { "execute": "block-latency-trace-start" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-trace-stop",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_block_latency_trace_stop,
+    },
+
+SQMP
+block-latency-trace-stop
+------------------------
+
+Stop recording request spans. The spans recorded so far are kept.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "block-latency-trace-stop" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-block-latency-trace",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_block_latency_trace,
+    },
+
+SQMP
+query-block-latency-trace
+-------------------------
+
+Return the time spent by the recorded requests in each call stack of the
+block graph, excluding the time spent in callees.
+
+Each element of the returned array contains:
+
+- "stack": frames separated by semicolons, outermost first (json-string)
+- "ns": time spent in the innermost frame in nanoseconds (json-int)
+- "count": number of spans that ended in the innermost frame (json-int)
+
+Example:
+
+-> { "execute": "query-block-latency-trace" }
+<- { "return": [
+       { "stack": "read;blk:drive0", "ns": 41210, "count": 12 },
+       { "stack": "read;blk:drive0;qcow2:disk0", "ns": 80312, "count": 12 },
+       { "stack": "read;blk:drive0;qcow2:disk0;file", "ns": 2107836,
+         "count": 12 },
+       { "stack": "write;blk:drive0;qcow2:disk0", "ns": 10233, "count": 2 },
+       { "stack": "write;blk:drive0;qcow2:disk0;file", "ns": 301655,
+         "count": 2 },
+       { "stack": "write;blk:drive0;qcow2:disk0;file (read)", "ns": 152041,
+         "count": 1 } ] }
+
 EQMP
 
     {
@@ -0,0 +1,103 @@
+#!/usr/bin/env python
+# NBD connection proxy - route each client connection to a given server
+#
+# Usage: nbd-conn-proxy.py <num-conns> <listen-socket> <server-socket>...
+#
+# Listens on the UNIX socket <listen-socket>, accepts <num-conns> client
+# connections and forwards the n-th one to the n-th <server-socket> (the
+# last one for all connections past the end of the list).  This lets a
+# test make a multi-connection client see a different export on its
+# additional connections.
+#
+# When a connection is closed, a line is printed that says whether the
+# client sent any requests on it beyond the handshake.  The proxy exits
+# once all connections are closed.
+#
+# Copyright (C) 2026 agent <agent@local>
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+
+import sys
+import os
+import socket
+import threading
+
+# The handshake is well below this many bytes from the client
+HANDSHAKE_MAX_BYTES = 4096
+
+output_lock = threading.Lock()
+
+def forward(src, dst, counter):
+    while True:
+        try:
+            buf = src.recv(65536)
+        except socket.error:
+            buf = b''
+        if not buf:
+            break
+        counter[0] += len(buf)
+        try:
+            dst.sendall(buf)
+        except socket.error:
+            break
+    try:
+        dst.shutdown(socket.SHUT_WR)
+    except socket.error:
+        pass
+
+def handle_connection(index, client, server_path):
+    server = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    server.connect(server_path)
+
+    from_client = [0]
+    from_server = [0]
+    threads = [threading.Thread(target=forward,
+                                args=(client, server, from_client)),
+               threading.Thread(target=forward,
+                                args=(server, client, from_server))]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    client.close()
+    server.close()
+
+    if from_client[0] > HANDSHAKE_MAX_BYTES:
+        state = 'requests'
+    else:
+        state = 'no requests'
+    with output_lock:
+        sys.stdout.write('connection %d: %s\n' % (index, state))
+        sys.stdout.flush()
+
+def main(args):
+    if len(args) < 4:
+        sys.stderr.write('usage: %s <num-conns> <listen-socket> '
+                         '<server-socket>...\n' % args[0])
+        sys.exit(1)
+
+    num_conns = int(args[1])
+    listen_path = args[2]
+    servers = args[3:]
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.bind(listen_path)
+    sock.listen(num_conns)
+
+    threads = []
+    for i in range(num_conns):
+        client, _ = sock.accept()
+        server = servers[min(i, len(servers) - 1)]
+        t = threading.Thread(target=handle_connection,
+                             args=(i, client, server))
+        t.start()
+        threads.append(t)
+    sock.close()
+    os.unlink(listen_path)
+
+    for t in threads:
+        t.join()
+
+if __name__ == '__main__':
+    main(sys.argv)
@@ -16,6 +16,7 @@
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 
 static AioContext *ctx;
 
@@ -83,6 +84,20 @@ static void bh_delete_cb(void *opaque)
     }
 }
 
+static int bh_nested_polls;
+
+static void bh_nested_poll_cb(void *opaque)
+{
+    BHTestData *data = opaque;
+
+    data->n++;
+    if (bh_nested_polls == 0) {
+        /* Runs the bottom half that was scheduled together with this one */
+        bh_nested_polls++;
+        g_assert(aio_poll(ctx, false));
+    }
+}
+
 static void event_ready_cb(EventNotifier *e)
 {
     EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
@@ -218,6 +233,118 @@ static void test_bh_cancel(void)
     qemu_bh_delete(data.bh);
 }
 
+typedef struct {
+    QEMUBH *bh;
+    BHTestData *data;
+    bool kicked;
+} BHScheduleThreadData;
+
+static void *bh_schedule_thread(void *opaque)
+{
+    BHScheduleThreadData *t = opaque;
+    int i;
+
+    /* Let the main thread go to sleep in aio_poll() */
+    g_usleep(100 * 1000);
+    qemu_bh_schedule(t->bh);
+
+    /* Wake up the main thread ourselves if the bottom half does not */
+    for (i = 0; i < 100 && !atomic_read(&t->data->n); i++) {
+        g_usleep(10 * 1000);
+    }
+    if (!atomic_read(&t->data->n)) {
+        t->kicked = true;
+        aio_notify(ctx);
+    }
+    return NULL;
+}
+
+/* A bottom half that is cancelled stays queued until the next aio_bh_poll();
+ * scheduling another one from a different thread must still wake up
+ * the event loop.
+ */
+static void do_test_bh_cancel_schedule_from_thread(bool same_bh)
+{
+    BHTestData data1 = { .n = 0 };
+    BHTestData data2 = { .n = 0 };
+    BHScheduleThreadData t;
+    QemuThread thread;
+
+    data1.bh = aio_bh_new(ctx, bh_test_cb, &data1);
+    data2.bh = aio_bh_new(ctx, bh_test_cb, &data2);
+    t = (BHScheduleThreadData) {
+        .bh     = same_bh ? data1.bh : data2.bh,
+        .data   = same_bh ? &data1 : &data2,
+    };
+
+    qemu_bh_schedule(data1.bh);
+    qemu_bh_cancel(data1.bh);
+
+    qemu_thread_create(&thread, "bh_schedule_thread", bh_schedule_thread,
+                       &t, QEMU_THREAD_JOINABLE);
+    while (!atomic_read(&t.data->n)) {
+        aio_poll(ctx, true);
+    }
+    qemu_thread_join(&thread);
+
+    g_assert(!t.kicked);
+    g_assert_cmpint(t.data->n, ==, 1);
+    g_assert_cmpint(data1.n + data2.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    qemu_bh_delete(data1.bh);
+    qemu_bh_delete(data2.bh);
+}
+
+static void test_bh_cancel_schedule_from_thread(void)
+{
+    do_test_bh_cancel_schedule_from_thread(false);
+}
+
+static void test_bh_cancel_reschedule_from_thread(void)
+{
+    do_test_bh_cancel_schedule_from_thread(true);
+}
+
+static void test_bh_schedule_idle_then_schedule(void)
+{
+    BHTestData data = { .n = 0 };
+    data.bh = aio_bh_new(ctx, bh_test_cb, &data);
+
+    qemu_bh_schedule_idle(data.bh);
+    qemu_bh_schedule(data.bh);
+    g_assert_cmpint(aio_compute_timeout(ctx), ==, 0);
+
+    /* The bottom half is not idle anymore, so it counts as progress */
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+    qemu_bh_delete(data.bh);
+}
+
+static void test_bh_nested_poll(void)
+{
+    BHTestData data1 = { .n = 0 };
+    BHTestData data2 = { .n = 0 };
+    data1.bh = aio_bh_new(ctx, bh_nested_poll_cb, &data1);
+    data2.bh = aio_bh_new(ctx, bh_nested_poll_cb, &data2);
+
+    bh_nested_polls = 0;
+    qemu_bh_schedule(data1.bh);
+    qemu_bh_schedule(data2.bh);
+
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(bh_nested_polls, ==, 1);
+    g_assert_cmpint(data1.n, ==, 1);
+    g_assert_cmpint(data2.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    qemu_bh_delete(data1.bh);
+    qemu_bh_delete(data2.bh);
+}
+
 static void test_bh_delete(void)
 {
     BHTestData data = { .n = 0 };
@@ -847,6 +974,13 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/bh/schedule",             test_bh_schedule);
     g_test_add_func("/aio/bh/schedule10",           test_bh_schedule10);
     g_test_add_func("/aio/bh/cancel",               test_bh_cancel);
+    g_test_add_func("/aio/bh/cancel-schedule-from-thread",
+                    test_bh_cancel_schedule_from_thread);
+    g_test_add_func("/aio/bh/cancel-reschedule-from-thread",
+                    test_bh_cancel_reschedule_from_thread);
+    g_test_add_func("/aio/bh/idle-then-schedule",
+                    test_bh_schedule_idle_then_schedule);
+    g_test_add_func("/aio/bh/nested-poll",          test_bh_nested_poll);
     g_test_add_func("/aio/bh/delete",               test_bh_delete);
     g_test_add_func("/aio/bh/callback-delete/one",  test_bh_delete_from_cb);
     g_test_add_func("/aio/bh/callback-delete/many", test_bh_delete_from_cb_many);
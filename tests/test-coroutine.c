@@ -366,6 +366,81 @@ static void perf_cost(void)
                    (unsigned long)(1000000000.0 * duration / maxcycles));
 }
 
+/*
+ * In-flight benchmark: many coroutines suspended at the same time, as with
+ * a deep request queue.  Reports the cost of switching to a coroutine whose
+ * stack is not cache hot, and the memory used by each suspended coroutine.
+ */
+
+static void coroutine_fn yield_twice(void *opaque)
+{
+    qemu_coroutine_yield();
+    qemu_coroutine_yield();
+}
+
+/* Resident set size in KiB, or -1 if unknown */
+static long get_rss(void)
+{
+    long rss = -1;
+#ifdef CONFIG_LINUX
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size;
+
+    if (f) {
+        if (fscanf(f, "%ld %ld", &size, &rss) == 2) {
+            rss *= getpagesize() / 1024;
+        } else {
+            rss = -1;
+        }
+        fclose(f);
+    }
+#endif
+    return rss;
+}
+
+static void perf_in_flight(void)
+{
+    const unsigned int max = 10000;
+    Coroutine **co = g_new(Coroutine *, max);
+    unsigned int i;
+    double start_duration, switch_duration, end_duration;
+    long rss_before, rss_after;
+
+    rss_before = get_rss();
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        co[i] = qemu_coroutine_create(yield_twice, NULL);
+        qemu_coroutine_enter(co[i]);
+    }
+    start_duration = g_test_timer_elapsed();
+    rss_after = get_rss();
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        qemu_coroutine_enter(co[i]);
+    }
+    switch_duration = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        qemu_coroutine_enter(co[i]);
+    }
+    end_duration = g_test_timer_elapsed();
+
+    g_test_message("In flight %u coroutines, %u KiB stack: start %f s, "
+                   "end %f s, %luns per switch",
+                   max, COROUTINE_STACK_SIZE / 1024, start_duration,
+                   end_duration,
+                   (unsigned long)(1000000000.0 * switch_duration / max));
+    if (rss_before >= 0 && rss_after >= 0) {
+        g_test_message("In flight %u coroutines: %ld KiB resident, "
+                       "%ld bytes per coroutine",
+                       max, rss_after - rss_before,
+                       (rss_after - rss_before) * 1024 / max);
+    }
+    g_free(co);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -390,6 +465,7 @@ int main(int argc, char **argv)
         g_test_add_func("/perf/yield", perf_yield);
         g_test_add_func("/perf/function-call", perf_baseline);
         g_test_add_func("/perf/cost", perf_cost);
+        g_test_add_func("/perf/in-flight", perf_in_flight);
     }
     return g_test_run();
 }
@@ -24,6 +24,7 @@
 #include "crypto/block.h"
 #include "qemu/buffer.h"
 #include "crypto/secret.h"
+#include "qemu/thread.h"
 #ifndef _WIN32
 #include <sys/resource.h>
 #endif
@@ -271,6 +272,74 @@ static void test_block_assert_setup(const struct QCryptoBlockTestData *data,
 }
 
 
+#define TEST_BLOCK_THREADS 4
+#define TEST_BLOCK_THREAD_LEN (64 * 512)
+#define TEST_BLOCK_THREAD_LOOPS 20
+
+struct QCryptoBlockThreadData {
+    QCryptoBlock *blk;
+    uint64_t startsector;
+    uint8_t *plain;
+    uint8_t *cipher;
+};
+
+static void *test_block_thread(void *opaque)
+{
+    struct QCryptoBlockThreadData *data = opaque;
+    uint8_t *buf = g_new(uint8_t, TEST_BLOCK_THREAD_LEN);
+    int i;
+
+    for (i = 0; i < TEST_BLOCK_THREAD_LOOPS; i++) {
+        memcpy(buf, data->plain, TEST_BLOCK_THREAD_LEN);
+
+        g_assert(qcrypto_block_encrypt(data->blk, data->startsector, buf,
+                                       TEST_BLOCK_THREAD_LEN,
+                                       &error_abort) == 0);
+        g_assert(memcmp(buf, data->cipher, TEST_BLOCK_THREAD_LEN) == 0);
+
+        g_assert(qcrypto_block_decrypt(data->blk, data->startsector, buf,
+                                       TEST_BLOCK_THREAD_LEN,
+                                       &error_abort) == 0);
+        g_assert(memcmp(buf, data->plain, TEST_BLOCK_THREAD_LEN) == 0);
+    }
+
+    g_free(buf);
+    return NULL;
+}
+
+/* Check that concurrent users of one block get the same results
+ * as a single thread does */
+static void test_block_threads(QCryptoBlock *blk)
+{
+    struct QCryptoBlockThreadData data[TEST_BLOCK_THREADS];
+    QemuThread threads[TEST_BLOCK_THREADS];
+    size_t i;
+
+    for (i = 0; i < TEST_BLOCK_THREADS; i++) {
+        data[i].blk = blk;
+        data[i].startsector = i * 1000;
+        data[i].plain = g_new(uint8_t, TEST_BLOCK_THREAD_LEN);
+        data[i].cipher = g_new(uint8_t, TEST_BLOCK_THREAD_LEN);
+        memset(data[i].plain, 0x40 + i, TEST_BLOCK_THREAD_LEN);
+        memcpy(data[i].cipher, data[i].plain, TEST_BLOCK_THREAD_LEN);
+        g_assert(qcrypto_block_encrypt(blk, data[i].startsector,
+                                       data[i].cipher, TEST_BLOCK_THREAD_LEN,
+                                       &error_abort) == 0);
+    }
+
+    for (i = 0; i < TEST_BLOCK_THREADS; i++) {
+        qemu_thread_create(&threads[i], "test-block", test_block_thread,
+                           &data[i], QEMU_THREAD_JOINABLE);
+    }
+
+    for (i = 0; i < TEST_BLOCK_THREADS; i++) {
+        qemu_thread_join(&threads[i]);
+        g_free(data[i].plain);
+        g_free(data[i].cipher);
+    }
+}
+
+
 static void test_block(gconstpointer opaque)
 {
     const struct QCryptoBlockTestData *data = opaque;
@@ -304,6 +373,7 @@ static void test_block(gconstpointer opaque)
                              test_block_read_func,
                              &header,
                              0,
+                             1,
                              NULL);
     g_assert(blk == NULL);
 
@@ -312,6 +382,7 @@ static void test_block(gconstpointer opaque)
                              test_block_read_func,
                              &header,
                              QCRYPTO_BLOCK_OPEN_NO_IO,
+                             1,
                              &error_abort);
 
     g_assert(qcrypto_block_get_cipher(blk) == NULL);
@@ -326,10 +397,25 @@ static void test_block(gconstpointer opaque)
                              test_block_read_func,
                              &header,
                              0,
+                             1,
+                             &error_abort);
+    g_assert(blk);
+
+    test_block_assert_setup(data, blk);
+
+    qcrypto_block_free(blk);
+
+    /* And once more for use from several threads */
+    blk = qcrypto_block_open(data->open_opts,
+                             test_block_read_func,
+                             &header,
+                             0,
+                             TEST_BLOCK_THREADS,
                              &error_abort);
     g_assert(blk);
 
     test_block_assert_setup(data, blk);
+    test_block_threads(blk);
 
     qcrypto_block_free(blk);
 
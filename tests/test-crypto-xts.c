@@ -27,6 +27,7 @@
 #include "crypto/init.h"
 #include "crypto/xts.h"
 #include "crypto/aes.h"
+#include "crypto/aesni.h"
 
 typedef struct {
     const char *path;
@@ -407,6 +408,121 @@ static void test_xts(const void *opaque)
 }
 
 
+static void test_xts_aesni(const void *opaque)
+{
+    const QCryptoXTSTestData *data = opaque;
+    unsigned char out[512], Torg[16], T[16];
+    int j;
+    unsigned long len;
+    QCryptoAESNIKey enc, dec, tweak_enc, tweak_dec;
+
+    g_assert(qcrypto_aesni_set_key(data->key1, data->keylen / 2,
+                                   &enc, &dec) == 0);
+    g_assert(qcrypto_aesni_set_key(data->key2, data->keylen / 2,
+                                   &tweak_enc, &tweak_dec) == 0);
+
+    for (j = 0; j < 2; j++) {
+        /* the AES-NI code only handles whole blocks, so splitting
+         * needs a length that is a multiple of two blocks */
+        if ((j == 1) && (data->PTLEN % 32)) {
+            continue;
+        }
+        len = data->PTLEN / 2;
+
+        STORE64L(data->seqnum, Torg);
+        memset(Torg + 8, 0, 8);
+
+        memcpy(T, Torg, sizeof(T));
+        if (j == 0) {
+            qcrypto_aesni_xts_encrypt(&enc, &tweak_enc, &tweak_dec, T,
+                                      data->PTX, out, data->PTLEN);
+        } else {
+            qcrypto_aesni_xts_encrypt(&enc, &tweak_enc, &tweak_dec, T,
+                                      data->PTX, out, len);
+            qcrypto_aesni_xts_encrypt(&enc, &tweak_enc, &tweak_dec, T,
+                                      &data->PTX[len], &out[len], len);
+        }
+
+        g_assert(memcmp(out, data->CTX, data->PTLEN) == 0);
+
+        memcpy(T, Torg, sizeof(T));
+        if (j == 0) {
+            qcrypto_aesni_xts_decrypt(&dec, &tweak_enc, &tweak_dec, T,
+                                      data->CTX, out, data->PTLEN);
+        } else {
+            qcrypto_aesni_xts_decrypt(&dec, &tweak_enc, &tweak_dec, T,
+                                      data->CTX, out, len);
+            qcrypto_aesni_xts_decrypt(&dec, &tweak_enc, &tweak_dec, T,
+                                      &data->CTX[len], &out[len], len);
+        }
+
+        g_assert(memcmp(out, data->PTX, data->PTLEN) == 0);
+    }
+}
+
+
+#define TEST_XTS_PERF_SECTOR 512
+#define TEST_XTS_PERF_BUFFER (64 * 1024)
+#define TEST_XTS_PERF_TOTAL (256 * 1024 * 1024)
+
+/* Encrypt and decrypt like a LUKS volume with aes-xts-plain64 does,
+ * one sector at a time with a fresh IV */
+static void perf_xts(const void *opaque)
+{
+    bool aesni = GPOINTER_TO_INT(opaque);
+    /* Same keys as test #2, but using their full size for AES-256 */
+    const QCryptoXTSTestData *data = &test_data[1];
+    struct TestAES aesdata, aestweak;
+    QCryptoAESNIKey enc, dec, tweak_enc, tweak_dec;
+    uint8_t *buf = g_malloc0(TEST_XTS_PERF_BUFFER);
+    uint8_t T[16];
+    size_t done, off;
+    double duration;
+
+    if (aesni) {
+        if (!qcrypto_aesni_available()) {
+            g_test_message("AES-NI not available, skipping\n");
+            g_free(buf);
+            return;
+        }
+        qcrypto_aesni_set_key(data->key1, 32, &enc, &dec);
+        qcrypto_aesni_set_key(data->key2, 32, &tweak_enc, &tweak_dec);
+    } else {
+        AES_set_encrypt_key(data->key1, 256, &aesdata.enc);
+        AES_set_decrypt_key(data->key1, 256, &aesdata.dec);
+        AES_set_encrypt_key(data->key2, 256, &aestweak.enc);
+        AES_set_decrypt_key(data->key2, 256, &aestweak.dec);
+    }
+
+    g_test_timer_start();
+    for (done = 0; done < TEST_XTS_PERF_TOTAL; done += TEST_XTS_PERF_BUFFER) {
+        for (off = 0; off < TEST_XTS_PERF_BUFFER;
+             off += TEST_XTS_PERF_SECTOR) {
+            STORE64L((uint64_t)(done + off) / TEST_XTS_PERF_SECTOR, T);
+            memset(T + 8, 0, 8);
+            if (aesni) {
+                qcrypto_aesni_xts_encrypt(&enc, &tweak_enc, &tweak_dec, T,
+                                          buf + off, buf + off,
+                                          TEST_XTS_PERF_SECTOR);
+            } else {
+                xts_encrypt(&aesdata, &aestweak,
+                            test_xts_aes_encrypt,
+                            test_xts_aes_decrypt,
+                            T, TEST_XTS_PERF_SECTOR, buf + off, buf + off);
+            }
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("XTS AES-256 %s encrypt %d MB: %f s, %f MB/s\n",
+                   aesni ? "AES-NI" : "table",
+                   TEST_XTS_PERF_TOTAL / (1024 * 1024), duration,
+                   TEST_XTS_PERF_TOTAL / (1024 * 1024) / duration);
+
+    g_free(buf);
+}
+
+
 int main(int argc, char **argv)
 {
     size_t i;
@@ -419,5 +535,25 @@ int main(int argc, char **argv)
         g_test_add_data_func(test_data[i].path, &test_data[i], test_xts);
     }
 
+    if (qcrypto_aesni_available()) {
+        for (i = 0; i < G_N_ELEMENTS(test_data); i++) {
+            char *path;
+
+            if (test_data[i].PTLEN % 16) {
+                continue;
+            }
+            path = g_strdup_printf("%s/aesni", test_data[i].path);
+            g_test_add_data_func(path, &test_data[i], test_xts_aesni);
+            g_free(path);
+        }
+    }
+
+    if (g_test_perf()) {
+        g_test_add_data_func("/crypto/xts/perf/table",
+                             GINT_TO_POINTER(false), perf_xts);
+        g_test_add_data_func("/crypto/xts/perf/aesni",
+                             GINT_TO_POINTER(true), perf_xts);
+    }
+
     return g_test_run();
 }
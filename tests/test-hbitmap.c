@@ -634,6 +634,55 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    int r;
+
+    hbitmap_test_init(data, L3 * 2, 3);
+    r = hbitmap_serialization_granularity(data->hb);
+    g_assert_cmpint(r, ==, 64 << 3);
+}
+
+static void test_hbitmap_serialize_part(TestHBitmapData *data,
+                                        const void *unused)
+{
+    uint64_t gran, start, count;
+    uint8_t *buf;
+    HBitmap *copy;
+    HBitmapIter hbi;
+    int64_t next;
+
+    hbitmap_test_init(data, L3 + 23, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, 300, 700);
+    hbitmap_test_set(data, L2 + 5, 17);
+    hbitmap_test_set(data, L3 + 22, 1);
+
+    /* Copy the bitmap in chunks, leaving out the chunks that are empty */
+    gran = hbitmap_serialization_granularity(data->hb) * 4;
+    copy = hbitmap_alloc(data->size, data->granularity);
+    buf = g_malloc0(hbitmap_serialization_size(data->hb, 0, gran));
+    for (start = 0; start < data->size; start += gran) {
+        count = MIN(gran, data->size - start);
+        hbitmap_iter_init(&hbi, data->hb, start);
+        next = hbitmap_iter_next(&hbi);
+        if (next < 0 || next >= start + count) {
+            hbitmap_deserialize_zeroes(copy, start, count, false);
+        } else {
+            hbitmap_serialize_part(data->hb, buf, start, count);
+            hbitmap_deserialize_part(copy, buf, start, count, false);
+        }
+    }
+    hbitmap_deserialize_finish(copy);
+    g_free(buf);
+
+    /* Check the copy against the shadow bitmap of the original */
+    hbitmap_free(data->hb);
+    data->hb = copy;
+    hbitmap_test_check(data, 0);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -683,6 +732,11 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
+    hbitmap_test_add("/hbitmap/serialize/part",
+                     test_hbitmap_serialize_part);
     g_test_run();
 
     return 0;
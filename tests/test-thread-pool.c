@@ -32,6 +32,14 @@ static int long_cb(void *opaque)
     return 0;
 }
 
+static int sleep_cb(void *opaque)
+{
+    WorkerTestData *data = opaque;
+    g_usleep(1000);
+    atomic_inc(&data->n);
+    return 0;
+}
+
 static void done_cb(void *opaque, int ret)
 {
     WorkerTestData *data = opaque;
@@ -134,6 +142,38 @@ static void test_submit_many(void)
     }
 }
 
+static void test_stats(void)
+{
+    WorkerTestData data[10];
+    ThreadPoolStats before, after;
+    int i;
+
+    thread_pool_get_stats(pool, &before);
+    g_assert_cmpint(before.queued, ==, 0);
+
+    for (i = 0; i < 10; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(pool, sleep_cb, &data[i], done_cb, &data[i]);
+    }
+
+    thread_pool_get_stats(pool, &after);
+    g_assert_cmpint(after.queued, <=, 10);
+    g_assert_cmpint(after.threads, >, 0);
+    g_assert_cmpint(after.threads, <=, after.max_threads);
+
+    active = 10;
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+
+    thread_pool_get_stats(pool, &after);
+    g_assert_cmpint(after.queued, ==, 0);
+    g_assert_cmpint(after.completed - before.completed, ==, 10);
+    g_assert_cmpint(after.run_ns - before.run_ns, >=, 10 * SCALE_MS);
+    g_assert_cmpint(after.queue_wait_ns, >=, before.queue_wait_ns);
+}
+
 static void do_test_cancel(bool sync)
 {
     WorkerTestData data[100];
@@ -240,6 +280,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/stats", test_stats);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
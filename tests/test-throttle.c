@@ -648,6 +648,238 @@ static void test_groups(void)
     g_assert(blkp3->throttle_state == NULL);
 }
 
+static void test_groups_query(void)
+{
+    ThrottleConfig cfg1;
+    BlockBackend *blk1, *blk2;
+    ThrottleGroupInfoList *list, *e;
+    ThrottleGroupInfo *info = NULL;
+    ThrottleGroupMemberInfoList *m;
+    int n = 0;
+
+    blk1 = blk_new();
+    blk2 = blk_new();
+
+    throttle_group_register_blk(blk1, "query");
+    throttle_group_register_blk(blk2, "query");
+
+    /* New members get the default weight */
+    g_assert_cmpint(throttle_group_get_weight(blk1), ==,
+                    THROTTLE_GROUP_WEIGHT_DEFAULT);
+    throttle_group_set_weight(blk2, 300);
+    g_assert_cmpint(throttle_group_get_weight(blk2), ==, 300);
+
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_BPS_TOTAL].avg = 100000;
+    cfg1.buckets[THROTTLE_BPS_TOTAL].max = 200000;
+    cfg1.buckets[THROTTLE_OPS_WRITE].avg = 100;
+    throttle_group_config(blk1, &cfg1);
+
+    list = throttle_group_query_all();
+    for (e = list; e; e = e->next) {
+        if (!strcmp(e->value->name, "query")) {
+            info = e->value;
+        }
+    }
+    g_assert(info);
+
+    /* Only the limits that are set have a burst credit, and the buckets
+     * are still empty */
+    g_assert(info->has_bps_credit);
+    g_assert_cmpint(info->bps_credit, ==, 200000);
+    g_assert(info->has_iops_wr_credit);
+    g_assert_cmpint(info->iops_wr_credit, ==, 10);
+    g_assert(!info->has_bps_rd_credit);
+    g_assert(!info->has_iops_credit);
+
+    for (m = info->members; m; m = m->next) {
+        g_assert(m->value->weight == THROTTLE_GROUP_WEIGHT_DEFAULT ||
+                 m->value->weight == 300);
+        g_assert_cmpint(m->value->rd_queued, ==, 0);
+        g_assert_cmpint(m->value->wr_throttled, ==, 0);
+        g_assert_cmpint(m->value->wr_wait_ns, ==, 0);
+        n++;
+    }
+    g_assert_cmpint(n, ==, 2);
+
+    qapi_free_ThrottleGroupInfoList(list);
+
+    throttle_group_unregister_blk(blk1);
+    throttle_group_unregister_blk(blk2);
+    blk_unref(blk1);
+    blk_unref(blk2);
+}
+
+typedef struct {
+    BlockBackend *blk;
+    unsigned int bytes;
+    unsigned int *count;    /* requests that went through */
+    unsigned int *left;     /* requests still to issue in the group */
+    unsigned int *running;  /* coroutines that haven't finished */
+} ThrottleGroupWorker;
+
+/* Issue requests until the group has issued enough of them */
+static void coroutine_fn throttle_group_worker(void *opaque)
+{
+    ThrottleGroupWorker *w = opaque;
+
+    while (*w->left > 0) {
+        (*w->left)--;
+        throttle_group_co_io_limits_intercept(w->blk, w->bytes, false);
+        (*w->count)++;
+    }
+    (*w->running)--;
+}
+
+static void test_groups_weight(void)
+{
+    ThrottleConfig cfg1;
+    BlockBackend *blk1, *blk2, *blk3;
+    ThrottleGroupWorker workers[8];
+    unsigned int count1 = 0, count2 = 0, left, running;
+    unsigned int base1, base2;
+    int i;
+
+    blk1 = blk_new();
+    blk2 = blk_new();
+    blk3 = blk_new();
+
+    /* blk3 stays idle; it must not be picked although it never advanced
+     * its virtual time */
+    throttle_group_register_blk(blk1, "weight");
+    throttle_group_register_blk(blk2, "weight");
+    throttle_group_register_blk(blk3, "weight");
+    throttle_group_set_weight(blk1, 300);
+    throttle_group_set_weight(blk2, 100);
+
+    /* 2000 requests per second, with a burst of 200 */
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_OPS_TOTAL].avg = 2000;
+    throttle_group_config(blk1, &cfg1);
+
+    /* Four coroutines per member keep both queues busy all the time */
+    left = 1000;
+    running = 8;
+    for (i = 0; i < 8; i++) {
+        workers[i] = (ThrottleGroupWorker) {
+            .blk        = i % 2 ? blk2 : blk1,
+            .bytes      = 4096,
+            .count      = i % 2 ? &count2 : &count1,
+            .left       = &left,
+            .running    = &running,
+        };
+        qemu_coroutine_enter(qemu_coroutine_create(throttle_group_worker,
+                                                   &workers[i]));
+    }
+
+    /* The burst goes through in the order the requests come in, only
+     * count what is scheduled once the group is throttling */
+    while (count1 + count2 < 200) {
+        aio_poll(ctx, true);
+    }
+    base1 = count1;
+    base2 = count2;
+
+    while (running > 0) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(count1 + count2, ==, 1000);
+
+    /* blk1 has 3 times the weight of blk2, so it gets 3 times the service */
+    count1 -= base1;
+    count2 -= base2;
+    g_assert_cmpint(count1, >=, count2 * 5 / 2);
+    g_assert_cmpint(count1, <=, count2 * 7 / 2);
+
+    throttle_group_unregister_blk(blk1);
+    throttle_group_unregister_blk(blk2);
+    throttle_group_unregister_blk(blk3);
+    blk_unref(blk1);
+    blk_unref(blk2);
+    blk_unref(blk3);
+}
+
+static void test_groups_wakeup(void)
+{
+    ThrottleConfig cfg1;
+    AioContext *ctx2;
+    BlockBackend *blk1, *blk2;
+    BlockBackendPublic *blkp1, *blkp2;
+    ThrottleGroupWorker w1, w2, w3;
+    unsigned int count1 = 0, count2 = 0, count3 = 0;
+    unsigned int left1 = 1, left2 = 1, left3 = 1, running = 3;
+
+    ctx2 = aio_context_new(&error_abort);
+
+    blk1 = blk_new();
+    blk2 = blk_new();
+    blkp1 = blk_get_public(blk1);
+    blkp2 = blk_get_public(blk2);
+
+    throttle_group_register_blk(blk1, "wakeup");
+    throttle_group_register_blk(blk2, "wakeup");
+
+    /* Move the timers of blk2 to another AioContext, as
+     * blk_set_aio_context() does for a BlockBackend with a medium */
+    throttle_timers_detach_aio_context(&blkp2->throttle_timers);
+    throttle_timers_attach_aio_context(&blkp2->throttle_timers, ctx2);
+
+    /* 10 MB/s with a burst of 1 MB */
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_BPS_TOTAL].avg = 10 * 1000 * 1000;
+    throttle_group_config(blk1, &cfg1);
+
+    /* A large request of blk1 goes through and fills the bucket */
+    w1 = (ThrottleGroupWorker) {
+        .blk = blk1, .bytes = 1500 * 1000,
+        .count = &count1, .left = &left1, .running = &running,
+    };
+    qemu_coroutine_enter(qemu_coroutine_create(throttle_group_worker, &w1));
+    g_assert_cmpint(count1, ==, 1);
+
+    /* The next one of blk1 has to wait for blk1's timer.  It is tiny, so
+     * once it has run the bucket has room again... */
+    w2 = (ThrottleGroupWorker) {
+        .blk = blk1, .bytes = 1,
+        .count = &count2, .left = &left2, .running = &running,
+    };
+    qemu_coroutine_enter(qemu_coroutine_create(throttle_group_worker, &w2));
+    g_assert_cmpint(count2, ==, 0);
+    g_assert(timer_pending(blkp1->throttle_timers.timers[0]));
+
+    /* ...and one of blk2 is queued behind it */
+    w3 = (ThrottleGroupWorker) {
+        .blk = blk2, .bytes = 4096,
+        .count = &count3, .left = &left3, .running = &running,
+    };
+    qemu_coroutine_enter(qemu_coroutine_create(throttle_group_worker, &w3));
+    g_assert_cmpint(count3, ==, 0);
+    g_assert_cmpint(blkp2->pending_reqs[0], ==, 1);
+    g_assert(!timer_pending(blkp2->throttle_timers.timers[0]));
+
+    /* ...but when blk1's request has run, the request of blk2 must not be
+     * resumed from here, but by arming blk2's own timer */
+    while (count2 == 0) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(count3, ==, 0);
+    g_assert(!timer_pending(blkp1->throttle_timers.timers[0]));
+    g_assert(timer_pending(blkp2->throttle_timers.timers[0]));
+
+    /* That timer runs in the AioContext of blk2 */
+    while (count3 == 0) {
+        aio_poll(ctx2, true);
+    }
+    g_assert_cmpint(running, ==, 0);
+    g_assert_cmpint(blkp2->pending_reqs[0], ==, 0);
+
+    throttle_group_unregister_blk(blk1);
+    throttle_group_unregister_blk(blk2);
+    blk_unref(blk1);
+    blk_unref(blk2);
+    aio_context_unref(ctx2);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -673,6 +905,9 @@ int main(int argc, char **argv)
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/query",       test_groups_query);
+    g_test_add_func("/throttle/groups/weight",      test_groups_weight);
+    g_test_add_func("/throttle/groups/wakeup",      test_groups_wakeup);
     return g_test_run();
 }
 
@@ -19,6 +19,7 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
@@ -46,9 +47,16 @@ struct ThreadPoolElement {
     enum ThreadState state;
     int ret;
 
+    /* Time of submission, for the queue wait statistics.  */
+    int64_t submit_ns;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
+    /* Written by the thread that completes elem, then only accessed
+     * from the pool's AioContext.  */
+    QSLIST_ENTRY(ThreadPoolElement) done_next;
+
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
@@ -62,8 +70,13 @@ struct ThreadPool {
     int max_threads;
     QEMUBH *new_thread_bh;
 
+    /* Completed requests are pushed here, and moved to completion_batch
+     * by the completion bottom half.  */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSLIST_HEAD(, ThreadPoolElement) completion_batch;
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
@@ -72,8 +85,19 @@ struct ThreadPool {
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
+    int queued;
+    uint64_t completed;
+    uint64_t queue_wait_ns;
+    uint64_t run_ns;
 };
 
+/* Hands a request that reached THREAD_DONE to the completion bottom half.  */
+static void thread_pool_complete(ThreadPool *pool, ThreadPoolElement *req)
+{
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->done_list, req, done_next);
+    qemu_bh_schedule(pool->completion_bh);
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -84,6 +108,7 @@ static void *worker_thread(void *opaque)
 
     while (!pool->stopping) {
         ThreadPoolElement *req;
+        int64_t start_ns, wait_ns, run_ns;
         int ret;
 
         do {
@@ -100,9 +125,13 @@ static void *worker_thread(void *opaque)
         req = QTAILQ_FIRST(&pool->request_list);
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
         req->state = THREAD_ACTIVE;
+        pool->queued--;
         qemu_mutex_unlock(&pool->lock);
 
+        start_ns = get_clock();
+        wait_ns = start_ns - req->submit_ns;
         ret = req->func(req->arg);
+        run_ns = get_clock() - start_ns;
 
         req->ret = ret;
         /* Write ret before state.  */
@@ -110,8 +139,12 @@ static void *worker_thread(void *opaque)
         req->state = THREAD_DONE;
 
         qemu_mutex_lock(&pool->lock);
+        pool->completed++;
+        pool->queue_wait_ns += wait_ns;
+        pool->run_ns += run_ns;
 
-        qemu_bh_schedule(pool->completion_bh);
+        /* req may be freed as soon as the completion bottom half runs */
+        thread_pool_complete(pool, req);
     }
 
     pool->cur_threads--;
@@ -163,13 +196,26 @@ static void spawn_thread(ThreadPool *pool)
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
-
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
+    ThreadPoolElement *elem;
+    QSLIST_HEAD(, ThreadPoolElement) done;
+
+    for (;;) {
+        elem = QSLIST_FIRST(&pool->completion_batch);
+        if (!elem) {
+            /* Take all requests that completed since the last batch, in
+             * the order in which they completed */
+            QSLIST_MOVE_ATOMIC(&done, &pool->done_list);
+            if (QSLIST_EMPTY(&done)) {
+                break;
+            }
+            while ((elem = QSLIST_FIRST(&done)) != NULL) {
+                QSLIST_REMOVE_HEAD(&done, done_next);
+                QSLIST_INSERT_HEAD(&pool->completion_batch, elem, done_next);
+            }
             continue;
         }
+        QSLIST_REMOVE_HEAD(&pool->completion_batch, done_next);
+        assert(elem->state == THREAD_DONE);
 
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
@@ -180,16 +226,15 @@ restart:
             smp_rmb();
 
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
-             * wait for another request that completed at the same time.
+             * wait for another request of this batch.
              */
-            qemu_bh_schedule(pool->completion_bh);
+            if (!QSLIST_EMPTY(&pool->completion_batch)) {
+                qemu_bh_schedule(pool->completion_bh);
+            }
 
             elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
 }
 
@@ -209,10 +254,11 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+        pool->queued--;
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
+        thread_pool_complete(pool, elem);
     }
 
     qemu_mutex_unlock(&pool->lock);
@@ -242,6 +288,7 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
@@ -252,6 +299,7 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         spawn_thread(pool);
     }
     QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    pool->queued++;
     qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
@@ -285,6 +333,19 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
 }
 
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    qemu_mutex_lock(&pool->lock);
+    stats->max_threads = pool->max_threads;
+    stats->threads = pool->cur_threads;
+    stats->idle_threads = pool->idle_threads;
+    stats->queued = pool->queued;
+    stats->completed = pool->completed;
+    stats->queue_wait_ns = pool->queue_wait_ns;
+    stats->run_ns = pool->run_ns;
+    qemu_mutex_unlock(&pool->lock);
+}
+
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
     if (!ctx) {
@@ -301,6 +362,8 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
+    QSLIST_INIT(&pool->done_list);
+    QSLIST_INIT(&pool->completion_batch);
     QTAILQ_INIT(&pool->request_list);
 }
 
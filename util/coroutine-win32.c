@@ -71,11 +71,11 @@ static void CALLBACK coroutine_trampoline(void *co_)
 
 Coroutine *qemu_coroutine_new(void)
 {
-    const size_t stack_size = 1 << 20;
     CoroutineWin32 *co;
 
     co = g_malloc0(sizeof(*co));
-    co->fiber = CreateFiber(stack_size, coroutine_trampoline, &co->base);
+    co->fiber = CreateFiber(COROUTINE_STACK_SIZE, coroutine_trampoline,
+                            &co->base);
     return &co->base;
 }
 
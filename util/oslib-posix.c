@@ -132,6 +132,44 @@ void qemu_anon_ram_free(void *ptr, size_t size)
     qemu_ram_munmap(ptr, size);
 }
 
+void *qemu_alloc_stack(size_t *sz)
+{
+    void *ptr, *guardpage;
+    size_t pagesz = getpagesize();
+
+    /* allocate one extra page for the guard page */
+    *sz = ROUND_UP(*sz, pagesz) + pagesz;
+
+    ptr = mmap(NULL, *sz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        abort();
+    }
+
+#if defined(HOST_IA64)
+    /* separate register stack */
+    guardpage = ptr + (((*sz - pagesz) / 2) & ~(pagesz - 1));
+#elif defined(HOST_HPPA)
+    /* stack grows up */
+    guardpage = ptr + *sz - pagesz;
+#else
+    /* stack grows down */
+    guardpage = ptr;
+#endif
+    if (mprotect(guardpage, pagesz, PROT_NONE) != 0) {
+        abort();
+    }
+
+    trace_qemu_alloc_stack(*sz, ptr);
+    return ptr;
+}
+
+void qemu_free_stack(void *stack, size_t sz)
+{
+    trace_qemu_free_stack(stack, sz);
+    munmap(stack, sz);
+}
+
 void qemu_set_block(int fd)
 {
     int f;
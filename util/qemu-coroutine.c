@@ -22,6 +22,9 @@
 
 enum {
     POOL_BATCH_SIZE = 64,
+
+    /* Upper bound for alloc_pool, however many coroutines a thread uses */
+    POOL_MAX_SIZE = 512,
 };
 
 /** Free list to speed up creation */
@@ -31,6 +34,15 @@ static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(po
 static __thread unsigned int alloc_pool_size;
 static __thread Notifier coroutine_pool_cleanup_notifier;
 
+/* Coroutines created by this thread and not terminated yet, and the
+ * highest value seen so far.  alloc_pool keeps up to that many coroutines
+ * so that a thread with many requests in flight does not keep allocating
+ * and freeing stacks.  Coroutines that move to another thread make this
+ * inexact, which is fine for a heuristic.
+ */
+static __thread int coroutines_in_use;
+static __thread int coroutines_max_in_use;
+
 static void coroutine_pool_cleanup(Notifier *n, void *value)
 {
     Coroutine *co;
@@ -42,19 +54,33 @@ static void coroutine_pool_cleanup(Notifier *n, void *value)
     }
 }
 
+static void coroutine_pool_register_cleanup(void)
+{
+    if (!coroutine_pool_cleanup_notifier.notify) {
+        coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
+        qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
+    }
+}
+
+static unsigned int alloc_pool_max_size(void)
+{
+    return MIN(MAX(coroutines_max_in_use, POOL_BATCH_SIZE), POOL_MAX_SIZE);
+}
+
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 {
     Coroutine *co = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
+        if (++coroutines_in_use > coroutines_max_in_use) {
+            coroutines_max_in_use = coroutines_in_use;
+        }
+
         co = QSLIST_FIRST(&alloc_pool);
         if (!co) {
             if (release_pool_size > POOL_BATCH_SIZE) {
                 /* Slow path; a good place to register the destructor, too.  */
-                if (!coroutine_pool_cleanup_notifier.notify) {
-                    coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
-                }
+                coroutine_pool_register_cleanup();
 
                 /* This is not exact; there could be a little skew between
                  * release_pool_size and the actual size of release_pool.  But
@@ -86,12 +112,15 @@ static void coroutine_delete(Coroutine *co)
     co->caller = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
+        coroutines_in_use--;
+
         if (release_pool_size < POOL_BATCH_SIZE * 2) {
             QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
             atomic_inc(&release_pool_size);
             return;
         }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
+        if (alloc_pool_size < alloc_pool_max_size()) {
+            coroutine_pool_register_cleanup();
             QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
             alloc_pool_size++;
             return;